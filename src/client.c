@@ -125,6 +125,27 @@ int stunnel_msspi_bio_write( CLI * c, const void * buf, int len )
 #define SHUT_RDWR 2
 #endif
 
+#ifndef USE_FORK
+
+typedef struct connect_pool_entry_struct {
+    struct connect_pool_entry_struct *next;
+    SSL *ssl;                                  /* established TLS connection */
+    SOCKET fd;                                          /* connected socket */
+    unsigned idx;                      /* connected address in connect_addr */
+    time_t created;                         /* time of the TLS handshake */
+    int pending;           /* application data received, no need to watch */
+} CONNECT_POOL_ENTRY;
+
+struct connect_pool_struct {
+    CONNECT_POOL_ENTRY *head, *tail;         /* idle connections, oldest first */
+    unsigned idle;                           /* the number of idle connections */
+    SOCKET wake[2];                      /* wakes up the pool maintenance */
+    int stop;                              /* set on configuration reload */
+    unsigned long long hits, misses;             /* client connection stats */
+};
+
+#endif /* !defined(USE_FORK) */
+
 NOEXPORT void client_try(CLI *);
 NOEXPORT void exec_connect_loop(CLI *);
 NOEXPORT void exec_connect_once(CLI *);
@@ -134,7 +155,41 @@ NOEXPORT void remote_start(CLI *);
 NOEXPORT void ssl_start(CLI *);
 NOEXPORT void session_cache_retrieve(CLI *);
 NOEXPORT void print_cipher(CLI *);
+#ifdef USE_KTLS
+NOEXPORT void ktls_check(CLI *);
+#endif /* USE_KTLS */
+#ifndef USE_FORK
+NOEXPORT int connect_pool_get(CLI *);
+NOEXPORT void connect_pool_keeper(CLI *);
+NOEXPORT int connect_pool_fill(CLI *);
+NOEXPORT int connect_pool_alive(CLI *, CONNECT_POOL_ENTRY *);
+NOEXPORT void connect_pool_discard(CONNECT_POOL_ENTRY *, char *);
+NOEXPORT void connect_pool_wake(struct connect_pool_struct *);
+#endif /* !defined(USE_FORK) */
 NOEXPORT void transfer(CLI *);
+NOEXPORT void ring_init(RING *, SERVICE_OPTIONS *);
+NOEXPORT void ring_acquire(RING *);
+NOEXPORT void ring_release(RING *);
+NOEXPORT char *ring_data(RING *, size_t *);
+NOEXPORT char *ring_space(RING *, size_t *);
+NOEXPORT void ring_fill(RING *, size_t);
+NOEXPORT void ring_produce(RING *, size_t);
+NOEXPORT void ring_consume(RING *, size_t);
+NOEXPORT void ring_resize(RING *, size_t);
+NOEXPORT ssize_t ring_readsocket(SOCKET, RING *);
+NOEXPORT ssize_t ring_writesocket(SOCKET, RING *);
+NOEXPORT void buffer_pool_merge(TLS_DATA *);
+NOEXPORT char *buffer_pool_take(size_t);
+NOEXPORT int buffer_pool_store(char *, size_t);
+NOEXPORT void buffer_cache_return(TLS_DATA *, int);
+NOEXPORT char *buffer_get(size_t);
+NOEXPORT void buffer_put(char *, size_t);
+#ifdef USE_SPLICE
+NOEXPORT void transfer_splice(CLI *);
+NOEXPORT int splice_available(CLI *);
+NOEXPORT ssize_t splice_move(CLI *, SOCKET, SOCKET, size_t, int, const char *);
+NOEXPORT void splice_cleanup(CLI *);
+#endif /* USE_SPLICE */
 NOEXPORT int parse_socket_error(CLI *, const char *);
 
 NOEXPORT void auth_user(CLI *);
@@ -144,8 +199,21 @@ NOEXPORT char **env_alloc(CLI *);
 NOEXPORT void env_free(char **);
 #endif
 NOEXPORT SOCKET connect_remote(CLI *);
+NOEXPORT int connect_race(CLI *, unsigned);
+NOEXPORT void connect_cost_sample(CLI *, unsigned, int, int64_t);
+#ifndef USE_FORK
+NOEXPORT int connect_target(SERVICE_OPTIONS *, SOCKADDR_UNION *);
+NOEXPORT void connect_active_acquire(CLI *, int);
+NOEXPORT void connect_active_release(CLI *);
+NOEXPORT unsigned connect_leastconn(CLI *);
+NOEXPORT unsigned connect_p2c(CLI *);
+NOEXPORT double connect_cost(CLI *, unsigned, int64_t);
+NOEXPORT void cost_mean(SERVICE_OPTIONS *, CONNECT_COST *);
+NOEXPORT double cost_decay(double, int64_t, int64_t, double);
+#endif /* !defined(USE_FORK) */
 NOEXPORT void idx_cache_save(SSL_SESSION *, SOCKADDR_UNION *);
 NOEXPORT unsigned idx_cache_retrieve(CLI *);
+NOEXPORT unsigned rr_next(SERVICE_OPTIONS *);
 NOEXPORT void connect_setup(CLI *);
 NOEXPORT int connect_init(CLI *, int);
 NOEXPORT int redirect(CLI *);
@@ -161,11 +229,38 @@ CLI *alloc_client_session(SERVICE_OPTIONS *opt, SOCKET rfd, SOCKET wfd) {
     c->opt=opt;
     c->local_rfd.fd=rfd;
     c->local_wfd.fd=wfd;
+    /* accept threads and schedulers may allocate concurrently */
+#if (defined(USE_OS_THREADS) || defined(USE_SCHEDULERS)) && \
+        defined(__GNUC__) && defined(__ATOMIC_RELAXED)
+    c->seq=__atomic_fetch_add(&seq, 1, __ATOMIC_RELAXED);
+#elif defined(USE_OS_THREADS) || defined(USE_SCHEDULERS)
+    CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_CLIENTS]);
+    c->seq=seq++;
+    CRYPTO_THREAD_unlock(stunnel_locks[LOCK_CLIENTS]);
+#else
     c->seq=seq++;
-    c->rr=c->opt->rr++;
+#endif
+    c->rr=rr_next(opt);
     return c;
 }
 
+/* per-service sequential number for round-robin failover */
+NOEXPORT unsigned rr_next(SERVICE_OPTIONS *opt) {
+#if (defined(USE_OS_THREADS) || defined(USE_SCHEDULERS)) && \
+        defined(__GNUC__) && defined(__ATOMIC_RELAXED)
+    return __atomic_fetch_add(&opt->rr, 1, __ATOMIC_RELAXED);
+#elif defined(USE_OS_THREADS) || defined(USE_SCHEDULERS)
+    unsigned rr;
+
+    CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_CLIENTS]);
+    rr=opt->rr++;
+    CRYPTO_THREAD_unlock(stunnel_locks[LOCK_CLIENTS]);
+    return rr;
+#else
+    return opt->rr++;
+#endif
+}
+
 #if defined(USE_WIN32) || defined(USE_OS2)
 unsigned __stdcall
 #else
@@ -173,9 +268,6 @@ void *
 #endif
         client_thread(void *arg) {
     CLI *c=arg;
-#ifdef DEBUG_STACK_SIZE
-    size_t stack_size=c->opt->stack_size;
-#endif
 
 #ifdef USE_FORK
     /* do not use signal pipe in child processes */
@@ -189,6 +281,29 @@ void *
     signal(SIGINT, SIG_DFL);
 #endif /* USE_FORK */
 
+    client_thread_run(c);
+
+    /* terminate the thread */
+#if defined(USE_WIN32) || defined(USE_OS2)
+#if !defined(_WIN32_WCE)
+    _endthreadex(0);
+#endif
+    return 0;
+#else
+#ifdef USE_UCONTEXT
+    s_poll_wait(NULL, 0, 0); /* wait on poll() */
+#endif
+    return NULL;
+#endif
+}
+
+/* serve a single client in the current thread, either a dedicated one
+ * or a reusable thread pool worker */
+void client_thread_run(CLI *c) {
+#ifdef DEBUG_STACK_SIZE
+    size_t stack_size=c->opt->stack_size;
+#endif
+
     /* make sure c->thread_* values are initialized */
     CRYPTO_THREAD_read_lock(stunnel_locks[LOCK_THREAD_LIST]);
     CRYPTO_THREAD_unlock(stunnel_locks[LOCK_THREAD_LIST]);
@@ -213,7 +328,8 @@ void *
     if(c->thread_next)
         c->thread_next->thread_prev=c->thread_prev;
 #ifdef USE_PTHREAD
-    pthread_detach(c->thread_id);
+    if(!c->flag.pooled) /* pool workers are joined in thread_pool_stop() */
+        pthread_detach(c->thread_id);
 #endif
 #ifdef USE_WIN32
     CloseHandle(c->thread_id);
@@ -227,19 +343,6 @@ void *
     str_stats(); /* client thread allocation tracking */
     tls_cleanup();
     /* s_log() is not allowed after tls_cleanup() */
-
-    /* terminate the thread */
-#if defined(USE_WIN32) || defined(USE_OS2)
-#if !defined(_WIN32_WCE)
-    _endthreadex(0);
-#endif
-    return 0;
-#else
-#ifdef USE_UCONTEXT
-    s_poll_wait(NULL, 0, 0); /* wait on poll() */
-#endif
-    return NULL;
-#endif
 }
 
 #ifdef DEBUG_STACK_SIZE
@@ -250,6 +353,11 @@ void ignore_value(void *ptr) {
 
 void client_main(CLI *c) {
     s_log(LOG_DEBUG, "Service [%s] started", c->opt->servname);
+#ifndef USE_FORK
+    if(c->flag.pool) {
+        connect_pool_keeper(c);
+    } else
+#endif /* !defined(USE_FORK) */
     if(c->opt->exec_name && c->opt->connect_addr.names) {
         if(c->opt->option.retry)
             exec_connect_loop(c);
@@ -258,6 +366,9 @@ void client_main(CLI *c) {
     } else {
         client_run(c);
     }
+#ifndef USE_FORK
+    mux_tunnel_free(c); /* a client-side mux tunnel was served */
+#endif /* !defined(USE_FORK) */
 }
 
 void client_free(CLI *c) {
@@ -342,11 +453,14 @@ NOEXPORT void client_run(CLI *c) {
 #endif
 
 #ifndef USE_FORK
-#ifdef USE_OS_THREADS
-    CRYPTO_atomic_add(&num_clients, 1, &num, stunnel_locks[LOCK_CLIENTS]);
+    /* accepted connections were already counted by accept_one() */
+#if defined(USE_OS_THREADS) || defined(USE_SCHEDULERS)
+    CRYPTO_atomic_add(&num_clients, c->flag.admitted ? 0 : 1, &num,
+        stunnel_locks[LOCK_CLIENTS]);
 #else
-    num=++num_clients;
+    num=c->flag.admitted ? num_clients : ++num_clients;
 #endif
+    c->flag.admitted=0;
     ui_clients(num);
 #endif
 
@@ -355,6 +469,9 @@ NOEXPORT void client_run(CLI *c) {
     c->fd=INVALID_SOCKET;
     c->ssl=NULL;
     c->sock_bytes=c->ssl_bytes=0;
+#ifdef USE_SPLICE
+    c->sock_pipe[0]=c->sock_pipe[1]=c->ssl_pipe[0]=c->ssl_pipe[1]=-1;
+#endif /* USE_SPLICE */
     if(c->opt->option.client) {
         c->sock_rfd=&(c->local_rfd);
         c->sock_wfd=&(c->local_wfd);
@@ -377,10 +494,22 @@ NOEXPORT void client_run(CLI *c) {
     c->exception_pointer=exception_backup;
 
     rst=err==1 && c->opt->option.reset;
-    s_log(LOG_NOTICE,
-        "Connection %s: %llu byte(s) sent to TLS, %llu byte(s) sent to socket",
-        rst ? "reset" : "closed",
-        (unsigned long long)c->ssl_bytes, (unsigned long long)c->sock_bytes);
+    if(c->flag.passed)
+        s_log(LOG_INFO, "Connection passed to a mux tunnel");
+    else
+        s_log(LOG_NOTICE,
+            "Connection %s: %llu byte(s) sent to TLS, %llu byte(s) sent to socket",
+            rst ? "reset" : "closed",
+            (unsigned long long)c->ssl_bytes, (unsigned long long)c->sock_bytes);
+
+        /* return transfer buffers to the pool */
+    ring_release(&c->sock_buff);
+    ring_release(&c->ssl_buff);
+
+#ifdef USE_SPLICE
+        /* cleanup zero-copy transfer pipes */
+    splice_cleanup(c);
+#endif /* USE_SPLICE */
 
         /* cleanup temporary (e.g. IDENT) socket */
     if(c->fd!=INVALID_SOCKET)
@@ -407,6 +536,10 @@ NOEXPORT void client_run(CLI *c) {
 #endif
     }
 
+#ifndef USE_FORK
+    connect_active_release(c);
+#endif /* !defined(USE_FORK) */
+
         /* cleanup the remote socket */
     if(c->remote_fd.fd!=INVALID_SOCKET) { /* remote socket initialized */
         if(rst && c->remote_fd.is_socket) /* reset */
@@ -441,7 +574,7 @@ NOEXPORT void client_run(CLI *c) {
         pid_status_hang("Child process"); /* null SIGCHLD handler was used */
     s_log(LOG_DEBUG, "Service [%s] finished", c->opt->servname);
 #else
-#ifdef USE_OS_THREADS
+#if defined(USE_OS_THREADS) || defined(USE_SCHEDULERS)
     CRYPTO_atomic_add(&num_clients, -1, &num, stunnel_locks[LOCK_CLIENTS]);
 #else
     num=--num_clients;
@@ -464,12 +597,25 @@ NOEXPORT void client_run(CLI *c) {
 #endif /* __GNUC__ */
 
 NOEXPORT void client_try(CLI *c) {
+#ifndef USE_FORK
+    if(c->mux) { /* a client-side mux tunnel has no local connection */
+        remote_start(c);
+        ssl_start(c);
+        mux_tunnel(c);
+        return;
+    }
+#endif /* !defined(USE_FORK) */
     local_start(c);
     protocol(c, c->opt, PROTOCOL_EARLY);
     if(c->opt->option.connect_before_ssl) {
-        remote_start(c);
-        protocol(c, c->opt, PROTOCOL_MIDDLE);
-        ssl_start(c);
+#ifndef USE_FORK
+        if(!connect_pool_get(c)) /* no established connection available */
+#endif /* !defined(USE_FORK) */
+        {
+            remote_start(c);
+            protocol(c, c->opt, PROTOCOL_MIDDLE);
+            ssl_start(c);
+        }
     } else {
         ssl_start(c);
         protocol(c, c->opt, PROTOCOL_MIDDLE);
@@ -575,6 +721,7 @@ NOEXPORT void remote_start(CLI *c) {
 NOEXPORT void ssl_start(CLI *c) {
     int i, err;
     SSL_SESSION *sess;
+    int64_t start;
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
     int unsafe_openssl;
 #endif /* OpenSSL version < 1.1.0 */
@@ -732,6 +879,7 @@ NOEXPORT void ssl_start(CLI *c) {
         (OpenSSL_version_num()>=0x10000000L &&
         OpenSSL_version_num()<0x1000002fL);
 #endif /* OpenSSL version < 1.1.0 */
+    start=clock_ms();
     while(1) {
         /* critical section for OpenSSL version < 0.9.8p or 1.x.x < 1.0.0b *
          * this critical section is a crude workaround for CVE-2010-3864   *
@@ -769,6 +917,8 @@ NOEXPORT void ssl_start(CLI *c) {
                 s_log(LOG_INFO, "ssl_start: s_poll_wait:"
                     " TIMEOUTbusy exceeded: sending reset");
                 s_poll_dump(c->fds, LOG_DEBUG);
+                if(c->opt->option.client)
+                    connect_cost_sample(c, c->idx, 1, -1);
                 throw_exception(c, 1);
             case 1:
                 break; /* OK */
@@ -788,12 +938,16 @@ NOEXPORT void ssl_start(CLI *c) {
                 continue;
             }
         }
-        if(c->opt->option.client)
+        if(c->opt->option.client) {
             sslerror("SSL_connect");
-        else
+            connect_cost_sample(c, c->idx, 1, -1);
+        } else {
             sslerror("SSL_accept");
+        }
         throw_exception(c, 1);
     }
+    if(c->opt->option.client)
+        connect_cost_sample(c, c->idx, 1, clock_ms()-start);
 #ifdef MSSPISSL
     if( c->msh )
     {
@@ -883,13 +1037,22 @@ NOEXPORT void ssl_start(CLI *c) {
     }
 #endif
     print_cipher(c);
+#ifdef USE_KTLS
+    ktls_check(c);
+#endif /* USE_KTLS */
     sess=SSL_get1_session(c->ssl);
     if(sess) {
         if(SSL_session_reused(c->ssl)) {
             print_session_id(sess);
         } else { /* a new session was negotiated */
             /* SSL_SESS_CACHE_NO_INTERNAL_STORE prevented automatic caching */
-            if(!c->opt->option.client)
+            /* evictions from the internal cache would also remove
+             * the session from the shared memory cache */
+            if(!c->opt->option.client
+#ifdef USE_SHM_CACHE
+                    && !c->opt->shm_cache
+#endif /* USE_SHM_CACHE */
+                    )
                 SSL_CTX_add_session(c->opt->ctx, sess);
         }
         SSL_SESSION_free(sess);
@@ -944,6 +1107,424 @@ NOEXPORT void print_cipher(CLI *c) { /* print negotiated cipher */
 #endif
 }
 
+#ifdef USE_KTLS
+NOEXPORT void ktls_check(CLI *c) { /* detect kernel TLS offload */
+    int tx, rx;
+#if defined(USE_OS_THREADS) || defined(USE_SCHEDULERS)
+    int num;
+#endif
+
+    if(!c->opt->option.ktls)
+        return;
+    tx=BIO_get_ktls_send(SSL_get_wbio(c->ssl));
+    rx=BIO_get_ktls_recv(SSL_get_rbio(c->ssl));
+#if defined(USE_OS_THREADS) || defined(USE_SCHEDULERS)
+    CRYPTO_atomic_add(&c->opt->ktls_checked, 1, &num,
+        stunnel_locks[LOCK_CLIENTS]);
+    if(tx)
+        CRYPTO_atomic_add(&c->opt->ktls_tx, 1, &num,
+            stunnel_locks[LOCK_CLIENTS]);
+    if(rx)
+        CRYPTO_atomic_add(&c->opt->ktls_rx, 1, &num,
+            stunnel_locks[LOCK_CLIENTS]);
+#else
+    ++c->opt->ktls_checked;
+    if(tx)
+        ++c->opt->ktls_tx;
+    if(rx)
+        ++c->opt->ktls_rx;
+#endif
+    s_log(LOG_INFO, "Kernel TLS: TX %s, RX %s",
+        tx ? "offloaded" : "software", rx ? "offloaded" : "software");
+}
+
+void ktls_info(void) {
+    SERVICE_OPTIONS *opt;
+
+    CRYPTO_THREAD_read_lock(stunnel_locks[LOCK_SECTIONS]);
+    for(opt=service_options.next; opt; opt=opt->next) {
+        if(!opt->option.ktls)
+            continue;
+        s_log(LOG_NOTICE, "Service [%s]: kernel TLS checked on %d "
+            "connection(s), TX offloaded on %d, RX offloaded on %d",
+            opt->servname, opt->ktls_checked, opt->ktls_tx, opt->ktls_rx);
+#ifdef USE_SPLICE
+        if(opt->option.zerocopy)
+            s_log(LOG_NOTICE, "Service [%s]: zero-copy transfer used on %d "
+                "connection(s)", opt->servname, opt->splice_used);
+#endif /* USE_SPLICE */
+    }
+    CRYPTO_THREAD_unlock(stunnel_locks[LOCK_SECTIONS]);
+}
+#endif /* USE_KTLS */
+
+/**************************************** connection pool */
+
+#ifndef USE_FORK
+
+int connect_pool_init(SERVICE_OPTIONS *opt) {
+    struct connect_pool_struct *pool;
+
+    pool=str_alloc_detached(sizeof(struct connect_pool_struct));
+#ifdef USE_WIN32
+    if(make_sockets(pool->wake)) {
+#else
+    if(s_pipe(pool->wake, 1, "connect_pool")) {
+#endif
+        str_free(pool);
+        return 1;
+    }
+    opt->connect_pool=pool;
+    return 0;
+}
+
+/* called by the main thread on configuration reload */
+void connect_pool_stop(SERVICE_OPTIONS *opt) {
+    struct connect_pool_struct *pool=opt->connect_pool;
+
+    if(!pool)
+        return;
+    CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_CONNECT_POOL]);
+    pool->stop=1;
+    CRYPTO_THREAD_unlock(stunnel_locks[LOCK_CONNECT_POOL]);
+    connect_pool_wake(pool);
+}
+
+/* called when the last reference to the section is released */
+void connect_pool_free(SERVICE_OPTIONS *opt) {
+    struct connect_pool_struct *pool=opt->connect_pool;
+
+    if(!pool)
+        return;
+    while(pool->head) { /* the keeper did not run, callbacks are unsafe */
+        CONNECT_POOL_ENTRY *entry=pool->head;
+        pool->head=entry->next;
+        SSL_set_shutdown(entry->ssl, SSL_SENT_SHUTDOWN|SSL_RECEIVED_SHUTDOWN);
+        SSL_free(entry->ssl);
+        closesocket(entry->fd);
+        str_free(entry);
+    }
+    closesocket(pool->wake[0]);
+    closesocket(pool->wake[1]);
+    str_free(pool);
+    opt->connect_pool=NULL;
+}
+
+void connect_pool_info(void) {
+    SERVICE_OPTIONS *opt;
+
+    CRYPTO_THREAD_read_lock(stunnel_locks[LOCK_SECTIONS]);
+    for(opt=service_options.next; opt; opt=opt->next) {
+        struct connect_pool_struct *pool=opt->connect_pool;
+        if(!pool)
+            continue;
+        CRYPTO_THREAD_read_lock(stunnel_locks[LOCK_CONNECT_POOL]);
+        s_log(LOG_NOTICE, "Service [%s] connection pool: %u of %u idle, "
+            "%llu hit(s), %llu miss(es)", opt->servname,
+            pool->idle, opt->connect_pool_size, pool->hits, pool->misses);
+        CRYPTO_THREAD_unlock(stunnel_locks[LOCK_CONNECT_POOL]);
+    }
+    CRYPTO_THREAD_unlock(stunnel_locks[LOCK_SECTIONS]);
+}
+
+/* take an established TLS connection for a new client */
+NOEXPORT int connect_pool_get(CLI *c) {
+    struct connect_pool_struct *pool=c->opt->connect_pool;
+    CONNECT_POOL_ENTRY *entry;
+    char byte;
+    ssize_t num;
+
+    if(!pool)
+        return 0; /* connectPool not configured */
+    for(;;) {
+        CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_CONNECT_POOL]);
+        entry=pool->head;
+        if(entry) {
+            pool->head=entry->next;
+            if(!pool->head)
+                pool->tail=NULL;
+            --pool->idle;
+            ++pool->hits;
+        } else {
+            ++pool->misses;
+        }
+        CRYPTO_THREAD_unlock(stunnel_locks[LOCK_CONNECT_POOL]);
+        connect_pool_wake(pool); /* request a replacement */
+        if(!entry) {
+            s_log(LOG_INFO, "Connection pool empty");
+            return 0;
+        }
+        /* callbacks need a valid client, even to close the connection */
+        if(!SSL_set_ex_data(entry->ssl, index_ssl_cli, c)) {
+            sslerror("SSL_set_ex_data");
+            connect_pool_discard(entry, "failed");
+            continue;
+        }
+        /* the peer may have closed the connection since the last check */
+        num=recv(entry->fd, &byte, 1, MSG_PEEK);
+        if(!num) {
+            connect_pool_discard(entry, "closed by peer");
+            continue;
+        }
+        if(num<0) {
+            switch(get_last_socket_error()) {
+            case S_EWOULDBLOCK:
+#if S_EAGAIN!=S_EWOULDBLOCK
+            case S_EAGAIN:
+#endif
+                break;
+            default:
+                connect_pool_discard(entry, "failed");
+                continue;
+            }
+        }
+        break; /* alive */
+    }
+
+    c->remote_fd.fd=entry->fd;
+    c->remote_fd.is_socket=1;
+    c->ssl=entry->ssl;
+    c->idx=entry->idx;
+    connect_active_acquire(c, (int)entry->idx);
+    c->reneg_state=RENEG_ESTABLISHED;
+    str_free(entry);
+    s_log(LOG_INFO, "Using a pooled TLS connection (FD=%ld)",
+        (long)c->remote_fd.fd);
+    return 1;
+}
+
+/* maintain the idle connections of a service */
+NOEXPORT void connect_pool_keeper(CLI *c) {
+    struct connect_pool_struct *pool=c->opt->connect_pool;
+    CONNECT_POOL_ENTRY *entry, **ptr, *checked, *expired;
+    char dummy[64];
+    int backoff=0, timeout, stop;
+    unsigned idle;
+    time_t now, retry=0;
+
+    s_log(LOG_INFO, "Connection pool started: %u connection(s)",
+        c->opt->connect_pool_size);
+    c->remote_fd.fd=INVALID_SOCKET;
+    c->fd=INVALID_SOCKET;
+    c->ssl=NULL;
+    c->ssl_rfd=c->ssl_wfd=&(c->remote_fd);
+    c->fds=s_poll_alloc();
+    addrlist_clear(&c->connect_addr, 0);
+
+    for(;;) {
+        /* remove connections exceeding TIMEOUTidle */
+        now=time(NULL);
+        expired=NULL;
+        CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_CONNECT_POOL]);
+        while(pool->head &&
+                now-pool->head->created>=c->opt->timeout_idle) {
+            entry=pool->head;
+            pool->head=entry->next;
+            --pool->idle;
+            entry->next=expired;
+            expired=entry;
+        }
+        stop=pool->stop;
+        if(stop) { /* close all the idle connections */
+            while(pool->head) {
+                entry=pool->head;
+                pool->head=entry->next;
+                entry->next=expired;
+                expired=entry;
+            }
+            pool->idle=0;
+        }
+        if(!pool->head)
+            pool->tail=NULL;
+        idle=pool->idle;
+        CRYPTO_THREAD_unlock(stunnel_locks[LOCK_CONNECT_POOL]);
+        while(expired) {
+            entry=expired;
+            expired=entry->next;
+            connect_pool_discard(entry, stop ? "closed" : "expired");
+        }
+        if(stop)
+            break;
+
+        /* establish a missing connection */
+        if(idle<c->opt->connect_pool_size && now>=retry) {
+            if(connect_pool_fill(c)) { /* exponential backoff */
+                backoff=backoff ? (backoff<32 ? 2*backoff : 60) : 1;
+                retry=time(NULL)+backoff;
+            } else {
+                backoff=0;
+            }
+            continue;
+        }
+
+        /* wait for a client, a peer event, or a timeout */
+        s_poll_init(c->fds, 0);
+        s_poll_add(c->fds, pool->wake[0], 1, 0);
+        timeout=idle<c->opt->connect_pool_size ? (int)(retry-now) : 60;
+        CRYPTO_THREAD_read_lock(stunnel_locks[LOCK_CONNECT_POOL]);
+        for(entry=pool->head; entry; entry=entry->next)
+            if(!entry->pending)
+                s_poll_add(c->fds, entry->fd, 1, 0);
+        if(pool->head && pool->head->created+c->opt->timeout_idle-now<timeout)
+            timeout=(int)(pool->head->created+c->opt->timeout_idle-now)+1;
+        CRYPTO_THREAD_unlock(stunnel_locks[LOCK_CONNECT_POOL]);
+        switch(s_poll_wait(c->fds, timeout, 0)) {
+        case -1:
+            sockerror("connect_pool_keeper: s_poll_wait");
+            s_poll_sleep(1, 0);
+            continue;
+        case 0:
+            continue;
+        default:
+            break;
+        }
+        if(s_poll_canread(c->fds, pool->wake[0]))
+            while(readsocket(pool->wake[0], dummy, sizeof dummy)>0)
+                ;
+
+        /* detach the idle connections with events to check them */
+        checked=NULL;
+        CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_CONNECT_POOL]);
+        pool->tail=NULL;
+        for(ptr=&pool->head; *ptr;) {
+            entry=*ptr;
+            if(!entry->pending && (s_poll_canread(c->fds, entry->fd) ||
+                    s_poll_hup(c->fds, entry->fd))) {
+                *ptr=entry->next;
+                --pool->idle;
+                entry->next=checked;
+                checked=entry;
+            } else {
+                pool->tail=entry;
+                ptr=&entry->next;
+            }
+        }
+        CRYPTO_THREAD_unlock(stunnel_locks[LOCK_CONNECT_POOL]);
+        while(checked) {
+            entry=checked;
+            checked=entry->next;
+            if(!connect_pool_alive(c, entry)) {
+                connect_pool_discard(entry, "closed by peer");
+                continue;
+            }
+            /* put it back in the order of creation */
+            CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_CONNECT_POOL]);
+            for(ptr=&pool->head; *ptr && (*ptr)->created<=entry->created;
+                    ptr=&(*ptr)->next)
+                ;
+            entry->next=*ptr;
+            *ptr=entry;
+            if(!entry->next)
+                pool->tail=entry;
+            ++pool->idle;
+            CRYPTO_THREAD_unlock(stunnel_locks[LOCK_CONNECT_POOL]);
+        }
+    }
+
+    s_poll_free(c->fds);
+    s_log(LOG_INFO, "Connection pool stopped");
+}
+
+/* establish a new TLS connection and add it to the pool */
+NOEXPORT int connect_pool_fill(CLI *c) {
+    struct connect_pool_struct *pool=c->opt->connect_pool;
+    CONNECT_POOL_ENTRY *entry;
+    jmp_buf exception_buffer, *exception_backup;
+    int err;
+
+    c->rr=rr_next(c->opt); /* round-robin failover spreads the connections */
+    exception_backup=c->exception_pointer;
+    c->exception_pointer=&exception_buffer;
+    err=setjmp(exception_buffer);
+    if(!err) {
+        remote_start(c);
+        ssl_start(c);
+    }
+    c->exception_pointer=exception_backup;
+
+    str_free(c->connect_addr.addr);
+    addrlist_clear(&c->connect_addr, 0);
+    if(c->fd!=INVALID_SOCKET) {
+        closesocket(c->fd);
+        c->fd=INVALID_SOCKET;
+    }
+    if(err) {
+        if(c->ssl) {
+            SSL_free(c->ssl);
+            c->ssl=NULL;
+        }
+        if(c->remote_fd.fd!=INVALID_SOCKET) {
+            closesocket(c->remote_fd.fd);
+            c->remote_fd.fd=INVALID_SOCKET;
+        }
+        s_log(LOG_ERR, "Connection pool: Failed to connect");
+        return 1;
+    }
+
+    entry=str_alloc_detached(sizeof(CONNECT_POOL_ENTRY));
+    entry->ssl=c->ssl;
+    entry->fd=c->remote_fd.fd;
+    entry->idx=c->idx;
+    entry->created=time(NULL);
+    c->ssl=NULL;
+    c->remote_fd.fd=INVALID_SOCKET;
+    CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_CONNECT_POOL]);
+    if(pool->tail)
+        pool->tail->next=entry;
+    else
+        pool->head=entry;
+    pool->tail=entry;
+    ++pool->idle;
+    CRYPTO_THREAD_unlock(stunnel_locks[LOCK_CONNECT_POOL]);
+    s_log(LOG_DEBUG, "Connection pool: FD=%ld added", (long)entry->fd);
+    return 0;
+}
+
+/* process post-handshake messages without consuming application data */
+NOEXPORT int connect_pool_alive(CLI *c, CONNECT_POOL_ENTRY *entry) {
+    char byte;
+    int num, err;
+
+    SSL_set_ex_data(entry->ssl, index_ssl_cli, c);
+    num=SSL_peek(entry->ssl, &byte, 1);
+    if(num>0) { /* the server spoke first */
+        entry->pending=1;
+        return 1;
+    }
+    err=SSL_get_error(entry->ssl, num);
+    if(err==SSL_ERROR_WANT_READ || err==SSL_ERROR_WANT_WRITE)
+        return 1;
+    ERR_clear_error(); /* an unexpected EOF is not worth reporting */
+    return 0;
+}
+
+NOEXPORT void connect_pool_discard(CONNECT_POOL_ENTRY *entry, char *reason) {
+    s_log(LOG_INFO, "Connection pool: FD=%ld %s", (long)entry->fd, reason);
+    SSL_shutdown(entry->ssl); /* a single non-blocking close_notify attempt */
+    ERR_clear_error();
+    SSL_free(entry->ssl);
+    closesocket(entry->fd);
+    str_free(entry);
+}
+
+#ifdef __GNUC__
+#if __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 6) || defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-result"
+#endif /* __GNUC__>=4.6 */
+#endif /* __GNUC__ */
+NOEXPORT void connect_pool_wake(struct connect_pool_struct *pool) {
+    /* a full pipe already has a pending wakeup */
+    writesocket(pool->wake[1], "", 1);
+}
+#ifdef __GNUC__
+#if __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 6)
+#pragma GCC diagnostic pop
+#endif /* __GNUC__>=4.6 */
+#endif /* __GNUC__ */
+
+#endif /* !defined(USE_FORK) */
+
 /****************************** transfer data */
 NOEXPORT void transfer(CLI *c) {
     int timeout; /* s_poll_wait timeout in seconds */
@@ -954,6 +1535,9 @@ NOEXPORT void transfer(CLI *c) {
     int watchdog=0; /* a counter to detect an infinite loop */
     ssize_t num;
     int err;
+    TLS_DATA *tls_data;
+    char *ptr;
+    size_t len;
     /* logical channels (not file descriptors!) open for read or write */
     int sock_open_rd=1, sock_open_wr=1;
     /* awaited conditions on TLS file descriptors */
@@ -968,23 +1552,30 @@ NOEXPORT void transfer(CLI *c) {
     int bytes;
 #endif
 
-    c->sock_ptr=c->ssl_ptr=0;
+#ifdef USE_SPLICE
+    if(c->opt->option.zerocopy && splice_available(c))
+        transfer_splice(c); /* returns when TLS processing is needed */
+#endif /* USE_SPLICE */
+
+    ring_init(&c->sock_buff, c->opt);
+    ring_init(&c->ssl_buff, c->opt);
 
     do { /* main loop of client data transfer */
         /****************************** initialize *_wants_* */
         read_wants_read|=!(SSL_get_shutdown(c->ssl)&SSL_RECEIVED_SHUTDOWN)
-            && c->ssl_ptr<BUFFSIZE && !read_wants_write;
+            && c->ssl_buff.len<c->ssl_buff.size && !read_wants_write;
         write_wants_write|=!(SSL_get_shutdown(c->ssl)&SSL_SENT_SHUTDOWN)
-            && c->sock_ptr && !write_wants_read;
+            && c->sock_buff.len && !write_wants_read;
 
         /****************************** setup c->fds structure */
         s_poll_init(c->fds, 0); /* initialize the structure */
         /* for plain socket open data strem = open file descriptor */
         /* make sure to add each open socket to receive exceptions! */
         if(sock_open_rd) /* only poll if the read file descriptor is open */
-            s_poll_add(c->fds, c->sock_rfd->fd, c->sock_ptr<BUFFSIZE, 0);
+            s_poll_add(c->fds, c->sock_rfd->fd,
+                c->sock_buff.len<c->sock_buff.size, 0);
         if(sock_open_wr) /* only poll if the write file descriptor is open */
-            s_poll_add(c->fds, c->sock_wfd->fd, 0, c->ssl_ptr>0);
+            s_poll_add(c->fds, c->sock_wfd->fd, 0, c->ssl_buff.len>0);
         /* poll TLS file descriptors unless TLS shutdown was completed */
         if(SSL_get_shutdown(c->ssl)!=
                 (SSL_SENT_SHUTDOWN|SSL_RECEIVED_SHUTDOWN)) {
@@ -1006,13 +1597,23 @@ NOEXPORT void transfer(CLI *c) {
             timeout=0; /* process any buffered data without delay */
         } else if((sock_open_rd && /* both peers open */
                 !(SSL_get_shutdown(c->ssl)&SSL_RECEIVED_SHUTDOWN)) ||
-                c->ssl_ptr /* data buffered to write to socket */ ||
-                c->sock_ptr /* data buffered to write to TLS */) {
+                c->ssl_buff.len /* data buffered to write to socket */ ||
+                c->sock_buff.len /* data buffered to write to TLS */) {
             timeout=c->opt->timeout_idle;
         } else {
             timeout=c->opt->timeout_close;
         }
-        err=s_poll_wait(c->fds, timeout, 0);
+        tls_data=tls_get();
+        if(timeout && tls_data && tls_data->buffer_cache_num) {
+            /* idle connections return their buffers to the shared pool */
+            err=s_poll_wait(c->fds, 0, 0);
+            if(!err) {
+                buffer_cache_flush(tls_data);
+                err=s_poll_wait(c->fds, timeout, 0);
+            }
+        } else {
+            err=s_poll_wait(c->fds, timeout, 0);
+        }
         switch(err) {
         case -1:
             sockerror("transfer: s_poll_wait");
@@ -1022,7 +1623,7 @@ NOEXPORT void transfer(CLI *c) {
                 break;
             if((sock_open_rd &&
                     !(SSL_get_shutdown(c->ssl)&SSL_RECEIVED_SHUTDOWN)) ||
-                    c->ssl_ptr || c->sock_ptr) {
+                    c->ssl_buff.len || c->sock_buff.len) {
                 s_log(LOG_INFO, "transfer: s_poll_wait:"
                     " TIMEOUTidle exceeded: sending reset");
                 s_poll_dump(c->fds, LOG_DEBUG);
@@ -1086,20 +1687,20 @@ NOEXPORT void transfer(CLI *c) {
         if(!(sock_can_rd || sock_can_wr || ssl_can_rd || ssl_can_wr)) {
             if(s_poll_hup(c->fds, c->sock_rfd->fd) ||
                     s_poll_hup(c->fds, c->sock_wfd->fd)) {
-                if(c->ssl_ptr) {
+                if(c->ssl_buff.len) {
                     s_log(LOG_ERR,
                         "Socket closed (HUP) with %ld unsent byte(s)",
-                        (long)c->ssl_ptr);
+                        (long)c->ssl_buff.len);
                     throw_exception(c, 1); /* reset the sockets */
                 }
                 s_log(LOG_INFO, "Socket closed (HUP)");
                 sock_open_rd=sock_open_wr=0;
             } else if(s_poll_hup(c->fds, c->ssl_rfd->fd) ||
                     s_poll_hup(c->fds, c->ssl_wfd->fd)) {
-                if(c->sock_ptr) {
+                if(c->sock_buff.len) {
                     s_log(LOG_ERR,
                         "TLS socket closed (HUP) with %ld unsent byte(s)",
-                        (long)c->sock_ptr);
+                        (long)c->sock_buff.len);
                     throw_exception(c, 1); /* reset the sockets */
                 }
                 s_log(LOG_INFO, "TLS socket closed (HUP)");
@@ -1156,7 +1757,7 @@ NOEXPORT void transfer(CLI *c) {
 
         /****************************** write to socket */
         if(sock_open_wr && sock_can_wr) {
-            num=writesocket(c->sock_wfd->fd, c->ssl_buff, c->ssl_ptr);
+            num=ring_writesocket(c->sock_wfd->fd, &c->ssl_buff);
             switch(num) {
             case -1: /* error */
                 if(parse_socket_error(c, "writesocket"))
@@ -1167,9 +1768,6 @@ NOEXPORT void transfer(CLI *c) {
                 s_log(LOG_DEBUG, "writesocket returned 0");
                 break; /* do not reset the watchdog */
             default:
-                memmove(c->ssl_buff, c->ssl_buff+num, c->ssl_ptr-(size_t)num);
-                c->ssl_ptr-=(size_t)num;
-                memset(c->ssl_buff+c->ssl_ptr, 0, (size_t)num); /* paranoia */
                 c->sock_bytes+=(size_t)num;
                 watchdog=0; /* reset the watchdog */
             }
@@ -1177,8 +1775,10 @@ NOEXPORT void transfer(CLI *c) {
 
         /****************************** read from socket */
         if(sock_open_rd && sock_can_rd) {
-            num=readsocket(c->sock_rfd->fd,
-                c->sock_buff+c->sock_ptr, BUFFSIZE-c->sock_ptr);
+            ring_acquire(&c->sock_buff);
+            num=ring_readsocket(c->sock_rfd->fd, &c->sock_buff);
+            if(!c->sock_buff.len)
+                ring_release(&c->sock_buff);
             switch(num) {
             case -1:
                 if(parse_socket_error(c, "readsocket"))
@@ -1190,7 +1790,6 @@ NOEXPORT void transfer(CLI *c) {
                 sock_open_rd=0;
                 break; /* do not reset the watchdog */
             default:
-                c->sock_ptr+=(size_t)num;
                 watchdog=0; /* reset the watchdog */
             }
         }
@@ -1198,26 +1797,24 @@ NOEXPORT void transfer(CLI *c) {
         /****************************** update *_wants_* based on new *_ptr */
         /* this update is also required for SSL_pending() to be used */
         read_wants_read|=!(SSL_get_shutdown(c->ssl)&SSL_RECEIVED_SHUTDOWN)
-            && c->ssl_ptr<BUFFSIZE && !read_wants_write;
+            && c->ssl_buff.len<c->ssl_buff.size && !read_wants_write;
         write_wants_write|=!(SSL_get_shutdown(c->ssl)&SSL_SENT_SHUTDOWN)
-            && c->sock_ptr && !write_wants_read;
+            && c->sock_buff.len && !write_wants_read;
 
         /****************************** write to TLS */
         if((write_wants_read && ssl_can_rd) ||
                 (write_wants_write && ssl_can_wr)) {
             write_wants_read=0;
             write_wants_write=0;
-            num=SSL_write(c->ssl, c->sock_buff, (int)(c->sock_ptr));
+            ptr=ring_data(&c->sock_buff, &len);
+            num=SSL_write(c->ssl, ptr, (int)len);
             switch(err=SSL_get_error(c->ssl, (int)num)) {
             case SSL_ERROR_NONE:
                 if(num==0) { /* nothing was written: ignore */
                     s_log(LOG_DEBUG, "SSL_write returned 0");
                     break; /* do not reset the watchdog */
                 }
-                memmove(c->sock_buff, c->sock_buff+num,
-                    c->sock_ptr-(size_t)num);
-                c->sock_ptr-=(size_t)num;
-                memset(c->sock_buff+c->sock_ptr, 0, (size_t)num); /* paranoia */
+                ring_consume(&c->sock_buff, (size_t)num);
                 c->ssl_bytes+=(size_t)num;
                 watchdog=0; /* reset the watchdog */
                 break;
@@ -1238,10 +1835,10 @@ NOEXPORT void transfer(CLI *c) {
                     break; /* a non-critical error: retry */
                 /* EOF -> buggy (e.g. Microsoft) peer:
                  * TLS socket closed without close_notify alert */
-                if(c->sock_ptr) { /* TODO: what about buffered data? */
+                if(c->sock_buff.len) { /* TODO: what about buffered data? */
                     s_log(LOG_ERR,
                         "TLS socket closed (SSL_write) with %ld unsent byte(s)",
-                        (long)c->sock_ptr);
+                        (long)c->sock_buff.len);
                     throw_exception(c, 1); /* reset the sockets */
                 }
                 s_log(LOG_INFO, "TLS socket closed (SSL_write)");
@@ -1268,14 +1865,18 @@ NOEXPORT void transfer(CLI *c) {
                 (read_wants_write && ssl_can_wr)) {
             read_wants_read=0;
             read_wants_write=0;
-            num=SSL_read(c->ssl, c->ssl_buff+c->ssl_ptr, (int)(BUFFSIZE-c->ssl_ptr));
+            ring_acquire(&c->ssl_buff);
+            ptr=ring_space(&c->ssl_buff, &len);
+            num=SSL_read(c->ssl, ptr, (int)len);
+            if(num<=0 && !c->ssl_buff.len)
+                ring_release(&c->ssl_buff);
             switch(err=SSL_get_error(c->ssl, (int)num)) {
             case SSL_ERROR_NONE:
                 if(num==0) { /* nothing was read: ignore */
                     s_log(LOG_DEBUG, "SSL_read returned 0");
                     break; /* do not reset the watchdog */
                 }
-                c->ssl_ptr+=(size_t)num;
+                ring_fill(&c->ssl_buff, (size_t)num);
                 watchdog=0; /* reset the watchdog */
                 break;
             case SSL_ERROR_WANT_WRITE:
@@ -1297,10 +1898,10 @@ NOEXPORT void transfer(CLI *c) {
                     break; /* a non-critical error: retry */
                 /* EOF -> buggy (e.g. Microsoft) peer:
                  * TLS socket closed without close_notify alert */
-                if(c->sock_ptr || write_wants_write) {
+                if(c->sock_buff.len || write_wants_write) {
                     s_log(LOG_ERR,
                         "TLS socket closed (SSL_read) with %ld unsent byte(s)",
-                        (long)c->sock_ptr);
+                        (long)c->sock_buff.len);
                     throw_exception(c, 1); /* reset the sockets */
                 }
                 s_log(LOG_INFO, "TLS socket closed (SSL_read)");
@@ -1331,10 +1932,10 @@ NOEXPORT void transfer(CLI *c) {
             sock_open_rd=0;
         }
         if(sock_open_wr && s_poll_hup(c->fds, c->sock_wfd->fd)) {
-            if(c->ssl_ptr) {
+            if(c->ssl_buff.len) {
                 s_log(LOG_ERR,
                     "Write socket closed (write hangup) with %ld unsent byte(s)",
-                    (long)c->ssl_ptr);
+                    (long)c->ssl_buff.len);
                 throw_exception(c, 1); /* reset the sockets */
             }
             s_log(LOG_INFO, "Write socket closed (write hangup)");
@@ -1352,10 +1953,10 @@ NOEXPORT void transfer(CLI *c) {
         }
         if(!(SSL_get_shutdown(c->ssl)&SSL_SENT_SHUTDOWN) &&
                 s_poll_hup(c->fds, c->ssl_wfd->fd)) {
-            if(c->sock_ptr || write_wants_write) {
+            if(c->sock_buff.len || write_wants_write) {
                 s_log(LOG_ERR,
                     "TLS socket closed (write hangup) with %ld unsent byte(s)",
-                    (long)c->sock_ptr);
+                    (long)c->sock_buff.len);
                 throw_exception(c, 1); /* reset the sockets */
             }
             s_log(LOG_INFO, "TLS socket closed (write hangup)");
@@ -1365,7 +1966,7 @@ NOEXPORT void transfer(CLI *c) {
 
         /****************************** check write shutdown conditions */
         if(sock_open_wr && SSL_get_shutdown(c->ssl)&SSL_RECEIVED_SHUTDOWN &&
-                !c->ssl_ptr) {
+                !c->ssl_buff.len) {
             sock_open_wr=0; /* no further write allowed */
             if(!c->sock_wfd->is_socket) {
                 s_log(LOG_DEBUG, "Closing the file descriptor");
@@ -1378,7 +1979,7 @@ NOEXPORT void transfer(CLI *c) {
             }
         }
         if(!(SSL_get_shutdown(c->ssl)&SSL_SENT_SHUTDOWN) && !sock_open_rd &&
-                !c->sock_ptr && !write_wants_write) {
+                !c->sock_buff.len && !write_wants_write) {
             if(SSL_version(c->ssl)!=SSL2_VERSION) {
                 s_log(LOG_DEBUG, "Sending close_notify alert");
                 shutdown_wants_write=1;
@@ -1426,7 +2027,7 @@ NOEXPORT void transfer(CLI *c) {
                 shutdown_wants_write ? "Y" : "n");
             s_log(LOG_ERR, "socket input buffer: %ld byte(s), "
                 "TLS input buffer: %ld byte(s)",
-                (long)c->sock_ptr, (long)c->ssl_ptr);
+                (long)c->sock_buff.len, (long)c->ssl_buff.len);
             throw_exception(c, 1);
         }
 
@@ -1434,6 +2035,580 @@ NOEXPORT void transfer(CLI *c) {
         shutdown_wants_read || shutdown_wants_write);
 }
 
+/****************************** ring buffers */
+
+/* the storage is followed by a spare area, so that up to a full TLS record
+ * can be passed to SSL_write() or SSL_read() as a single contiguous block
+ * even when it wraps around the end of the buffer */
+#define RING_SPARE(r) ((r)->size<SSL3_RT_MAX_PLAIN_LENGTH ? \
+    (r)->size : SSL3_RT_MAX_PLAIN_LENGTH)
+
+NOEXPORT void ring_init(RING *ring, SERVICE_OPTIONS *opt) {
+    ring->buff=NULL;
+    ring->size=opt->buffer_size;
+    ring->head=ring->len=ring->peak=ring->dirty=0;
+    ring->adaptive=opt->option.buffer_adaptive;
+    ring->wipe=opt->option.wipe_buffers;
+}
+
+/* storage is only attached while the buffer holds data */
+NOEXPORT void ring_acquire(RING *ring) {
+    if(!ring->buff) {
+        ring->buff=buffer_get(ring->size+RING_SPARE(ring));
+        ring->peak=0;
+        ring->dirty=0;
+    }
+}
+
+NOEXPORT void ring_release(RING *ring) {
+    if(ring->buff) {
+        /* pooled storage is reused by other connections */
+        memset(ring->buff, 0, ring->dirty);
+        buffer_put(ring->buff, ring->size+RING_SPARE(ring));
+        ring->buff=NULL;
+    }
+    ring->head=ring->len=0;
+}
+
+/* the contiguous block of stored data at the head of the buffer */
+NOEXPORT char *ring_data(RING *ring, size_t *len) {
+    size_t first, want;
+
+    if(ring->head+ring->len<=ring->size) {
+        *len=ring->len;
+    } else { /* wrapped around */
+        first=ring->size-ring->head;
+        want=ring->len<SSL3_RT_MAX_PLAIN_LENGTH ?
+            ring->len : SSL3_RT_MAX_PLAIN_LENGTH;
+        if(first<want) { /* mirror the beginning in the spare area */
+            memcpy(ring->buff+ring->size, ring->buff, want-first);
+            if(ring->dirty<ring->size+want-first)
+                ring->dirty=ring->size+want-first;
+        } else
+            want=first;
+        *len=want;
+    }
+    return ring->buff+ring->head;
+}
+
+/* the contiguous block of free space following the stored data */
+NOEXPORT char *ring_space(RING *ring, size_t *len) {
+    size_t tail=ring->head+ring->len, want;
+
+    if(tail<ring->size) {
+        want=ring->size-ring->len;
+        if(want>SSL3_RT_MAX_PLAIN_LENGTH)
+            want=SSL3_RT_MAX_PLAIN_LENGTH;
+        *len=ring->size-tail;
+        if(*len<want) /* continue into the spare area */
+            *len=want;
+        return ring->buff+tail;
+    }
+    tail-=ring->size; /* wrapped around */
+    *len=ring->head-tail;
+    return ring->buff+tail;
+}
+
+/* account for the data stored with ring_space() */
+NOEXPORT void ring_fill(RING *ring, size_t num) {
+    size_t tail=ring->head+ring->len;
+
+    if(tail<ring->size && tail+num>ring->dirty)
+        ring->dirty=tail+num;
+    if(tail<ring->size && tail+num>ring->size) { /* spare area was used */
+        memcpy(ring->buff, ring->buff+ring->size, tail+num-ring->size);
+        if(ring->wipe) /* paranoia */
+            memset(ring->buff+ring->size, 0, tail+num-ring->size);
+    }
+    ring_produce(ring, num);
+}
+
+/* account for the data stored in the free space */
+NOEXPORT void ring_produce(RING *ring, size_t num) {
+    size_t tail;
+
+    ring->len+=num;
+    tail=ring->head+ring->len<ring->size ? ring->head+ring->len : ring->size;
+    if(tail>ring->dirty)
+        ring->dirty=tail;
+    if(ring->len>ring->peak)
+        ring->peak=ring->len;
+    if(ring->adaptive && ring->len==ring->size && ring->size<BUFFSIZE_MAX)
+        ring_resize(ring, 2*ring->size<BUFFSIZE_MAX ?
+            2*ring->size : BUFFSIZE_MAX); /* sustained throughput */
+}
+
+/* remove the processed data without moving the remaining data */
+NOEXPORT void ring_consume(RING *ring, size_t num) {
+    size_t first;
+
+    if(ring->wipe) { /* paranoia */
+        first=num<ring->size-ring->head ? num : ring->size-ring->head;
+        memset(ring->buff+ring->head, 0, first);
+        memset(ring->buff, 0, num-first);
+        if(num>first) /* the beginning may be mirrored in the spare area */
+            memset(ring->buff+ring->size, 0, RING_SPARE(ring));
+    }
+    ring->head=(ring->head+num)%ring->size;
+    ring->len-=num;
+    if(ring->len) /* not drained */
+        return;
+    ring_release(ring);
+    if(ring->adaptive && ring->peak<=ring->size/4 && ring->size>BUFFSIZE_MIN)
+        ring->size=ring->size/2>BUFFSIZE_MIN ?
+            ring->size/2 : BUFFSIZE_MIN; /* mostly idle */
+}
+
+/* move the stored data to a new storage of the specified size */
+NOEXPORT void ring_resize(RING *ring, size_t size) {
+    char *buff;
+    size_t first, spare;
+
+    spare=size<SSL3_RT_MAX_PLAIN_LENGTH ? size : SSL3_RT_MAX_PLAIN_LENGTH;
+    buff=buffer_get(size+spare);
+    first=ring->len<ring->size-ring->head ? ring->len : ring->size-ring->head;
+    memcpy(buff, ring->buff+ring->head, first);
+    memcpy(buff+first, ring->buff, ring->len-first);
+    memset(ring->buff, 0, ring->dirty); /* pooled storage is reused */
+    buffer_put(ring->buff, ring->size+RING_SPARE(ring));
+    s_log(LOG_DEBUG, "Transfer buffer resized from %lu to %lu byte(s)",
+        (unsigned long)ring->size, (unsigned long)size);
+    ring->buff=buff;
+    ring->size=size;
+    ring->head=0;
+    ring->dirty=ring->len;
+}
+
+NOEXPORT ssize_t ring_readsocket(SOCKET fd, RING *ring) {
+    ssize_t num;
+#ifdef HAVE_SYS_UIO_H
+    struct iovec iov[2];
+    int cnt=1;
+    size_t tail=ring->head+ring->len;
+
+    if(tail<ring->size) {
+        iov[0].iov_base=ring->buff+tail;
+        iov[0].iov_len=ring->size-tail;
+        if(ring->head) {
+            /* the free space wraps around the end of the buffer */
+            iov[1].iov_base=ring->buff;
+            iov[1].iov_len=ring->head;
+            cnt=2;
+        }
+    } else {
+        iov[0].iov_base=ring->buff+tail-ring->size;
+        iov[0].iov_len=ring->size-ring->len;
+    }
+    num=readv(fd, iov, cnt);
+    if(num>0)
+        ring_produce(ring, (size_t)num);
+#else
+    char *ptr;
+    size_t len;
+
+    ptr=ring_space(ring, &len);
+    num=readsocket(fd, ptr, len);
+    if(num>0)
+        ring_fill(ring, (size_t)num);
+#endif
+    return num;
+}
+
+NOEXPORT ssize_t ring_writesocket(SOCKET fd, RING *ring) {
+    ssize_t num;
+#ifdef HAVE_SYS_UIO_H
+    struct iovec iov[2];
+    int cnt=1;
+#else
+    char *ptr;
+    size_t len;
+#endif
+
+    if(!ring->len) /* nothing to write */
+        return 0;
+#ifdef HAVE_SYS_UIO_H
+    iov[0].iov_base=ring->buff+ring->head;
+    iov[0].iov_len=ring->len;
+    if(ring->head+ring->len>ring->size) {
+        /* the stored data wraps around the end of the buffer */
+        iov[0].iov_len=ring->size-ring->head;
+        iov[1].iov_base=ring->buff;
+        iov[1].iov_len=ring->len-iov[0].iov_len;
+        cnt=2;
+    }
+    num=writev(fd, iov, cnt);
+#else
+    ptr=ring_data(ring, &len);
+    num=writesocket(fd, ptr, len);
+#endif
+    if(num>0)
+        ring_consume(ring, (size_t)num);
+    return num;
+}
+
+/****************************** shared pool of I/O buffers */
+typedef struct pooled_buffer_struct {
+    struct pooled_buffer_struct *next;
+} POOLED_BUFFER;
+
+/* each list holds idle buffers of a single size */
+#define BUFFER_POOL_LISTS 16
+NOEXPORT struct {
+    size_t size;
+    POOLED_BUFFER *head;
+} buffer_pool[BUFFER_POOL_LISTS];
+NOEXPORT size_t buffer_pool_cached=0; /* bytes in idle buffers */
+NOEXPORT unsigned buffer_pool_used=0;
+NOEXPORT unsigned long long buffer_pool_hits=0, buffer_pool_misses=0;
+
+/* the caller holds LOCK_BUFFERS */
+NOEXPORT void buffer_pool_merge(TLS_DATA *tls_data) {
+    buffer_pool_used+=(unsigned)tls_data->buffer_used;
+    buffer_pool_hits+=tls_data->buffer_hits;
+    buffer_pool_misses+=tls_data->buffer_misses;
+    tls_data->buffer_used=0;
+    tls_data->buffer_hits=tls_data->buffer_misses=0;
+}
+
+/* the caller holds LOCK_BUFFERS */
+NOEXPORT char *buffer_pool_take(size_t size) {
+    POOLED_BUFFER *buffer;
+    int i;
+
+    for(i=0; i<BUFFER_POOL_LISTS; ++i) {
+        if(buffer_pool[i].size==size && buffer_pool[i].head) {
+            buffer=buffer_pool[i].head;
+            buffer_pool[i].head=buffer->next;
+            buffer_pool_cached-=size;
+            return (char *)buffer;
+        }
+    }
+    return NULL; /* no idle buffer of this size */
+}
+
+/* the caller holds LOCK_BUFFERS */
+NOEXPORT int buffer_pool_store(char *ptr, size_t size) {
+    POOLED_BUFFER *buffer=(POOLED_BUFFER *)ptr;
+    int i, found=-1;
+
+    if(buffer_pool_cached+size>BUFFER_POOL_SIZE)
+        return 0; /* the pool is full */
+    for(i=0; i<BUFFER_POOL_LISTS; ++i) {
+        if(buffer_pool[i].size==size) {
+            found=i;
+            break;
+        }
+        if(found<0 && !buffer_pool[i].head) /* reusable list */
+            found=i;
+    }
+    if(found<0)
+        return 0;
+    buffer_pool[found].size=size;
+    buffer->next=buffer_pool[found].head;
+    buffer_pool[found].head=buffer;
+    buffer_pool_cached+=size;
+    return 1;
+}
+
+/* move the oldest num buffers of the thread cache to the shared pool */
+NOEXPORT void buffer_cache_return(TLS_DATA *tls_data, int num) {
+    POOLED_BUFFER *rejected=NULL, *buffer;
+    int i;
+
+    CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_BUFFERS]);
+    buffer_pool_merge(tls_data);
+    for(i=0; i<num; ++i) {
+        if(!buffer_pool_store(tls_data->buffer_cache[i],
+                tls_data->buffer_cache_size[i])) {
+            buffer=(POOLED_BUFFER *)tls_data->buffer_cache[i];
+            buffer->next=rejected;
+            rejected=buffer;
+        }
+    }
+    CRYPTO_THREAD_unlock(stunnel_locks[LOCK_BUFFERS]);
+    tls_data->buffer_cache_num-=num;
+    for(i=0; i<tls_data->buffer_cache_num; ++i) {
+        tls_data->buffer_cache[i]=tls_data->buffer_cache[i+num];
+        tls_data->buffer_cache_size[i]=tls_data->buffer_cache_size[i+num];
+    }
+    while(rejected) {
+        buffer=rejected;
+        rejected=rejected->next;
+        str_free(buffer);
+    }
+}
+
+void buffer_cache_flush(TLS_DATA *tls_data) {
+    if(tls_data->buffer_cache_num || tls_data->buffer_used ||
+            tls_data->buffer_hits || tls_data->buffer_misses)
+        buffer_cache_return(tls_data, tls_data->buffer_cache_num);
+}
+
+NOEXPORT char *buffer_get(size_t size) {
+    TLS_DATA *tls_data;
+    char *buff;
+    int i;
+
+    tls_data=tls_get();
+    if(tls_data) { /* the most recently cached buffer first */
+        for(i=tls_data->buffer_cache_num-1; i>=0; --i) {
+            if(tls_data->buffer_cache_size[i]==size) {
+                buff=tls_data->buffer_cache[i];
+                --tls_data->buffer_cache_num;
+                for(; i<tls_data->buffer_cache_num; ++i) {
+                    tls_data->buffer_cache[i]=tls_data->buffer_cache[i+1];
+                    tls_data->buffer_cache_size[i]=
+                        tls_data->buffer_cache_size[i+1];
+                }
+                ++tls_data->buffer_hits;
+                ++tls_data->buffer_used;
+                return buff;
+            }
+        }
+    }
+
+    CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_BUFFERS]);
+    buff=buffer_pool_take(size);
+    if(buff)
+        ++buffer_pool_hits;
+    else
+        ++buffer_pool_misses;
+    ++buffer_pool_used;
+    if(tls_data) {
+        buffer_pool_merge(tls_data);
+        /* refill the thread cache for the next buffer_get() */
+        for(i=1; buff && i<BUFFER_CACHE_BATCH &&
+                tls_data->buffer_cache_num<BUFFER_CACHE_SIZE; ++i) {
+            tls_data->buffer_cache[tls_data->buffer_cache_num]=
+                buffer_pool_take(size);
+            if(!tls_data->buffer_cache[tls_data->buffer_cache_num])
+                break;
+            tls_data->buffer_cache_size[tls_data->buffer_cache_num++]=size;
+        }
+    }
+    CRYPTO_THREAD_unlock(stunnel_locks[LOCK_BUFFERS]);
+    if(!buff) /* no idle buffer of this size */
+        buff=str_alloc_detached(size);
+    return buff;
+}
+
+NOEXPORT void buffer_put(char *ptr, size_t size) {
+    TLS_DATA *tls_data;
+    int stored;
+
+    tls_data=tls_get();
+    if(tls_data) { /* keep it in the thread cache */
+        if(tls_data->buffer_cache_num>=BUFFER_CACHE_SIZE)
+            buffer_cache_return(tls_data, BUFFER_CACHE_BATCH);
+        tls_data->buffer_cache[tls_data->buffer_cache_num]=ptr;
+        tls_data->buffer_cache_size[tls_data->buffer_cache_num++]=size;
+        --tls_data->buffer_used;
+        return;
+    }
+
+    CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_BUFFERS]);
+    --buffer_pool_used;
+    stored=buffer_pool_store(ptr, size);
+    CRYPTO_THREAD_unlock(stunnel_locks[LOCK_BUFFERS]);
+    if(!stored) /* the pool is full */
+        str_free(ptr);
+}
+
+/* per-thread statistics are merged whenever the thread uses the shared pool */
+void buffer_pool_info(void) {
+    CRYPTO_THREAD_read_lock(stunnel_locks[LOCK_BUFFERS]);
+    s_log(LOG_NOTICE, "Buffer pool: %u buffer(s) in use, %lu byte(s) cached, "
+        "%llu hit(s), %llu miss(es)",
+        buffer_pool_used, (unsigned long)buffer_pool_cached,
+        buffer_pool_hits, buffer_pool_misses);
+    CRYPTO_THREAD_unlock(stunnel_locks[LOCK_BUFFERS]);
+}
+
+#ifdef USE_SPLICE
+
+/* the maximum number of bytes kept in each pipe */
+#define SPLICE_PIPE_SIZE 65536
+
+/* zero-copy transfer requires kernel TLS in both directions */
+NOEXPORT int splice_available(CLI *c) {
+#ifdef MSSPISSL
+    if(c->msh) {
+        s_log(LOG_INFO, "Zero-copy transfer disabled: msspi connection");
+        return 0;
+    }
+#endif /* MSSPISSL */
+    if(!BIO_get_ktls_send(SSL_get_wbio(c->ssl)) ||
+            !BIO_get_ktls_recv(SSL_get_rbio(c->ssl))) {
+        s_log(LOG_INFO, "Zero-copy transfer disabled: kernel TLS inactive");
+        return 0;
+    }
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    if(SSL_has_pending(c->ssl)) {
+#else
+    if(SSL_pending(c->ssl)) {
+#endif
+        s_log(LOG_INFO, "Zero-copy transfer disabled: buffered TLS data");
+        return 0;
+    }
+    if(s_pipe(c->sock_pipe, 1, "sock_pipe") ||
+            s_pipe(c->ssl_pipe, 1, "ssl_pipe")) {
+        splice_cleanup(c);
+        return 0;
+    }
+    return 1;
+}
+
+/* relay data with splice(2) while the kernel encrypts and decrypts records
+ * anything else (EOF, alerts, or other non-data records) is left
+ * for the regular transfer() loop once both pipes are drained */
+NOEXPORT void transfer_splice(CLI *c) {
+    size_t sock_queued=0, ssl_queued=0; /* bytes stored in the pipes */
+    int sock_full=0, ssl_full=0; /* pipe buffers exhausted */
+    int splicing=1;
+    ssize_t num;
+#if defined(USE_OS_THREADS) || defined(USE_SCHEDULERS)
+    int used;
+
+    CRYPTO_atomic_add(&c->opt->splice_used, 1, &used,
+        stunnel_locks[LOCK_CLIENTS]);
+#else
+    ++c->opt->splice_used;
+#endif
+
+    s_log(LOG_INFO, "Zero-copy transfer started");
+    while(splicing || sock_queued || ssl_queued) {
+        s_poll_init(c->fds, 0);
+        if(splicing && !(sock_full && sock_queued) &&
+                sock_queued<SPLICE_PIPE_SIZE)
+            s_poll_add(c->fds, c->sock_rfd->fd, 1, 0);
+        if(splicing && !(ssl_full && ssl_queued) &&
+                ssl_queued<SPLICE_PIPE_SIZE)
+            s_poll_add(c->fds, c->ssl_rfd->fd, 1, 0);
+        if(sock_queued)
+            s_poll_add(c->fds, c->ssl_wfd->fd, 0, 1);
+        if(ssl_queued)
+            s_poll_add(c->fds, c->sock_wfd->fd, 0, 1);
+
+        switch(s_poll_wait(c->fds, c->opt->timeout_idle, 0)) {
+        case -1:
+            sockerror("transfer_splice: s_poll_wait");
+            throw_exception(c, 1);
+        case 0:
+            s_log(LOG_INFO, "transfer_splice: s_poll_wait:"
+                " TIMEOUTidle exceeded: sending reset");
+            s_poll_dump(c->fds, LOG_DEBUG);
+            throw_exception(c, 1);
+        }
+
+        /* write to TLS */
+        if(sock_queued && s_poll_canwrite(c->fds, c->ssl_wfd->fd)) {
+            num=splice_move(c, c->sock_pipe[0], c->ssl_wfd->fd,
+                sock_queued, 0, "splice (pipe->TLS)");
+            if(num>0) {
+                sock_queued-=(size_t)num;
+                sock_full=0;
+                c->ssl_bytes+=(size_t)num;
+            }
+        }
+
+        /* write to socket */
+        if(ssl_queued && s_poll_canwrite(c->fds, c->sock_wfd->fd)) {
+            num=splice_move(c, c->ssl_pipe[0], c->sock_wfd->fd,
+                ssl_queued, 0, "splice (pipe->socket)");
+            if(num>0) {
+                ssl_queued-=(size_t)num;
+                ssl_full=0;
+                c->sock_bytes+=(size_t)num;
+            }
+        }
+
+        if(!splicing)
+            continue; /* only drain the pipes */
+
+        /* read from socket */
+        if(s_poll_canread(c->fds, c->sock_rfd->fd)) {
+            num=splice_move(c, c->sock_rfd->fd, c->sock_pipe[1],
+                SPLICE_PIPE_SIZE-sock_queued, 1, "splice (socket->pipe)");
+            if(num>0) {
+                sock_queued+=(size_t)num;
+            } else if(num==0) {
+                s_log(LOG_DEBUG, "Zero-copy transfer: socket closed");
+                splicing=0;
+            } else if(num==-2) {
+                s_log(LOG_DEBUG, "Zero-copy transfer: unsupported socket");
+                splicing=0;
+            } else {
+                sock_full=1; /* retry after some data is written */
+            }
+        }
+
+        /* read from TLS */
+        if(splicing && s_poll_canread(c->fds, c->ssl_rfd->fd)) {
+            num=splice_move(c, c->ssl_rfd->fd, c->ssl_pipe[1],
+                SPLICE_PIPE_SIZE-ssl_queued, 1, "splice (TLS->pipe)");
+            if(num>0) {
+                ssl_queued+=(size_t)num;
+            } else if(num==0) {
+                s_log(LOG_DEBUG, "Zero-copy transfer: TLS socket closed");
+                splicing=0;
+            } else if(num==-2) {
+                s_log(LOG_DEBUG, "Zero-copy transfer: non-data TLS record");
+                splicing=0;
+            } else {
+                ssl_full=1; /* retry after some data is written */
+            }
+        }
+    }
+    splice_cleanup(c);
+    s_log(LOG_INFO, "Zero-copy transfer finished: "
+        "%llu byte(s) sent to TLS, %llu byte(s) sent to socket",
+        (unsigned long long)c->ssl_bytes, (unsigned long long)c->sock_bytes);
+}
+
+/* returns the number of bytes moved, 0 on EOF, -1 to retry, or -2
+ * (only if fallback is allowed) when splice(2) cannot read the input,
+ * e.g. the kernel TLS layer requires OpenSSL to process a non-data record */
+NOEXPORT ssize_t splice_move(CLI *c, SOCKET in, SOCKET out, size_t len,
+        int fallback, const char *txt) {
+    ssize_t num;
+
+    num=splice(in, NULL, out, NULL, len, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+    if(num>=0)
+        return num;
+    switch(get_last_socket_error()) {
+    case S_EINTR:
+    case S_EWOULDBLOCK:
+#if S_EAGAIN!=S_EWOULDBLOCK
+    case S_EAGAIN:
+#endif
+        return -1;
+    case S_EINVAL:
+    case EIO:
+        if(fallback)
+            return -2;
+        /* fall through */
+    default:
+        ioerror(txt);
+        throw_exception(c, 1);
+    }
+    return -1; /* unreachable */
+}
+
+NOEXPORT void splice_cleanup(CLI *c) {
+    int i;
+
+    for(i=0; i<2; ++i) {
+        if(c->sock_pipe[i]>=0)
+            close(c->sock_pipe[i]);
+        c->sock_pipe[i]=-1;
+        if(c->ssl_pipe[i]>=0)
+            close(c->ssl_pipe[i]);
+        c->ssl_pipe[i]=-1;
+    }
+}
+
+#endif /* USE_SPLICE */
+
 #ifdef __GNUC__
 #if __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 6)
 #pragma GCC diagnostic push
@@ -1738,6 +2913,7 @@ void env_free(char **env) {
 NOEXPORT SOCKET connect_remote(CLI *c) {
     SOCKET fd;
     unsigned idx_start, idx_try;
+    int64_t start;
 
     connect_setup(c);
     switch(c->connect_addr.num) {
@@ -1751,35 +2927,215 @@ NOEXPORT SOCKET connect_remote(CLI *c) {
         idx_start=idx_cache_retrieve(c);
     }
 
-    /* try to connect each host from the list */
-    for(idx_try=0; idx_try<c->connect_addr.num; idx_try++) {
-        c->idx=(idx_start+idx_try)%c->connect_addr.num;
-        if(!connect_init(c, c->connect_addr.addr[c->idx].sa.sa_family) &&
-                !s_connect(c, &c->connect_addr.addr[c->idx],
-                    addr_len(&c->connect_addr.addr[c->idx]))) {
+    if(c->opt->option.happy_eyeballs && c->connect_addr.num>1) {
+        /* race the hosts from the list */
+        if(connect_race(c, idx_start)) {
+            s_log(LOG_ERR, "No more addresses to connect");
+            throw_exception(c, 1);
+        }
+    } else {
+        /* try to connect each host from the list */
+        for(idx_try=0; idx_try<c->connect_addr.num; idx_try++) {
+            c->idx=(idx_start+idx_try)%c->connect_addr.num;
+            start=clock_ms();
+            if(!connect_init(c, c->connect_addr.addr[c->idx].sa.sa_family) &&
+                    !s_connect(c, &c->connect_addr.addr[c->idx],
+                        addr_len(&c->connect_addr.addr[c->idx]))) {
+                connect_cost_sample(c, c->idx, 0, clock_ms()-start);
+                break; /* success! */
+            }
+            connect_cost_sample(c, c->idx, 0, -1);
+            if(c->fd!=INVALID_SOCKET) {
+                closesocket(c->fd);
+                c->fd=INVALID_SOCKET;
+            }
+        }
+        if(idx_try>=c->connect_addr.num) {
+            s_log(LOG_ERR, "No more addresses to connect");
+            throw_exception(c, 1);
+        }
+    }
 #ifdef MSSPISSL
-            if( !c->msh )
+    if( !c->msh )
 #endif
-            if(c->ssl) {
-                SSL_SESSION *sess=SSL_get1_session(c->ssl);
-                if(sess) {
-                    idx_cache_save(sess, &c->connect_addr.addr[c->idx]);
-                    SSL_SESSION_free(sess);
+    if(c->ssl) {
+        SSL_SESSION *sess=SSL_get1_session(c->ssl);
+        if(sess) {
+            idx_cache_save(sess, &c->connect_addr.addr[c->idx]);
+            SSL_SESSION_free(sess);
+        }
+    }
+#ifndef USE_FORK
+    if(!c->flag.pool) /* idle pooled connections are not counted */
+        connect_active_acquire(c,
+            connect_target(c->opt, &c->connect_addr.addr[c->idx]));
+#endif /* !defined(USE_FORK) */
+    print_bound_address(c);
+    fd=c->fd;
+    c->fd=INVALID_SOCKET;
+    return fd;
+}
+
+/* RFC 8305 "Connection Attempt Delay" */
+#define RACE_DELAY 250
+
+/* start staggered connection attempts in the failover order, and keep
+ * the first one to complete; returns 0 with c->fd and c->idx set */
+NOEXPORT int connect_race(CLI *c, unsigned idx_start) {
+    unsigned num=c->connect_addr.num, started=0, active=0, i, winner;
+    SOCKET *fds;
+    int64_t *deadlines, now, next_start=0, wait;
+    SOCKADDR_UNION *addr;
+    char *dst;
+    int error;
+
+    fds=str_alloc(num*sizeof(SOCKET));
+    deadlines=str_alloc(num*sizeof(int64_t));
+    for(i=0; i<num; ++i)
+        fds[i]=INVALID_SOCKET;
+    winner=num;
+    while(winner==num) {
+        now=clock_ms();
+
+        /* start the next attempt */
+        if(started<num && (!active || now>=next_start)) {
+            i=(idx_start+started++)%num;
+            addr=&c->connect_addr.addr[i];
+            next_start=now+RACE_DELAY;
+            if(connect_init(c, addr->sa.sa_family)) {
+                if(c->fd!=INVALID_SOCKET) {
+                    closesocket(c->fd);
+                    c->fd=INVALID_SOCKET;
+                }
+                next_start=now; /* no need to wait */
+                continue;
+            }
+            dst=s_ntop(addr, addr_len(addr));
+            s_log(LOG_INFO, "connect_race: connecting %s", dst);
+            if(!connect(c->fd, &addr->sa, addr_len(addr))) {
+                winner=i; /* connected immediately */
+            } else {
+                error=get_last_socket_error();
+                if(error==S_EINPROGRESS || error==S_EWOULDBLOCK) {
+                    fds[i]=c->fd;
+                    deadlines[i]=now+1000*(int64_t)c->opt->timeout_connect;
+                    ++active;
+                } else {
+                    s_log(LOG_ERR, "connect_race: connect %s: %s (%d)",
+                        dst, s_strerror(error), error);
+                    closesocket(c->fd);
+                    connect_cost_sample(c, i, 0, -1);
+                    next_start=now; /* no need to wait */
                 }
+                c->fd=INVALID_SOCKET;
             }
-            print_bound_address(c);
-            fd=c->fd;
-            c->fd=INVALID_SOCKET;
-            return fd; /* success! */
+            str_free(dst);
+            continue;
         }
-        if(c->fd!=INVALID_SOCKET) {
-            closesocket(c->fd);
-            c->fd=INVALID_SOCKET;
+        if(!active) /* all the attempts failed */
+            break;
+
+        /* wait for the active attempts */
+        wait=started<num ? next_start-now : -1;
+        s_poll_init(c->fds, 0);
+        for(i=0; i<num; ++i) {
+            if(fds[i]==INVALID_SOCKET)
+                continue;
+            s_poll_add(c->fds, fds[i], 1, 1);
+            if(wait<0 || deadlines[i]-now<wait)
+                wait=deadlines[i]>now ? deadlines[i]-now : 0;
+        }
+        switch(s_poll_wait(c->fds, (int)(wait/1000), (int)(wait%1000))) {
+        case -1:
+            sockerror("connect_race: s_poll_wait");
+            started=num; /* abandon the remaining attempts */
+            active=0;
+            break;
+        case 0:
+            break;
+        default:
+            for(i=0; i<num && winner==num; ++i) {
+                if(fds[i]==INVALID_SOCKET ||
+                        (!s_poll_canwrite(c->fds, fds[i]) &&
+                        !s_poll_canread(c->fds, fds[i]) &&
+                        !s_poll_err(c->fds, fds[i])))
+                    continue;
+                error=get_socket_error(fds[i]);
+                if(!error && s_poll_canwrite(c->fds, fds[i])) {
+                    winner=i;
+                    continue;
+                }
+                addr=&c->connect_addr.addr[i];
+                dst=s_ntop(addr, addr_len(addr));
+                s_log(LOG_ERR, "connect_race: connect %s: %s (%d)",
+                    dst, s_strerror(error), error);
+                str_free(dst);
+                closesocket(fds[i]);
+                fds[i]=INVALID_SOCKET;
+                --active;
+                connect_cost_sample(c, i, 0, -1);
+                next_start=0; /* start the next attempt immediately */
+            }
+        }
+        if(winner<num)
+            break;
+
+        /* expire the attempts exceeding TIMEOUTconnect */
+        now=clock_ms();
+        for(i=0; i<num; ++i) {
+            if(fds[i]==INVALID_SOCKET || now<deadlines[i])
+                continue;
+            addr=&c->connect_addr.addr[i];
+            dst=s_ntop(addr, addr_len(addr));
+            s_log(LOG_ERR, "connect_race: s_poll_wait %s:"
+                " TIMEOUTconnect exceeded", dst);
+            str_free(dst);
+            closesocket(fds[i]);
+            fds[i]=INVALID_SOCKET;
+            --active;
+            connect_cost_sample(c, i, 0, -1);
         }
     }
-    s_log(LOG_ERR, "No more addresses to connect");
-    throw_exception(c, 1);
-    return INVALID_SOCKET; /* some C compilers require a return value */
+
+    /* close the other attempts */
+    for(i=0; i<num; ++i) {
+        if(fds[i]==INVALID_SOCKET)
+            continue;
+        if(i==winner) {
+            c->fd=fds[i];
+            connect_cost_sample(c, i, 0, clock_ms()-
+                (deadlines[i]-1000*(int64_t)c->opt->timeout_connect));
+        } else {
+            closesocket(fds[i]);
+        }
+    }
+    str_free(fds);
+    str_free(deadlines);
+    if(winner==num)
+        return 1; /* failure */
+    c->idx=winner;
+    addr=&c->connect_addr.addr[winner];
+    dst=s_ntop(addr, addr_len(addr));
+    s_log(LOG_NOTICE, "connect_race: connected %s", dst);
+    str_free(dst);
+    return 0; /* success */
+}
+
+/* current time in milliseconds, monotonic where available */
+int64_t clock_ms(void) {
+#if defined(USE_WIN32)
+    return (int64_t)GetTickCount64();
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000+ts.tv_nsec/1000000;
+#else
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec*1000+tv.tv_usec/1000;
+#endif
 }
 
 NOEXPORT void idx_cache_save(SSL_SESSION *sess, SOCKADDR_UNION *cur_addr) {
@@ -1850,6 +3206,16 @@ NOEXPORT unsigned idx_cache_retrieve(CLI *c) {
     if(c->opt->failover==FAILOVER_RR) {
         i=(c->connect_addr.start+c->rr)%c->connect_addr.num;
         s_log(LOG_INFO, "failover: round-robin, starting at entry #%d", i);
+#ifndef USE_FORK
+    } else if(c->opt->failover==FAILOVER_LEASTCONN) {
+        i=connect_leastconn(c);
+        s_log(LOG_INFO, "failover: least connections, starting at entry #%d",
+            i);
+    } else if(c->opt->failover==FAILOVER_P2C) {
+        i=connect_p2c(c);
+        s_log(LOG_INFO, "failover: power of two choices, starting at entry #%d",
+            i);
+#endif /* !defined(USE_FORK) */
     } else {
         i=0;
         s_log(LOG_INFO, "failover: priority, starting at entry #0");
@@ -1857,6 +3223,231 @@ NOEXPORT unsigned idx_cache_retrieve(CLI *c) {
     return i;
 }
 
+#ifndef USE_FORK
+
+/* weight of a new latency measurement in the moving average */
+#define COST_ALPHA 0.3
+/* milliseconds for old latency measurements to lose half of their weight */
+#define COST_DECAY 10000
+
+/* find the "connect" target of the service, or return -1 */
+NOEXPORT int connect_target(SERVICE_OPTIONS *opt, SOCKADDR_UNION *addr) {
+    unsigned i;
+    socklen_t len=addr_len(addr);
+
+    if(!opt->connect_active)
+        return -1;
+    for(i=0; i<opt->connect_addr.num; ++i)
+        if(addr_len(&opt->connect_addr.addr[i])==len &&
+                !memcmp(&opt->connect_addr.addr[i], addr, (size_t)len))
+            return (int)i;
+    return -1; /* redirected or dynamic destination */
+}
+
+NOEXPORT void connect_active_acquire(CLI *c, int target) {
+    int num;
+
+    connect_active_release(c); /* just in case */
+    if(target<0 || (unsigned)target>=c->opt->connect_addr.num)
+        return;
+    c->connect_active=c->opt->connect_active+target;
+#if defined(USE_OS_THREADS) || defined(USE_SCHEDULERS)
+    CRYPTO_atomic_add(c->connect_active, 1, &num, stunnel_locks[LOCK_CLIENTS]);
+#else
+    num=++*c->connect_active;
+#endif
+    s_log(LOG_DEBUG, "Target #%d: %d active connection(s)", target, num);
+}
+
+NOEXPORT void connect_active_release(CLI *c) {
+    int num;
+
+    if(!c->connect_active)
+        return;
+#if defined(USE_OS_THREADS) || defined(USE_SCHEDULERS)
+    CRYPTO_atomic_add(c->connect_active, -1, &num, stunnel_locks[LOCK_CLIENTS]);
+#else
+    num=--*c->connect_active;
+#endif
+    (void)num; /* squash the unused variable warning */
+    c->connect_active=NULL;
+}
+
+/* the target with the fewest active connections */
+NOEXPORT unsigned connect_leastconn(CLI *c) {
+    unsigned i, idx, best=0;
+    int target, num, best_num=-1;
+
+    /* start at the round-robin position to spread the ties */
+    for(i=0; i<c->connect_addr.num; ++i) {
+        idx=(c->connect_addr.start+c->rr+i)%c->connect_addr.num;
+        target=connect_target(c->opt, &c->connect_addr.addr[idx]);
+        /* a racy read is good enough for load balancing */
+        num=target<0 ? 0 : c->opt->connect_active[target];
+        if(best_num<0 || num<best_num) {
+            best=idx;
+            best_num=num;
+        }
+    }
+    return best;
+}
+
+void connect_target_info(void) {
+    SERVICE_OPTIONS *opt;
+    unsigned i;
+    char *addr_txt;
+    CONNECT_COST cost, mean;
+    int64_t now;
+
+    CRYPTO_THREAD_read_lock(stunnel_locks[LOCK_SECTIONS]);
+    for(opt=service_options.next; opt; opt=opt->next) {
+        if(!opt->connect_active)
+            continue;
+        now=clock_ms();
+        for(i=0; i<opt->connect_addr.num; ++i) {
+            addr_txt=s_ntop(&opt->connect_addr.addr[i],
+                addr_len(&opt->connect_addr.addr[i]));
+            CRYPTO_THREAD_read_lock(stunnel_locks[LOCK_CONNECT_COST]);
+            cost=opt->connect_cost[i];
+            cost_mean(opt, &mean);
+            CRYPTO_THREAD_unlock(stunnel_locks[LOCK_CONNECT_COST]);
+            s_log(LOG_NOTICE, "Service [%s] target %s: %d active connection(s), "
+                "connect %.1f ms, handshake %.1f ms", opt->servname, addr_txt,
+                opt->connect_active[i],
+                cost_decay(cost.connect_ms, cost.connect_time, now,
+                    mean.connect_ms),
+                cost_decay(cost.handshake_ms, cost.handshake_time, now,
+                    mean.handshake_ms));
+            str_free(addr_txt);
+        }
+    }
+    CRYPTO_THREAD_unlock(stunnel_locks[LOCK_SECTIONS]);
+}
+
+/* "failover = p2c": the cheaper of two random targets */
+NOEXPORT unsigned connect_p2c(CLI *c) {
+    unsigned num=c->connect_addr.num, r[2]={0, 0}, a, b;
+    double cost_a, cost_b;
+    int64_t now;
+
+    if(num<2)
+        return 0;
+    /* ignore the error value and the distribution bias */
+    RAND_bytes((unsigned char *)r, sizeof r);
+    a=r[0]%num;
+    b=r[1]%(num-1);
+    if(b>=a) /* two distinct targets */
+        ++b;
+    now=clock_ms();
+    cost_a=connect_cost(c, a, now);
+    cost_b=connect_cost(c, b, now);
+    s_log(LOG_DEBUG, "p2c: entry #%u cost %.1f, entry #%u cost %.1f",
+        a, cost_a, b, cost_b);
+    return cost_b<cost_a ? b : a;
+}
+
+/* the expected latency weighted by the number of active connections */
+NOEXPORT double connect_cost(CLI *c, unsigned idx, int64_t now) {
+    int target;
+    CONNECT_COST cost, mean;
+
+    target=connect_target(c->opt, &c->connect_addr.addr[idx]);
+    if(target<0)
+        return 0.0;
+    CRYPTO_THREAD_read_lock(stunnel_locks[LOCK_CONNECT_COST]);
+    cost=c->opt->connect_cost[target];
+    cost_mean(c->opt, &mean);
+    CRYPTO_THREAD_unlock(stunnel_locks[LOCK_CONNECT_COST]);
+    /* a racy read is good enough for load balancing */
+    return (cost_decay(cost.connect_ms, cost.connect_time, now,
+            mean.connect_ms)+
+        cost_decay(cost.handshake_ms, cost.handshake_time, now,
+            mean.handshake_ms)+1.0)*
+        (c->opt->connect_active[target]+1);
+}
+
+/* the mean latency of the measured targets
+ * must be called with LOCK_CONNECT_COST held */
+NOEXPORT void cost_mean(SERVICE_OPTIONS *opt, CONNECT_COST *mean) {
+    unsigned i, connect_num=0, handshake_num=0;
+
+    memset(mean, 0, sizeof(CONNECT_COST));
+    for(i=0; i<opt->connect_addr.num; ++i) {
+        if(opt->connect_cost[i].connect_time) {
+            mean->connect_ms+=opt->connect_cost[i].connect_ms;
+            ++connect_num;
+        }
+        if(opt->connect_cost[i].handshake_time) {
+            mean->handshake_ms+=opt->connect_cost[i].handshake_ms;
+            ++handshake_num;
+        }
+    }
+    if(connect_num)
+        mean->connect_ms/=connect_num;
+    if(handshake_num)
+        mean->handshake_ms/=handshake_num;
+}
+
+/* old measurements gradually lose their weight, so that the targets
+ * penalized for failures are eventually tried again, while the targets
+ * rarely used do not look cheaper than the others */
+NOEXPORT double cost_decay(double ms, int64_t updated, int64_t now,
+        double mean) {
+    if(!updated)
+        return mean; /* no measurements */
+    if(now<=updated)
+        return ms;
+    /* half-life */
+    return mean+(ms-mean)*exp2(-(double)(now-updated)/COST_DECAY);
+}
+
+#endif /* !defined(USE_FORK) */
+
+/* record the connect (handshake=0) or TLS handshake (handshake=1) time
+ * of a "connect" target in milliseconds, or -1 for a failure */
+NOEXPORT void connect_cost_sample(CLI *c, unsigned idx, int handshake,
+        int64_t ms) {
+#ifndef USE_FORK
+    int target;
+    double *avg;
+    int64_t now, *updated;
+    CONNECT_COST mean;
+
+    if(idx>=c->connect_addr.num)
+        return;
+    target=connect_target(c->opt, &c->connect_addr.addr[idx]);
+    if(target<0)
+        return;
+    if(ms<0) /* penalize the failure with its timeout */
+        ms=1000*(int64_t)(handshake ?
+            c->opt->timeout_busy : c->opt->timeout_connect);
+    now=clock_ms();
+    CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_CONNECT_COST]);
+    if(handshake) {
+        avg=&c->opt->connect_cost[target].handshake_ms;
+        updated=&c->opt->connect_cost[target].handshake_time;
+    } else {
+        avg=&c->opt->connect_cost[target].connect_ms;
+        updated=&c->opt->connect_cost[target].connect_time;
+    }
+    if(*updated) {
+        cost_mean(c->opt, &mean);
+        *avg=cost_decay(*avg, *updated, now,
+            handshake ? mean.handshake_ms : mean.connect_ms);
+        *avg+=COST_ALPHA*((double)ms-*avg);
+    } else { /* the first measurement */
+        *avg=(double)ms;
+    }
+    *updated=now ? now : 1;
+    CRYPTO_THREAD_unlock(stunnel_locks[LOCK_CONNECT_COST]);
+#else /* USE_FORK */
+    (void)c; /* squash the unused parameter warning */
+    (void)idx; /* squash the unused parameter warning */
+    (void)handshake; /* squash the unused parameter warning */
+    (void)ms; /* squash the unused parameter warning */
+#endif /* USE_FORK */
+}
+
 NOEXPORT void connect_setup(CLI *c) {
     if(redirect(c)) { /* process "redirect" first */
         s_log(LOG_NOTICE, "Redirecting connection");
@@ -51,6 +51,52 @@
 /* I/O buffer size: 18432 (0x4800) is the maximum size of TLS record payload */
 #define BUFFSIZE 18432
 
+/* bufferSize limits */
+#define BUFFSIZE_MIN 1024
+#define BUFFSIZE_MAX 1048576
+
+/* maximum number of bytes in idle I/O buffers kept for reuse */
+#define BUFFER_POOL_SIZE (1024*BUFFSIZE)
+
+/* idle I/O buffers kept by each thread, and moved to or from the pool at once */
+#define BUFFER_CACHE_SIZE 4
+#define BUFFER_CACHE_BATCH 2
+
+/* per-thread pool of small memory blocks in str.c */
+#define STR_POOL_CLASSES 8
+#define STR_POOL_SIZE 65536
+
+/* arena chunk size and the largest allocation served from an arena */
+#define STR_ARENA_CHUNK 4096
+#define STR_ARENA_MAX 1024
+
+/* default number of connections accepted per listening socket wakeup */
+#define ACCEPT_BATCH 16
+
+/* asynchronous logging: queued records (a power of 2) and writev() batch */
+#define LOG_QUEUE_SIZE 4096
+#define LOG_BATCH 64
+
+/* sessiond response timeout (in milliseconds) and idle channels per service */
+#define SESSIOND_TIMEOUT 200
+#define SESSIOND_POOL_SIZE 16
+
+/* built-in sessiond server: hash table shards, buckets per shard,
+ * expiry wheel slots (in seconds), datagrams per recvmmsg(2) call,
+ * the maximum number of server threads, and the default memory limit */
+#define SESSIOND_SHARDS 16
+#define SESSIOND_BUCKETS 1024
+#define SESSIOND_WHEEL 256
+#define SESSIOND_BATCH 32
+#define SESSIOND_THREADS 64
+#define SESSIOND_MEMORY (16*1024*1024)
+
+/* shared memory session cache: lock stripes, slots per set,
+ * and the maximum length of an encoded session */
+#define SHM_CACHE_STRIPES 64
+#define SHM_CACHE_WAYS 8
+#define SHM_CACHE_VAL_LEN 2048
+
 /* how many bytes of random input to read from files for PRNG */
 /* security margin is huge to compensate for flawed entropy */
 #define RANDOM_BYTES 1024
@@ -180,6 +226,10 @@ typedef int                 ssize_t;
 #define _THREAD_SAFE
 #endif
 #include <pthread.h>
+/* asynchronous logging needs a writer thread and atomic operations */
+#if defined(__GNUC__) && defined(__ATOMIC_ACQ_REL) && defined(HAVE_SYS_UIO_H)
+#define USE_LOG_ASYNC
+#endif
 #endif
 
 /* systemd */
@@ -208,6 +258,7 @@ typedef int                 ssize_t;
 #include <stdarg.h>      /* va_ */
 #include <string.h>
 #include <ctype.h>       /* isalnum */
+#include <math.h>        /* exp2 */
 #include <time.h>
 #include <sys/stat.h>    /* stat */
 #include <setjmp.h>
@@ -331,6 +382,12 @@ typedef int SOCKET;
 #endif /* HAVE_POLL_H */
 #endif /* HAVE_POLL && !BROKEN_POLL */
 
+/* the UCONTEXT scheduler keeps a persistent epoll set on Linux */
+#if defined(USE_UCONTEXT) && defined(USE_POLL) && defined(__linux__)
+#include <sys/epoll.h>
+#define USE_EPOLL
+#endif /* USE_UCONTEXT && USE_POLL && __linux__ */
+
 #ifdef HAVE_SYS_FILIO_H
 #include <sys/filio.h>   /* for FIONBIO */
 #endif
@@ -346,6 +403,12 @@ typedef int SOCKET;
 #include <sys/uio.h>    /* struct iovec */
 #endif /* HAVE_SYS_UIO_H */
 
+/* session cache shared between processes with mmap(2) */
+#if defined(_POSIX_MAPPED_FILES) && _POSIX_MAPPED_FILES>0
+#include <sys/mman.h>   /* mmap */
+#define USE_SHM_CACHE
+#endif /* _POSIX_MAPPED_FILES */
+
 /* BSD sockets */
 #include <netinet/in.h>  /* struct sockaddr_in */
 #include <sys/socket.h>  /* getpeername */
@@ -500,6 +563,35 @@ STACK_OF(SSL_COMP) *SSL_COMP_get_compression_methods(void);
 #define OpenSSL_version(x) SSLeay_version(x)
 #endif
 
+/* kernel TLS offload (OpenSSL 3.0 or later) */
+#ifdef SSL_OP_ENABLE_KTLS
+#define USE_KTLS
+/* splice(2) for zero-copy data transfer over kernel TLS */
+#if defined(__linux__) && defined(SPLICE_F_MOVE)
+#define USE_SPLICE
+#endif /* __linux__ && SPLICE_F_MOVE */
+#endif /* SSL_OP_ENABLE_KTLS */
+
+/* the built-in sessiond server batches datagrams with recvmmsg(2) */
+#if defined(USE_PTHREAD) && defined(__linux__) && defined(MSG_WAITFORONE)
+#define USE_SESSIOND_SERVER
+#endif /* USE_PTHREAD && __linux__ && MSG_WAITFORONE */
+
+/* accept threads rely on SO_REUSEPORT load balancing (Linux 3.9 or later) */
+#if defined(USE_PTHREAD) && defined(__linux__) && defined(SO_REUSEPORT)
+#define USE_ACCEPT_THREADS
+#endif /* USE_PTHREAD && __linux__ && SO_REUSEPORT */
+
+/* UCONTEXT contexts can be spread over several scheduler threads, which
+ * needs epoll, atomic operations, OpenSSL 1.1.0 locking, and pthreads in libc */
+#if defined(USE_EPOLL) && defined(__GNUC__) && defined(__ATOMIC_ACQ_REL) && \
+        OPENSSL_VERSION_NUMBER>=0x10100004L && (!defined(__GLIBC__) || \
+        __GLIBC__>2 || (__GLIBC__==2 && __GLIBC_MINOR__>=34))
+#include <pthread.h>
+#include <sys/eventfd.h>
+#define USE_SCHEDULERS
+#endif /* USE_EPOLL && ... */
+
 /**************************************** other defines */
 
 /* always use IPv4 defaults! */
@@ -49,6 +49,49 @@ DH *dh_params=NULL;
 int dh_temp_params=0;
 #endif /* OPENSSL_NO_DH */
 
+#ifdef USE_SHM_CACHE
+/* the layout of a shared memory session cache file */
+#define SHM_CACHE_MAGIC "stnlshm"
+
+typedef struct {
+    time_t expire;                                   /* 0 for an empty slot */
+    unsigned key_len, val_len;
+    u_char key[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    u_char val[SHM_CACHE_VAL_LEN];
+} SHM_CACHE_SLOT;
+
+typedef struct {
+    unsigned long long hits, misses, stores, evictions;
+} SHM_CACHE_STATS;
+
+typedef struct {
+    char magic[sizeof SHM_CACHE_MAGIC];      /* identifies the file format */
+    unsigned slot_size, stripes, ways, sets;
+    SHM_CACHE_STATS stats[SHM_CACHE_STRIPES];   /* guarded by stripe locks */
+    SHM_CACHE_SLOT slot[1];                    /* sets*ways cached sessions */
+} SHM_CACHE_MAP;
+
+typedef struct shm_cache_struct { /* a cache file mapped by this process */
+    struct shm_cache_struct *next;
+    char *name;
+    dev_t dev;
+    ino_t ino;
+    int fd;                          /* the descriptor used for record locks */
+    SHM_CACHE_MAP *map;
+    size_t size;
+    unsigned sets;
+    unsigned refs;                  /* the number of sections using the file */
+    CRYPTO_RWLOCK *lock[SHM_CACHE_STRIPES];       /* in-process stripe locks */
+} SHM_CACHE;
+
+static SHM_CACHE *shm_cache_list=NULL;
+#endif /* USE_SHM_CACHE */
+
+/* session migration on reload */
+static SSL_CTX *migrate_ctx=NULL;              /* the destination context */
+static TLS_DATA *migrate_tls=NULL;  /* the thread performing the migration */
+static unsigned migrate_num=0;              /* the number of moved sessions */
+
 /**************************************** prototypes */
 
 /* SNI */
@@ -113,6 +156,12 @@ NOEXPORT SSL_SESSION *sess_get_cb(SSL *,
     unsigned char *, int, int *);
 NOEXPORT void sess_remove_cb(SSL_CTX *, SSL_SESSION *);
 
+/* session migration on reload */
+NOEXPORT void session_migrate(SSL_SESSION *);
+NOEXPORT int context_same_identity(SERVICE_OPTIONS *, SERVICE_OPTIONS *);
+NOEXPORT int same_string(const char *, const char *);
+NOEXPORT int same_name_list(const NAME_LIST *, const NAME_LIST *);
+
 /* sessiond interface */
 NOEXPORT void cache_new(SSL *, SSL_SESSION *);
 NOEXPORT SSL_SESSION *cache_get(SSL *, const unsigned char *, int);
@@ -121,6 +170,26 @@ NOEXPORT void cache_transfer(SSL_CTX *, const u_char, const long,
     const u_char *, const size_t,
     const u_char *, const size_t,
     unsigned char **, size_t *);
+NOEXPORT int cache_receive(SESSIOND_CHANNEL *, u_char *, unsigned,
+    CACHE_PACKET *, const u_char *, const size_t, unsigned char **, size_t *);
+NOEXPORT SESSIOND_CHANNEL *sessiond_channel_get(SERVICE_OPTIONS *);
+NOEXPORT void sessiond_channel_put(SERVICE_OPTIONS *, SESSIOND_CHANNEL *);
+NOEXPORT void sessiond_channel_free(SESSIOND_CHANNEL *);
+
+/* shared memory session cache */
+#ifdef USE_SHM_CACHE
+NOEXPORT int shm_cache_init(SERVICE_OPTIONS *);
+NOEXPORT SHM_CACHE *shm_cache_open(const char *, long);
+NOEXPORT SHM_CACHE_MAP *shm_cache_map(int, const char *, unsigned *, size_t *);
+NOEXPORT size_t shm_cache_bytes(unsigned);
+NOEXPORT int shm_cache_file_lock(int, off_t, off_t, short);
+NOEXPORT SHM_CACHE_SLOT *shm_cache_lock(SHM_CACHE *,
+    const u_char *, unsigned, unsigned *);
+NOEXPORT void shm_cache_unlock(SHM_CACHE *, unsigned);
+NOEXPORT void shm_cache_new(SHM_CACHE *, SSL_SESSION *);
+NOEXPORT SSL_SESSION *shm_cache_get(SHM_CACHE *, const u_char *, int);
+NOEXPORT void shm_cache_remove(SHM_CACHE *, SSL_SESSION *);
+#endif /* USE_SHM_CACHE */
 
 /* info callbacks */
 NOEXPORT void info_callback(const SSL *, int, int);
@@ -199,6 +268,12 @@ int context_init(SERVICE_OPTIONS *section) { /* init TLS context */
     SSL_CTX_clear_options(section->ctx, SSL_OP_NO_COMPRESSION);
 #endif /* SSL_OP_NO_COMPRESSION */
 
+#ifdef USE_KTLS
+    /* TLS options: kernel TLS offload */
+    if(section->option.ktls)
+        SSL_CTX_set_options(section->ctx, SSL_OP_ENABLE_KTLS);
+#endif /* USE_KTLS */
+
     /* TLS options: configure the user-specified values */
     SSL_CTX_set_options(section->ctx,
         (SSL_OPTIONS_TYPE)(section->ssl_options_set));
@@ -262,6 +337,10 @@ int context_init(SERVICE_OPTIONS *section) { /* init TLS context */
     SSL_CTX_sess_set_new_cb(section->ctx, sess_new_cb);
     SSL_CTX_sess_set_get_cb(section->ctx, sess_get_cb);
     SSL_CTX_sess_set_remove_cb(section->ctx, sess_remove_cb);
+#ifdef USE_SHM_CACHE
+    if(!section->option.client && shm_cache_init(section))
+        return 1; /* FAILED */
+#endif /* USE_SHM_CACHE */
 
     /* set info callback */
     SSL_CTX_set_info_callback(section->ctx, info_callback);
@@ -1164,6 +1243,11 @@ NOEXPORT int sess_new_cb(SSL *ssl, SSL_SESSION *sess) {
     if(c->opt->option.client)
         session_cache_save(c, sess);
 
+#ifdef USE_SHM_CACHE
+    if(c->opt->shm_cache)
+        shm_cache_new(c->opt->shm_cache, sess);
+#endif /* USE_SHM_CACHE */
+
     if(c->opt->option.sessiond)
         cache_new(ssl, sess);
 
@@ -1277,6 +1361,13 @@ NOEXPORT SSL_SESSION *sess_get_cb(SSL *ssl,
     s_log(LOG_DEBUG, "Get session callback");
     *do_copy=0; /* allow the session to be freed automatically */
     c=SSL_get_ex_data(ssl, index_ssl_cli);
+#ifdef USE_SHM_CACHE
+    if(c->opt->shm_cache) {
+        SSL_SESSION *sess=shm_cache_get(c->opt->shm_cache, key, key_len);
+        if(sess || !c->opt->option.sessiond)
+            return sess;
+    }
+#endif /* USE_SHM_CACHE */
     if(c->opt->option.sessiond)
         return cache_get(ssl, key, key_len);
     return NULL; /* no session to resume */
@@ -1286,18 +1377,198 @@ NOEXPORT void sess_remove_cb(SSL_CTX *ctx, SSL_SESSION *sess) {
     SERVICE_OPTIONS *opt;
 
     s_log(LOG_DEBUG, "Remove session callback");
+    if(migrate_tls && migrate_tls==tls_get()) { /* reloading */
+        if(ctx!=migrate_ctx)
+            session_migrate(sess);
+        return;
+    }
     opt=SSL_CTX_get_ex_data(ctx, index_ssl_ctx_opt);
+#ifdef USE_SHM_CACHE
+    if(opt->shm_cache)
+        shm_cache_remove(opt->shm_cache, sess);
+#endif /* USE_SHM_CACHE */
     if(opt->option.sessiond)
         cache_remove(ctx, sess);
 }
 
-/**************************************** sessiond functionality */
+/**************************************** session migration on reload */
+
+/* move the cached sessions and ticket keys of unchanged sections */
+void context_migrate(SERVICE_OPTIONS *new_list, SERVICE_OPTIONS *old_list) {
+    SERVICE_OPTIONS *old_section, *new_section;
+
+    for(old_section=old_list; old_section; old_section=old_section->next) {
+        if(old_section->option.client || !old_section->ctx)
+            continue;
+        for(new_section=new_list; new_section; new_section=new_section->next)
+            if(!new_section->option.client && new_section->ctx &&
+                    !strcmp(new_section->servname, old_section->servname))
+                break;
+        if(new_section && !context_same_identity(old_section, new_section)) {
+            s_log(LOG_INFO, "Service [%s]: TLS identity changed, "
+                "cached sessions discarded", old_section->servname);
+            new_section=NULL;
+        }
+
+        /* the remove callback executed by this thread either moves
+         * the session to the new context or silently discards it,
+         * as other stunnel processes may still use the shared caches */
+        migrate_ctx=new_section ? new_section->ctx : NULL;
+        migrate_tls=tls_get();
+        migrate_num=0;
+        SSL_CTX_flush_sessions(old_section->ctx,
+            (long)time(NULL)+old_section->session_timeout+1);
+        migrate_tls=NULL;
+        migrate_ctx=NULL;
+        if(!new_section)
+            continue;
+        new_section->sessions_migrated=old_section->sessions_migrated+
+            migrate_num;
+
+#ifdef SSL_CTRL_GET_TLSEXT_TICKET_KEYS
+        if(!new_section->ticket_key) { /* random keys generated by OpenSSL */
+            unsigned char keys[80];
+#if OPENSSL_VERSION_NUMBER>=0x10100000L
+            long keys_len=80;
+#else /* OPENSSL_VERSION_NUMBER<0x10100000L */
+            long keys_len=48;
+#endif /* OPENSSL_VERSION_NUMBER<0x10100000L */
+            if(SSL_CTX_get_tlsext_ticket_keys(old_section->ctx,
+                    keys, keys_len))
+                SSL_CTX_set_tlsext_ticket_keys(new_section->ctx,
+                    keys, keys_len);
+            OPENSSL_cleanse(keys, sizeof keys);
+        }
+#endif /* SSL_CTRL_GET_TLSEXT_TICKET_KEYS */
+        s_log(LOG_INFO, "Service [%s]: %u cached session(s) migrated",
+            new_section->servname, migrate_num);
+    }
+}
+
+/* executed by the remove callback with the old context locked */
+NOEXPORT void session_migrate(SSL_SESSION *sess) {
+    SSL_SESSION *copy;
+    unsigned char *val, *val_tmp;
+    int val_len;
+
+    if(!migrate_ctx) /* nowhere to move the session */
+        return;
+    if((long)SSL_SESSION_get_time(sess)+SSL_SESSION_get_timeout(sess)<=
+            (long)time(NULL)) /* expired */
+        return;
+    /* a copy without the "not resumable" flag set by the flush */
+    val_len=i2d_SSL_SESSION(sess, NULL);
+    if(val_len<=0)
+        return;
+    val_tmp=val=str_alloc((size_t)val_len);
+    i2d_SSL_SESSION(sess, &val_tmp);
+    val_tmp=val;
+    copy=d2i_SSL_SESSION(NULL,
+#if OPENSSL_VERSION_NUMBER>=0x0090707fL
+        (const unsigned char **)
+#endif /* OpenSSL version >= 0.9.7g */
+        &val_tmp, (long)val_len);
+    str_free(val);
+    if(!copy)
+        return;
+    if(SSL_CTX_add_session(migrate_ctx, copy))
+        ++migrate_num;
+    SSL_SESSION_free(copy);
+}
 
-#define CACHE_CMD_NEW     0x00
-#define CACHE_CMD_GET     0x01
-#define CACHE_CMD_REMOVE  0x02
-#define CACHE_RESP_ERR    0x80
-#define CACHE_RESP_OK     0x81
+/* sessions are only valid with the same certificate, key, CA,
+ * verification, and protocol settings */
+NOEXPORT int context_same_identity(SERVICE_OPTIONS *a, SERVICE_OPTIONS *b) {
+#if OPENSSL_VERSION_NUMBER>=0x10002000L
+    X509 *cert_a, *cert_b;
+    EVP_PKEY *key_a, *key_b;
+    STACK_OF(X509_NAME) *ca_a, *ca_b;
+    int i;
+
+    cert_a=SSL_CTX_get0_certificate(a->ctx);
+    cert_b=SSL_CTX_get0_certificate(b->ctx);
+    if(!cert_a!=!cert_b || (cert_a && X509_cmp(cert_a, cert_b)))
+        return 0;
+    key_a=SSL_CTX_get0_privatekey(a->ctx);
+    key_b=SSL_CTX_get0_privatekey(b->ctx);
+#if OPENSSL_VERSION_NUMBER>=0x30000000L
+    if(!key_a!=!key_b || (key_a && EVP_PKEY_eq(key_a, key_b)!=1))
+#else /* OPENSSL_VERSION_NUMBER<0x30000000L */
+    if(!key_a!=!key_b || (key_a && EVP_PKEY_cmp(key_a, key_b)!=1))
+#endif /* OPENSSL_VERSION_NUMBER<0x30000000L */
+        return 0;
+    ca_a=SSL_CTX_get_client_CA_list(a->ctx);
+    ca_b=SSL_CTX_get_client_CA_list(b->ctx);
+    if(sk_X509_NAME_num(ca_a)!=sk_X509_NAME_num(ca_b))
+        return 0;
+    for(i=0; i<sk_X509_NAME_num(ca_a); ++i)
+        if(X509_NAME_cmp(sk_X509_NAME_value(ca_a, i),
+                sk_X509_NAME_value(ca_b, i)))
+            return 0;
+    /* the client certificates of the resumed sessions are not verified
+     * again, so the CA and CRL data must not have changed since then */
+    if(a->option.request_cert && (!a->file_stamps || !b->file_stamps ||
+            strcmp(a->file_stamps, b->file_stamps)))
+        return 0;
+    return same_string(a->ca_file, b->ca_file) &&
+        same_string(a->ca_dir, b->ca_dir) &&
+        same_string(a->crl_file, b->crl_file) &&
+        same_string(a->crl_dir, b->crl_dir) &&
+        same_name_list(a->check_host, b->check_host) &&
+        same_name_list(a->check_email, b->check_email) &&
+        same_name_list(a->check_ip, b->check_ip) &&
+        same_name_list(a->config, b->config) &&
+        a->option.request_cert==b->option.request_cert &&
+        a->option.require_cert==b->option.require_cert &&
+        a->option.verify_chain==b->option.verify_chain &&
+        a->option.verify_peer==b->option.verify_peer &&
+#ifndef OPENSSL_NO_PSK
+        !a->psk_keys && !b->psk_keys &&
+#endif /* !defined(OPENSSL_NO_PSK) */
+        same_string(a->cipher_list, b->cipher_list) &&
+#ifndef OPENSSL_NO_TLS1_3
+        same_string(a->ciphersuites, b->ciphersuites) &&
+#endif /* TLS 1.3 */
+#if OPENSSL_VERSION_NUMBER>=0x10100000L
+        a->min_proto_version==b->min_proto_version &&
+        a->max_proto_version==b->max_proto_version &&
+#endif /* OPENSSL_VERSION_NUMBER>=0x10100000L */
+        a->ssl_options_set==b->ssl_options_set &&
+        a->ssl_options_clear==b->ssl_options_clear;
+#else /* OPENSSL_VERSION_NUMBER<0x10002000L */
+    (void)a; /* squash the unused parameter warning */
+    (void)b; /* squash the unused parameter warning */
+    return 0; /* the context cannot be inspected */
+#endif /* OPENSSL_VERSION_NUMBER<0x10002000L */
+}
+
+NOEXPORT int same_string(const char *a, const char *b) {
+    return a==b || (a && b && !strcmp(a, b));
+}
+
+NOEXPORT int same_name_list(const NAME_LIST *a, const NAME_LIST *b) {
+    for(; a && b; a=a->next, b=b->next)
+        if(strcmp(a->name, b->name))
+            return 0;
+    return !a && !b;
+}
+
+void session_cache_info(void) {
+    SERVICE_OPTIONS *section;
+
+    for(section=service_options.next; section; section=section->next)
+        if(!section->option.client && section->ctx)
+            s_log(LOG_NOTICE, "Service [%s] sessions: %ld cached, "
+                "%ld reuse(s), %ld miss(es), %ld timeout(s), "
+                "%u migrated on reload",
+                section->servname, SSL_CTX_sess_number(section->ctx),
+                SSL_CTX_sess_hits(section->ctx),
+                SSL_CTX_sess_misses(section->ctx),
+                SSL_CTX_sess_timeouts(section->ctx),
+                section->sessions_migrated);
+}
+
+/**************************************** sessiond functionality */
 
 NOEXPORT void cache_new(SSL *ssl, SSL_SESSION *sess) {
     unsigned char *val, *val_tmp;
@@ -1345,14 +1616,6 @@ NOEXPORT void cache_remove(SSL_CTX *ctx, SSL_SESSION *sess) {
         session_id, session_id_length, NULL, 0, NULL, NULL);
 }
 
-#define MAX_VAL_LEN 512
-typedef struct {
-    u_char version, type;
-    u_short timeout;
-    u_char key[SSL_MAX_SSL_SESSION_ID_LENGTH];
-    u_char val[MAX_VAL_LEN];
-} CACHE_PACKET;
-
 NOEXPORT void cache_transfer(SSL_CTX *ctx, const u_char type,
         const long timeout,
         const u_char *key, const size_t key_len,
@@ -1360,11 +1623,12 @@ NOEXPORT void cache_transfer(SSL_CTX *ctx, const u_char type,
         unsigned char **ret, size_t *ret_len) {
     char session_id_txt[2*SSL_MAX_SSL_SESSION_ID_LENGTH+1];
     const char *type_description[]={"new", "get", "remove"};
-    SOCKET s;
-    ssize_t len;
-    struct timeval t;
     CACHE_PACKET *packet;
     SERVICE_OPTIONS *section;
+    SESSIOND_CHANNEL *channel;
+    u_char *pending;
+    unsigned i, waiting=0;
+    int result;
 
     if(ret) /* set error as the default result if required */
         *ret=NULL;
@@ -1396,76 +1660,598 @@ NOEXPORT void cache_transfer(SSL_CTX *ctx, const u_char type,
     if(val && val_len) /* only check it to make code analysis tools happy */
         memcpy(packet->val, val, val_len);
 
-    /* create the socket */
-    s=s_socket(AF_INET, SOCK_DGRAM, 0, 0, "cache_transfer: socket");
-    if(s==INVALID_SOCKET) {
+    /* retrieve pointer to the section structure of this ctx */
+    section=SSL_CTX_get_ex_data(ctx, index_ssl_ctx_opt);
+    channel=sessiond_channel_get(section);
+    if(!channel) {
         str_free(packet);
         return;
     }
 
-    /* retrieve pointer to the section structure of this ctx */
-    section=SSL_CTX_get_ex_data(ctx, index_ssl_ctx_opt);
-    if(sendto(s, (void *)packet,
+    /* send the request to all the replicas without waiting for responses */
+    pending=str_alloc(channel->num);
+    for(i=0; i<channel->num; ++i) {
+        if(send(channel->fd[i], (void *)packet,
 #ifdef USE_WIN32
-            (int)
+                (int)
 #endif
-            (sizeof(CACHE_PACKET)-MAX_VAL_LEN+val_len),
-            0, &section->sessiond_addr.sa,
-            addr_len(&section->sessiond_addr))<0) {
-        sockerror("cache_transfer: sendto");
-        closesocket(s);
-        str_free(packet);
-        return;
+                (sizeof(CACHE_PACKET)-MAX_VAL_LEN+val_len), 0)<0) {
+            sockerror("cache_transfer: send");
+            continue;
+        }
+        pending[i]=1;
+        ++waiting;
+    }
+
+    if(ret && ret_len && waiting) { /* a response is required */
+        result=cache_receive(channel, pending, waiting,
+            packet, key, key_len, ret, ret_len);
+        CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_SESSIOND]);
+        if(result>0)
+            ++section->sessiond_hits;
+        else if(result==0)
+            ++section->sessiond_misses;
+        else
+            ++section->sessiond_timeouts;
+        CRYPTO_THREAD_unlock(stunnel_locks[LOCK_SESSIOND]);
     }
+    str_free(pending);
+    sessiond_channel_put(section, channel);
+    str_free(packet);
+}
 
-    if(!ret || !ret_len) { /* no response is required */
-        closesocket(s);
-        str_free(packet);
-        return;
+/* the first positive response wins, a miss requires all replicas to agree */
+/* returns 1 for a hit, 0 for a miss, -1 for a timeout */
+NOEXPORT int cache_receive(SESSIOND_CHANNEL *channel,
+        u_char *pending, unsigned waiting, CACHE_PACKET *packet,
+        const u_char *key, const size_t key_len,
+        unsigned char **ret, size_t *ret_len) {
+    s_poll_set *fds;
+    ssize_t len;
+    unsigned i;
+    int64_t deadline, remaining;
+    int err;
+
+    /* stale or malformed packets must not extend the timeout */
+    deadline=clock_ms()+SESSIOND_TIMEOUT;
+    fds=s_poll_alloc();
+    while(waiting) {
+        remaining=deadline-clock_ms();
+        if(remaining<=0) {
+            s_poll_free(fds);
+            s_log(LOG_INFO, "cache_transfer: recv timeout");
+            return -1;
+        }
+        s_poll_init(fds, 0);
+        for(i=0; i<channel->num; ++i)
+            if(pending[i])
+                s_poll_add(fds, channel->fd[i], 1, 0);
+        err=s_poll_wait(fds, (int)(remaining/1000), (int)(remaining%1000));
+        if(err<0) {
+            sockerror("cache_transfer: s_poll_wait");
+            s_poll_free(fds);
+            return -1;
+        }
+        if(err==0) {
+            s_poll_free(fds);
+            s_log(LOG_INFO, "cache_transfer: recv timeout");
+            return -1;
+        }
+        for(i=0; i<channel->num; ++i) {
+            if(!pending[i] || !s_poll_canread(fds, channel->fd[i]))
+                continue;
+            len=recv(channel->fd[i], (void *)packet, sizeof(CACHE_PACKET), 0);
+            if(len<0) {
+                if(get_last_socket_error()==S_EWOULDBLOCK ||
+                        get_last_socket_error()==S_EAGAIN)
+                    continue;
+                sockerror("cache_transfer: recv"); /* e.g. replica not running */
+                pending[i]=0;
+                --waiting;
+                continue;
+            }
+            /* a channel may still receive late responses to the previous
+             * requests, so the session id is used to match the response */
+            if(len<(int)sizeof(CACHE_PACKET)-MAX_VAL_LEN || /* too short */
+                    packet->version!=1 || /* wrong version */
+                    safe_memcmp(packet->key, key, key_len)) { /* another id */
+                s_log(LOG_DEBUG, "cache_transfer: stale or malformed packet");
+                continue;
+            }
+            pending[i]=0;
+            --waiting;
+            if(packet->type==CACHE_RESP_OK) {
+                s_poll_free(fds);
+                *ret_len=(size_t)len-(sizeof(CACHE_PACKET)-MAX_VAL_LEN);
+                *ret=str_alloc(*ret_len);
+                s_log(LOG_INFO, "cache_transfer: session found");
+                memcpy(*ret, packet->val, *ret_len);
+                return 1;
+            }
+        }
     }
+    s_poll_free(fds);
+    s_log(LOG_INFO, "cache_transfer: session not found");
+    return 0;
+}
 
-    /* set recvfrom timeout to 200ms */
-    t.tv_sec=0;
-    t.tv_usec=200;
-    if(setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (void *)&t, sizeof t)<0) {
-        sockerror("cache_transfer: setsockopt SO_RCVTIMEO");
-        closesocket(s);
-        str_free(packet);
-        return;
+NOEXPORT SESSIOND_CHANNEL *sessiond_channel_get(SERVICE_OPTIONS *section) {
+    SESSIOND_CHANNEL *channel;
+    SOCKADDR_UNION *addr;
+    SOCKET fd;
+
+    /* reuse an idle channel if possible */
+    CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_SESSIOND]);
+    channel=section->sessiond_pool;
+    if(channel) {
+        section->sessiond_pool=channel->next;
+        --section->sessiond_idle;
+    }
+    CRYPTO_THREAD_unlock(stunnel_locks[LOCK_SESSIOND]);
+    if(channel)
+        return channel;
+
+    /* channels outlive client threads, so they are detached */
+    channel=str_alloc_detached(sizeof(SESSIOND_CHANNEL));
+    channel->fd=str_alloc_detached(section->sessiond_num*sizeof(SOCKET));
+    channel->num=0;
+    while(channel->num<section->sessiond_num) {
+        addr=section->sessiond_addr+channel->num;
+        fd=s_socket(addr->sa.sa_family, SOCK_DGRAM, 0, 1, "sessiond: socket");
+        if(fd==INVALID_SOCKET) {
+            sessiond_channel_free(channel);
+            return NULL;
+        }
+        if(connect(fd, &addr->sa, addr_len(addr))) {
+            sockerror("sessiond: connect");
+            closesocket(fd);
+            sessiond_channel_free(channel);
+            return NULL;
+        }
+        channel->fd[channel->num++]=fd;
+    }
+    s_log(LOG_DEBUG, "sessiond: new channel to %u replica(s)", channel->num);
+    return channel;
+}
+
+NOEXPORT void sessiond_channel_put(SERVICE_OPTIONS *section,
+        SESSIOND_CHANNEL *channel) {
+    CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_SESSIOND]);
+    if(section->sessiond_idle<SESSIOND_POOL_SIZE) {
+        channel->next=section->sessiond_pool;
+        section->sessiond_pool=channel;
+        ++section->sessiond_idle;
+        channel=NULL;
+    }
+    CRYPTO_THREAD_unlock(stunnel_locks[LOCK_SESSIOND]);
+    if(channel) /* too many idle channels */
+        sessiond_channel_free(channel);
+}
+
+NOEXPORT void sessiond_channel_free(SESSIOND_CHANNEL *channel) {
+    unsigned i;
+
+    for(i=0; i<channel->num; ++i)
+        closesocket(channel->fd[i]);
+    str_free(channel->fd);
+    str_free(channel);
+}
+
+/* the section is no longer used by any client */
+void sessiond_free(SERVICE_OPTIONS *section) {
+    SESSIOND_CHANNEL *channel;
+
+    while(section->sessiond_pool) {
+        channel=section->sessiond_pool;
+        section->sessiond_pool=channel->next;
+        sessiond_channel_free(channel);
     }
+    section->sessiond_idle=0;
+}
 
-    /* retrieve response */
-    len=recv(s, (void *)packet, sizeof(CACHE_PACKET), 0);
-    closesocket(s);
-    if(len<0) {
-        if(get_last_socket_error()==S_EWOULDBLOCK ||
-                get_last_socket_error()==S_EAGAIN)
-            s_log(LOG_INFO, "cache_transfer: recv timeout");
-        else
-            sockerror("cache_transfer: recv");
-        str_free(packet);
-        return;
+#ifdef __GNUC__
+#if __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 6)
+#pragma GCC diagnostic push
+#endif /* __GNUC__>=4.6 */
+#pragma GCC diagnostic ignored "-Wformat"
+#pragma GCC diagnostic ignored "-Wformat-extra-args"
+#endif /* __GNUC__ */
+void sessiond_info(void) {
+    SERVICE_OPTIONS *section;
+
+    CRYPTO_THREAD_read_lock(stunnel_locks[LOCK_SESSIOND]);
+    for(section=service_options.next; section; section=section->next)
+        if(section->option.sessiond)
+            s_log(LOG_NOTICE, "Service [%s] sessiond: %u replica(s), "
+                "%llu hit(s), %llu miss(es), %llu timeout(s)",
+                section->servname, section->sessiond_num,
+                section->sessiond_hits, section->sessiond_misses,
+                section->sessiond_timeouts);
+    CRYPTO_THREAD_unlock(stunnel_locks[LOCK_SESSIOND]);
+}
+#ifdef __GNUC__
+#if __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 6)
+#pragma GCC diagnostic pop
+#endif /* __GNUC__>=4.6 */
+#endif /* __GNUC__ */
+
+/**************************************** shared memory session cache */
+
+#ifdef USE_SHM_CACHE
+
+NOEXPORT int shm_cache_init(SERVICE_OPTIONS *section) {
+    SHM_CACHE *cache=NULL;
+    struct stat st;
+
+    if(!section->session_cache_file)
+        return 0; /* OK */
+    CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_SHM_CACHE]);
+    /* reuse the mapping of the same file, as closing another descriptor
+     * of the file would release the record locks held by this process */
+    if(!stat(section->session_cache_file, &st))
+        for(cache=shm_cache_list; cache; cache=cache->next)
+            if(cache->dev==st.st_dev && cache->ino==st.st_ino)
+                break;
+    if(!cache) {
+        cache=shm_cache_open(section->session_cache_file,
+            section->session_size);
+        if(cache) {
+            cache->next=shm_cache_list;
+            shm_cache_list=cache;
+        }
     }
+    if(cache)
+        ++cache->refs;
+    CRYPTO_THREAD_unlock(stunnel_locks[LOCK_SHM_CACHE]);
+    if(!cache)
+        return 1; /* FAILED */
+    section->shm_cache=cache;
+    return 0; /* OK */
+}
 
-    /* parse results */
-    if(len<(int)sizeof(CACHE_PACKET)-MAX_VAL_LEN || /* too short */
-            packet->version!=1 || /* wrong version */
-            safe_memcmp(packet->key, key, key_len)) { /* wrong session id */
-        s_log(LOG_DEBUG, "cache_transfer: malformed packet received");
-        str_free(packet);
+NOEXPORT SHM_CACHE *shm_cache_open(const char *name, long size) {
+    SHM_CACHE *cache;
+    SHM_CACHE_MAP *map;
+    struct stat st;
+    unsigned sets, i;
+    size_t map_size;
+    int fd, flags;
+
+    if(size<=0 || size>INT_MAX) /* 0 means unlimited for OpenSSL */
+        size=SSL_SESSION_CACHE_MAX_SIZE_DEFAULT;
+    sets=(unsigned)((size+SHM_CACHE_WAYS-1)/SHM_CACHE_WAYS);
+
+    flags=O_RDWR|O_CREAT;
+#ifdef O_CLOEXEC
+    flags|=O_CLOEXEC;
+#endif /* O_CLOEXEC */
+#ifdef O_NOFOLLOW
+    flags|=O_NOFOLLOW; /* refuse a planted symbolic link */
+#endif /* O_NOFOLLOW */
+    fd=open(name, flags, 0600);
+    if(fd<0) {
+        ioerror(name);
+        return NULL;
+    }
+    /* resumed sessions skip the authentication, so nobody else
+     * may be able to store sessions in the file */
+    if(fstat(fd, &st)) {
+        ioerror(name);
+        close(fd);
+        return NULL;
+    }
+    if(!S_ISREG(st.st_mode)) {
+        s_log(LOG_ERR, "Session cache file %s: Not a regular file", name);
+        close(fd);
+        return NULL;
+    }
+    if(st.st_uid!=geteuid()) {
+        s_log(LOG_ERR, "Session cache file %s: Owned by another user", name);
+        close(fd);
+        return NULL;
+    }
+    if(st.st_mode&022) {
+        s_log(LOG_ERR, "Session cache file %s: Writable by group or others",
+            name);
+        close(fd);
+        return NULL;
+    }
+    /* only one process at a time can check or initialize the file */
+    if(shm_cache_file_lock(fd, 0, 0, F_WRLCK)) {
+        close(fd);
+        return NULL;
+    }
+    map=shm_cache_map(fd, name, &sets, &map_size);
+    shm_cache_file_lock(fd, 0, 0, F_UNLCK);
+    if(!map || fstat(fd, &st)) {
+        if(map)
+            munmap((void *)map, map_size);
+        close(fd);
+        return NULL;
+    }
+
+    cache=str_alloc_detached(sizeof(SHM_CACHE));
+    cache->next=NULL;
+    cache->name=str_dup_detached(name);
+    cache->dev=st.st_dev;
+    cache->ino=st.st_ino;
+    cache->fd=fd;
+    cache->map=map;
+    cache->size=map_size;
+    cache->sets=sets;
+    cache->refs=0;
+    for(i=0; i<SHM_CACHE_STRIPES; ++i)
+        cache->lock[i]=CRYPTO_THREAD_lock_new();
+    s_log(LOG_INFO, "Session cache file %s mapped: %u session(s)",
+        name, sets*SHM_CACHE_WAYS);
+    return cache;
+}
+
+/* the whole file is locked by the caller */
+NOEXPORT SHM_CACHE_MAP *shm_cache_map(int fd, const char *name,
+        unsigned *sets, size_t *map_size) {
+    SHM_CACHE_MAP header, *map;
+    struct stat st;
+    size_t header_size=offsetof(SHM_CACHE_MAP, slot);
+    int init=1;
+
+    if(fstat(fd, &st)) {
+        ioerror(name);
+        return NULL;
+    }
+    if((size_t)st.st_size>=header_size &&
+            pread(fd, &header, header_size, 0)==(ssize_t)header_size &&
+            !memcmp(header.magic, SHM_CACHE_MAGIC, sizeof header.magic) &&
+            header.slot_size==sizeof(SHM_CACHE_SLOT) &&
+            header.stripes==SHM_CACHE_STRIPES &&
+            header.ways==SHM_CACHE_WAYS && header.sets &&
+            (size_t)st.st_size>=shm_cache_bytes(header.sets)) {
+        /* other processes may already use the existing geometry */
+        if(header.sets!=*sets)
+            s_log(LOG_NOTICE, "Session cache file %s: "
+                "keeping the existing size of %u session(s)",
+                name, header.sets*SHM_CACHE_WAYS);
+        *sets=header.sets;
+        init=0;
+    }
+
+    *map_size=shm_cache_bytes(*sets);
+    if(init && (ftruncate(fd, 0) || ftruncate(fd, (off_t)*map_size))) {
+        ioerror("ftruncate");
+        return NULL;
+    }
+    map=mmap(NULL, *map_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map==MAP_FAILED) {
+        ioerror("mmap");
+        return NULL;
+    }
+    if(init) { /* the file was zeroed by ftruncate() */
+        map->slot_size=sizeof(SHM_CACHE_SLOT);
+        map->stripes=SHM_CACHE_STRIPES;
+        map->ways=SHM_CACHE_WAYS;
+        map->sets=*sets;
+        memcpy(map->magic, SHM_CACHE_MAGIC, sizeof map->magic);
+        s_log(LOG_INFO, "Session cache file %s initialized", name);
+    }
+    return map;
+}
+
+NOEXPORT size_t shm_cache_bytes(unsigned sets) {
+    return offsetof(SHM_CACHE_MAP, slot)+
+        (size_t)sets*SHM_CACHE_WAYS*sizeof(SHM_CACHE_SLOT);
+}
+
+/* POSIX record locks are released when the owning process exits */
+NOEXPORT int shm_cache_file_lock(int fd, off_t start, off_t len, short type) {
+    struct flock fl;
+    int err;
+
+    memset(&fl, 0, sizeof fl);
+    fl.l_type=type;
+    fl.l_whence=SEEK_SET;
+    fl.l_start=start;
+    fl.l_len=len; /* 0 means the whole file */
+    do {
+        err=fcntl(fd, F_SETLKW, &fl);
+    } while(err<0 && get_last_socket_error()==S_EINTR);
+    if(err<0) {
+        ioerror("fcntl F_SETLKW");
+        return 1; /* FAILED */
+    }
+    return 0; /* OK */
+}
+
+/* lock the stripe of the key and return the slots of its set */
+NOEXPORT SHM_CACHE_SLOT *shm_cache_lock(SHM_CACHE *cache,
+        const u_char *key, unsigned key_len, unsigned *stripe) {
+    unsigned hash=2166136261u, set, i; /* FNV-1a */
+
+    for(i=0; i<key_len; ++i) {
+        hash^=key[i];
+        hash*=16777619u;
+    }
+    set=hash%cache->sets;
+    *stripe=set%SHM_CACHE_STRIPES;
+    /* record locks do not exclude the threads of the same process */
+    CRYPTO_THREAD_write_lock(cache->lock[*stripe]);
+    if(shm_cache_file_lock(cache->fd, (off_t)*stripe, 1, F_WRLCK)) {
+        CRYPTO_THREAD_unlock(cache->lock[*stripe]);
+        return NULL;
+    }
+    return cache->map->slot+(size_t)set*SHM_CACHE_WAYS;
+}
+
+NOEXPORT void shm_cache_unlock(SHM_CACHE *cache, unsigned stripe) {
+    shm_cache_file_lock(cache->fd, (off_t)stripe, 1, F_UNLCK);
+    CRYPTO_THREAD_unlock(cache->lock[stripe]);
+}
+
+NOEXPORT void shm_cache_new(SHM_CACHE *cache, SSL_SESSION *sess) {
+    SHM_CACHE_SLOT *set, *slot=NULL;
+    const unsigned char *session_id;
+    unsigned int session_id_length;
+    unsigned char *val;
+    unsigned stripe, i;
+    int val_len;
+    time_t now;
+
+    val_len=i2d_SSL_SESSION(sess, NULL);
+    if(val_len<=0 || val_len>SHM_CACHE_VAL_LEN) {
+        s_log(LOG_INFO, "Session too big for the shared cache (%d bytes)",
+            val_len);
         return;
     }
-    if(packet->type!=CACHE_RESP_OK) {
-        s_log(LOG_INFO, "cache_transfer: session not found");
-        str_free(packet);
+    session_id=SSL_SESSION_get_id(sess, &session_id_length);
+    if(!session_id_length)
+        return;
+    now=time(NULL);
+    set=shm_cache_lock(cache, session_id, session_id_length, &stripe);
+    if(!set)
+        return;
+    for(i=0; i<SHM_CACHE_WAYS && !slot; ++i)
+        if(set[i].expire && set[i].key_len==session_id_length &&
+                !memcmp(set[i].key, session_id, session_id_length))
+            slot=set+i;
+    if(!slot) { /* replace an empty, expired, or the oldest slot */
+        slot=set;
+        for(i=1; i<SHM_CACHE_WAYS; ++i)
+            if(set[i].expire<slot->expire)
+                slot=set+i;
+        if(slot->expire>now)
+            ++cache->map->stats[stripe].evictions;
+    }
+    slot->expire=now+SSL_SESSION_get_timeout(sess);
+    slot->key_len=session_id_length;
+    memcpy(slot->key, session_id, session_id_length);
+    val=slot->val;
+    slot->val_len=(unsigned)i2d_SSL_SESSION(sess, &val);
+    ++cache->map->stats[stripe].stores;
+    shm_cache_unlock(cache, stripe);
+}
+
+NOEXPORT SSL_SESSION *shm_cache_get(SHM_CACHE *cache,
+        const u_char *key, int key_len) {
+    SHM_CACHE_SLOT *set;
+    u_char val[SHM_CACHE_VAL_LEN];
+    const u_char *val_tmp;
+    size_t val_len=0;
+    unsigned stripe, i;
+    time_t now;
+
+    if(key_len<=0 || key_len>SSL_MAX_SSL_SESSION_ID_LENGTH)
+        return NULL;
+    now=time(NULL);
+    set=shm_cache_lock(cache, key, (unsigned)key_len, &stripe);
+    if(!set)
+        return NULL;
+    for(i=0; i<SHM_CACHE_WAYS; ++i)
+        if(set[i].expire>now && set[i].key_len==(unsigned)key_len &&
+                !memcmp(set[i].key, key, (size_t)key_len)) {
+            val_len=set[i].val_len;
+            if(val_len>SHM_CACHE_VAL_LEN) /* corrupted */
+                val_len=0;
+            memcpy(val, set[i].val, val_len);
+            break;
+        }
+    if(val_len)
+        ++cache->map->stats[stripe].hits;
+    else
+        ++cache->map->stats[stripe].misses;
+    shm_cache_unlock(cache, stripe);
+
+    if(!val_len)
+        return NULL;
+    /* decode the session after the stripe is released */
+    val_tmp=val;
+    return d2i_SSL_SESSION(NULL,
+#if OPENSSL_VERSION_NUMBER<0x0090707fL
+        (unsigned char **)
+#endif /* OpenSSL version < 0.9.7g */
+        &val_tmp, (long)val_len);
+}
+
+NOEXPORT void shm_cache_remove(SHM_CACHE *cache, SSL_SESSION *sess) {
+    SHM_CACHE_SLOT *set;
+    const unsigned char *session_id;
+    unsigned int session_id_length;
+    unsigned stripe, i;
+
+    session_id=SSL_SESSION_get_id(sess, &session_id_length);
+    if(!session_id_length)
+        return;
+    set=shm_cache_lock(cache, session_id, session_id_length, &stripe);
+    if(!set)
+        return;
+    for(i=0; i<SHM_CACHE_WAYS; ++i)
+        if(set[i].key_len==session_id_length &&
+                !memcmp(set[i].key, session_id, session_id_length))
+            set[i].expire=0;
+    shm_cache_unlock(cache, stripe);
+}
+
+/* the section is no longer used by any client */
+void shm_cache_free(SERVICE_OPTIONS *section) {
+    SHM_CACHE *cache=section->shm_cache, **ptr;
+    unsigned i;
+
+    if(!cache)
+        return;
+    section->shm_cache=NULL;
+    CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_SHM_CACHE]);
+    if(--cache->refs) { /* still used by other sections */
+        CRYPTO_THREAD_unlock(stunnel_locks[LOCK_SHM_CACHE]);
         return;
     }
-    *ret_len=(size_t)len-(sizeof(CACHE_PACKET)-MAX_VAL_LEN);
-    *ret=str_alloc(*ret_len);
-    s_log(LOG_INFO, "cache_transfer: session found");
-    memcpy(*ret, packet->val, *ret_len);
-    str_free(packet);
+    for(ptr=&shm_cache_list; *ptr; ptr=&(*ptr)->next)
+        if(*ptr==cache) {
+            *ptr=cache->next;
+            break;
+        }
+    CRYPTO_THREAD_unlock(stunnel_locks[LOCK_SHM_CACHE]);
+    munmap((void *)cache->map, cache->size);
+    close(cache->fd);
+    for(i=0; i<SHM_CACHE_STRIPES; ++i)
+        CRYPTO_THREAD_lock_free(cache->lock[i]);
+    str_free(cache->name);
+    str_free(cache);
+}
+
+#ifdef __GNUC__
+#if __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 6)
+#pragma GCC diagnostic push
+#endif /* __GNUC__>=4.6 */
+#pragma GCC diagnostic ignored "-Wformat"
+#pragma GCC diagnostic ignored "-Wformat-extra-args"
+#endif /* __GNUC__ */
+void shm_cache_info(void) {
+    SHM_CACHE *cache;
+    SHM_CACHE_STATS total;
+    unsigned i;
+
+    CRYPTO_THREAD_read_lock(stunnel_locks[LOCK_SHM_CACHE]);
+    for(cache=shm_cache_list; cache; cache=cache->next) {
+        /* the counters are shared by all the processes using the file */
+        memset(&total, 0, sizeof total);
+        for(i=0; i<SHM_CACHE_STRIPES; ++i) {
+            total.hits+=cache->map->stats[i].hits;
+            total.misses+=cache->map->stats[i].misses;
+            total.stores+=cache->map->stats[i].stores;
+            total.evictions+=cache->map->stats[i].evictions;
+        }
+        s_log(LOG_NOTICE, "Session cache file %s: %u slot(s), "
+            "%llu hit(s), %llu miss(es), %llu store(s), %llu eviction(s)",
+            cache->name, cache->sets*SHM_CACHE_WAYS,
+            total.hits, total.misses, total.stores, total.evictions);
+    }
+    CRYPTO_THREAD_unlock(stunnel_locks[LOCK_SHM_CACHE]);
 }
+#ifdef __GNUC__
+#if __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 6)
+#pragma GCC diagnostic pop
+#endif /* __GNUC__>=4.6 */
+#endif /* __GNUC__ */
+
+#endif /* USE_SHM_CACHE */
 
 /**************************************** informational callback */
 
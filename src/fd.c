@@ -131,6 +131,11 @@ SOCKET s_accept(SOCKET sockfd, struct sockaddr *addr, socklen_t *addrlen,
 #else
     fd=accept(sockfd, addr, addrlen);
 #endif
+    if(fd==INVALID_SOCKET) {
+        int err=get_last_socket_error();
+        if(err==S_EAGAIN || err==S_EWOULDBLOCK)
+            return INVALID_SOCKET; /* no pending connections is not an error */
+    }
     return setup_fd(fd, nonblock, msg);
 }
 
@@ -41,6 +41,11 @@
 NOEXPORT void log_queue(SERVICE_OPTIONS *, int, char *, char *, char *);
 NOEXPORT void log_raw(SERVICE_OPTIONS *, int, char *, char *, char *);
 NOEXPORT void safestring(char *);
+#ifdef USE_LOG_ASYNC
+NOEXPORT void log_async(SERVICE_OPTIONS *, int, char *, char *, char *);
+NOEXPORT void log_async_start(void);
+NOEXPORT void log_async_drain(void);
+#endif /* USE_LOG_ASYNC */
 
 static DISK_FILE *outfile=NULL;
 static struct LIST { /* single-linked list of log lines */
@@ -51,6 +56,34 @@ static struct LIST { /* single-linked list of log lines */
 } *head=NULL, *tail=NULL;
 static LOG_MODE log_mode=LOG_MODE_BUFFER;
 
+#ifdef USE_LOG_ASYNC
+
+/* a preformatted record for the writer thread */
+typedef struct {
+    char *line; /* detached "stamp id: text" */
+    size_t id_offset; /* syslog messages start with the id */
+    int level;
+    int log_stderr;
+} LOG_RECORD;
+
+/* bounded lock-free multi-producer single-consumer queue
+ * http://www.1024cores.net/home/lock-free-algorithms/queues */
+typedef struct {
+    size_t seq;
+    LOG_RECORD record;
+} LOG_CELL;
+
+NOEXPORT LOG_CELL log_cells[LOG_QUEUE_SIZE];
+NOEXPORT size_t log_enqueue_pos=0, log_dequeue_pos=0, log_written_pos=0;
+NOEXPORT unsigned long log_dropped=0; /* the total number of dropped records */
+NOEXPORT int log_async_enabled=0, log_async_drop=0; /* copied from options */
+NOEXPORT int log_writer_allowed=0, log_writer_running=0, log_writer_sleeping=0;
+NOEXPORT int log_outfile_closed=0; /* written under LOCK_LOG_MODE */
+NOEXPORT pthread_mutex_t log_writer_mutex=PTHREAD_MUTEX_INITIALIZER;
+NOEXPORT pthread_cond_t log_writer_cond=PTHREAD_COND_INITIALIZER;
+
+#endif /* USE_LOG_ASYNC */
+
 #if !defined(USE_WIN32) && !defined(__vms)
 
 static int syslog_opened=0;
@@ -121,8 +154,17 @@ int log_open(int sink) {
     if(sink&SINK_SYSLOG)
         syslog_open();
 #endif
-    if(sink&SINK_OUTFILE && outfile_open())
-        return 1;
+    if(sink&SINK_OUTFILE) {
+        int err=outfile_open();
+#ifdef USE_LOG_ASYNC
+        CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_LOG_MODE]);
+        /* let the writer thread continue */
+        __atomic_store_n(&log_outfile_closed, 0, __ATOMIC_RELEASE);
+        CRYPTO_THREAD_unlock(stunnel_locks[LOCK_LOG_MODE]);
+#endif /* USE_LOG_ASYNC */
+        if(err)
+            return 1;
+    }
     return 0;
 }
 
@@ -133,8 +175,13 @@ void log_close(int sink) {
     if(sink&SINK_SYSLOG)
         syslog_close();
 #endif
-    if(sink&SINK_OUTFILE)
+    if(sink&SINK_OUTFILE) {
         outfile_close();
+#ifdef USE_LOG_ASYNC
+        /* the writer thread waits for log_open() */
+        __atomic_store_n(&log_outfile_closed, 1, __ATOMIC_RELEASE);
+#endif /* USE_LOG_ASYNC */
+    }
     CRYPTO_THREAD_unlock(stunnel_locks[LOCK_LOG_MODE]);
 }
 
@@ -184,6 +231,17 @@ void s_log(int level, const char *format, ...) {
         va_end(ap);
         safestring(text);
 
+#ifdef USE_LOG_ASYNC
+        /* hand over to the writer thread without locking */
+        if(log_mode==LOG_MODE_CONFIGURED && log_async_enabled &&
+                __atomic_load_n(&log_writer_running, __ATOMIC_ACQUIRE)) {
+            log_async(tls_data->opt, level, stamp, id, text);
+            set_last_error(libc_error);
+            set_last_socket_error(socket_error);
+            return;
+        }
+#endif /* USE_LOG_ASYNC */
+
         /* either log or queue for logging */
         CRYPTO_THREAD_read_lock(stunnel_locks[LOCK_LOG_MODE]);
         if(log_mode==LOG_MODE_BUFFER)
@@ -225,6 +283,12 @@ NOEXPORT void log_queue(SERVICE_OPTIONS *opt,
 }
 
 void log_flush(LOG_MODE new_mode) {
+#ifdef USE_LOG_ASYNC
+    /* keep the order of records around a log file reopen: the queued
+     * records are written before the newer ones are buffered, and before
+     * the buffered ones are emitted */
+    log_async_drain();
+#endif /* USE_LOG_ASYNC */
     CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_LOG_MODE]);
 
     /* prevent changing LOG_MODE_CONFIGURED to LOG_MODE_ERROR
@@ -246,7 +310,20 @@ void log_flush(LOG_MODE new_mode) {
         CRYPTO_THREAD_unlock(stunnel_locks[LOCK_LOG_BUFFER]);
     }
 
+#ifdef USE_LOG_ASYNC
+    if(new_mode==LOG_MODE_CONFIGURED) { /* apply the current options */
+        log_async_enabled=global_options.option.log_async;
+        log_async_drop=global_options.option.log_drop;
+    }
+#endif /* USE_LOG_ASYNC */
+
     CRYPTO_THREAD_unlock(stunnel_locks[LOCK_LOG_MODE]);
+
+#ifdef USE_LOG_ASYNC
+    if(new_mode==LOG_MODE_CONFIGURED && log_async_enabled &&
+            log_writer_allowed && !log_writer_running)
+        log_async_start();
+#endif /* USE_LOG_ASYNC */
 }
 
 NOEXPORT void log_raw(SERVICE_OPTIONS *opt,
@@ -301,6 +378,255 @@ NOEXPORT void log_raw(SERVICE_OPTIONS *opt,
     str_free(line);
 }
 
+#ifdef USE_LOG_ASYNC
+
+/**************************************** asynchronous logging */
+
+NOEXPORT int log_async_push(LOG_RECORD *);
+NOEXPORT int log_async_pop(LOG_RECORD *);
+NOEXPORT void log_async_wake(void);
+NOEXPORT void *log_writer(void *);
+NOEXPORT void log_writer_wait(void);
+NOEXPORT void log_writer_batch(LOG_RECORD *, unsigned);
+NOEXPORT void log_async_sleep(long);
+
+/* the writer thread is only started after daemonize() */
+void log_async_init(void) {
+    log_writer_allowed=1;
+    if(log_async_enabled && !log_writer_running)
+        log_async_start();
+}
+
+void log_async_info(void) {
+    size_t queued;
+
+    if(!log_writer_running)
+        return;
+    queued=__atomic_load_n(&log_enqueue_pos, __ATOMIC_ACQUIRE)-
+        __atomic_load_n(&log_written_pos, __ATOMIC_ACQUIRE);
+    s_log(LOG_NOTICE, "Log queue: %lu record(s) queued, %lu dropped",
+        (unsigned long)queued,
+        __atomic_load_n(&log_dropped, __ATOMIC_RELAXED));
+}
+
+NOEXPORT void log_async_start(void) {
+    pthread_t thread_id;
+    size_t i;
+#if defined(HAVE_PTHREAD_SIGMASK) && !defined(__APPLE__)
+    sigset_t new_set, old_set;
+#endif /* HAVE_PTHREAD_SIGMASK && !__APPLE__*/
+
+    for(i=0; i<LOG_QUEUE_SIZE; ++i)
+        log_cells[i].seq=i;
+#if defined(HAVE_PTHREAD_SIGMASK) && !defined(__APPLE__)
+    sigfillset(&new_set);
+    pthread_sigmask(SIG_SETMASK, &new_set, &old_set); /* block signals */
+#endif /* HAVE_PTHREAD_SIGMASK && !__APPLE__*/
+    if(pthread_create(&thread_id, NULL, log_writer, NULL))
+        ioerror("pthread_create");
+    else
+        __atomic_store_n(&log_writer_running, 1, __ATOMIC_RELEASE);
+#if defined(HAVE_PTHREAD_SIGMASK) && !defined(__APPLE__)
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL); /* unblock signals */
+#endif /* HAVE_PTHREAD_SIGMASK && !__APPLE__*/
+}
+
+/* wait until the records queued so far are written */
+NOEXPORT void log_async_drain(void) {
+    size_t pos;
+
+    if(!log_writer_running)
+        return;
+    pos=__atomic_load_n(&log_enqueue_pos, __ATOMIC_ACQUIRE);
+    while((ssize_t)(__atomic_load_n(&log_written_pos, __ATOMIC_ACQUIRE)-pos)<0 &&
+            !__atomic_load_n(&log_outfile_closed, __ATOMIC_ACQUIRE)) {
+        log_async_wake();
+        log_async_sleep(1);
+    }
+}
+
+NOEXPORT void log_async(SERVICE_OPTIONS *opt,
+        int level, char *stamp, char *id, char *text) {
+    LOG_RECORD record;
+    size_t stamp_len, id_len, text_len;
+
+    /* build the line once, directly in a detached allocation */
+    stamp_len=strlen(stamp);
+    id_len=strlen(id);
+    text_len=strlen(text);
+    record.line=str_alloc_detached(stamp_len+1+id_len+2+text_len+1);
+    memcpy(record.line, stamp, stamp_len);
+    record.line[stamp_len]=' ';
+    memcpy(record.line+stamp_len+1, id, id_len);
+    memcpy(record.line+stamp_len+1+id_len, ": ", 2);
+    memcpy(record.line+stamp_len+1+id_len+2, text, text_len+1);
+    record.id_offset=stamp_len+1;
+    record.level=level;
+    record.log_stderr=opt->option.log_stderr;
+    str_free(stamp);
+    str_free(id);
+    str_free(text);
+
+    while(!log_async_push(&record)) { /* the queue is full */
+        if(log_async_drop) {
+            __atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+            str_free(record.line);
+            return;
+        }
+        log_async_wake(); /* apply backpressure */
+        log_async_sleep(1);
+    }
+}
+
+NOEXPORT int log_async_push(LOG_RECORD *record) {
+    LOG_CELL *cell;
+    size_t pos, seq;
+
+    pos=__atomic_load_n(&log_enqueue_pos, __ATOMIC_RELAXED);
+    for(;;) {
+        cell=log_cells+(pos&(LOG_QUEUE_SIZE-1));
+        seq=__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        if(seq==pos) { /* the cell is free -> try to reserve it */
+            if(__atomic_compare_exchange_n(&log_enqueue_pos, &pos, pos+1,
+                    1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if((ssize_t)(seq-pos)<0) { /* the cell was not consumed */
+            return 0;
+        } else { /* another producer reserved the cell */
+            pos=__atomic_load_n(&log_enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    cell->record=*record;
+    __atomic_store_n(&cell->seq, pos+1, __ATOMIC_RELEASE);
+    log_async_wake();
+    return 1;
+}
+
+NOEXPORT int log_async_pop(LOG_RECORD *record) {
+    LOG_CELL *cell=log_cells+(log_dequeue_pos&(LOG_QUEUE_SIZE-1));
+
+    if(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE)!=log_dequeue_pos+1)
+        return 0; /* the queue is empty */
+    *record=cell->record;
+    __atomic_store_n(&cell->seq, log_dequeue_pos+LOG_QUEUE_SIZE,
+        __ATOMIC_RELEASE);
+    log_dequeue_pos++;
+    return 1;
+}
+
+/* s_poll_sleep() cannot be used, as it terminates threads on exit */
+NOEXPORT void log_async_sleep(long msec) {
+    struct timespec ts;
+
+    ts.tv_sec=0;
+    ts.tv_nsec=msec*1000000;
+    nanosleep(&ts, NULL);
+}
+
+/* the mutex is only used when the writer thread is sleeping */
+NOEXPORT void log_async_wake(void) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(!__atomic_load_n(&log_writer_sleeping, __ATOMIC_RELAXED))
+        return;
+    pthread_mutex_lock(&log_writer_mutex);
+    pthread_cond_signal(&log_writer_cond);
+    pthread_mutex_unlock(&log_writer_mutex);
+}
+
+NOEXPORT void *log_writer(void *arg) {
+    LOG_RECORD batch[LOG_BATCH];
+    unsigned num;
+
+    (void)arg; /* squash the unused parameter warning */
+    tls_alloc(NULL, NULL, "log");
+    for(;;) {
+        for(num=0; num<LOG_BATCH && log_async_pop(batch+num); ++num)
+            ;
+        if(num) {
+            log_writer_batch(batch, num);
+            __atomic_add_fetch(&log_written_pos, num, __ATOMIC_RELEASE);
+        } else {
+            log_writer_wait();
+        }
+    }
+    return NULL; /* it should never be executed */
+}
+
+NOEXPORT void log_writer_wait(void) {
+    struct timespec ts;
+    LOG_CELL *cell=log_cells+(log_dequeue_pos&(LOG_QUEUE_SIZE-1));
+
+    pthread_mutex_lock(&log_writer_mutex);
+    __atomic_store_n(&log_writer_sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    /* check again after announcing that we are about to sleep */
+    if(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE)!=log_dequeue_pos+1) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec++; /* just in case */
+        pthread_cond_timedwait(&log_writer_cond, &log_writer_mutex, &ts);
+    }
+    __atomic_store_n(&log_writer_sleeping, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&log_writer_mutex);
+}
+
+NOEXPORT void log_writer_batch(LOG_RECORD *batch, unsigned num) {
+    struct iovec iov[2*LOG_BATCH];
+    static char newline[]="\n";
+    unsigned i;
+    ssize_t written;
+    unsigned long dropped;
+    static unsigned long reported=0;
+    char *notice=NULL;
+
+    /* report overflows directly, as s_log() could overflow again */
+    dropped=__atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+    if(dropped!=reported) {
+        notice=str_printf("%.*s LOG%d[log]: "
+            "Log queue overflow: %lu record(s) dropped",
+            (int)batch[0].id_offset-1, batch[0].line, /* the time stamp */
+            LOG_WARNING, dropped-reported);
+        reported=dropped;
+    }
+
+    CRYPTO_THREAD_read_lock(stunnel_locks[LOCK_LOG_MODE]);
+    while(log_outfile_closed) { /* log file is being reopened */
+        CRYPTO_THREAD_unlock(stunnel_locks[LOCK_LOG_MODE]);
+        log_async_sleep(10);
+        CRYPTO_THREAD_read_lock(stunnel_locks[LOCK_LOG_MODE]);
+    }
+    if(outfile) { /* a single write for the whole batch */
+        for(i=0; i<num; ++i) {
+            iov[2*i].iov_base=batch[i].line;
+            iov[2*i].iov_len=strlen(batch[i].line);
+            iov[2*i+1].iov_base=newline;
+            iov[2*i+1].iov_len=1;
+        }
+        written=writev(outfile->fd, iov, (int)(2*num));
+        (void)written; /* no meaningful way here to handle the result */
+    }
+    for(i=0; i<num; ++i) {
+#if !defined(__vms)
+        if(global_options.option.log_syslog)
+            syslog(batch[i].level, "%s", batch[i].line+batch[i].id_offset);
+#endif /* __vms */
+        if(batch[i].log_stderr)
+            ui_new_log(batch[i].line);
+        str_free(batch[i].line);
+    }
+    if(notice) {
+        if(outfile)
+            file_putline(outfile, notice);
+#if !defined(__vms)
+        if(global_options.option.log_syslog)
+            syslog(LOG_WARNING, "%s", notice+batch[0].id_offset);
+#endif /* __vms */
+        str_free(notice);
+    }
+    CRYPTO_THREAD_unlock(stunnel_locks[LOCK_LOG_MODE]);
+}
+
+#endif /* USE_LOG_ASYNC */
+
 #ifdef __GNUC__
 #if __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 6)
 #pragma GCC diagnostic push
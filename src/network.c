@@ -161,6 +161,16 @@ int s_poll_err(s_poll_set *fds, SOCKET fd) {
     return 0; /* not listed in fds */
 }
 
+/* iterate over readable descriptors, *pos needs to be initialized with 0 */
+SOCKET s_poll_next_read(s_poll_set *fds, unsigned *pos) {
+    while(*pos<fds->nfds) {
+        struct pollfd *ufd=fds->ufds+(*pos)++;
+        if(ufd->revents&(POLLIN|POLLERR))
+            return ufd->fd;
+    }
+    return INVALID_SOCKET; /* no more readable descriptors */
+}
+
 NOEXPORT void s_poll_realloc(s_poll_set *fds) {
     fds->ufds=str_realloc(fds->ufds, fds->allocated*sizeof(struct pollfd));
 }
@@ -175,8 +185,478 @@ void s_poll_dump(s_poll_set *fds, int level) {
 
 #ifdef USE_UCONTEXT
 
+#ifdef USE_EPOLL
+
+/* a waiting context interested in a file descriptor */
+typedef struct epoll_watcher_struct {
+    CONTEXT *context;
+    struct pollfd *ufd; /* the entry in context->fds->ufds */
+    struct epoll_watcher_struct *next; /* next watcher of the same fd */
+} EPOLL_WATCHER;
+
+/* the kernel state of a file descriptor in the epoll set of a scheduler */
+typedef struct epoll_fd_struct {
+    EPOLL_WATCHER *head; /* waiting contexts */
+    uint32_t events; /* events currently registered with the kernel */
+    int registered;
+    int unpollable; /* not supported by epoll, e.g., a regular file */
+} EPOLL_FD;
+
+#define EPOLL_MAX_EVENTS 64
+
+#endif /* USE_EPOLL */
+
+#ifdef USE_SCHEDULERS
+NOEXPORT pthread_mutex_t schedulers_mutex=PTHREAD_MUTEX_INITIALIZER;
+NOEXPORT unsigned schedulers_sleeping=0;
+NOEXPORT int schedulers_stopping=0;
+
+NOEXPORT CONTEXT *scheduler_steal(SCHEDULER *);
+NOEXPORT void scheduler_sleep(SCHEDULER *, int);
+NOEXPORT void scheduler_notify(SCHEDULER *);
+#endif /* USE_SCHEDULERS */
+
+#ifdef USE_EPOLL
+
+/**************************************** timer heap */
+
+/* monotonic time in milliseconds */
+NOEXPORT int64_t epoll_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000+ts.tv_nsec/1000000;
+}
+
+NOEXPORT void timer_heap_set(SCHEDULER *sched, unsigned i, CONTEXT *context) {
+    sched->timer_heap[i]=context;
+    context->heap_index=i+1; /* 0 means "not in the heap" */
+}
+
+NOEXPORT void timer_heap_up(SCHEDULER *sched, unsigned i) {
+    CONTEXT **heap=sched->timer_heap, *context=heap[i];
+
+    while(i>0 && heap[(i-1)/2]->deadline>context->deadline) {
+        timer_heap_set(sched, i, heap[(i-1)/2]);
+        i=(i-1)/2;
+    }
+    timer_heap_set(sched, i, context);
+}
+
+NOEXPORT void timer_heap_down(SCHEDULER *sched, unsigned i) {
+    CONTEXT **heap=sched->timer_heap, *context=heap[i];
+    unsigned child;
+
+    for(;;) {
+        child=2*i+1;
+        if(child>=sched->timer_heap_size)
+            break;
+        if(child+1<sched->timer_heap_size &&
+                heap[child+1]->deadline<heap[child]->deadline)
+            child++;
+        if(heap[child]->deadline>=context->deadline)
+            break;
+        timer_heap_set(sched, i, heap[child]);
+        i=child;
+    }
+    timer_heap_set(sched, i, context);
+}
+
+NOEXPORT void timer_insert(SCHEDULER *sched, CONTEXT *context) {
+    if(sched->timer_heap_size==sched->timer_heap_allocated) {
+        sched->timer_heap_allocated=sched->timer_heap_allocated ?
+            2*sched->timer_heap_allocated : 64;
+        sched->timer_heap=str_realloc_detached(sched->timer_heap,
+            sched->timer_heap_allocated*sizeof(CONTEXT *));
+    }
+    sched->timer_heap[sched->timer_heap_size++]=context;
+    timer_heap_up(sched, sched->timer_heap_size-1);
+}
+
+NOEXPORT void timer_remove(SCHEDULER *sched, CONTEXT *context) {
+    unsigned i;
+
+    if(!context->heap_index) /* not in the heap */
+        return;
+    i=context->heap_index-1;
+    context->heap_index=0;
+    if(i==--sched->timer_heap_size) /* the last element */
+        return;
+    sched->timer_heap[i]=sched->timer_heap[sched->timer_heap_size];
+    timer_heap_up(sched, i);
+    timer_heap_down(sched, sched->timer_heap[i]->heap_index-1);
+}
+
+#endif /* USE_EPOLL */
+
+/**************************************** context queues */
+
+/* the waiting queue is private to the scheduler thread,
+ * while other schedulers may steal from the ready queue */
+
+NOEXPORT void waiting_queue_append(SCHEDULER *sched, CONTEXT *context) {
+    context->next=NULL;
+#ifdef USE_EPOLL
+    context->prev=sched->waiting_tail;
+#endif /* USE_EPOLL */
+    if(sched->waiting_tail)
+        sched->waiting_tail->next=context;
+    sched->waiting_tail=context;
+    if(!sched->waiting_head)
+        sched->waiting_head=context;
+}
+
+#ifdef USE_EPOLL
+NOEXPORT void waiting_queue_remove(SCHEDULER *sched, CONTEXT *context) {
+    if(context->prev)
+        context->prev->next=context->next;
+    else
+        sched->waiting_head=context->next;
+    if(context->next)
+        context->next->prev=context->prev;
+    else
+        sched->waiting_tail=context->prev;
+}
+#endif /* USE_EPOLL */
+
+/* only called by the scheduler thread owning the queue */
+void ready_queue_append(SCHEDULER *sched, CONTEXT *context) {
+#ifdef USE_SCHEDULERS
+    int surplus;
+
+    pthread_mutex_lock(&sched->mutex);
+#endif /* USE_SCHEDULERS */
+    context->next=NULL;
+    if(sched->ready_tail)
+        sched->ready_tail->next=context;
+    sched->ready_tail=context;
+    if(!sched->ready_head)
+        sched->ready_head=context;
+#ifdef USE_SCHEDULERS
+    /* more contexts than the owner is about to execute */
+    surplus=sched->current || sched->ready_head!=context;
+    pthread_mutex_unlock(&sched->mutex);
+    if(surplus)
+        scheduler_notify(sched);
+#endif /* USE_SCHEDULERS */
+}
+
+NOEXPORT CONTEXT *ready_queue_pop(SCHEDULER *sched) {
+    CONTEXT *context;
+
+#ifdef USE_SCHEDULERS
+    pthread_mutex_lock(&sched->mutex);
+#endif /* USE_SCHEDULERS */
+    context=sched->ready_head;
+    if(context) {
+        sched->ready_head=context->next;
+        if(!sched->ready_head) /* the queue is empty */
+            sched->ready_tail=NULL;
+    }
+#ifdef USE_SCHEDULERS
+    pthread_mutex_unlock(&sched->mutex);
+#endif /* USE_SCHEDULERS */
+    return context;
+}
+
+#ifdef USE_SCHEDULERS
+
+/**************************************** work stealing */
+
+/* take the oldest ready context of another scheduler */
+NOEXPORT CONTEXT *scheduler_steal(SCHEDULER *sched) {
+    unsigned i;
+    SCHEDULER *victim;
+    CONTEXT *context, *prev;
+
+    for(i=1; i<schedulers_num; i++) {
+        victim=schedulers[(sched->id+i)%schedulers_num];
+        pthread_mutex_lock(&victim->mutex);
+        prev=NULL;
+        for(context=victim->ready_head; context && context->pinned;
+                context=context->next)
+            prev=context;
+        if(context) {
+            if(prev)
+                prev->next=context->next;
+            else
+                victim->ready_head=context->next;
+            if(victim->ready_tail==context)
+                victim->ready_tail=prev;
+        }
+        pthread_mutex_unlock(&victim->mutex);
+        if(context) {
+            __atomic_add_fetch(&sched->stolen, 1, __ATOMIC_RELAXED);
+            return context;
+        }
+    }
+    return NULL;
+}
+
+/* announce that the scheduler is about to block in epoll_wait() */
+NOEXPORT void scheduler_sleep(SCHEDULER *sched, int sleeping) {
+    pthread_mutex_lock(&schedulers_mutex);
+    if(sched->sleeping!=sleeping) {
+        sched->sleeping=sleeping;
+        if(sleeping)
+            __atomic_add_fetch(&schedulers_sleeping, 1, __ATOMIC_SEQ_CST);
+        else
+            __atomic_sub_fetch(&schedulers_sleeping, 1, __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&schedulers_mutex);
+}
+
+/* wake up a sleeping scheduler to steal the surplus of ready contexts */
+NOEXPORT void scheduler_notify(SCHEDULER *sched) {
+    unsigned i;
+    SCHEDULER *sleeper=NULL;
+    uint64_t one=1;
+
+    if(!__atomic_load_n(&schedulers_sleeping, __ATOMIC_SEQ_CST))
+        return;
+    pthread_mutex_lock(&schedulers_mutex);
+    for(i=1; i<schedulers_num; i++) {
+        sleeper=schedulers[(sched->id+i)%schedulers_num];
+        if(sleeper->sleeping) {
+            sleeper->sleeping=0;
+            __atomic_sub_fetch(&schedulers_sleeping, 1, __ATOMIC_SEQ_CST);
+            break;
+        }
+        sleeper=NULL;
+    }
+    pthread_mutex_unlock(&schedulers_mutex);
+    if(sleeper &&
+            write(sleeper->wakeup_fd, &one, sizeof one)!=(ssize_t)sizeof one)
+        ioerror("write");
+}
+
+#endif /* USE_SCHEDULERS */
+
+#ifdef USE_EPOLL
+
+/**************************************** epoll set */
+
+NOEXPORT void epoll_init(SCHEDULER *sched) {
+#ifdef USE_SCHEDULERS
+    struct epoll_event event;
+#endif /* USE_SCHEDULERS */
+
+    sched->epoll_fd=epoll_create1(EPOLL_CLOEXEC);
+    if(sched->epoll_fd<0) {
+        ioerror("epoll_create1");
+        fatal("Cannot create the epoll instance");
+    }
+#ifdef USE_SCHEDULERS
+    sched->wakeup_fd=eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if(sched->wakeup_fd<0) {
+        ioerror("eventfd");
+        fatal("Cannot create the scheduler wakeup descriptor");
+    }
+    memset(&event, 0, sizeof event);
+    event.events=EPOLLIN;
+    event.data.fd=sched->wakeup_fd;
+    if(epoll_ctl(sched->epoll_fd, EPOLL_CTL_ADD, sched->wakeup_fd, &event)) {
+        ioerror("epoll_ctl");
+        fatal("Cannot watch the scheduler wakeup descriptor");
+    }
+#endif /* USE_SCHEDULERS */
+}
+
+NOEXPORT void epoll_update(SCHEDULER *sched, SOCKET fd) {
+    EPOLL_FD *entry=sched->epoll_fds+fd;
+    EPOLL_WATCHER *watcher;
+    struct epoll_event event;
+    uint32_t events=0;
+    int op;
+
+    /* epoll event bits are the same as poll event bits on Linux */
+    for(watcher=entry->head; watcher; watcher=watcher->next)
+        events|=(uint32_t)(uint16_t)watcher->ufd->events;
+    if(!entry->head) { /* no more watchers */
+        entry->unpollable=0; /* the descriptor may be reused */
+        if(!entry->registered)
+            return;
+        op=EPOLL_CTL_DEL;
+        entry->registered=0;
+    } else if(entry->unpollable) { /* always ready */
+        return;
+    } else if(!entry->registered) {
+        op=EPOLL_CTL_ADD;
+        entry->registered=1;
+    } else if(entry->events!=events) {
+        op=EPOLL_CTL_MOD;
+    } else { /* nothing has changed */
+        return;
+    }
+    entry->events=events;
+    memset(&event, 0, sizeof event);
+    event.events=events;
+    event.data.fd=fd;
+    if(!epoll_ctl(sched->epoll_fd, op, fd, &event))
+        return;
+    if(op==EPOLL_CTL_ADD && get_last_socket_error()==EPERM) {
+        /* regular files (e.g. inetd mode stdin) are always ready */
+        entry->registered=0;
+        entry->unpollable=1;
+        return;
+    }
+    ioerror("epoll_ctl");
+}
+
+/* register the file descriptors of a context entering the waiting queue */
+NOEXPORT void epoll_watch(SCHEDULER *sched, CONTEXT *context) {
+    unsigned i, max_fd;
+    EPOLL_WATCHER *watcher;
+    EPOLL_FD *entry;
+    struct pollfd *ufd;
+
+    if(sched->epoll_fd<0)
+        epoll_init(sched);
+    if(context->fds->nfds>context->watchers_allocated) {
+        context->watchers_allocated=context->fds->nfds;
+        context->watchers=str_realloc_detached(context->watchers,
+            context->watchers_allocated*sizeof(EPOLL_WATCHER));
+    }
+    max_fd=0;
+    for(i=0; i<context->fds->nfds; i++)
+        if((unsigned)context->fds->ufds[i].fd>=max_fd)
+            max_fd=(unsigned)context->fds->ufds[i].fd+1;
+    if(max_fd>sched->epoll_fds_allocated) {
+        sched->epoll_fds=str_realloc_detached(sched->epoll_fds,
+            max_fd*sizeof(EPOLL_FD));
+        memset(sched->epoll_fds+sched->epoll_fds_allocated, 0,
+            (max_fd-sched->epoll_fds_allocated)*sizeof(EPOLL_FD));
+        sched->epoll_fds_allocated=max_fd;
+    }
+    context->ready=0;
+    for(i=0; i<context->fds->nfds; i++) {
+        ufd=context->fds->ufds+i;
+        ufd->revents=0;
+        entry=sched->epoll_fds+ufd->fd;
+        watcher=context->watchers+i;
+        watcher->context=context;
+        watcher->ufd=ufd;
+        watcher->next=entry->head;
+        entry->head=watcher;
+        epoll_update(sched, ufd->fd);
+        if(entry->unpollable) { /* emulate poll() semantics */
+            ufd->revents=(short)(ufd->events&(POLLIN|POLLOUT));
+            if(ufd->revents)
+                context->ready++;
+        }
+    }
+}
+
+/* unregister the file descriptors of a context leaving the waiting queue */
+NOEXPORT void epoll_unwatch(SCHEDULER *sched, CONTEXT *context) {
+    unsigned i;
+    EPOLL_WATCHER **ptr;
+
+    for(i=0; i<context->fds->nfds; i++) {
+        for(ptr=&sched->epoll_fds[context->fds->ufds[i].fd].head; *ptr;
+                ptr=&(*ptr)->next)
+            if(*ptr==context->watchers+i) {
+                *ptr=(*ptr)->next;
+                break;
+            }
+        epoll_update(sched, context->fds->ufds[i].fd);
+    }
+}
+
+/* a context is ready to run -> move it from the waiting queue */
+/* it is only published in the ready queue by scheduler_publish() */
+NOEXPORT void epoll_wake(SCHEDULER *sched, CONTEXT *context) {
+    waiting_queue_remove(sched, context);
+    timer_remove(sched, context);
+    context->next=NULL;
+    if(sched->woken_tail)
+        sched->woken_tail->next=context;
+    sched->woken_tail=context;
+    if(!sched->woken_head)
+        sched->woken_head=context;
+}
+
+/* unregister the descriptors of woken contexts and make them runnable */
+/* the context running the scheduler is only published after it is left */
+NOEXPORT void scheduler_publish(SCHEDULER *sched, CONTEXT *self) {
+    CONTEXT *context;
+
+    while(sched->woken_head) {
+        context=sched->woken_head;
+        sched->woken_head=context->next;
+        epoll_unwatch(sched, context);
+        if(context==self)
+            sched->self_ready=1;
+        else
+            ready_queue_append(sched, context);
+    }
+    sched->woken_tail=NULL;
+}
+
 /* move ready contexts from waiting queue to ready queue */
-NOEXPORT void scan_waiting_queue(void) {
+/* the cost is proportional to the number of events, not of waiting fds */
+NOEXPORT void scan_waiting_queue(SCHEDULER *sched, CONTEXT *self) {
+    int retval, i, timeout;
+    CONTEXT *context;
+    EPOLL_WATCHER *watcher;
+    int64_t now;
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+#ifdef USE_SCHEDULERS
+    uint64_t counter;
+#endif /* USE_SCHEDULERS */
+
+    if(sched->epoll_fd<0)
+        epoll_init(sched);
+    if(sched->timer_heap_size) {
+        now=epoll_now();
+        timeout=sched->timer_heap[0]->deadline<=now ? 0 :
+            (int)(sched->timer_heap[0]->deadline-now);
+    } else {
+        timeout=-1; /* infinity */
+    }
+
+#ifdef DEBUG_UCONTEXT
+    s_log(LOG_DEBUG, "Waiting %d millisecond(s) for epoll events", timeout);
+#endif
+    do { /* skip "Interrupted system call" errors */
+        retval=epoll_wait(sched->epoll_fd, events, EPOLL_MAX_EVENTS, timeout);
+    } while(retval<0 && get_last_socket_error()==S_EINTR);
+    for(i=0; i<retval; i++) {
+#ifdef USE_SCHEDULERS
+        if(events[i].data.fd==sched->wakeup_fd) { /* scheduler_notify() */
+            if(read(sched->wakeup_fd, &counter, sizeof counter)<0 &&
+                    get_last_socket_error()!=S_EAGAIN)
+                ioerror("read");
+            continue;
+        }
+#endif /* USE_SCHEDULERS */
+        for(watcher=sched->epoll_fds[events[i].data.fd].head; watcher;
+                watcher=watcher->next) {
+            watcher->ufd->revents=(short)(events[i].events&(uint32_t)
+                (uint16_t)(watcher->ufd->events|POLLERR|POLLHUP));
+#ifdef DEBUG_UCONTEXT
+            s_log(LOG_DEBUG, "CONTEXT %ld, FD=%ld, revents=0x%X",
+                watcher->context->id, (long)watcher->ufd->fd,
+                watcher->ufd->revents);
+#endif
+            if(watcher->ufd->revents && !watcher->context->ready++)
+                epoll_wake(sched, watcher->context);
+        }
+    }
+    /* expired deadlines */
+    now=epoll_now();
+    while(sched->timer_heap_size && sched->timer_heap[0]->deadline<=now) {
+        context=sched->timer_heap[0];
+        epoll_wake(sched, context);
+    }
+    /* all events are collected before any descriptor is unregistered */
+    scheduler_publish(sched, self);
+}
+
+#else /* USE_EPOLL */
+
+/* move ready contexts from waiting queue to ready queue */
+NOEXPORT void scan_waiting_queue(SCHEDULER *sched, CONTEXT *self) {
     int retval;
     CONTEXT *context, *prev;
     int min_timeout;
@@ -185,11 +665,12 @@ NOEXPORT void scan_waiting_queue(void) {
     static unsigned max_nfds=0;
     static struct pollfd *ufds=NULL;
 
+    (void)self; /* there is nobody to steal the contexts */
     time(&now);
     /* count file descriptors */
     min_timeout=-1; /* infinity */
     nfds=0;
-    for(context=waiting_head; context; context=context->next) {
+    for(context=sched->waiting_head; context; context=context->next) {
         nfds+=context->fds->nfds;
         if(context->finish>=0) /* finite time */
             if(min_timeout<0 || min_timeout>context->finish-now)
@@ -202,7 +683,7 @@ NOEXPORT void scan_waiting_queue(void) {
         max_nfds=nfds;
     }
     nfds=0;
-    for(context=waiting_head; context; context=context->next)
+    for(context=sched->waiting_head; context; context=context->next)
         for(i=0; i<context->fds->nfds; i++) {
             ufds[nfds].fd=context->fds->ufds[i].fd;
             ufds[nfds].events=context->fds->ufds[i].events;
@@ -220,7 +701,7 @@ NOEXPORT void scan_waiting_queue(void) {
     /* process the returned data */
     nfds=0;
     prev=NULL; /* previous element of the waiting queue */
-    context=waiting_head;
+    context=sched->waiting_head;
     while(context) {
         context->ready=0;
         /* count ready file descriptors in each context */
@@ -246,91 +727,209 @@ NOEXPORT void scan_waiting_queue(void) {
             if(prev)
                 prev->next=context->next;
             else
-                waiting_head=context->next;
+                sched->waiting_head=context->next;
             if(!context->next) /* same as context==waiting_tail */
-                waiting_tail=prev;
+                sched->waiting_tail=prev;
 
             /* append context context to the ready queue */
-            context->next=NULL;
-            if(ready_tail)
-                ready_tail->next=context;
-            ready_tail=context;
-            if(!ready_head)
-                ready_head=context;
+            ready_queue_append(sched, context);
         } else { /* leave the context context in the waiting queue */
             prev=context;
         }
-        context=prev ? prev->next : waiting_head;
+        context=prev ? prev->next : sched->waiting_head;
     }
 }
 
-int s_poll_wait(s_poll_set *fds, int sec, int msec) {
-    CONTEXT *context; /* current context */
-    static CONTEXT *to_free=NULL; /* delayed memory deallocation */
+#endif /* USE_EPOLL */
 
-    /* FIXME: msec parameter is currently ignored with UCONTEXT threads */
-    (void)msec; /* squash the unused parameter warning */
+/**************************************** context switching */
 
-    /* remove the current context from ready queue */
-    context=ready_head;
-    ready_head=ready_head->next;
-    if(!ready_head) /* the queue is empty */
-        ready_tail=NULL;
-    /* it is safe to s_log() after new ready_head is set */
+/* find the next context to execute, waiting for one if needed */
+/* self is the current context if it may be resumed, or NULL */
+NOEXPORT CONTEXT *scheduler_next(SCHEDULER *sched, CONTEXT *self) {
+    CONTEXT *context;
+
+    for(;;) {
+#ifdef USE_SCHEDULERS
+        if(sched->id && __atomic_load_n(&schedulers_stopping, __ATOMIC_SEQ_CST))
+            return NULL; /* scheduler_stop() was called */
+#endif /* USE_SCHEDULERS */
+        context=ready_queue_pop(sched);
+#ifdef USE_EPOLL
+        if(sched->self_ready) {
+            sched->self_ready=0;
+            if(!context)
+                return self;
+            sched->deferred=self; /* let the other context run first */
+        }
+#endif /* USE_EPOLL */
+        if(context)
+            return context;
+#ifdef USE_SCHEDULERS
+        if(schedulers_num>1) {
+            context=scheduler_steal(sched);
+            if(context)
+                return context;
+            if(sched->epoll_fd<0)
+                epoll_init(sched);
+            scheduler_sleep(sched, 1);
+            /* check again, as scheduler_notify() may have missed us */
+            context=scheduler_steal(sched);
+            if(context || (sched->id &&
+                    __atomic_load_n(&schedulers_stopping, __ATOMIC_SEQ_CST))) {
+                scheduler_sleep(sched, 0);
+                return context;
+            }
+            scan_waiting_queue(sched, self);
+            scheduler_sleep(sched, 0);
+            continue;
+        }
+#endif /* USE_SCHEDULERS */
+        scan_waiting_queue(sched, self);
+    }
+}
+
+/* complete a context switch in the context that has just been entered */
+void scheduler_switched(void) {
+    SCHEDULER *sched=scheduler_get(); /* possibly not the original one */
+    CONTEXT *context;
 
     /* it is illegal to deallocate the stack of the current context */
-    if(to_free) { /* a delayed deallocation is scheduled */
+    context=sched->to_free;
+    if(context) { /* a delayed deallocation is scheduled */
+        sched->to_free=NULL;
 #ifdef DEBUG_UCONTEXT
-        s_log(LOG_DEBUG, "Releasing context %ld", to_free->id);
+        s_log(LOG_DEBUG, "Releasing context %ld", context->id);
 #endif
-        str_free(to_free->stack);
-        str_free(to_free);
-        to_free=NULL;
+        str_free(context->stack);
+#ifdef USE_EPOLL
+        str_free(context->watchers);
+#endif /* USE_EPOLL */
+        str_free(context);
+    }
+#ifdef USE_EPOLL
+    /* it was illegal to let other schedulers resume the previous context */
+    context=sched->deferred;
+    if(context) {
+        sched->deferred=NULL;
+        ready_queue_append(sched, context);
     }
+#endif /* USE_EPOLL */
+}
+
+int s_poll_wait(s_poll_set *fds, int sec, int msec) {
+    SCHEDULER *sched=scheduler_get();
+    CONTEXT *context=sched->current, *next;
+
+#ifndef USE_EPOLL
+    /* FIXME: msec parameter is currently ignored with poll() scheduler */
+    (void)msec; /* squash the unused parameter warning */
+#endif /* USE_EPOLL */
 
     /* manage the current thread */
     if(fds) { /* something to wait for -> swap the context */
         context->fds=fds; /* set file descriptors to wait for */
+#ifdef USE_EPOLL
+        context->deadline=sec<0 ? -1 : epoll_now()+1000*sec+msec;
+        waiting_queue_append(sched, context);
+        if(context->deadline>=0)
+            timer_insert(sched, context);
+        epoll_watch(sched, context);
+        if(context->ready) { /* some descriptors are always ready */
+            epoll_wake(sched, context);
+            scheduler_publish(sched, context);
+        }
+#else /* USE_EPOLL */
         context->finish=sec<0 ? -1 : time(NULL)+sec;
-
-        /* append the current context to the waiting queue */
-        context->next=NULL;
-        if(waiting_tail)
-            waiting_tail->next=context;
-        waiting_tail=context;
-        if(!waiting_head)
-            waiting_head=context;
-    } else { /* nothing to wait for -> drop the context */
-        to_free=context; /* schedule for delayed deallocation */
+        waiting_queue_append(sched, context);
+#endif /* USE_EPOLL */
     }
-
-    while(!ready_head) /* wait until there is a thread to switch to */
-        scan_waiting_queue();
+    sched->current=NULL;
+    /* s_log() uses the thread local storage of the scheduler from now on */
+
+    /* wait until there is a thread to switch to */
+    next=scheduler_next(sched, fds ? context : NULL);
+#ifdef USE_SCHEDULERS
+    if(!next) { /* scheduler_stop() was called: abandon the context */
+        if(!fds)
+            sched->to_free=context;
+        setcontext(&sched->home);
+        ioerror("setcontext"); /* should not ever happen */
+        return 0;
+    }
+#endif /* USE_SCHEDULERS */
+    sched->current=next;
 
     /* switch threads */
     if(fds) { /* swap the current context */
-        if(context->id!=ready_head->id) {
+        if(next!=context) {
 #ifdef DEBUG_UCONTEXT
             s_log(LOG_DEBUG, "Context swap: %ld -> %ld",
-                context->id, ready_head->id);
+                context->id, next->id);
 #endif
-            swapcontext(&context->context, &ready_head->context);
+#ifdef USE_SCHEDULERS
+            __atomic_add_fetch(&sched->switches, 1, __ATOMIC_RELAXED);
+#endif /* USE_SCHEDULERS */
+            swapcontext(&context->context, &next->context);
+            /* the context may have been resumed by another scheduler */
+            scheduler_switched();
 #ifdef DEBUG_UCONTEXT
-            s_log(LOG_DEBUG, "Current context: %ld", ready_head->id);
+            s_log(LOG_DEBUG, "Current context: %ld", context->id);
 #endif
         }
-        return ready_head->ready;
+        return context->ready;
     } else { /* drop the current context */
 #ifdef DEBUG_UCONTEXT
         s_log(LOG_DEBUG, "Context set: %ld (dropped) -> %ld",
-            context->id, ready_head->id);
+            context->id, next->id);
 #endif
-        setcontext(&ready_head->context);
+        sched->to_free=context; /* schedule for delayed deallocation */
+        setcontext(&next->context);
         ioerror("setcontext"); /* should not ever happen */
         return 0;
     }
 }
 
+#ifdef USE_SCHEDULERS
+/* the first context switch of a new scheduler thread */
+void scheduler_run(void) {
+    SCHEDULER *sched=scheduler_get();
+    CONTEXT *next;
+
+    epoll_init(sched);
+    next=scheduler_next(sched, NULL);
+    if(!next) /* scheduler_stop() was called */
+        return;
+    sched->current=next;
+    if(swapcontext(&sched->home, &next->context)) {
+        ioerror("swapcontext"); /* should not ever happen */
+        return;
+    }
+    /* back on the native stack after scheduler_stop() */
+    sched->current=NULL;
+    scheduler_switched();
+}
+
+/* stop the other scheduler threads before the contexts are released */
+void scheduler_stop(void) {
+    unsigned i;
+    uint64_t one=1;
+
+    if(schedulers_num<=1)
+        return;
+    pthread_mutex_lock(&schedulers_mutex);
+    __atomic_store_n(&schedulers_stopping, 1, __ATOMIC_SEQ_CST);
+    for(i=1; i<schedulers_num; i++)
+        if(schedulers[i]->sleeping && write(schedulers[i]->wakeup_fd,
+                &one, sizeof one)!=(ssize_t)sizeof one)
+            ioerror("write");
+    pthread_mutex_unlock(&schedulers_mutex);
+    for(i=1; i<schedulers_num; i++)
+        if(pthread_join(schedulers[i]->thread_id, NULL))
+            s_log(LOG_ERR, "pthread_join() failed");
+    s_log(LOG_DEBUG, "Scheduler threads stopped");
+}
+#endif /* USE_SCHEDULERS */
 #else /* USE_UCONTEXT */
 
 int s_poll_wait(s_poll_set *fds, int sec, int msec) {
@@ -437,6 +1036,21 @@ int s_poll_err(s_poll_set *fds, SOCKET fd) {
     return FD_ISSET(fd, fds->oxfds);
 }
 
+/* iterate over readable descriptors, *pos needs to be initialized with 0 */
+SOCKET s_poll_next_read(s_poll_set *fds, unsigned *pos) {
+#ifdef USE_WIN32
+    while(*pos<fds->irfds->fd_count) {
+        SOCKET fd=fds->irfds->fd_array[(*pos)++];
+#else
+    while(*pos<=(unsigned)fds->max) {
+        SOCKET fd=(SOCKET)(*pos)++;
+#endif
+        if(s_poll_canread(fds, fd))
+            return fd;
+    }
+    return INVALID_SOCKET; /* no more readable descriptors */
+}
+
 #ifdef USE_WIN32
 #define FD_SIZE(fds) (8+(fds)->allocated*sizeof(SOCKET))
 #else
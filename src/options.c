@@ -64,6 +64,13 @@ typedef enum {
 
 NOEXPORT int options_file(char *, CONF_TYPE, SERVICE_OPTIONS **);
 NOEXPORT int init_section(int, SERVICE_OPTIONS **);
+NOEXPORT int sections_keep(void);
+NOEXPORT SERVICE_OPTIONS *section_unchanged(SERVICE_OPTIONS *);
+#ifndef USE_WIN32
+NOEXPORT char *file_stamps(SERVICE_OPTIONS *);
+NOEXPORT char *file_stamp(char *, const char *);
+NOEXPORT char *dir_stamps(char *, const char *);
+#endif
 #ifdef USE_WIN32
 struct dirent {
     char d_name[MAX_PATH];
@@ -94,6 +101,7 @@ NOEXPORT char *parse_debug_level(char *, SERVICE_OPTIONS *);
 NOEXPORT PSK_KEYS *psk_read(char *);
 NOEXPORT PSK_KEYS *psk_dup(PSK_KEYS *);
 NOEXPORT void psk_free(PSK_KEYS *);
+NOEXPORT int psk_equal(PSK_KEYS *, PSK_KEYS *);
 #endif /* !defined(OPENSSL_NO_PSK) */
 
 #if OPENSSL_VERSION_NUMBER>=0x10000000L
@@ -258,6 +266,8 @@ NOEXPORT void print_syntax(void);
 NOEXPORT void name_list_append(NAME_LIST **, char *);
 NOEXPORT void name_list_dup(NAME_LIST **, NAME_LIST *);
 NOEXPORT void name_list_free(NAME_LIST *);
+NOEXPORT int name_list_equal(NAME_LIST *, NAME_LIST *);
+NOEXPORT int addrlist_equal(SOCKADDR_LIST *, SOCKADDR_LIST *);
 #ifndef USE_WIN32
 NOEXPORT char **arg_alloc(char *);
 NOEXPORT char **arg_dup(char **);
@@ -383,6 +393,9 @@ int options_parse(CONF_TYPE type) {
         return 1;
     if(init_section(1, &section))
         return 1;
+    /* keep unchanged services running */
+    if(type==CONF_RELOAD && sections_keep())
+        return 1;
 
     s_log(LOG_NOTICE, "Configuration successful");
     return 0;
@@ -392,7 +405,7 @@ NOEXPORT int options_file(char *path, CONF_TYPE type,
         SERVICE_OPTIONS **section_ptr) {
     DISK_FILE *df;
     char line_text[CONFLINELEN], *errstr;
-    char config_line[CONFLINELEN], *config_opt, *config_arg;
+    char config_line[CONFLINELEN], *config_opt, *config_arg, *tmp_line;
     int i, line_number=0;
 #ifndef USE_WIN32
     int fd;
@@ -479,6 +492,11 @@ NOEXPORT int options_file(char *path, CONF_TYPE type,
         while(isspace((unsigned char)*config_arg))
             ++config_arg; /* remove initial whitespaces */
 
+        /* remember the option to detect unchanged sections on reload */
+        tmp_line=str_printf("%s=%s", config_opt, config_arg);
+        name_list_append(&(*section_ptr)->config_lines, tmp_line);
+        str_free(tmp_line);
+
         errstr=option_not_found;
         /* try global options first (e.g. for 'debug') */
         if(!new_service_options.next)
@@ -532,6 +550,168 @@ NOEXPORT int init_section(int eof, SERVICE_OPTIONS **section_ptr) {
     return 0;
 }
 
+/* replace the sections with unchanged configuration with running ones */
+NOEXPORT int sections_keep(void) {
+    SERVICE_OPTIONS **new_ptr, **old_ptr, *section, *running;
+    unsigned kept=0, total=0;
+
+#ifndef OPENSSL_NO_TLSEXT
+    /* a section that became an SNI master needs a new TLS context */
+    for(section=new_service_options.next; section; section=section->next) {
+        if(section->running && section->servername_list_head) {
+            section->running=NULL;
+            if(context_init(section)) {
+                s_log(LOG_ERR, "Service [%s]: Failed to initialize TLS context",
+                    section->servname);
+                return 1;
+            }
+        }
+    }
+#endif /* !defined(OPENSSL_NO_TLSEXT) */
+
+    CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_SECTIONS]);
+    for(new_ptr=&new_service_options.next; *new_ptr;
+            new_ptr=&(*new_ptr)->next) {
+        ++total;
+        section=*new_ptr;
+        running=section->running;
+        if(!running)
+            continue;
+        /* detach the running section from the current list */
+        for(old_ptr=&service_options.next; *old_ptr!=running;
+                old_ptr=&(*old_ptr)->next)
+            ;
+        *old_ptr=running->next;
+        /* move it into the new list, with its listening sockets,
+         * its TLS context, and its reference from the list */
+        running->next=section->next;
+        *new_ptr=running;
+        section->next=NULL;
+        section->running=NULL;
+        service_free(section);
+        s_log(LOG_INFO, "Service [%s] unchanged", running->servname);
+        ++kept;
+    }
+    CRYPTO_THREAD_unlock(stunnel_locks[LOCK_SECTIONS]);
+    s_log(LOG_NOTICE, "Kept %u of %u service(s) unchanged", kept, total);
+    return 0;
+}
+
+/* find a running section with the same configuration, files and addresses */
+NOEXPORT SERVICE_OPTIONS *section_unchanged(SERVICE_OPTIONS *section) {
+    SERVICE_OPTIONS *running, *tmp;
+
+    if(!section->file_stamps) /* no way to detect modified files */
+        return NULL;
+    if(!section->local_addr.num) /* only listening services are kept */
+        return NULL;
+#ifndef OPENSSL_NO_TLSEXT
+    if(!section->option.client && section->sni)
+        return NULL; /* SNI slaves are referenced by their master */
+#endif /* !defined(OPENSSL_NO_TLSEXT) */
+    if(!name_list_equal(service_options.config_lines,
+            new_service_options.config_lines))
+        return NULL; /* modified global options or defaults */
+
+    for(running=service_options.next; running; running=running->next)
+        if(!strcmp(running->servname, section->servname))
+            break;
+    if(!running || !running->ctx || !running->file_stamps)
+        return NULL;
+#ifndef OPENSSL_NO_TLSEXT
+    if(running->servername_list_head)
+        return NULL; /* SNI slaves are never kept */
+#endif /* !defined(OPENSSL_NO_TLSEXT) */
+    for(tmp=new_service_options.next; tmp!=section; tmp=tmp->next)
+        if(tmp->running==running)
+            return NULL; /* duplicate section name */
+
+    if(!name_list_equal(running->config_lines, section->config_lines) ||
+            strcmp(running->file_stamps, section->file_stamps))
+        return NULL;
+#ifndef OPENSSL_NO_PSK
+    /* PSKsecrets were read again while parsing the new configuration */
+    if(!psk_equal(running->psk_keys, section->psk_keys))
+        return NULL;
+#endif /* !defined(OPENSSL_NO_PSK) */
+    /* DNS names may resolve to new addresses */
+    if(!addrlist_equal(&running->local_addr, &section->local_addr) ||
+            !addrlist_equal(&running->connect_addr, &section->connect_addr) ||
+            !addrlist_equal(&running->redirect_addr, &section->redirect_addr))
+        return NULL;
+    if(running->sessiond_num!=section->sessiond_num ||
+            (section->sessiond_num && memcmp(running->sessiond_addr,
+                section->sessiond_addr,
+                section->sessiond_num*sizeof(SOCKADDR_UNION))))
+        return NULL;
+    return running;
+}
+
+#ifndef USE_WIN32
+
+/* identify the versions of the files read by context_init() */
+NOEXPORT char *file_stamps(SERVICE_OPTIONS *section) {
+    char *files[4], *stamps;
+    size_t i;
+
+    files[0]=section->cert;
+    files[1]=section->key;
+    files[2]=section->ca_file;
+    files[3]=section->crl_file;
+    stamps=str_dup("");
+    for(i=0; i<sizeof files/sizeof files[0]; ++i)
+        if(files[i])
+            stamps=file_stamp(stamps, files[i]);
+    /* certificates and CRLs are looked up in the directories on demand */
+    if(section->ca_dir)
+        stamps=dir_stamps(stamps, section->ca_dir);
+    if(section->crl_dir)
+        stamps=dir_stamps(stamps, section->crl_dir);
+    str_detach(stamps);
+    return stamps;
+}
+
+/* append the status of a file or directory to the stamps */
+NOEXPORT char *file_stamp(char *stamps, const char *path) {
+    struct stat sb;
+    char *tmp;
+
+    if(stat(path, &sb))
+        tmp=str_printf("%s%s:-\n", stamps, path);
+    else
+        tmp=str_printf("%s%s:%lu:%lu:%lu:%ld:%ld\n", stamps, path,
+            (unsigned long)sb.st_dev, (unsigned long)sb.st_ino,
+            (unsigned long)sb.st_size,
+            (long)sb.st_mtime, (long)sb.st_ctime);
+    str_free(stamps);
+    return tmp;
+}
+
+/* append the status of a directory and of each of its entries */
+NOEXPORT char *dir_stamps(char *stamps, const char *directory) {
+    struct dirent **namelist;
+    char *name;
+    int i, num;
+
+    stamps=file_stamp(stamps, directory);
+    num=scandir(directory, &namelist, NULL, alphasort);
+    if(num<0)
+        return stamps;
+    for(i=0; i<num; ++i) {
+        if(strcmp(namelist[i]->d_name, ".") &&
+                strcmp(namelist[i]->d_name, "..")) {
+            name=str_printf("%s/%s", directory, namelist[i]->d_name);
+            stamps=file_stamp(stamps, name);
+            str_free(name);
+        }
+        free(namelist[i]);
+    }
+    free(namelist);
+    return stamps;
+}
+
+#endif /* !defined(USE_WIN32) */
+
 #ifdef USE_WIN32
 
 int scandir(const char *dirp, struct dirent ***namelist,
@@ -618,7 +798,7 @@ void options_free() {
 }
 
 void service_up_ref(SERVICE_OPTIONS *section) {
-#ifdef USE_OS_THREADS
+#if defined(USE_OS_THREADS) || defined(USE_SCHEDULERS)
     int ref;
 
     CRYPTO_atomic_add(&section->ref, 1, &ref, stunnel_locks[LOCK_REF]);
@@ -630,7 +810,7 @@ void service_up_ref(SERVICE_OPTIONS *section) {
 void service_free(SERVICE_OPTIONS *section) {
     int ref;
 
-#ifdef USE_OS_THREADS
+#if defined(USE_OS_THREADS) || defined(USE_SCHEDULERS)
     CRYPTO_atomic_add(&section->ref, -1, &ref, stunnel_locks[LOCK_REF]);
 #else
     ref=--(section->ref);
@@ -651,6 +831,110 @@ NOEXPORT char *parse_global_option(CMD cmd, char *opt, char *arg) {
         s_log(LOG_NOTICE, "Global options:");
     }
 
+    /* acceptBatch */
+    switch(cmd) {
+    case CMD_SET_DEFAULTS:
+        new_global_options.accept_batch=ACCEPT_BATCH;
+        break;
+    case CMD_SET_COPY: /* not used for global options */
+        break;
+    case CMD_FREE:
+        break;
+    case CMD_SET_VALUE:
+        if(strcasecmp(opt, "acceptBatch"))
+            break;
+        {
+            char *tmp_str;
+            long num=strtol(arg, &tmp_str, 10);
+            if(tmp_str==arg || *tmp_str) /* not a number */
+                return "Illegal accept batch size";
+            if(num<1 || num>1024)
+                return "Accept batch size out of range";
+            new_global_options.accept_batch=(unsigned)num;
+        }
+        return NULL; /* OK */
+    case CMD_INITIALIZE:
+        break;
+    case CMD_PRINT_DEFAULTS:
+        s_log(LOG_NOTICE, "%-22s = %d", "acceptBatch", ACCEPT_BATCH);
+        break;
+    case CMD_PRINT_HELP:
+        s_log(LOG_NOTICE,
+            "%-22s = maximum number of connections accepted per wakeup",
+            "acceptBatch");
+        break;
+    }
+
+#ifdef USE_ACCEPT_THREADS
+    /* acceptCPU */
+    switch(cmd) {
+    case CMD_SET_DEFAULTS:
+        new_global_options.option.accept_cpu=0;
+        break;
+    case CMD_SET_COPY: /* not used for global options */
+        break;
+    case CMD_FREE:
+        break;
+    case CMD_SET_VALUE:
+        if(strcasecmp(opt, "acceptCPU"))
+            break;
+#ifdef SO_INCOMING_CPU
+        if(!strcasecmp(arg, "yes"))
+            new_global_options.option.accept_cpu=1;
+        else if(!strcasecmp(arg, "no"))
+            new_global_options.option.accept_cpu=0;
+        else
+            return "The argument needs to be either 'yes' or 'no'";
+        return NULL; /* OK */
+#else /* SO_INCOMING_CPU */
+        return "SO_INCOMING_CPU is not supported";
+#endif /* SO_INCOMING_CPU */
+    case CMD_INITIALIZE:
+        break;
+    case CMD_PRINT_DEFAULTS:
+        break;
+    case CMD_PRINT_HELP:
+        s_log(LOG_NOTICE,
+            "%-22s = yes|no bind accept threads to CPUs",
+            "acceptCPU");
+        break;
+    }
+
+    /* acceptThreads */
+    switch(cmd) {
+    case CMD_SET_DEFAULTS:
+        new_global_options.accept_threads=1;
+        break;
+    case CMD_SET_COPY: /* not used for global options */
+        break;
+    case CMD_FREE:
+        break;
+    case CMD_SET_VALUE:
+        if(strcasecmp(opt, "acceptThreads"))
+            break;
+        {
+            char *tmp_str;
+            long num=strtol(arg, &tmp_str, 10);
+            if(tmp_str==arg || *tmp_str) /* not a number */
+                return "Illegal number of accept threads";
+            if(num<1 || num>1024)
+                return "Number of accept threads out of range";
+            new_global_options.accept_threads=(unsigned)num;
+        }
+        return NULL; /* OK */
+    case CMD_INITIALIZE:
+        break;
+    case CMD_PRINT_DEFAULTS:
+        s_log(LOG_NOTICE, "%-22s = 1", "acceptThreads");
+        break;
+    case CMD_PRINT_HELP:
+        s_log(LOG_NOTICE,
+            "%-22s = number of threads with SO_REUSEPORT listening sockets",
+            "acceptThreads");
+        break;
+    }
+#endif /* USE_ACCEPT_THREADS */
+
     /* chroot */
 #ifdef HAVE_CHROOT
     switch(cmd) {
@@ -716,6 +1000,72 @@ NOEXPORT char *parse_global_option(CMD cmd, char *opt, char *arg) {
     }
 #endif /* !defined(OPENSSL_NO_COMP) */
 
+#ifndef USE_FORK
+    /* dnsCacheTimeout */
+    switch(cmd) {
+    case CMD_SET_DEFAULTS:
+        new_global_options.dns_cache_timeout=0; /* disabled */
+        break;
+    case CMD_SET_COPY: /* not used for global options */
+        break;
+    case CMD_FREE:
+        break;
+    case CMD_SET_VALUE:
+        if(strcasecmp(opt, "dnsCacheTimeout"))
+            break;
+        {
+            char *tmp_str;
+            long val=strtol(arg, &tmp_str, 10);
+            if(tmp_str==arg || *tmp_str || val<0 || val>INT_MAX)
+                return "Illegal DNS cache timeout";
+            new_global_options.dns_cache_timeout=(int)val;
+        }
+        return NULL; /* OK */
+    case CMD_INITIALIZE:
+        break;
+    case CMD_PRINT_DEFAULTS:
+        s_log(LOG_NOTICE, "%-22s = 0 seconds (disabled)", "dnsCacheTimeout");
+        break;
+    case CMD_PRINT_HELP:
+        s_log(LOG_NOTICE,
+            "%-22s = seconds to cache resolved addresses",
+            "dnsCacheTimeout");
+        break;
+    }
+
+    /* dnsNegativeTimeout */
+    switch(cmd) {
+    case CMD_SET_DEFAULTS:
+        new_global_options.dns_negative_timeout=5;
+        break;
+    case CMD_SET_COPY: /* not used for global options */
+        break;
+    case CMD_FREE:
+        break;
+    case CMD_SET_VALUE:
+        if(strcasecmp(opt, "dnsNegativeTimeout"))
+            break;
+        {
+            char *tmp_str;
+            long val=strtol(arg, &tmp_str, 10);
+            if(tmp_str==arg || *tmp_str || val<0 || val>INT_MAX)
+                return "Illegal DNS negative cache timeout";
+            new_global_options.dns_negative_timeout=(int)val;
+        }
+        return NULL; /* OK */
+    case CMD_INITIALIZE:
+        break;
+    case CMD_PRINT_DEFAULTS:
+        s_log(LOG_NOTICE, "%-22s = 5 seconds", "dnsNegativeTimeout");
+        break;
+    case CMD_PRINT_HELP:
+        s_log(LOG_NOTICE,
+            "%-22s = seconds to cache failed DNS lookups",
+            "dnsNegativeTimeout");
+        break;
+    }
+#endif /* !defined(USE_FORK) */
+
     /* EGD */
     switch(cmd) {
     case CMD_SET_DEFAULTS:
@@ -1013,6 +1363,69 @@ NOEXPORT char *parse_global_option(CMD cmd, char *opt, char *arg) {
         break;
     }
 
+#ifdef USE_LOG_ASYNC
+    /* logAsync */
+    switch(cmd) {
+    case CMD_SET_DEFAULTS:
+        new_global_options.option.log_async=0;
+        break;
+    case CMD_SET_COPY: /* not used for global options */
+        break;
+    case CMD_FREE:
+        break;
+    case CMD_SET_VALUE:
+        if(strcasecmp(opt, "logAsync"))
+            break;
+        if(!strcasecmp(arg, "yes"))
+            new_global_options.option.log_async=1;
+        else if(!strcasecmp(arg, "no"))
+            new_global_options.option.log_async=0;
+        else
+            return "The argument needs to be either 'yes' or 'no'";
+        return NULL; /* OK */
+    case CMD_INITIALIZE:
+        break;
+    case CMD_PRINT_DEFAULTS:
+        s_log(LOG_NOTICE, "%-22s = no", "logAsync");
+        break;
+    case CMD_PRINT_HELP:
+        s_log(LOG_NOTICE, "%-22s = yes|no write logs in a separate thread",
+            "logAsync");
+        break;
+    }
+
+    /* logOverflow */
+    switch(cmd) {
+    case CMD_SET_DEFAULTS:
+        new_global_options.option.log_drop=0;
+        break;
+    case CMD_SET_COPY: /* not used for global options */
+        break;
+    case CMD_FREE:
+        break;
+    case CMD_SET_VALUE:
+        if(strcasecmp(opt, "logOverflow"))
+            break;
+        if(!strcasecmp(arg, "block"))
+            new_global_options.option.log_drop=0;
+        else if(!strcasecmp(arg, "drop"))
+            new_global_options.option.log_drop=1;
+        else
+            return "The argument needs to be either 'block' or 'drop'";
+        return NULL; /* OK */
+    case CMD_INITIALIZE:
+        break;
+    case CMD_PRINT_DEFAULTS:
+        s_log(LOG_NOTICE, "%-22s = block", "logOverflow");
+        break;
+    case CMD_PRINT_HELP:
+        s_log(LOG_NOTICE,
+            "%-22s = block|drop log records when the logAsync queue is full",
+            "logOverflow");
+        break;
+    }
+#endif /* USE_LOG_ASYNC */
+
     /* output */
     switch(cmd) {
     case CMD_SET_DEFAULTS:
@@ -1164,75 +1577,329 @@ NOEXPORT char *parse_global_option(CMD cmd, char *opt, char *arg) {
     case CMD_INITIALIZE:
         break;
     case CMD_PRINT_DEFAULTS:
-        s_log(LOG_NOTICE, "%-22s = yes", "RNDoverwrite");
+        s_log(LOG_NOTICE, "%-22s = yes", "RNDoverwrite");
+        break;
+    case CMD_PRINT_HELP:
+        s_log(LOG_NOTICE, "%-22s = yes|no overwrite seed datafiles with new random data",
+            "RNDoverwrite");
+        break;
+    }
+
+#ifdef USE_SCHEDULERS
+    /* schedulerThreads */
+    switch(cmd) {
+    case CMD_SET_DEFAULTS:
+        new_global_options.scheduler_threads=1;
+        break;
+    case CMD_SET_COPY: /* not used for global options */
+        break;
+    case CMD_FREE:
+        break;
+    case CMD_SET_VALUE:
+        if(strcasecmp(opt, "schedulerThreads"))
+            break;
+        if(!strcasecmp(arg, "auto")) {
+            long num=sysconf(_SC_NPROCESSORS_ONLN);
+            new_global_options.scheduler_threads=num>1 ? (unsigned)num : 1;
+        } else {
+            char *tmp_str;
+            long num=strtol(arg, &tmp_str, 10);
+            if(tmp_str==arg || *tmp_str) /* not a number */
+                return "Illegal number of scheduler threads";
+            if(num<1 || num>1024)
+                return "Number of scheduler threads out of range";
+            new_global_options.scheduler_threads=(unsigned)num;
+        }
+        return NULL; /* OK */
+    case CMD_INITIALIZE:
+        break;
+    case CMD_PRINT_DEFAULTS:
+        s_log(LOG_NOTICE, "%-22s = 1", "schedulerThreads");
+        break;
+    case CMD_PRINT_HELP:
+        s_log(LOG_NOTICE,
+            "%-22s = auto|number of threads running client contexts",
+            "schedulerThreads");
+        break;
+    }
+#endif /* USE_SCHEDULERS */
+
+#ifdef USE_SESSIOND_SERVER
+    /* sessiondMemory */
+    switch(cmd) {
+    case CMD_SET_DEFAULTS:
+        new_global_options.sessiond_memory=SESSIOND_MEMORY;
+        break;
+    case CMD_SET_COPY: /* not used for global options */
+        break;
+    case CMD_FREE:
+        break;
+    case CMD_SET_VALUE:
+        if(strcasecmp(opt, "sessiondMemory"))
+            break;
+        {
+            char *tmp_str;
+            long size=strtol(arg, &tmp_str, 10);
+            if(tmp_str==arg || *tmp_str) /* not a number */
+                return "Illegal sessiond memory limit";
+            if(size<65536)
+                return "Sessiond memory limit too small";
+            new_global_options.sessiond_memory=(size_t)size;
+        }
+        return NULL; /* OK */
+    case CMD_INITIALIZE:
+        break;
+    case CMD_PRINT_DEFAULTS:
+        s_log(LOG_NOTICE, "%-22s = %d bytes", "sessiondMemory", SESSIOND_MEMORY);
+        break;
+    case CMD_PRINT_HELP:
+        s_log(LOG_NOTICE,
+            "%-22s = memory limit of the built-in sessiond server in bytes",
+            "sessiondMemory");
+        break;
+    }
+
+    /* sessiondServer */
+    switch(cmd) {
+    case CMD_SET_DEFAULTS:
+        new_global_options.option.sessiond_server=0;
+        memset(&new_global_options.sessiond_server_addr, 0,
+            sizeof(SOCKADDR_UNION));
+        new_global_options.sessiond_server_addr.in.sin_family=AF_INET;
+        break;
+    case CMD_SET_COPY: /* not used for global options */
+        break;
+    case CMD_FREE:
+        break;
+    case CMD_SET_VALUE:
+        if(strcasecmp(opt, "sessiondServer"))
+            break;
+        {
+            /* the unauthenticated server listens on loopback by default */
+            char *tmp_str=strchr(arg, ':') ? str_dup(arg) :
+                str_printf("127.0.0.1:%s", arg);
+            unsigned num=name2addr(&new_global_options.sessiond_server_addr,
+                tmp_str, 1);
+            str_free(tmp_str);
+            if(!num)
+                return "Failed to resolve sessiond server address";
+        }
+        new_global_options.option.sessiond_server=1;
+        return NULL; /* OK */
+    case CMD_INITIALIZE:
+        break;
+    case CMD_PRINT_DEFAULTS:
+        break;
+    case CMD_PRINT_HELP:
+        s_log(LOG_NOTICE,
+            "%-22s = [host:]port run a sessiond server at host:port",
+            "sessiondServer");
+        break;
+    }
+
+    /* sessiondThreads */
+    switch(cmd) {
+    case CMD_SET_DEFAULTS:
+        new_global_options.sessiond_threads=0; /* auto */
+        break;
+    case CMD_SET_COPY: /* not used for global options */
+        break;
+    case CMD_FREE:
+        break;
+    case CMD_SET_VALUE:
+        if(strcasecmp(opt, "sessiondThreads"))
+            break;
+        if(!strcasecmp(arg, "auto")) {
+            new_global_options.sessiond_threads=0;
+        } else {
+            char *tmp_str;
+            long num=strtol(arg, &tmp_str, 10);
+            if(tmp_str==arg || *tmp_str) /* not a number */
+                return "Illegal number of sessiond server threads";
+            if(num<1 || num>SESSIOND_THREADS)
+                return "Number of sessiond server threads out of range";
+            new_global_options.sessiond_threads=(unsigned)num;
+        }
+        return NULL; /* OK */
+    case CMD_INITIALIZE:
+        break;
+    case CMD_PRINT_DEFAULTS:
+        s_log(LOG_NOTICE, "%-22s = auto", "sessiondThreads");
+        break;
+    case CMD_PRINT_HELP:
+        s_log(LOG_NOTICE,
+            "%-22s = auto|number of built-in sessiond server threads",
+            "sessiondThreads");
+        break;
+    }
+#endif /* USE_SESSIOND_SERVER */
+
+    /* syslog */
+#ifndef USE_WIN32
+    switch(cmd) {
+    case CMD_SET_DEFAULTS:
+        new_global_options.option.log_syslog=1;
+        break;
+    case CMD_SET_COPY: /* not used for global options */
+        break;
+    case CMD_FREE:
+        break;
+    case CMD_SET_VALUE:
+        if(strcasecmp(opt, "syslog"))
+            break;
+        if(!strcasecmp(arg, "yes"))
+            new_global_options.option.log_syslog=1;
+        else if(!strcasecmp(arg, "no"))
+            new_global_options.option.log_syslog=0;
+        else
+            return "The argument needs to be either 'yes' or 'no'";
+        return NULL; /* OK */
+    case CMD_INITIALIZE:
+        break;
+    case CMD_PRINT_DEFAULTS:
+        break;
+    case CMD_PRINT_HELP:
+        s_log(LOG_NOTICE, "%-22s = yes|no send logging messages to syslog",
+            "syslog");
+        break;
+    }
+#endif
+
+    /* taskbar */
+#ifdef USE_WIN32
+    switch(cmd) {
+    case CMD_SET_DEFAULTS:
+        new_global_options.option.taskbar=1;
+        break;
+    case CMD_SET_COPY: /* not used for global options */
+        break;
+    case CMD_FREE:
+        break;
+    case CMD_SET_VALUE:
+        if(strcasecmp(opt, "taskbar"))
+            break;
+        if(!strcasecmp(arg, "yes"))
+            new_global_options.option.taskbar=1;
+        else if(!strcasecmp(arg, "no"))
+            new_global_options.option.taskbar=0;
+        else
+            return "The argument needs to be either 'yes' or 'no'";
+        return NULL; /* OK */
+    case CMD_INITIALIZE:
+        break;
+    case CMD_PRINT_DEFAULTS:
+        s_log(LOG_NOTICE, "%-22s = yes", "taskbar");
+        break;
+    case CMD_PRINT_HELP:
+        s_log(LOG_NOTICE, "%-22s = yes|no enable the taskbar icon", "taskbar");
+        break;
+    }
+#endif
+
+#ifdef USE_PTHREAD
+    /* threadPoolIdle */
+    switch(cmd) {
+    case CMD_SET_DEFAULTS:
+        new_global_options.thread_pool_idle=60;
+        break;
+    case CMD_SET_COPY: /* not used for global options */
+        break;
+    case CMD_FREE:
+        break;
+    case CMD_SET_VALUE:
+        if(strcasecmp(opt, "threadPoolIdle"))
+            break;
+        {
+            char *tmp_str;
+            long val=strtol(arg, &tmp_str, 10);
+            if(tmp_str==arg || *tmp_str || val<0 || val>INT_MAX)
+                return "Illegal thread pool idle timeout";
+            new_global_options.thread_pool_idle=(int)val;
+        }
+        return NULL; /* OK */
+    case CMD_INITIALIZE:
+        break;
+    case CMD_PRINT_DEFAULTS:
+        s_log(LOG_NOTICE, "%-22s = 60 seconds", "threadPoolIdle");
         break;
     case CMD_PRINT_HELP:
-        s_log(LOG_NOTICE, "%-22s = yes|no overwrite seed datafiles with new random data",
-            "RNDoverwrite");
+        s_log(LOG_NOTICE,
+            "%-22s = seconds to keep idle worker threads above the minimum",
+            "threadPoolIdle");
         break;
     }
 
-    /* syslog */
-#ifndef USE_WIN32
+    /* threadPoolMax */
     switch(cmd) {
     case CMD_SET_DEFAULTS:
-        new_global_options.option.log_syslog=1;
+        new_global_options.thread_pool_max=0; /* disabled */
         break;
     case CMD_SET_COPY: /* not used for global options */
         break;
     case CMD_FREE:
         break;
     case CMD_SET_VALUE:
-        if(strcasecmp(opt, "syslog"))
+        if(strcasecmp(opt, "threadPoolMax"))
             break;
-        if(!strcasecmp(arg, "yes"))
-            new_global_options.option.log_syslog=1;
-        else if(!strcasecmp(arg, "no"))
-            new_global_options.option.log_syslog=0;
-        else
-            return "The argument needs to be either 'yes' or 'no'";
+        {
+            char *tmp_str;
+            long num=strtol(arg, &tmp_str, 10);
+            if(tmp_str==arg || *tmp_str) /* not a number */
+                return "Illegal maximum number of pool threads";
+            if(num<0 || num>65536)
+                return "Maximum number of pool threads out of range";
+            new_global_options.thread_pool_max=(unsigned)num;
+        }
         return NULL; /* OK */
     case CMD_INITIALIZE:
         break;
     case CMD_PRINT_DEFAULTS:
+        s_log(LOG_NOTICE, "%-22s = 0 (disabled)", "threadPoolMax");
         break;
     case CMD_PRINT_HELP:
-        s_log(LOG_NOTICE, "%-22s = yes|no send logging messages to syslog",
-            "syslog");
+        s_log(LOG_NOTICE,
+            "%-22s = number of client worker threads to retain",
+            "threadPoolMax");
         break;
     }
-#endif
 
-    /* taskbar */
-#ifdef USE_WIN32
+    /* threadPoolMin */
     switch(cmd) {
     case CMD_SET_DEFAULTS:
-        new_global_options.option.taskbar=1;
+        new_global_options.thread_pool_min=0;
         break;
     case CMD_SET_COPY: /* not used for global options */
         break;
     case CMD_FREE:
         break;
     case CMD_SET_VALUE:
-        if(strcasecmp(opt, "taskbar"))
+        if(strcasecmp(opt, "threadPoolMin"))
             break;
-        if(!strcasecmp(arg, "yes"))
-            new_global_options.option.taskbar=1;
-        else if(!strcasecmp(arg, "no"))
-            new_global_options.option.taskbar=0;
-        else
-            return "The argument needs to be either 'yes' or 'no'";
+        {
+            char *tmp_str;
+            long num=strtol(arg, &tmp_str, 10);
+            if(tmp_str==arg || *tmp_str) /* not a number */
+                return "Illegal minimum number of pool threads";
+            if(num<0 || num>65536)
+                return "Minimum number of pool threads out of range";
+            new_global_options.thread_pool_min=(unsigned)num;
+        }
         return NULL; /* OK */
     case CMD_INITIALIZE:
+        if(new_global_options.thread_pool_min>
+                new_global_options.thread_pool_max)
+            return "threadPoolMin exceeds threadPoolMax";
         break;
     case CMD_PRINT_DEFAULTS:
-        s_log(LOG_NOTICE, "%-22s = yes", "taskbar");
+        s_log(LOG_NOTICE, "%-22s = 0", "threadPoolMin");
         break;
     case CMD_PRINT_HELP:
-        s_log(LOG_NOTICE, "%-22s = yes|no enable the taskbar icon", "taskbar");
+        s_log(LOG_NOTICE,
+            "%-22s = number of client worker threads to pre-start",
+            "threadPoolMin");
         break;
     }
-#endif
+#endif /* USE_PTHREAD */
 
     /* final checks */
     switch(cmd) {
@@ -1286,10 +1953,16 @@ NOEXPORT char *parse_service_option(CMD cmd, SERVICE_OPTIONS **section_ptr,
     case CMD_SET_DEFAULTS:
         addrlist_clear(&section->local_addr, 1);
         section->local_fd=NULL;
+#ifdef USE_ACCEPT_THREADS
+        section->shard_fd=NULL;
+#endif
         break;
     case CMD_SET_COPY:
         addrlist_clear(&section->local_addr, 1);
         section->local_fd=NULL;
+#ifdef USE_ACCEPT_THREADS
+        section->shard_fd=NULL;
+#endif
         name_list_dup(&section->local_addr.names,
             new_service_options.local_addr.names);
         break;
@@ -1297,6 +1970,9 @@ NOEXPORT char *parse_service_option(CMD cmd, SERVICE_OPTIONS **section_ptr,
         name_list_free(section->local_addr.names);
         str_free(section->local_addr.addr);
         str_free(section->local_fd);
+#ifdef USE_ACCEPT_THREADS
+        str_free(section->shard_fd);
+#endif
         break;
     case CMD_SET_VALUE:
         if(strcasecmp(opt, "accept"))
@@ -1312,6 +1988,25 @@ NOEXPORT char *parse_service_option(CMD cmd, SERVICE_OPTIONS **section_ptr,
             section->local_fd=str_alloc_detached(section->local_addr.num*sizeof(SOCKET));
             for(i=0; i<section->local_addr.num; ++i)
                 section->local_fd[i]=INVALID_SOCKET;
+#ifdef USE_ACCEPT_THREADS
+            if(new_global_options.accept_threads>1) {
+                unsigned num=section->local_addr.num*
+                    (new_global_options.accept_threads-1);
+                /* each shard would be bound to a different ephemeral port */
+                for(i=0; i<section->local_addr.num; ++i) {
+                    SOCKADDR_UNION *addr=section->local_addr.addr+i;
+                    if((addr->sa.sa_family==AF_INET
+#ifdef USE_IPv6
+                            || addr->sa.sa_family==AF_INET6
+#endif /* USE_IPv6 */
+                            ) && !addr->in.sin_port)
+                        return "Port 0 is not supported with acceptThreads > 1";
+                }
+                section->shard_fd=str_alloc_detached(num*sizeof(SOCKET));
+                for(i=0; i<num; ++i)
+                    section->shard_fd[i]=INVALID_SOCKET;
+            }
+#endif /* USE_ACCEPT_THREADS */
             ++endpoints;
         }
         break;
@@ -1323,6 +2018,50 @@ NOEXPORT char *parse_service_option(CMD cmd, SERVICE_OPTIONS **section_ptr,
         break;
     }
 
+    /* bufferSize */
+    switch(cmd) {
+    case CMD_SET_DEFAULTS:
+        section->buffer_size=BUFFSIZE;
+        section->option.buffer_adaptive=0;
+        break;
+    case CMD_SET_COPY:
+        section->buffer_size=new_service_options.buffer_size;
+        section->option.buffer_adaptive=
+            new_service_options.option.buffer_adaptive;
+        break;
+    case CMD_FREE:
+        break;
+    case CMD_SET_VALUE:
+        if(strcasecmp(opt, "bufferSize"))
+            break;
+        if(!strcasecmp(arg, "adaptive")) {
+            section->buffer_size=BUFFSIZE;
+            section->option.buffer_adaptive=1;
+            return NULL; /* OK */
+        }
+        {
+            char *tmp_str;
+            long size=strtol(arg, &tmp_str, 10);
+            if(tmp_str==arg || *tmp_str) /* not a number */
+                return "Illegal buffer size";
+            if(size<BUFFSIZE_MIN || size>BUFFSIZE_MAX)
+                return "Buffer size out of range";
+            section->buffer_size=(size_t)size;
+            section->option.buffer_adaptive=0;
+        }
+        return NULL; /* OK */
+    case CMD_INITIALIZE:
+        break;
+    case CMD_PRINT_DEFAULTS:
+        s_log(LOG_NOTICE, "%-22s = %d bytes", "bufferSize", BUFFSIZE);
+        break;
+    case CMD_PRINT_HELP:
+        s_log(LOG_NOTICE,
+            "%-22s = transfer buffer size (in bytes) or \"adaptive\"",
+            "bufferSize");
+        break;
+    }
+
     /* CApath */
     switch(cmd) {
     case CMD_SET_DEFAULTS:
@@ -1729,10 +2468,18 @@ NOEXPORT char *parse_service_option(CMD cmd, SERVICE_OPTIONS **section_ptr,
     case CMD_SET_DEFAULTS:
         addrlist_clear(&section->connect_addr, 0);
         section->connect_session=NULL;
+#ifndef USE_FORK
+        section->connect_active=NULL;
+        section->connect_cost=NULL;
+#endif /* !defined(USE_FORK) */
         break;
     case CMD_SET_COPY:
         addrlist_clear(&section->connect_addr, 0);
         section->connect_session=NULL;
+#ifndef USE_FORK
+        section->connect_active=NULL;
+        section->connect_cost=NULL;
+#endif /* !defined(USE_FORK) */
         name_list_dup(&section->connect_addr.names,
             new_service_options.connect_addr.names);
         break;
@@ -1740,6 +2487,10 @@ NOEXPORT char *parse_service_option(CMD cmd, SERVICE_OPTIONS **section_ptr,
         name_list_free(section->connect_addr.names);
         str_free(section->connect_addr.addr);
         str_free(section->connect_session);
+#ifndef USE_FORK
+        str_free(section->connect_active);
+        str_free(section->connect_cost);
+#endif /* !defined(USE_FORK) */
         break;
     case CMD_SET_VALUE:
         if(strcasecmp(opt, "connect"))
@@ -1759,6 +2510,14 @@ NOEXPORT char *parse_service_option(CMD cmd, SERVICE_OPTIONS **section_ptr,
             if(section->option.client)
                 section->connect_session=
                     str_alloc_detached(section->connect_addr.num*sizeof(SSL_SESSION *));
+#ifndef USE_FORK
+            if(section->connect_addr.num) {
+                section->connect_active=
+                    str_alloc_detached(section->connect_addr.num*sizeof(int));
+                section->connect_cost=str_alloc_detached(
+                    section->connect_addr.num*sizeof(CONNECT_COST));
+            }
+#endif /* !defined(USE_FORK) */
             ++endpoints;
         }
         break;
@@ -1770,6 +2529,61 @@ NOEXPORT char *parse_service_option(CMD cmd, SERVICE_OPTIONS **section_ptr,
         break;
     }
 
+    /* connectPool */
+#ifndef USE_FORK
+    switch(cmd) {
+    case CMD_SET_DEFAULTS:
+        section->connect_pool_size=0;
+        section->connect_pool=NULL;
+        break;
+    case CMD_SET_COPY:
+        section->connect_pool_size=new_service_options.connect_pool_size;
+        section->connect_pool=NULL;
+        break;
+    case CMD_FREE:
+        connect_pool_free(section);
+        break;
+    case CMD_SET_VALUE:
+        if(strcasecmp(opt, "connectPool"))
+            break;
+        {
+            char *tmp_str;
+            long size=strtol(arg, &tmp_str, 10);
+            if(tmp_str==arg || *tmp_str || size<0 || size>1000)
+                return "Illegal connection pool size";
+            section->connect_pool_size=(unsigned)size;
+        }
+        return NULL; /* OK */
+    case CMD_INITIALIZE:
+        if(!section->connect_pool_size)
+            break;
+        if(!section->option.client)
+            return "\"connectPool\" requires client mode";
+        if(!section->connect_addr.names || section->exec_name)
+            return "\"connectPool\" requires \"connect\" without \"exec\"";
+        if(section->protocol)
+            return "\"connectPool\" is incompatible with \"protocol\"";
+#ifndef USE_WIN32
+        if(section->option.transparent_src)
+            return "\"connectPool\" is incompatible with \"transparent\"";
+#endif
+        if(section->option.transparent_dst)
+            return "\"connectPool\" is incompatible with \"transparent\"";
+#ifdef MSSPISSL
+        if(section->option.msspi)
+            return "\"connectPool\" is not supported with msspi";
+#endif
+        break;
+    case CMD_PRINT_DEFAULTS:
+        s_log(LOG_NOTICE, "%-22s = %u", "connectPool", 0);
+        break;
+    case CMD_PRINT_HELP:
+        s_log(LOG_NOTICE, "%-22s = number of idle TLS connections to keep",
+            "connectPool");
+        break;
+    }
+#endif /* !defined(USE_FORK) */
+
     /* CRLpath */
     switch(cmd) {
     case CMD_SET_DEFAULTS:
@@ -2084,8 +2898,17 @@ NOEXPORT char *parse_service_option(CMD cmd, SERVICE_OPTIONS **section_ptr,
             section->failover=FAILOVER_RR;
         else if(!strcasecmp(arg, "prio"))
             section->failover=FAILOVER_PRIO;
+#ifndef USE_FORK
+        else if(!strcasecmp(arg, "leastconn"))
+            section->failover=FAILOVER_LEASTCONN;
+        else if(!strcasecmp(arg, "p2c"))
+            section->failover=FAILOVER_P2C;
+        else
+            return "The argument needs to be 'rr', 'prio', 'leastconn', or 'p2c'";
+#else /* USE_FORK */
         else
             return "The argument needs to be either 'rr' or 'prio'";
+#endif /* USE_FORK */
         return NULL; /* OK */
     case CMD_INITIALIZE:
         if(section->option.delayed_lookup)
@@ -2094,8 +2917,44 @@ NOEXPORT char *parse_service_option(CMD cmd, SERVICE_OPTIONS **section_ptr,
     case CMD_PRINT_DEFAULTS:
         break;
     case CMD_PRINT_HELP:
+#ifndef USE_FORK
+        s_log(LOG_NOTICE, "%-22s = rr|prio|leastconn|p2c failover strategy",
+            "failover");
+#else /* USE_FORK */
         s_log(LOG_NOTICE, "%-22s = rr|prio failover strategy",
             "failover");
+#endif /* USE_FORK */
+        break;
+    }
+
+    /* happyEyeballs */
+    switch(cmd) {
+    case CMD_SET_DEFAULTS:
+        section->option.happy_eyeballs=0;
+        break;
+    case CMD_SET_COPY:
+        section->option.happy_eyeballs=
+            new_service_options.option.happy_eyeballs;
+        break;
+    case CMD_FREE:
+        break;
+    case CMD_SET_VALUE:
+        if(strcasecmp(opt, "happyEyeballs"))
+            break;
+        if(!strcasecmp(arg, "yes"))
+            section->option.happy_eyeballs=1;
+        else if(!strcasecmp(arg, "no"))
+            section->option.happy_eyeballs=0;
+        else
+            return "The argument needs to be either 'yes' or 'no'";
+        return NULL; /* OK */
+    case CMD_INITIALIZE:
+        break;
+    case CMD_PRINT_DEFAULTS:
+        break;
+    case CMD_PRINT_HELP:
+        s_log(LOG_NOTICE, "%-22s = yes|no race connections to remote hosts",
+            "happyEyeballs");
         break;
     }
 
@@ -2175,6 +3034,39 @@ NOEXPORT char *parse_service_option(CMD cmd, SERVICE_OPTIONS **section_ptr,
         break;
     }
 
+    /* ktls */
+#ifdef USE_KTLS
+    switch(cmd) {
+    case CMD_SET_DEFAULTS:
+        section->option.ktls=0;
+        section->ktls_checked=section->ktls_tx=section->ktls_rx=0;
+        break;
+    case CMD_SET_COPY:
+        section->option.ktls=new_service_options.option.ktls;
+        section->ktls_checked=section->ktls_tx=section->ktls_rx=0;
+        break;
+    case CMD_FREE:
+        break;
+    case CMD_SET_VALUE:
+        if(strcasecmp(opt, "ktls"))
+            break;
+        if(!strcasecmp(arg, "yes"))
+            section->option.ktls=1;
+        else if(!strcasecmp(arg, "no"))
+            section->option.ktls=0;
+        else
+            return "The argument needs to be either 'yes' or 'no'";
+        return NULL; /* OK */
+    case CMD_INITIALIZE:
+        break;
+    case CMD_PRINT_DEFAULTS:
+        break;
+    case CMD_PRINT_HELP:
+        s_log(LOG_NOTICE, "%-22s = yes|no kernel TLS offload", "ktls");
+        break;
+    }
+#endif /* USE_KTLS */
+
     /* libwrap */
 #ifdef USE_LIBWRAP
     switch(cmd) {
@@ -2271,6 +3163,44 @@ NOEXPORT char *parse_service_option(CMD cmd, SERVICE_OPTIONS **section_ptr,
         break;
     }
 
+    /* muxStreams */
+    switch(cmd) {
+    case CMD_SET_DEFAULTS:
+        section->mux_streams=100;
+#ifndef USE_FORK
+        section->mux_tunnels=NULL;
+#endif /* !defined(USE_FORK) */
+        break;
+    case CMD_SET_COPY:
+        section->mux_streams=new_service_options.mux_streams;
+#ifndef USE_FORK
+        section->mux_tunnels=NULL;
+#endif /* !defined(USE_FORK) */
+        break;
+    case CMD_FREE:
+        break;
+    case CMD_SET_VALUE:
+        if(strcasecmp(opt, "muxStreams"))
+            break;
+        {
+            char *tmp_str;
+            long num=strtol(arg, &tmp_str, 10);
+            if(tmp_str==arg || *tmp_str || num<1 || num>10000)
+                return "Illegal number of multiplexed streams";
+            section->mux_streams=(unsigned)num;
+        }
+        return NULL; /* OK */
+    case CMD_INITIALIZE:
+        break;
+    case CMD_PRINT_DEFAULTS:
+        s_log(LOG_NOTICE, "%-22s = %u", "muxStreams", 100);
+        break;
+    case CMD_PRINT_HELP:
+        s_log(LOG_NOTICE, "%-22s = maximum number of streams in a mux tunnel",
+            "muxStreams");
+        break;
+    }
+
 #ifndef OPENSSL_NO_OCSP
 
     /* OCSP */
@@ -2997,13 +3927,52 @@ NOEXPORT char *parse_service_option(CMD cmd, SERVICE_OPTIONS **section_ptr,
     }
 #endif
 
+#ifdef USE_SHM_CACHE
+    /* sessionCacheFile */
+    switch(cmd) {
+    case CMD_SET_DEFAULTS:
+        section->session_cache_file=NULL;
+        section->shm_cache=NULL;
+        break;
+    case CMD_SET_COPY:
+        section->session_cache_file=
+            str_dup_detached(new_service_options.session_cache_file);
+        section->shm_cache=NULL;
+        break;
+    case CMD_FREE:
+        shm_cache_free(section);
+        str_free(section->session_cache_file);
+        break;
+    case CMD_SET_VALUE:
+        if(strcasecmp(opt, "sessionCacheFile"))
+            break;
+#ifdef SSL_OP_NO_TICKET
+        /* stateless session tickets bypass the session callbacks */
+        section->ssl_options_set|=SSL_OP_NO_TICKET;
+#endif
+        str_free(section->session_cache_file);
+        section->session_cache_file=str_dup_detached(arg);
+        return NULL; /* OK */
+    case CMD_INITIALIZE:
+        break;
+    case CMD_PRINT_DEFAULTS:
+        break;
+    case CMD_PRINT_HELP:
+        s_log(LOG_NOTICE, "%-22s = session cache file shared between processes",
+            "sessionCacheFile");
+        break;
+    }
+#endif /* USE_SHM_CACHE */
+
     /* sessionCacheSize */
     switch(cmd) {
     case CMD_SET_DEFAULTS:
         section->session_size=1000L;
+        section->sessions_migrated=0;
         break;
     case CMD_SET_COPY:
         section->session_size=new_service_options.session_size;
+        section->sessions_migrated=0;
         break;
     case CMD_FREE:
         break;
@@ -3062,15 +4031,36 @@ NOEXPORT char *parse_service_option(CMD cmd, SERVICE_OPTIONS **section_ptr,
     switch(cmd) {
     case CMD_SET_DEFAULTS:
         section->option.sessiond=0;
-        memset(&section->sessiond_addr, 0, sizeof(SOCKADDR_UNION));
-        section->sessiond_addr.in.sin_family=AF_INET;
+        section->option.sessiond_own=0;
+        section->sessiond_addr=NULL;
+        section->sessiond_num=0;
+        section->sessiond_pool=NULL;
+        section->sessiond_idle=0;
+        section->sessiond_hits=0;
+        section->sessiond_misses=0;
+        section->sessiond_timeouts=0;
         break;
     case CMD_SET_COPY:
         section->option.sessiond=new_service_options.option.sessiond;
-        memcpy(&section->sessiond_addr, &new_service_options.sessiond_addr,
-            sizeof(SOCKADDR_UNION));
+        section->option.sessiond_own=0;
+        section->sessiond_num=new_service_options.sessiond_num;
+        if(section->sessiond_num) {
+            section->sessiond_addr=str_alloc_detached(
+                section->sessiond_num*sizeof(SOCKADDR_UNION));
+            memcpy(section->sessiond_addr, new_service_options.sessiond_addr,
+                section->sessiond_num*sizeof(SOCKADDR_UNION));
+        } else {
+            section->sessiond_addr=NULL;
+        }
+        section->sessiond_pool=NULL;
+        section->sessiond_idle=0;
+        section->sessiond_hits=0;
+        section->sessiond_misses=0;
+        section->sessiond_timeouts=0;
         break;
     case CMD_FREE:
+        sessiond_free(section);
+        str_free(section->sessiond_addr);
         break;
     case CMD_SET_VALUE:
         if(strcasecmp(opt, "sessiond"))
@@ -3081,8 +4071,21 @@ NOEXPORT char *parse_service_option(CMD cmd, SERVICE_OPTIONS **section_ptr,
         /* this prevents session callbacks from being executed */
         section->ssl_options_set|=SSL_OP_NO_TICKET;
 #endif
-        if(!name2addr(&section->sessiond_addr, arg, 0))
+        if(!section->option.sessiond_own) { /* override the defaults */
+            str_free(section->sessiond_addr);
+            section->sessiond_addr=NULL;
+            section->sessiond_num=0;
+            section->option.sessiond_own=1;
+        }
+        /* each occurrence of the option in a section adds a replica */
+        section->sessiond_addr=str_realloc_detached(section->sessiond_addr,
+            (section->sessiond_num+1)*sizeof(SOCKADDR_UNION));
+        memset(section->sessiond_addr+section->sessiond_num, 0,
+            sizeof(SOCKADDR_UNION));
+        section->sessiond_addr[section->sessiond_num].in.sin_family=AF_INET;
+        if(!name2addr(section->sessiond_addr+section->sessiond_num, arg, 0))
             return "Failed to resolve sessiond server address";
+        ++section->sessiond_num;
         return NULL; /* OK */
     case CMD_INITIALIZE:
         break;
@@ -3695,13 +4698,83 @@ NOEXPORT char *parse_service_option(CMD cmd, SERVICE_OPTIONS **section_ptr,
         break;
     }
 
-    /* final checks */
+    /* wipeBuffers */
+    switch(cmd) {
+    case CMD_SET_DEFAULTS:
+        section->option.wipe_buffers=0;
+        break;
+    case CMD_SET_COPY:
+        section->option.wipe_buffers=new_service_options.option.wipe_buffers;
+        break;
+    case CMD_FREE:
+        break;
+    case CMD_SET_VALUE:
+        if(strcasecmp(opt, "wipeBuffers"))
+            break;
+        if(!strcasecmp(arg, "yes"))
+            section->option.wipe_buffers=1;
+        else if(!strcasecmp(arg, "no"))
+            section->option.wipe_buffers=0;
+        else
+            return "The argument needs to be either 'yes' or 'no'";
+        return NULL; /* OK */
+    case CMD_INITIALIZE:
+        break;
+    case CMD_PRINT_DEFAULTS:
+        break;
+    case CMD_PRINT_HELP:
+        s_log(LOG_NOTICE, "%-22s = yes|no zero transferred data in buffers",
+            "wipeBuffers");
+        break;
+    }
+
+    /* zerocopy */
+#ifdef USE_SPLICE
     switch(cmd) {
     case CMD_SET_DEFAULTS:
+        section->option.zerocopy=0;
+        section->splice_used=0;
+        break;
+    case CMD_SET_COPY:
+        section->option.zerocopy=new_service_options.option.zerocopy;
+        section->splice_used=0;
+        break;
+    case CMD_FREE:
+        break;
+    case CMD_SET_VALUE:
+        if(strcasecmp(opt, "zerocopy"))
+            break;
+        if(!strcasecmp(arg, "yes"))
+            section->option.zerocopy=1;
+        else if(!strcasecmp(arg, "no"))
+            section->option.zerocopy=0;
+        else
+            return "The argument needs to be either 'yes' or 'no'";
+        return NULL; /* OK */
+    case CMD_INITIALIZE:
+        if(section->option.zerocopy && !section->option.ktls)
+            return "\"zerocopy\" requires \"ktls\"";
+        break;
+    case CMD_PRINT_DEFAULTS:
+        break;
+    case CMD_PRINT_HELP:
+        s_log(LOG_NOTICE, "%-22s = yes|no splice() data with kernel TLS",
+            "zerocopy");
         break;
+    }
+#endif /* USE_SPLICE */
+
+    /* final checks */
+    switch(cmd) {
+    case CMD_SET_DEFAULTS:
     case CMD_SET_COPY:
+        section->config_lines=NULL;
+        section->file_stamps=NULL;
+        section->running=NULL;
         break;
     case CMD_FREE:
+        name_list_free(section->config_lines);
+        str_free(section->file_stamps);
         str_free(section->chain);
         if(section->session)
             SSL_SESSION_free(section->session);
@@ -3738,7 +4811,14 @@ NOEXPORT char *parse_service_option(CMD cmd, SERVICE_OPTIONS **section_ptr,
                 !section->option.connect_before_ssl)
             section->ssl_options_set|=SSL_OP_NO_TICKET;
 #endif /* SSL_OP_NO_TICKET */
-        if(context_init(section)) /* initialize TLS context */
+        if(section!=&new_service_options) {
+#ifndef USE_WIN32
+            section->file_stamps=file_stamps(section);
+#endif
+            /* sections_keep() will use the running section instead */
+            section->running=section_unchanged(section);
+        }
+        if(!section->running && context_init(section)) /* TLS context */
             return "Failed to initialize TLS context";
         break;
     case CMD_PRINT_DEFAULTS:
@@ -4140,6 +5220,14 @@ NOEXPORT PSK_KEYS *psk_dup(PSK_KEYS *src) {
     return head;
 }
 
+NOEXPORT int psk_equal(PSK_KEYS *a, PSK_KEYS *b) {
+    for(; a && b; a=a->next, b=b->next)
+        if(strcmp(a->identity, b->identity) || a->key_len!=b->key_len ||
+                memcmp(a->key_val, b->key_val, a->key_len))
+            return 0;
+    return !a && !b;
+}
+
 NOEXPORT void psk_free(PSK_KEYS *head) {
     while(head) {
         PSK_KEYS *next=head->next;
@@ -4764,6 +5852,25 @@ NOEXPORT void name_list_free(NAME_LIST *ptr) {
     }
 }
 
+NOEXPORT int name_list_equal(NAME_LIST *a, NAME_LIST *b) {
+    for(; a && b; a=a->next, b=b->next)
+        if(strcmp(a->name, b->name))
+            return 0;
+    return !a && !b;
+}
+
+NOEXPORT int addrlist_equal(SOCKADDR_LIST *a, SOCKADDR_LIST *b) {
+    unsigned i;
+
+    if(a->num!=b->num)
+        return 0;
+    for(i=0; i<a->num; ++i)
+        if(addr_len(a->addr+i)!=addr_len(b->addr+i) ||
+                memcmp(a->addr+i, b->addr+i, (size_t)addr_len(a->addr+i)))
+            return 0;
+    return 1;
+}
+
 #ifndef USE_WIN32
 
 /* allocate 'exec' arguments */
@@ -41,7 +41,7 @@ OPENSSLDIR = u:/extras
 #SYSLOGDIR = /unixos2/workdir/syslog
 INCLUDES = -I$(OPENSSLDIR)/outinc
 LIBS = -lsocket -L$(OPENSSLDIR)/out -lssl -lcrypto -lz -lsyslog
-OBJS = file.o client.o log.o options.o protocol.o network.o ssl.o ctx.o verify.o sthreads.o stunnel.o pty.o resolver.o str.o tls.o fd.o dhparam.o cron.o
+OBJS = file.o client.o log.o options.o protocol.o network.o ssl.o ctx.o verify.o sthreads.o stunnel.o pty.o resolver.o str.o tls.o fd.o dhparam.o cron.o sessiond.o
 LIBDIR = .
 CFLAGS = -O2 -Wall -Wshadow -Wcast-align -Wpointer-arith
 
@@ -72,6 +72,7 @@ tls.o: tls.c common.h prototypes.h
 fd.o: fd.c common.h prototypes.h
 dhparam.o: dhparam.c common.h prototypes.h
 cron.o: cron.c common.h prototypes.h
+sessiond.o: sessiond.c common.h prototypes.h
 
 clean:
 	rm -f *.o *.exe
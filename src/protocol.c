@@ -66,6 +66,8 @@ NOEXPORT char *imap_server(CLI *, SERVICE_OPTIONS *, const PHASE);
 NOEXPORT char *nntp_client(CLI *, SERVICE_OPTIONS *, const PHASE);
 NOEXPORT char *connect_server(CLI *, SERVICE_OPTIONS *, const PHASE);
 NOEXPORT char *connect_client(CLI *, SERVICE_OPTIONS *, const PHASE);
+NOEXPORT char *mux_client(CLI *, SERVICE_OPTIONS *, const PHASE);
+NOEXPORT char *mux_server(CLI *, SERVICE_OPTIONS *, const PHASE);
 #ifndef OPENSSL_NO_MD4
 NOEXPORT void ntlm(CLI *, SERVICE_OPTIONS *);
 NOEXPORT char *ntlm1();
@@ -117,6 +119,10 @@ char *protocol(CLI *c, SERVICE_OPTIONS *opt, const PHASE phase) {
         return opt->option.client ?
             connect_client(c, opt, phase) :
             connect_server(c, opt, phase);
+    if(!strcasecmp(opt->protocol, "mux"))
+        return opt->option.client ?
+            mux_client(c, opt, phase) :
+            mux_server(c, opt, phase);
     return "Protocol not supported";
 }
 
@@ -1445,4 +1451,1067 @@ NOEXPORT char *base64(int encode, const char *in, int len) {
     return out;
 }
 
+/**************************************** mux */
+
+/*
+ * stunnel-to-stunnel multiplexing of many connections over a few TLS tunnels
+ *
+ * Each frame starts with an 8-byte header:
+ *   type (1 byte), flags (1 byte, reserved), payload length (2 bytes),
+ *   stream id (4 bytes), all in the network byte order
+ *
+ * The client opens streams, and the server connects them to its "connect"
+ * targets.  DATA frames are limited by a per-stream window replenished with
+ * WINDOW frames as the data is written to the destination socket.  CLOSE
+ * ends the sending direction of a stream, and RESET aborts the stream.
+ */
+
+#ifndef SHUT_WR
+#define SHUT_WR 1
+#endif
+
+#define MUX_VERSION 1
+#define MUX_HEADER 8
+#define MUX_FRAME_MAX 16384          /* maximum payload of a DATA frame */
+#define MUX_WINDOW 131072            /* per-stream flow control window */
+#define MUX_IN_SIZE (2*(MUX_HEADER+MUX_FRAME_MAX))
+#define MUX_OUT_HIGH (4*(MUX_HEADER+MUX_FRAME_MAX)) /* stop reading sockets */
+#define MUX_OUT_MAX (16*MUX_OUT_HIGH)                /* stop reading TLS */
+#define MUX_WRITE_MAX 65536          /* maximum length of a single SSL_write */
+#define MUX_HASH 256
+
+typedef enum {
+    MUX_HELLO, MUX_OPEN, MUX_DATA, MUX_UPDATE, MUX_CLOSE, MUX_RESET
+} MUX_FRAME;
+
+typedef struct mux_stream_struct {
+    struct mux_stream_struct *prev, *next;       /* streams of the tunnel */
+    struct mux_stream_struct *hash_next;           /* the same hash bucket */
+    uint32_t id;
+    SOCKET fd;
+    int connecting;                          /* non-blocking connect() */
+    unsigned attempts;                /* connect() attempts (server side) */
+    time_t deadline;                          /* TIMEOUTconnect deadline */
+    int sock_open_rd, sock_open_wr;   /* socket directions still in use */
+    int peer_open;                          /* the peer may send more DATA */
+    uint32_t send_window;          /* DATA bytes we are allowed to send */
+    uint32_t recv_window;    /* DATA bytes the peer is allowed to send */
+    uint32_t credit;      /* bytes written to the socket, not yet reported */
+    char *buff;            /* received DATA not yet written to the socket */
+    size_t buff_pos, buff_len;
+} MUX_STREAM;
+
+#ifndef USE_FORK
+typedef struct mux_pending_struct {
+    struct mux_pending_struct *next;
+    SOCKET fd;
+} MUX_PENDING;
+#endif /* !defined(USE_FORK) */
+
+typedef struct mux_tunnel_struct {
+#ifndef USE_FORK
+        /* shared with accepting threads, protected by LOCK_MUX */
+    struct mux_tunnel_struct *next;          /* tunnels of the service */
+    MUX_PENDING *pending, *pending_last; /* connections to be opened */
+    unsigned streams;                      /* open and pending streams */
+    unsigned limit;                      /* streams accepted by the peer */
+    int closing;                            /* no more streams accepted */
+#endif /* !defined(USE_FORK) */
+    SOCKET wake[2];   /* wakeup pipe of the client side, or INVALID_SOCKET */
+        /* private to the thread serving the tunnel */
+    MUX_STREAM *head;
+    MUX_STREAM *hash[MUX_HASH];
+    unsigned num;                                   /* open streams */
+    uint32_t next_id;                             /* client-side stream ids */
+    int hello;                           /* HELLO received from the peer */
+    char *in;                                /* partially received frames */
+    size_t in_len;
+    char *out;                             /* frames to be sent over TLS */
+    size_t out_pos, out_len, out_size;
+    int read_wants_write, write_wants_read;
+} MUX_TUNNEL;
+
+NOEXPORT void mux_server_run(CLI *);
+#ifndef USE_FORK
+NOEXPORT void mux_attach(CLI *);
+NOEXPORT int mux_assign(SERVICE_OPTIONS *, MUX_PENDING *);
+NOEXPORT void mux_limit(SERVICE_OPTIONS *, MUX_TUNNEL *, unsigned);
+NOEXPORT void mux_open_pending(MUX_TUNNEL *);
+NOEXPORT int mux_closing(MUX_TUNNEL *, int);
+NOEXPORT void mux_wake(MUX_TUNNEL *);
+NOEXPORT void mux_tunnel_release(SERVICE_OPTIONS *, MUX_TUNNEL *);
+#endif /* !defined(USE_FORK) */
+NOEXPORT int mux_loop(CLI *, MUX_TUNNEL *);
+NOEXPORT int mux_ssl_read(CLI *, MUX_TUNNEL *);
+NOEXPORT int mux_ssl_write(CLI *, MUX_TUNNEL *);
+NOEXPORT int mux_parse(CLI *, MUX_TUNNEL *);
+NOEXPORT int mux_frame(CLI *, MUX_TUNNEL *, int, uint32_t, uint8_t *, size_t);
+NOEXPORT void mux_hello(CLI *, MUX_TUNNEL *);
+NOEXPORT void mux_open(CLI *, MUX_TUNNEL *, uint32_t);
+NOEXPORT int mux_connect(CLI *, MUX_STREAM *);
+NOEXPORT void mux_connected(CLI *, MUX_TUNNEL *, MUX_STREAM *);
+NOEXPORT void mux_sock_read(MUX_TUNNEL *, MUX_STREAM *);
+NOEXPORT void mux_sock_write(CLI *, MUX_TUNNEL *, MUX_STREAM *,
+    uint8_t *, size_t);
+NOEXPORT void mux_sock_flush(CLI *, MUX_TUNNEL *, MUX_STREAM *);
+NOEXPORT ssize_t mux_sock_send(MUX_TUNNEL *, MUX_STREAM *,
+    const char *, size_t);
+NOEXPORT void mux_check(MUX_TUNNEL *, MUX_STREAM *);
+NOEXPORT MUX_STREAM *mux_stream_new(MUX_TUNNEL *, uint32_t, SOCKET);
+NOEXPORT MUX_STREAM *mux_stream_find(MUX_TUNNEL *, uint32_t);
+NOEXPORT void mux_stream_reset(MUX_TUNNEL *, MUX_STREAM *, char *);
+NOEXPORT void mux_stream_free(MUX_TUNNEL *, MUX_STREAM *);
+NOEXPORT void mux_streams_free(MUX_TUNNEL *);
+NOEXPORT uint8_t *mux_put(MUX_TUNNEL *, MUX_FRAME, uint32_t, size_t);
+NOEXPORT void mux_put_uint32(MUX_TUNNEL *, MUX_FRAME, uint32_t, uint32_t);
+NOEXPORT uint32_t mux_get_uint32(const uint8_t *);
+NOEXPORT void mux_set_uint32(uint8_t *, uint32_t);
+
+NOEXPORT char *mux_client(CLI *c, SERVICE_OPTIONS *opt, const PHASE phase) {
+#ifdef USE_FORK
+    (void)c; /* squash the unused parameter warning */
+    (void)opt; /* squash the unused parameter warning */
+    (void)phase; /* squash the unused parameter warning */
+    return "The 'mux' protocol is not supported in the client mode with FORK threading";
+#else /* USE_FORK */
+    switch(phase) {
+    case PROTOCOL_CHECK:
+        if(!opt->connect_addr.names || opt->exec_name)
+            return "The 'mux' protocol requires \"connect\" without \"exec\"";
+        if(opt->option.transparent_dst)
+            return "The 'mux' protocol is incompatible with \"transparent\"";
+#ifndef USE_WIN32
+        if(opt->option.transparent_src)
+            return "The 'mux' protocol is incompatible with \"transparent\"";
+#endif
+#ifdef MSSPISSL
+        if(opt->option.msspi)
+            return "The 'mux' protocol is not supported with msspi";
+#endif
+        break;
+    case PROTOCOL_EARLY:
+        mux_attach(c);
+        throw_exception(c, 2); /* the connection is served by a tunnel */
+    default:
+        break;
+    }
+    return NULL;
+#endif /* USE_FORK */
+}
+
+NOEXPORT char *mux_server(CLI *c, SERVICE_OPTIONS *opt, const PHASE phase) {
+    switch(phase) {
+    case PROTOCOL_CHECK:
+        if(opt->exec_name)
+            return "The 'mux' protocol is incompatible with \"exec\"";
+        if(opt->redirect_addr.names)
+            return "The 'mux' protocol is incompatible with \"redirect\"";
+        /* streams are connected by the tunnel, not by connect_remote() */
+        if(opt->option.local)
+            return "The 'mux' protocol is incompatible with \"local\"";
+#ifndef USE_WIN32
+        if(opt->option.transparent_src)
+            return "The 'mux' protocol is incompatible with \"transparent\"";
+#endif
+        if(opt->failover==FAILOVER_LEASTCONN || opt->failover==FAILOVER_P2C)
+            return "The 'mux' protocol requires \"failover = rr\" or \"prio\"";
+#ifdef MSSPISSL
+        if(opt->option.msspi)
+            return "The 'mux' protocol is not supported with msspi";
+#endif
+        break;
+    case PROTOCOL_MIDDLE:
+        mux_server_run(c); /* does not return */
+        break;
+    default:
+        break;
+    }
+    return NULL;
+}
+
+/* demultiplex the tunnel established by the client */
+NOEXPORT void mux_server_run(CLI *c) {
+    MUX_TUNNEL *t;
+    int err;
+
+    if(!addrlist_dup(&c->connect_addr, &c->opt->connect_addr)) {
+        s_log(LOG_ERR, "No remote host resolved");
+        throw_exception(c, 1);
+    }
+    t=str_alloc(sizeof(MUX_TUNNEL));
+    t->wake[0]=t->wake[1]=INVALID_SOCKET;
+    s_log(LOG_INFO, "Mux tunnel established");
+    err=mux_loop(c, t);
+    mux_streams_free(t);
+    str_free(t->in);
+    str_free(t->out);
+    str_free(t);
+    throw_exception(c, err ? 1 : 2); /* skip the regular data transfer */
+}
+
+#ifndef USE_FORK
+
+/* pass an accepted connection to a tunnel with a free stream slot */
+NOEXPORT void mux_attach(CLI *c) {
+    MUX_PENDING *pending;
+
+    if(c->local_rfd.fd!=c->local_wfd.fd || !c->local_rfd.is_socket) {
+        s_log(LOG_ERR, "The 'mux' protocol requires a local socket");
+        throw_exception(c, 1);
+    }
+    pending=str_alloc_detached(sizeof(MUX_PENDING));
+    pending->fd=c->local_rfd.fd;
+    if(mux_assign(c->opt, pending)) {
+        str_free(pending);
+        throw_exception(c, 1);
+    }
+    /* the socket is now owned by the tunnel */
+    c->local_rfd.fd=c->local_wfd.fd=INVALID_SOCKET;
+    c->flag.passed=1;
+}
+
+/* queue a connection on a tunnel, or start a new tunnel */
+NOEXPORT int mux_assign(SERVICE_OPTIONS *opt, MUX_PENDING *pending) {
+    MUX_TUNNEL *t, *best=NULL, *created=NULL;
+    CLI *tunnel_c;
+
+    pending->next=NULL;
+    CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_MUX]);
+    for(t=opt->mux_tunnels; t; t=t->next) /* the least loaded tunnel */
+        if(!t->closing && t->streams<t->limit &&
+                (!best || t->streams<best->streams))
+            best=t;
+    t=best;
+    if(!t) { /* all the tunnels are busy */
+        t=str_alloc_detached(sizeof(MUX_TUNNEL));
+#ifdef USE_WIN32
+        if(make_sockets(t->wake)) {
+#else
+        if(s_pipe(t->wake, 1, "mux")) {
+#endif
+            CRYPTO_THREAD_unlock(stunnel_locks[LOCK_MUX]);
+            str_free(t);
+            return 1;
+        }
+        t->limit=opt->mux_streams; /* until HELLO is received */
+        t->next=opt->mux_tunnels;
+        opt->mux_tunnels=t;
+        created=t;
+    }
+    if(t->pending)
+        t->pending_last->next=pending;
+    else
+        t->pending=pending;
+    t->pending_last=pending;
+    ++t->streams;
+    if(!created) /* t may be released as soon as LOCK_MUX is unlocked */
+        mux_wake(t);
+    CRYPTO_THREAD_unlock(stunnel_locks[LOCK_MUX]);
+
+    if(!created)
+        return 0;
+    s_log(LOG_INFO, "Starting a new mux tunnel");
+    service_up_ref(opt);
+    tunnel_c=alloc_client_session(opt, INVALID_SOCKET, INVALID_SOCKET);
+    tunnel_c->mux=created;
+    if(create_client(INVALID_SOCKET, INVALID_SOCKET, tunnel_c)) {
+        s_log(LOG_ERR, "Failed to start a mux tunnel");
+        mux_tunnel_release(opt, created); /* closes the queued socket */
+        service_free(opt);
+    }
+    return 0;
+}
+
+/* apply the limit of the peer, moving the excess connections elsewhere */
+NOEXPORT void mux_limit(SERVICE_OPTIONS *opt, MUX_TUNNEL *t, unsigned limit) {
+    MUX_PENDING *pending, *moved=NULL;
+    unsigned keep;
+
+    CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_MUX]);
+    if(limit<t->limit)
+        t->limit=limit;
+    if(t->streams>t->limit) { /* detach the newest pending connections */
+        keep=t->limit>t->num ? t->limit-t->num : 0;
+        if(!keep) {
+            moved=t->pending;
+            t->pending=NULL;
+        } else {
+            for(pending=t->pending; pending && --keep; pending=pending->next)
+                ;
+            if(pending) {
+                moved=pending->next;
+                pending->next=NULL;
+                t->pending_last=pending;
+            }
+        }
+        for(pending=moved; pending; pending=pending->next)
+            --t->streams;
+    }
+    CRYPTO_THREAD_unlock(stunnel_locks[LOCK_MUX]);
+    while(moved) {
+        pending=moved;
+        moved=pending->next;
+        if(mux_assign(opt, pending)) {
+            closesocket(pending->fd);
+            str_free(pending);
+        }
+    }
+}
+
+/* serve a tunnel in a dedicated client thread */
+void mux_tunnel(CLI *c) {
+    MUX_TUNNEL *t=c->mux;
+    s_log(LOG_INFO, "Mux tunnel established");
+    mux_hello(c, t);
+    mux_loop(c, t);
+    mux_closing(t, 1);
+    mux_streams_free(t);
+}
+
+/* release the tunnel when its thread is finished */
+void mux_tunnel_free(CLI *c) {
+    if(!c->mux)
+        return;
+    mux_tunnel_release(c->opt, c->mux);
+    c->mux=NULL;
+}
+
+/* called by the main thread on configuration reload */
+void mux_stop(SERVICE_OPTIONS *opt) {
+    MUX_TUNNEL *t;
+
+    CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_MUX]);
+    for(t=opt->mux_tunnels; t; t=t->next) {
+        t->closing=1;
+        mux_wake(t);
+    }
+    CRYPTO_THREAD_unlock(stunnel_locks[LOCK_MUX]);
+}
+
+void mux_info(void) {
+    SERVICE_OPTIONS *opt;
+    MUX_TUNNEL *t;
+    unsigned tunnels, streams;
+
+    CRYPTO_THREAD_read_lock(stunnel_locks[LOCK_SECTIONS]);
+    for(opt=service_options.next; opt; opt=opt->next) {
+        if(!opt->mux_tunnels)
+            continue;
+        tunnels=streams=0;
+        CRYPTO_THREAD_read_lock(stunnel_locks[LOCK_MUX]);
+        for(t=opt->mux_tunnels; t; t=t->next) {
+            ++tunnels;
+            streams+=t->streams;
+        }
+        CRYPTO_THREAD_unlock(stunnel_locks[LOCK_MUX]);
+        s_log(LOG_NOTICE, "Service [%s] mux: %u tunnel(s), %u stream(s)",
+            opt->servname, tunnels, streams);
+    }
+    CRYPTO_THREAD_unlock(stunnel_locks[LOCK_SECTIONS]);
+}
+
+/* open the streams of the connections attached by other threads */
+NOEXPORT void mux_open_pending(MUX_TUNNEL *t) {
+    MUX_PENDING *pending;
+    MUX_STREAM *s;
+
+    for(;;) {
+        /* before HELLO only a single stream is opened, as the limit of
+         * the peer is not known yet; the others wait for a free slot */
+        pending=NULL;
+        CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_MUX]);
+        if(t->pending && t->num<t->limit && (t->hello || !t->num)) {
+            pending=t->pending;
+            t->pending=pending->next;
+        }
+        CRYPTO_THREAD_unlock(stunnel_locks[LOCK_MUX]);
+        if(!pending)
+            break;
+        do { /* skip 0 and the ids still in use after a wraparound */
+            ++t->next_id;
+        } while(!t->next_id || mux_stream_find(t, t->next_id));
+        s=mux_stream_new(t, t->next_id, pending->fd);
+        str_free(pending);
+        mux_put(t, MUX_OPEN, s->id, 0);
+        s_log(LOG_DEBUG, "Mux stream %lu opened (FD=%ld)",
+            (unsigned long)s->id, (long)s->fd);
+    }
+}
+
+/* check (and optionally set) the end of the client-side tunnel */
+NOEXPORT int mux_closing(MUX_TUNNEL *t, int force) {
+    int done;
+
+    CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_MUX]);
+    if(force)
+        t->closing=1;
+    done=t->closing && (force || !t->streams);
+    CRYPTO_THREAD_unlock(stunnel_locks[LOCK_MUX]);
+    return done;
+}
+
+#ifdef __GNUC__
+#if __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 6) || defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-result"
+#endif /* __GNUC__>=4.6 */
+#endif /* __GNUC__ */
+NOEXPORT void mux_wake(MUX_TUNNEL *t) {
+    /* a full pipe already has a pending wakeup */
+    writesocket(t->wake[1], "", 1);
+}
+#ifdef __GNUC__
+#if __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 6)
+#pragma GCC diagnostic pop
+#endif /* __GNUC__>=4.6 */
+#endif /* __GNUC__ */
+
+NOEXPORT void mux_tunnel_release(SERVICE_OPTIONS *opt, MUX_TUNNEL *t) {
+    MUX_TUNNEL **ptr;
+    MUX_PENDING *pending;
+
+    CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_MUX]);
+    for(ptr=&opt->mux_tunnels; *ptr && *ptr!=t; ptr=&(*ptr)->next)
+        ;
+    if(*ptr)
+        *ptr=t->next;
+    pending=t->pending;
+    t->pending=NULL;
+    CRYPTO_THREAD_unlock(stunnel_locks[LOCK_MUX]);
+    while(pending) { /* never opened */
+        MUX_PENDING *next=pending->next;
+        closesocket(pending->fd);
+        str_free(pending);
+        pending=next;
+    }
+    mux_streams_free(t);
+    closesocket(t->wake[0]);
+    closesocket(t->wake[1]);
+    str_free(t->in);
+    str_free(t->out);
+    str_free(t);
+}
+
+#endif /* !defined(USE_FORK) */
+
+/* returns 0 when the tunnel was closed, or 1 on error */
+NOEXPORT int mux_loop(CLI *c, MUX_TUNNEL *t) {
+    MUX_STREAM *s, *next;
+    int ssl_ready=1, timeout, idle, num;
+    time_t now;
+    char dummy[64];
+
+    t->in=str_alloc(MUX_IN_SIZE);
+    for(;;) {
+        /****************************** process TLS data */
+        if(ssl_ready && t->out_len<MUX_OUT_MAX && mux_ssl_read(c, t))
+            return 1;
+        if(t->out_len && mux_ssl_write(c, t))
+            return 1;
+#ifndef USE_FORK
+        if(t->wake[0]!=INVALID_SOCKET && mux_closing(t, 0)) {
+            s_log(LOG_INFO, "Mux tunnel closed");
+            return 0;
+        }
+        if(t->wake[0]!=INVALID_SOCKET)
+            mux_open_pending(t);
+#endif /* !defined(USE_FORK) */
+
+        /****************************** setup c->fds structure */
+        s_poll_init(c->fds, 0);
+        if(t->wake[0]!=INVALID_SOCKET)
+            s_poll_add(c->fds, t->wake[0], 1, 0);
+        s_poll_add(c->fds, c->ssl_rfd->fd,
+            (t->out_len<MUX_OUT_MAX && !t->read_wants_write) ||
+            t->write_wants_read, 0);
+        s_poll_add(c->fds, c->ssl_wfd->fd, 0,
+            (t->out_len && !t->write_wants_read) || t->read_wants_write);
+        timeout=c->opt->timeout_idle;
+        idle=1;
+        now=time(NULL);
+        for(s=t->head; s; s=s->next) {
+            if(s->connecting) {
+                s_poll_add(c->fds, s->fd, 0, 1);
+                if(s->deadline-now<timeout) {
+                    timeout=s->deadline>now ? (int)(s->deadline-now) : 0;
+                    idle=0;
+                }
+            } else if((s->sock_open_rd && s->send_window &&
+                    t->out_len<MUX_OUT_HIGH) || s->buff_len) {
+                /* no events are awaited on half-closed sockets */
+                s_poll_add(c->fds, s->fd,
+                    s->sock_open_rd && s->send_window &&
+                        t->out_len<MUX_OUT_HIGH,
+                    s->buff_len>0);
+            }
+        }
+        if(t->out_len<MUX_OUT_MAX && SSL_pending(c->ssl)) {
+            timeout=0; /* process any buffered data without delay */
+            idle=0;
+        }
+
+        /****************************** wait for an event */
+        num=s_poll_wait(c->fds, timeout, 0);
+        if(num<0) {
+            sockerror("mux_loop: s_poll_wait");
+            return 1;
+        }
+        if(!num && idle) {
+#ifndef USE_FORK
+            /* keep the tunnel if a new connection was just attached */
+            if(t->wake[0]!=INVALID_SOCKET && !t->num) {
+                CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_MUX]);
+                if(!t->streams)
+                    t->closing=1;
+                CRYPTO_THREAD_unlock(stunnel_locks[LOCK_MUX]);
+                continue;
+            }
+#endif /* !defined(USE_FORK) */
+            s_log(LOG_INFO, "Mux tunnel closed: TIMEOUTidle exceeded");
+            return 0;
+        }
+
+        /****************************** process the events */
+#ifndef USE_FORK
+        if(t->wake[0]!=INVALID_SOCKET && s_poll_canread(c->fds, t->wake[0])) {
+            while(readsocket(t->wake[0], dummy, sizeof dummy)>0)
+                ;
+        }
+#else /* USE_FORK */
+        (void)dummy; /* squash the unused variable warning */
+#endif /* USE_FORK */
+        ssl_ready=SSL_pending(c->ssl) ||
+            s_poll_canread(c->fds, c->ssl_rfd->fd) ||
+            s_poll_hup(c->fds, c->ssl_rfd->fd) ||
+            (t->read_wants_write && s_poll_canwrite(c->fds, c->ssl_wfd->fd));
+        now=time(NULL);
+        for(s=t->head; s; s=next) {
+            next=s->next; /* s may be released */
+            if(s->connecting) {
+                if(s_poll_canwrite(c->fds, s->fd)) {
+                    mux_connected(c, t, s);
+                } else if(now>=s->deadline) {
+                    s_log(LOG_ERR, "Mux stream %lu: TIMEOUTconnect exceeded",
+                        (unsigned long)s->id);
+                    closesocket(s->fd);
+                    s->fd=INVALID_SOCKET;
+                    ++s->attempts;
+                    if(mux_connect(c, s))
+                        mux_stream_reset(t, s, "connect failed");
+                }
+                continue;
+            }
+            if(s->buff_len && (s_poll_canwrite(c->fds, s->fd) ||
+                    s_poll_hup(c->fds, s->fd)))
+                mux_sock_flush(c, t, s);
+            else if(s->sock_open_rd && (s_poll_canread(c->fds, s->fd) ||
+                    s_poll_rdhup(c->fds, s->fd)))
+                mux_sock_read(t, s);
+        }
+    }
+}
+
+/* read and process the frames received over TLS */
+NOEXPORT int mux_ssl_read(CLI *c, MUX_TUNNEL *t) {
+    int num, err;
+
+    t->read_wants_write=0;
+    while(t->out_len<MUX_OUT_MAX) { /* the peer is not reading */
+        num=SSL_read(c->ssl, t->in+t->in_len, (int)(MUX_IN_SIZE-t->in_len));
+        err=SSL_get_error(c->ssl, num);
+        switch(err) {
+        case SSL_ERROR_NONE:
+            t->in_len+=(size_t)num;
+            if(mux_parse(c, t))
+                return 1;
+            break;
+        case SSL_ERROR_WANT_WRITE:
+            t->read_wants_write=1;
+            return 0;
+        case SSL_ERROR_WANT_READ: /* happens quite often */
+        case SSL_ERROR_WANT_X509_LOOKUP:
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            if(num)
+                sockerror("mux_ssl_read: SSL_read");
+            else
+                s_log(LOG_INFO, "TLS socket closed (SSL_read)");
+            return 1;
+        case SSL_ERROR_ZERO_RETURN: /* close_notify alert received */
+            s_log(LOG_INFO, "TLS closed (SSL_read)");
+            return 1;
+        case SSL_ERROR_SSL:
+            sslerror("SSL_read");
+            return 1;
+        default:
+            s_log(LOG_ERR, "SSL_read/SSL_get_error returned %d", err);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* send the queued frames over TLS */
+NOEXPORT int mux_ssl_write(CLI *c, MUX_TUNNEL *t) {
+    int num, err;
+
+    t->write_wants_read=0;
+    while(t->out_len) {
+        /* retries use the same data and a length that is not shorter */
+        num=SSL_write(c->ssl, t->out+t->out_pos,
+            (int)(t->out_len<MUX_WRITE_MAX ? t->out_len : MUX_WRITE_MAX));
+        err=SSL_get_error(c->ssl, num);
+        switch(err) {
+        case SSL_ERROR_NONE:
+            t->out_pos+=(size_t)num;
+            t->out_len-=(size_t)num;
+            c->ssl_bytes+=(uint64_t)num;
+            break;
+        case SSL_ERROR_WANT_WRITE:
+        case SSL_ERROR_WANT_X509_LOOKUP:
+            return 0;
+        case SSL_ERROR_WANT_READ:
+            t->write_wants_read=1;
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            if(num)
+                sockerror("mux_ssl_write: SSL_write");
+            else
+                s_log(LOG_INFO, "TLS socket closed (SSL_write)");
+            return 1;
+        case SSL_ERROR_ZERO_RETURN: /* close_notify alert received */
+            s_log(LOG_INFO, "TLS closed (SSL_write)");
+            return 1;
+        case SSL_ERROR_SSL:
+            sslerror("SSL_write");
+            return 1;
+        default:
+            s_log(LOG_ERR, "SSL_write/SSL_get_error returned %d", err);
+            return 1;
+        }
+    }
+    t->out_pos=0;
+    return 0;
+}
+
+/* process the complete frames */
+NOEXPORT int mux_parse(CLI *c, MUX_TUNNEL *t) {
+    uint8_t *frame;
+    size_t pos=0, len;
+
+    while(t->in_len-pos>=MUX_HEADER) {
+        frame=(uint8_t *)t->in+pos;
+        len=(size_t)frame[2]<<8|frame[3];
+        if(len>MUX_FRAME_MAX) {
+            s_log(LOG_ERR, "Mux protocol error: Frame too long");
+            return 1;
+        }
+        if(t->in_len-pos<MUX_HEADER+len)
+            break; /* incomplete frame */
+        if(mux_frame(c, t, frame[0], mux_get_uint32(frame+4),
+                frame+MUX_HEADER, len))
+            return 1;
+        pos+=MUX_HEADER+len;
+    }
+    t->in_len-=pos;
+    memmove(t->in, t->in+pos, t->in_len);
+    return 0;
+}
+
+NOEXPORT int mux_frame(CLI *c, MUX_TUNNEL *t,
+        int type, uint32_t id, uint8_t *data, size_t len) {
+    MUX_STREAM *s;
+    uint32_t num;
+
+    if(!t->hello) {
+        if(type!=MUX_HELLO || len<8) {
+            s_log(LOG_ERR, "Mux protocol error: HELLO expected");
+            return 1;
+        }
+        num=mux_get_uint32(data);
+        if(num!=MUX_VERSION) {
+            s_log(LOG_ERR, "Unsupported mux protocol version %lu",
+                (unsigned long)num);
+            return 1;
+        }
+        t->hello=1;
+        num=mux_get_uint32(data+4); /* muxStreams of the peer */
+        if(!num) {
+            s_log(LOG_ERR, "Mux protocol error: no streams allowed");
+            return 1;
+        }
+        s_log(LOG_DEBUG, "Mux peer accepts %lu stream(s)", (unsigned long)num);
+#ifndef USE_FORK
+        if(t->wake[0]!=INVALID_SOCKET)
+            mux_limit(c->opt, t, num);
+#endif /* !defined(USE_FORK) */
+        if(!c->opt->option.client) /* reply to the client */
+            mux_hello(c, t);
+        return 0;
+    }
+    if(type==MUX_OPEN) {
+        if(c->opt->option.client || !id || mux_stream_find(t, id)) {
+            s_log(LOG_ERR, "Mux protocol error: Invalid OPEN");
+            return 1;
+        }
+        if(t->num>=c->opt->mux_streams) {
+            s_log(LOG_ERR, "Mux stream %lu rejected: muxStreams exceeded",
+                (unsigned long)id);
+            mux_put(t, MUX_RESET, id, 0);
+            return 0;
+        }
+        mux_open(c, t, id);
+        return 0;
+    }
+    s=mux_stream_find(t, id);
+    switch(type) {
+    case MUX_DATA:
+        if(!s) /* already closed or reset */
+            return 0;
+        if(!s->peer_open || len>s->recv_window) {
+            s_log(LOG_ERR, "Mux protocol error: Unexpected DATA");
+            return 1;
+        }
+        s->recv_window-=(uint32_t)len;
+        mux_sock_write(c, t, s, data, len);
+        return 0;
+    case MUX_UPDATE:
+        if(len!=4) {
+            s_log(LOG_ERR, "Mux protocol error: Invalid WINDOW");
+            return 1;
+        }
+        num=mux_get_uint32(data);
+        if(!s)
+            return 0;
+        if(num>MUX_WINDOW-s->send_window) {
+            s_log(LOG_ERR, "Mux protocol error: Window overflow");
+            return 1;
+        }
+        s->send_window+=num;
+        return 0;
+    case MUX_CLOSE:
+        if(!s)
+            return 0;
+        s->peer_open=0;
+        mux_check(t, s);
+        return 0;
+    case MUX_RESET:
+        if(!s)
+            return 0;
+        s_log(LOG_INFO, "Mux stream %lu reset by peer", (unsigned long)id);
+        mux_stream_free(t, s);
+        return 0;
+    default: /* reserved for future extensions */
+        s_log(LOG_DEBUG, "Mux frame type %d ignored", type);
+        return 0;
+    }
+}
+
+/* announce the protocol version and the local muxStreams */
+NOEXPORT void mux_hello(CLI *c, MUX_TUNNEL *t) {
+    uint8_t *hello;
+
+    hello=mux_put(t, MUX_HELLO, 0, 8);
+    mux_set_uint32(hello, MUX_VERSION);
+    mux_set_uint32(hello+4, c->opt->mux_streams);
+}
+
+/* open a stream requested by the client */
+NOEXPORT void mux_open(CLI *c, MUX_TUNNEL *t, uint32_t id) {
+    MUX_STREAM *s;
+
+    s=mux_stream_new(t, id, INVALID_SOCKET);
+    if(mux_connect(c, s))
+        mux_stream_reset(t, s, "connect failed");
+}
+
+/* start a non-blocking connect() to the next target */
+NOEXPORT int mux_connect(CLI *c, MUX_STREAM *s) {
+    SOCKADDR_UNION *addr;
+    int err;
+
+    for(; s->attempts<c->connect_addr.num; ++s->attempts) {
+        if(c->opt->failover==FAILOVER_PRIO)
+            addr=c->connect_addr.addr+s->attempts;
+        else
+            addr=c->connect_addr.addr+
+                (c->connect_addr.start+c->rr+s->id+s->attempts)%
+                c->connect_addr.num;
+        s->fd=s_socket(addr->sa.sa_family, SOCK_STREAM, 0, 1, "remote socket");
+        if(s->fd==INVALID_SOCKET)
+            continue;
+        if(socket_options_set(c->opt, s->fd, 2))
+            s_log(LOG_WARNING, "Failed to set remote socket options");
+        s->connecting=1;
+        s->deadline=time(NULL)+c->opt->timeout_connect;
+        if(!connect(s->fd, &addr->sa, addr_len(addr)))
+            return 0; /* writable once connected */
+        err=get_last_socket_error();
+        if(err==S_EINPROGRESS || err==S_EWOULDBLOCK)
+            return 0;
+        s_log(LOG_ERR, "Mux stream %lu: connect: %s (%d)",
+            (unsigned long)s->id, s_strerror(err), err);
+        closesocket(s->fd);
+        s->fd=INVALID_SOCKET;
+    }
+    s->connecting=0;
+    return 1;
+}
+
+/* a non-blocking connect() has finished */
+NOEXPORT void mux_connected(CLI *c, MUX_TUNNEL *t, MUX_STREAM *s) {
+    int err=get_socket_error(s->fd);
+
+    if(err) {
+        s_log(LOG_ERR, "Mux stream %lu: connect: %s (%d)",
+            (unsigned long)s->id, s_strerror(err), err);
+        closesocket(s->fd);
+        s->fd=INVALID_SOCKET;
+        ++s->attempts;
+        if(mux_connect(c, s))
+            mux_stream_reset(t, s, "connect failed");
+        return;
+    }
+    s->connecting=0;
+    s_log(LOG_DEBUG, "Mux stream %lu connected (FD=%ld)",
+        (unsigned long)s->id, (long)s->fd);
+    mux_sock_flush(c, t, s); /* the data received while connecting */
+}
+
+/* read socket data into a DATA frame */
+NOEXPORT void mux_sock_read(MUX_TUNNEL *t, MUX_STREAM *s) {
+    uint8_t *data;
+    size_t len;
+    ssize_t num;
+
+    if(!s->send_window) /* only an error could have been reported */
+        return;
+    len=s->send_window<MUX_FRAME_MAX ? s->send_window : MUX_FRAME_MAX;
+    data=mux_put(t, MUX_DATA, s->id, len);
+    num=readsocket(s->fd, (char *)data, len);
+    if(num>0) {
+        data[-6]=(uint8_t)(num>>8); /* update the payload length */
+        data[-5]=(uint8_t)num;
+        t->out_len-=len-(size_t)num;
+        s->send_window-=(uint32_t)num;
+        return;
+    }
+    t->out_len-=MUX_HEADER+len; /* nothing to send */
+    if(!num) { /* EOF */
+        s->sock_open_rd=0;
+        mux_put(t, MUX_CLOSE, s->id, 0);
+        mux_check(t, s);
+        return;
+    }
+    switch(get_last_socket_error()) {
+    case S_EINTR:
+    case S_EWOULDBLOCK:
+#if S_EAGAIN!=S_EWOULDBLOCK
+    case S_EAGAIN:
+#endif
+        return;
+    default:
+        mux_stream_reset(t, s, "socket read failed");
+    }
+}
+
+/* write DATA to the socket, and buffer the rest */
+NOEXPORT void mux_sock_write(CLI *c, MUX_TUNNEL *t, MUX_STREAM *s,
+        uint8_t *data, size_t len) {
+    ssize_t num=0;
+
+    if(!s->connecting && !s->buff_len) { /* most writes complete at once */
+        num=mux_sock_send(t, s, (char *)data, len);
+        if(num<0) /* the stream was reset */
+            return;
+        s->credit+=(uint32_t)num;
+        c->sock_bytes+=(uint64_t)num;
+    }
+    if((size_t)num<len) {
+        if(!s->buff)
+            s->buff=str_alloc(MUX_WINDOW);
+        if(s->buff_pos+s->buff_len+len-(size_t)num>MUX_WINDOW) {
+            memmove(s->buff, s->buff+s->buff_pos, s->buff_len);
+            s->buff_pos=0;
+        }
+        memcpy(s->buff+s->buff_pos+s->buff_len, data+num, len-(size_t)num);
+        s->buff_len+=len-(size_t)num;
+    }
+    if(s->credit>=MUX_WINDOW/4) { /* replenish the window of the peer */
+        mux_put_uint32(t, MUX_UPDATE, s->id, s->credit);
+        s->recv_window+=s->credit;
+        s->credit=0;
+    }
+}
+
+/* write the buffered data to the socket */
+NOEXPORT void mux_sock_flush(CLI *c, MUX_TUNNEL *t, MUX_STREAM *s) {
+    ssize_t num;
+
+    if(s->buff_len) {
+        num=mux_sock_send(t, s, s->buff+s->buff_pos, s->buff_len);
+        if(num<0) /* the stream was reset */
+            return;
+        s->buff_pos+=(size_t)num;
+        s->buff_len-=(size_t)num;
+        s->credit+=(uint32_t)num;
+        c->sock_bytes+=(uint64_t)num;
+    }
+    if(!s->buff_len && s->buff) { /* release the memory of idle streams */
+        str_free(s->buff);
+        s->buff=NULL;
+        s->buff_pos=0;
+    }
+    if(s->credit>=MUX_WINDOW/4) { /* replenish the window of the peer */
+        mux_put_uint32(t, MUX_UPDATE, s->id, s->credit);
+        s->recv_window+=s->credit;
+        s->credit=0;
+    }
+    mux_check(t, s);
+}
+
+/* returns the number of bytes written, or -1 if the stream was reset */
+NOEXPORT ssize_t mux_sock_send(MUX_TUNNEL *t, MUX_STREAM *s,
+        const char *data, size_t len) {
+    ssize_t num;
+
+    for(;;) {
+        num=writesocket(s->fd, data, len);
+        if(num>=0)
+            return num;
+        switch(get_last_socket_error()) {
+        case S_EINTR:
+            break; /* retry */
+        case S_EWOULDBLOCK:
+#if S_EAGAIN!=S_EWOULDBLOCK
+        case S_EAGAIN:
+#endif
+            return 0;
+        default:
+            mux_stream_reset(t, s, "socket write failed");
+            return -1;
+        }
+    }
+}
+
+/* complete the shutdown of a stream */
+NOEXPORT void mux_check(MUX_TUNNEL *t, MUX_STREAM *s) {
+    if(s->connecting || s->buff_len)
+        return; /* mux_sock_flush() will check again */
+    if(!s->peer_open && s->sock_open_wr) { /* propagate CLOSE */
+        shutdown(s->fd, SHUT_WR);
+        s->sock_open_wr=0;
+    }
+    if(!s->sock_open_rd && !s->sock_open_wr) {
+        s_log(LOG_DEBUG, "Mux stream %lu closed", (unsigned long)s->id);
+        mux_stream_free(t, s);
+    }
+}
+
+NOEXPORT MUX_STREAM *mux_stream_new(MUX_TUNNEL *t, uint32_t id, SOCKET fd) {
+    MUX_STREAM *s;
+
+    s=str_alloc(sizeof(MUX_STREAM));
+    s->id=id;
+    s->fd=fd;
+    s->sock_open_rd=s->sock_open_wr=s->peer_open=1;
+    s->send_window=s->recv_window=MUX_WINDOW;
+    s->next=t->head;
+    if(t->head)
+        t->head->prev=s;
+    t->head=s;
+    s->hash_next=t->hash[id%MUX_HASH];
+    t->hash[id%MUX_HASH]=s;
+    ++t->num;
+    return s;
+}
+
+NOEXPORT MUX_STREAM *mux_stream_find(MUX_TUNNEL *t, uint32_t id) {
+    MUX_STREAM *s;
+
+    for(s=t->hash[id%MUX_HASH]; s && s->id!=id; s=s->hash_next)
+        ;
+    return s;
+}
+
+/* abort the stream and notify the peer */
+NOEXPORT void mux_stream_reset(MUX_TUNNEL *t, MUX_STREAM *s, char *reason) {
+    s_log(LOG_INFO, "Mux stream %lu reset: %s", (unsigned long)s->id, reason);
+    mux_put(t, MUX_RESET, s->id, 0);
+    mux_stream_free(t, s);
+}
+
+NOEXPORT void mux_stream_free(MUX_TUNNEL *t, MUX_STREAM *s) {
+    MUX_STREAM **ptr;
+
+    if(s->prev)
+        s->prev->next=s->next;
+    else
+        t->head=s->next;
+    if(s->next)
+        s->next->prev=s->prev;
+    for(ptr=&t->hash[s->id%MUX_HASH]; *ptr!=s; ptr=&(*ptr)->hash_next)
+        ;
+    *ptr=s->hash_next;
+    --t->num;
+#ifndef USE_FORK
+    if(t->wake[0]!=INVALID_SOCKET) {
+        CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_MUX]);
+        --t->streams;
+        CRYPTO_THREAD_unlock(stunnel_locks[LOCK_MUX]);
+    }
+#endif /* !defined(USE_FORK) */
+    if(s->fd!=INVALID_SOCKET)
+        closesocket(s->fd);
+    str_free(s->buff);
+    str_free(s);
+}
+
+NOEXPORT void mux_streams_free(MUX_TUNNEL *t) {
+    while(t->head)
+        mux_stream_free(t, t->head);
+}
+
+/* append a frame, and return the pointer to its payload */
+NOEXPORT uint8_t *mux_put(MUX_TUNNEL *t, MUX_FRAME type, uint32_t id,
+        size_t len) {
+    uint8_t *frame;
+
+    if(t->out_pos+t->out_len+MUX_HEADER+len>t->out_size) {
+        memmove(t->out, t->out+t->out_pos, t->out_len);
+        t->out_pos=0;
+        if(t->out_len+MUX_HEADER+len>t->out_size) {
+            t->out_size=2*(t->out_len+MUX_HEADER+len);
+            if(t->out_size<MUX_OUT_HIGH)
+                t->out_size=MUX_OUT_HIGH;
+            t->out=str_realloc(t->out, t->out_size);
+        }
+    }
+    frame=(uint8_t *)t->out+t->out_pos+t->out_len;
+    frame[0]=(uint8_t)type;
+    frame[1]=0; /* flags */
+    frame[2]=(uint8_t)(len>>8);
+    frame[3]=(uint8_t)len;
+    mux_set_uint32(frame+4, id);
+    t->out_len+=MUX_HEADER+len;
+    return frame+MUX_HEADER;
+}
+
+NOEXPORT void mux_put_uint32(MUX_TUNNEL *t, MUX_FRAME type, uint32_t id,
+        uint32_t value) {
+    mux_set_uint32(mux_put(t, type, id, 4), value);
+}
+
+NOEXPORT uint32_t mux_get_uint32(const uint8_t *ptr) {
+    return (uint32_t)ptr[0]<<24|(uint32_t)ptr[1]<<16|
+        (uint32_t)ptr[2]<<8|(uint32_t)ptr[3];
+}
+
+NOEXPORT void mux_set_uint32(uint8_t *ptr, uint32_t value) {
+    ptr[0]=(uint8_t)(value>>24);
+    ptr[1]=(uint8_t)(value>>16);
+    ptr[2]=(uint8_t)(value>>8);
+    ptr[3]=(uint8_t)value;
+}
+
 /* end of protocol.c */
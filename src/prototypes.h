@@ -154,6 +154,37 @@ typedef struct {
     char *output_file;
     FILE_MODE log_file_mode;
 
+        /* built-in sessiond server for sessiond.c */
+#ifdef USE_SESSIOND_SERVER
+    SOCKADDR_UNION sessiond_server_addr;            /* UDP listening address */
+    size_t sessiond_memory;                    /* session cache memory limit */
+    unsigned sessiond_threads;                /* server threads, 0 for auto */
+#endif /* USE_SESSIOND_SERVER */
+
+        /* accepting new connections in stunnel.c */
+    unsigned accept_batch;                /* connections accepted per wakeup */
+#ifdef USE_ACCEPT_THREADS
+    unsigned accept_threads;                 /* listeners per accept address */
+#endif /* USE_ACCEPT_THREADS */
+
+        /* DNS cache for resolver.c */
+#ifndef USE_FORK
+    int dns_cache_timeout;                 /* lifetime of resolved addresses */
+    int dns_negative_timeout;                  /* lifetime of failed lookups */
+#endif /* !defined(USE_FORK) */
+
+        /* UCONTEXT schedulers for sthreads.c */
+#ifdef USE_SCHEDULERS
+    unsigned scheduler_threads;          /* OS threads running client contexts */
+#endif /* USE_SCHEDULERS */
+
+        /* client thread pool for sthreads.c */
+#ifdef USE_PTHREAD
+    unsigned thread_pool_min;                 /* pre-started worker threads */
+    unsigned thread_pool_max;          /* retained worker threads, 0=no pool */
+    int thread_pool_idle;                 /* idle worker lifetime in seconds */
+#endif /* USE_PTHREAD */
+
         /* user interface configuration */
 #ifdef ICON_IMAGE
     ICON_IMAGE icon[ICON_NONE];                  /* user-specified GUI icons */
@@ -169,6 +200,16 @@ typedef struct {
         unsigned log_stderr:1;
         unsigned log_syslog:1;
 #endif
+#ifdef USE_ACCEPT_THREADS
+        unsigned accept_cpu:1;                   /* SO_INCOMING_CPU steering */
+#endif
+#ifdef USE_SESSIOND_SERVER
+        unsigned sessiond_server:1;              /* built-in sessiond server */
+#endif
+#ifdef USE_LOG_ASYNC
+        unsigned log_async:1;             /* write logs in a separate thread */
+        unsigned log_drop:1;               /* drop records on queue overflow */
+#endif
 #ifdef USE_FIPS
         unsigned fips:1;                           /* enable FIPS 140-2 mode */
 #endif
@@ -201,12 +242,44 @@ typedef struct ticket_key_struct {
 } TICKET_KEY;
 #endif /* OpenSSL 1.0.0 or later */
 
+/* sessiond protocol */
+#define CACHE_CMD_NEW     0x00
+#define CACHE_CMD_GET     0x01
+#define CACHE_CMD_REMOVE  0x02
+#define CACHE_RESP_ERR    0x80
+#define CACHE_RESP_OK     0x81
+#define MAX_VAL_LEN 512
+typedef struct {
+    u_char version, type;
+    u_short timeout;
+    u_char key[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    u_char val[MAX_VAL_LEN];
+} CACHE_PACKET;
+
+typedef struct sessiond_channel_struct { /* persistent sessiond sockets */
+    struct sessiond_channel_struct *next;
+    SOCKET *fd;                         /* a connected socket for each replica */
+    unsigned num;                                  /* the number of replicas */
+} SESSIOND_CHANNEL;
+
+#ifndef USE_FORK
+typedef struct connect_cost_struct { /* latency of a "connect" target */
+    double connect_ms, handshake_ms;         /* moving averages (EWMA) */
+    int64_t connect_time, handshake_time;  /* last update, 0 for never */
+} CONNECT_COST;
+#endif /* !defined(USE_FORK) */
+
 typedef struct service_options_struct {
     struct service_options_struct *next;   /* next node in the services list */
     SSL_CTX *ctx;                                            /*  TLS context */
     char *servname;        /* service name for logging & permission checking */
     int ref;                   /* reference counter for delayed deallocation */
 
+        /* service-specific data for options.c */
+    NAME_LIST *config_lines;     /* configuration lines to detect changes */
+    char *file_stamps;        /* status of the files loaded into the context */
+    struct service_options_struct *running; /* unchanged section to be kept */
+
         /* service-specific data for stunnel.c */
 #ifndef USE_WIN32
     uid_t uid;
@@ -251,6 +324,7 @@ typedef struct service_options_struct {
     char *pin;                                     /* pin-code for msspi key */
 #endif
     long session_size, session_timeout;
+    unsigned sessions_migrated;            /* sessions preserved by reloads */
     long unsigned ssl_options_set;
 #if OPENSSL_VERSION_NUMBER>=0x009080dfL
     long unsigned ssl_options_clear;
@@ -260,7 +334,15 @@ typedef struct service_options_struct {
 #else /* OPENSSL_VERSION_NUMBER<0x10100000L */
     SSL_METHOD *client_method, *server_method;
 #endif /* OPENSSL_VERSION_NUMBER<0x10100000L */
-    SOCKADDR_UNION sessiond_addr;
+    SOCKADDR_UNION *sessiond_addr;                      /* sessiond replicas */
+    unsigned sessiond_num;                /* the number of sessiond replicas */
+    SESSIOND_CHANNEL *sessiond_pool;               /* idle sessiond channels */
+    unsigned sessiond_idle;                   /* the number of idle channels */
+    unsigned long long sessiond_hits, sessiond_misses, sessiond_timeouts;
+#ifdef USE_SHM_CACHE
+    char *session_cache_file;          /* shared memory session cache file */
+    struct shm_cache_struct *shm_cache;    /* the mapped session cache file */
+#endif /* USE_SHM_CACHE */
 #ifndef OPENSSL_NO_TLSEXT
     char *sni;
     SERVERNAME_LIST *servername_list_head, *servername_list_tail;
@@ -291,14 +373,35 @@ typedef struct service_options_struct {
     SOCKADDR_UNION source_addr;
     SOCKADDR_LIST local_addr, connect_addr, redirect_addr;
     SOCKET *local_fd;                 /* array of accepting file descriptors */
+#ifdef USE_ACCEPT_THREADS
+    SOCKET *shard_fd;                         /* listeners of accept threads */
+#endif
     SSL_SESSION **connect_session;   /* per-destination client session cache */
+#ifndef USE_FORK
+    int *connect_active;          /* per-destination active connections */
+    CONNECT_COST *connect_cost;            /* per-destination latency */
+#endif /* !defined(USE_FORK) */
     SSL_SESSION *session;    /* previous client session for delayed resolver */
     int timeout_busy;                       /* maximum waiting for data time */
     int timeout_close;                          /* maximum close_notify time */
     int timeout_connect;                           /* maximum connect() time */
     int timeout_idle;                        /* maximum idle connection time */
-    enum {FAILOVER_RR, FAILOVER_PRIO} failover;         /* failover strategy */
+    size_t buffer_size;                      /* initial transfer buffer size */
+#ifndef USE_FORK
+    unsigned connect_pool_size;   /* idle TLS connections to keep connected */
+    struct connect_pool_struct *connect_pool;     /* pool of the connections */
+#endif /* !defined(USE_FORK) */
+    enum {FAILOVER_RR, FAILOVER_PRIO, FAILOVER_LEASTCONN, FAILOVER_P2C}
+        failover;                                       /* failover strategy */
     unsigned rr;   /* per-service sequential number for round-robin failover */
+#ifdef USE_KTLS
+    int ktls_checked;           /* connections checked for kernel TLS */
+    int ktls_tx;                /* connections with kernel TLS transmit */
+    int ktls_rx;                /* connections with kernel TLS receive */
+#endif /* USE_KTLS */
+#ifdef USE_SPLICE
+    int splice_used;            /* connections relayed with splice(2) */
+#endif /* USE_SPLICE */
     char *username;
 
         /* service-specific data for protocol.c */
@@ -308,6 +411,10 @@ typedef struct service_options_struct {
     char *protocol_username;
     char *protocol_password;
     char *protocol_authentication;
+    unsigned mux_streams;       /* maximum number of streams in a mux tunnel */
+#ifndef USE_FORK
+    struct mux_tunnel_struct *mux_tunnels;        /* client-side mux tunnels */
+#endif /* !defined(USE_FORK) */
 
         /* service-specific data for ui_*.c */
 #ifdef USE_WIN32
@@ -328,12 +435,14 @@ typedef struct service_options_struct {
         unsigned accept:1;              /* endpoint: accept */
         unsigned client:1;
         unsigned delayed_lookup:1;
+        unsigned happy_eyeballs:1;      /* race connection attempts */
 #ifdef USE_LIBWRAP
         unsigned libwrap:1;
 #endif
         unsigned local:1;               /* outgoing interface specified */
         unsigned retry:1;               /* loop remote+program */
         unsigned sessiond:1;
+        unsigned sessiond_own:1;        /* not inherited from the defaults */
 #ifndef USE_WIN32
         unsigned pty:1;
         unsigned transparent_src:1;
@@ -343,6 +452,14 @@ typedef struct service_options_struct {
         unsigned reset:1;               /* reset sockets on error */
         unsigned renegotiation:1;
         unsigned connect_before_ssl:1;
+        unsigned wipe_buffers:1;        /* zero transfer buffers after use */
+        unsigned buffer_adaptive:1;     /* resize transfer buffers */
+#ifdef USE_KTLS
+        unsigned ktls:1;                /* kernel TLS offload */
+#endif /* USE_KTLS */
+#ifdef USE_SPLICE
+        unsigned zerocopy:1;            /* splice() data with kernel TLS */
+#endif /* USE_SPLICE */
 #ifndef OPENSSL_NO_OCSP
         unsigned aia:1;                 /* Authority Information Access */
         unsigned nonce:1;               /* send and verify OCSP nonce */
@@ -429,6 +546,17 @@ typedef enum {
     RENEG_DETECTED /* renegotiation detected */
 } RENEG_STATE;
 
+typedef struct ring_struct {
+    char *buff;              /* circular data storage or NULL when drained */
+    size_t size;                                      /* size of the storage */
+    size_t head;                           /* index of the first stored byte */
+    size_t len;                                    /* number of stored bytes */
+    size_t peak;               /* maximum len since the storage was attached */
+    size_t dirty;         /* length of the storage prefix that may hold data */
+    int adaptive;                                 /* resize with the traffic */
+    int wipe;                                  /* zero the data once consumed */
+} RING;
+
 typedef struct client_data_struct {
 #ifdef MSSPISSL
     MSSPI_HANDLE msh;
@@ -454,6 +582,9 @@ typedef struct client_data_struct {
     SOCKADDR_UNION *bind_addr;               /* address to bind() the socket */
     SOCKADDR_LIST connect_addr;     /* either copied or resolved dynamically */
     unsigned idx;              /* actually connected address in connect_addr */
+#ifndef USE_FORK
+    int *connect_active;     /* active connection counter of the target */
+#endif /* !defined(USE_FORK) */
     FD local_rfd, local_wfd;             /* read and write local descriptors */
     FD remote_fd;                                  /* remote file descriptor */
     unsigned long pid;                           /* PID of the local process */
@@ -463,15 +594,26 @@ typedef struct client_data_struct {
     unsigned rr;    /* per-client sequential number for round-robin failover */
 
     /* data for transfer() function */
-    char sock_buff[BUFFSIZE];                          /* socket read buffer */
-    char ssl_buff[BUFFSIZE];                              /* TLS read buffer */
-    size_t sock_ptr, ssl_ptr;              /* index of the first unused byte */
+    RING sock_buff;                                    /* socket read buffer */
+    RING ssl_buff;                                        /* TLS read buffer */
     FD *sock_rfd, *sock_wfd;            /* read and write socket descriptors */
     FD *ssl_rfd, *ssl_wfd;                 /* read and write TLS descriptors */
     uint64_t sock_bytes, ssl_bytes;       /* bytes written to socket and TLS */
+#ifdef USE_SPLICE
+    int sock_pipe[2], ssl_pipe[2];      /* pipes for zero-copy data transfer */
+#endif /* USE_SPLICE */
     s_poll_set *fds;                                     /* file descriptors */
+#ifndef USE_FORK
+    struct mux_tunnel_struct *mux;        /* client-side mux tunnel to serve */
+#endif /* !defined(USE_FORK) */
     struct {
         unsigned psk:1;                            /* PSK identity was found */
+        unsigned pool:1;                     /* connection pool maintenance */
+        unsigned passed:1;                /* connection passed to a mux tunnel */
+        unsigned admitted:1;           /* already counted by accept_one() */
+#ifdef USE_PTHREAD
+        unsigned pooled:1;                /* served by a thread pool worker */
+#endif /* USE_PTHREAD */
     } flag;
 } CLI;
 
@@ -530,6 +672,10 @@ void set_nonblock(SOCKET, unsigned long);
 int log_open(int);
 void log_close(int);
 void log_flush(LOG_MODE);
+#ifdef USE_LOG_ASYNC
+void log_async_init(void);
+void log_async_info(void);
+#endif /* USE_LOG_ASYNC */
 void s_log(int, const char *, ...)
 #ifdef __GNUC__
     __attribute__((format(printf, 2, 3)));
@@ -584,8 +730,24 @@ void psk_sort(PSK_TABLE *, PSK_KEYS *);
 PSK_KEYS *psk_find(const PSK_TABLE *, const char *);
 #endif /* !defined(OPENSSL_NO_PSK) */
 void print_session_id(SSL_SESSION *);
+void context_migrate(SERVICE_OPTIONS *, SERVICE_OPTIONS *);
+void session_cache_info(void);
+void sessiond_free(SERVICE_OPTIONS *);
+void sessiond_info(void);
+#ifdef USE_SHM_CACHE
+void shm_cache_free(SERVICE_OPTIONS *);
+void shm_cache_info(void);
+#endif /* USE_SHM_CACHE */
 void sslerror(char *);
 
+/**************************************** prototypes for sessiond.c */
+
+#ifdef USE_SESSIOND_SERVER
+int sessiond_server_bind(void);
+int sessiond_server_init(void);
+void sessiond_server_info(void);
+#endif /* USE_SESSIOND_SERVER */
+
 /**************************************** prototypes for verify.c */
 
 int verify_init(SERVICE_OPTIONS *);
@@ -605,6 +767,7 @@ int s_poll_hup(s_poll_set *, SOCKET);
 int s_poll_rdhup(s_poll_set *, SOCKET);
 int s_poll_err(s_poll_set *, SOCKET);
 int s_poll_wait(s_poll_set *, int, int);
+SOCKET s_poll_next_read(s_poll_set *, unsigned *);
 void s_poll_dump(s_poll_set *, int);
 void s_poll_sleep(int, int);
 
@@ -633,9 +796,23 @@ unsigned __stdcall
 void *
 #endif
     client_thread(void *);
+void client_thread_run(CLI *);
 void client_main(CLI *);
 void client_free(CLI *);
 void throw_exception(CLI *, int) NORETURN;
+int64_t clock_ms(void);
+void buffer_cache_flush(TLS_DATA *);
+void buffer_pool_info(void);
+#ifndef USE_FORK
+int connect_pool_init(SERVICE_OPTIONS *);
+void connect_pool_stop(SERVICE_OPTIONS *);
+void connect_pool_free(SERVICE_OPTIONS *);
+void connect_pool_info(void);
+void connect_target_info(void);
+#endif /* !defined(USE_FORK) */
+#ifdef USE_KTLS
+void ktls_info(void);
+#endif /* USE_KTLS */
 
 /**************************************** prototypes for network.c */
 
@@ -668,6 +845,12 @@ typedef enum {
 } PHASE;
 
 char *protocol(CLI *, SERVICE_OPTIONS *opt, const PHASE);
+#ifndef USE_FORK
+void mux_tunnel(CLI *);
+void mux_tunnel_free(CLI *);
+void mux_stop(SERVICE_OPTIONS *);
+void mux_info(void);
+#endif /* !defined(USE_FORK) */
 
 /**************************************** prototypes for resolver.c */
 
@@ -678,6 +861,11 @@ unsigned hostport2addr(SOCKADDR_UNION *, char *, char *, int);
 
 unsigned name2addrlist(SOCKADDR_LIST *, char *);
 unsigned hostport2addrlist(SOCKADDR_LIST *, char *, char *);
+#ifndef USE_FORK
+int dns_cache_init(void);
+void dns_cache_flush(void);
+void dns_cache_info(void);
+#endif /* !defined(USE_FORK) */
 
 void addrlist_clear(SOCKADDR_LIST *, int);
 unsigned addrlist_dup(SOCKADDR_LIST *, const SOCKADDR_LIST *);
@@ -754,9 +942,17 @@ typedef void CRYPTO_RWLOCK;
 typedef enum {
     LOCK_THREAD_LIST,                       /* sthreads.c */
     LOCK_SESSION, LOCK_ADDR,
-    LOCK_CLIENTS, LOCK_SSL,                 /* client.c */
+    LOCK_CLIENTS, LOCK_SSL, LOCK_BUFFERS,   /* client.c */
+#ifndef USE_FORK
+    LOCK_CONNECT_POOL,                      /* client.c */
+    LOCK_MUX,                               /* protocol.c */
+    LOCK_CONNECT_COST,                      /* client.c */
+#endif /* !defined(USE_FORK) */
     LOCK_REF,                               /* options.c */
     LOCK_INET,                              /* resolver.c */
+#ifndef USE_FORK
+    LOCK_DNS,                               /* resolver.c */
+#endif /* !defined(USE_FORK) */
 #ifndef USE_WIN32
     LOCK_LIBWRAP,                           /* libwrap.c */
 #endif
@@ -765,6 +961,10 @@ typedef enum {
 #ifndef OPENSSL_NO_DH
     LOCK_DH,                                /* ctx.c */
 #endif /* OPENSSL_NO_DH */
+    LOCK_SESSIOND,                          /* ctx.c */
+#ifdef USE_SHM_CACHE
+    LOCK_SHM_CACHE,                         /* ctx.c */
+#endif /* USE_SHM_CACHE */
 #ifdef USE_WIN32
     LOCK_WIN_LOG,                           /* ui_win_gui.c */
 #endif
@@ -788,6 +988,11 @@ int sthreads_init(void);
 unsigned long stunnel_process_id(void);
 unsigned long stunnel_thread_id(void);
 int create_client(SOCKET, SOCKET, CLI *);
+#ifdef USE_PTHREAD
+int thread_pool_init(void);
+void thread_pool_stop(void);
+void thread_pool_info(void);
+#endif /* USE_PTHREAD */
 
 #ifdef USE_UCONTEXT
 typedef struct CONTEXT_STRUCTURE {
@@ -799,9 +1004,57 @@ typedef struct CONTEXT_STRUCTURE {
     time_t finish; /* when to finish poll() for this context */
     struct CONTEXT_STRUCTURE *next; /* next context on a list */
     void *tls; /* thread local storage for tls.c */
+#ifdef USE_EPOLL
+    struct CONTEXT_STRUCTURE *prev; /* previous context on the waiting queue */
+    struct epoll_watcher_struct *watchers; /* one per waited descriptor */
+    unsigned watchers_allocated;
+    int64_t deadline; /* monotonic milliseconds, or -1 for no timeout */
+    unsigned heap_index; /* position in the timer heap+1, or 0 */
+#endif /* USE_EPOLL */
+#ifdef USE_SCHEDULERS
+    int pinned; /* never stolen by other schedulers */
+#endif /* USE_SCHEDULERS */
 } CONTEXT;
-extern CONTEXT *ready_head, *ready_tail;
-extern CONTEXT *waiting_head, *waiting_tail;
+
+/* each scheduler runs its contexts in a single OS thread */
+typedef struct SCHEDULER_STRUCTURE {
+    CONTEXT *current; /* the running context, or NULL while scheduling */
+    CONTEXT *ready_head, *ready_tail; /* ready to execute */
+    CONTEXT *waiting_head, *waiting_tail; /* waiting on poll() */
+    CONTEXT *to_free; /* delayed memory deallocation */
+    void *tls; /* thread local storage for tls.c outside of contexts */
+#ifdef USE_EPOLL
+    CONTEXT *woken_head, *woken_tail; /* woken, but not yet published */
+    CONTEXT *deferred; /* published after switching away from its stack */
+    int self_ready; /* the context that was scheduling is ready */
+    int epoll_fd;
+    struct epoll_fd_struct *epoll_fds; /* indexed by file descriptors */
+    unsigned epoll_fds_allocated;
+    CONTEXT **timer_heap; /* binary min-heap ordered by deadlines */
+    unsigned timer_heap_size, timer_heap_allocated;
+#endif /* USE_EPOLL */
+#ifdef USE_SCHEDULERS
+    unsigned id;
+    pthread_t thread_id;
+    ucontext_t home; /* the native stack to return to on scheduler_stop() */
+    pthread_mutex_t mutex; /* protects the ready queue against stealing */
+    int wakeup_fd; /* eventfd to interrupt epoll_wait() */
+    int sleeping; /* waiting for work, protected by schedulers_mutex */
+    unsigned long long switches, stolen; /* statistics */
+#endif /* USE_SCHEDULERS */
+} SCHEDULER;
+
+SCHEDULER *scheduler_get(void);
+void ready_queue_append(SCHEDULER *, CONTEXT *);
+void scheduler_switched(void);
+#ifdef USE_SCHEDULERS
+extern SCHEDULER **schedulers;
+extern unsigned schedulers_num;
+int scheduler_start(void);
+void scheduler_run(void);
+void scheduler_stop(void);
+void scheduler_info(void);
+#endif /* USE_SCHEDULERS */
 #endif
 
 #ifdef _WIN32_WCE
@@ -849,10 +1102,19 @@ TLS_DATA *tls_get();
 
 extern TLS_DATA *ui_tls;
 typedef struct alloc_list_struct ALLOC_LIST;
+typedef struct arena_chunk_struct ARENA_CHUNK;
 
 struct tls_data_struct {
     ALLOC_LIST *alloc_head;
     size_t alloc_bytes, alloc_blocks;
+    ALLOC_LIST *alloc_pool[STR_POOL_CLASSES]; /* free blocks by size class */
+    size_t alloc_pool_bytes;
+    char *buffer_cache[BUFFER_CACHE_SIZE]; /* idle I/O buffers */
+    size_t buffer_cache_size[BUFFER_CACHE_SIZE];
+    int buffer_cache_num;
+    int buffer_used; /* statistics not merged into the shared pool yet */
+    unsigned buffer_hits, buffer_misses;
+    ARENA_CHUNK *arena; /* client allocations, the current chunk first */
     CLI *c;
     SERVICE_OPTIONS *opt;
     char *id;
@@ -885,8 +1147,8 @@ void *str_realloc_debug(void *, size_t, const char *, int);
 #define str_realloc(a, b) str_realloc_debug((a), (b), __FILE__, __LINE__)
 void *str_realloc_detached_debug(void *, size_t, const char *, int);
 #define str_realloc_detached(a, b) str_realloc_detached_debug((a), (b), __FILE__, __LINE__)
-void str_detach_debug(void *, const char *, int);
-#define str_detach(a) str_detach_debug((a), __FILE__, __LINE__)
+void *str_detach_debug(void *, const char *, int);
+#define str_detach(a) (a)=str_detach_debug((a), __FILE__, __LINE__)
 void str_free_debug(void *, const char *, int);
 #define str_free(a) str_free_debug((a), __FILE__, __LINE__), (a)=NULL
 #define str_free_expression(a) str_free_debug((a), __FILE__, __LINE__)
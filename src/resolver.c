@@ -44,8 +44,53 @@
 NOEXPORT int get_ipv6(LPTSTR);
 #endif
 NOEXPORT void addrlist2addr(SOCKADDR_UNION *, SOCKADDR_LIST *);
+NOEXPORT unsigned hostport2addrlist_uncached(SOCKADDR_LIST *, char *, char *);
 NOEXPORT void addrlist_reset(SOCKADDR_LIST *);
 
+#ifndef USE_FORK
+
+/* the number of DNS cache hash buckets */
+#define DNS_HASH_SIZE 256
+/* the maximum number of cached names, e.g., requested by the SOCKS clients */
+#define DNS_CACHE_MAX 4096
+
+typedef struct dns_entry_struct {
+    struct dns_entry_struct *next;                  /* next entry in a bucket */
+    struct dns_entry_struct *lru_prev, *lru_next;  /* least recently used list */
+    char *host, *port;                                       /* the lookup key */
+    SOCKADDR_UNION *addr;                             /* the resolved addresses */
+    unsigned num;                     /* number of addresses, 0 for a failure */
+    time_t updated, expires, refresh;         /* resolution, expiry, refresh */
+    time_t used;                              /* last use of the cached result */
+    int resolving;                          /* a lookup is already in progress */
+} DNS_ENTRY;
+
+NOEXPORT DNS_ENTRY *dns_hash[DNS_HASH_SIZE];
+NOEXPORT DNS_ENTRY *dns_lru_head=NULL, *dns_lru_tail=NULL;
+NOEXPORT unsigned dns_entries=0;
+NOEXPORT unsigned long long dns_hits=0, dns_misses=0;
+
+NOEXPORT unsigned dns_lookup(SOCKADDR_LIST *, char *, char *);
+NOEXPORT DNS_ENTRY **dns_find(const char *, const char *, time_t);
+NOEXPORT void dns_evict(void);
+NOEXPORT void dns_lru_unlink(DNS_ENTRY *);
+NOEXPORT void dns_lru_push(DNS_ENTRY *);
+NOEXPORT void dns_update(DNS_ENTRY *, SOCKADDR_LIST *);
+NOEXPORT unsigned dns_copy(SOCKADDR_LIST *, const DNS_ENTRY *);
+NOEXPORT void dns_free(DNS_ENTRY *);
+#ifdef USE_OS_THREADS
+NOEXPORT void dns_worker(void);
+NOEXPORT DNS_ENTRY *dns_expire(time_t);
+#endif /* USE_OS_THREADS */
+#ifdef USE_PTHREAD
+NOEXPORT void *dns_thread(void *);
+#endif /* USE_PTHREAD */
+#ifdef USE_WIN32
+NOEXPORT unsigned __stdcall dns_thread(void *);
+#endif /* USE_WIN32 */
+
+#endif /* !defined(USE_FORK) */
+
 #ifndef HAVE_GETADDRINFO
 
 #ifndef EAI_MEMORY
@@ -226,6 +271,16 @@ unsigned name2addrlist(SOCKADDR_LIST *addr_list, char *name) {
 
 unsigned hostport2addrlist(SOCKADDR_LIST *addr_list,
         char *host_name, char *port_name) {
+#ifndef USE_FORK
+    /* the default (loopback) host and passive lookups are not cached */
+    if(global_options.dns_cache_timeout>0 && host_name && !addr_list->passive)
+        return dns_lookup(addr_list, host_name, port_name);
+#endif /* !defined(USE_FORK) */
+    return hostport2addrlist_uncached(addr_list, host_name, port_name);
+}
+
+NOEXPORT unsigned hostport2addrlist_uncached(SOCKADDR_LIST *addr_list,
+        char *host_name, char *port_name) {
     struct addrinfo hints, *res, *cur;
     int err, retry=0;
     unsigned num;
@@ -293,6 +348,331 @@ unsigned hostport2addrlist(SOCKADDR_LIST *addr_list,
     return num; /* ok - return the number of new addresses */
 }
 
+#ifndef USE_FORK
+
+/**************************************** DNS cache */
+
+/* cached lookup with coalescing of concurrent requests for the same name */
+NOEXPORT unsigned dns_lookup(SOCKADDR_LIST *addr_list,
+        char *host_name, char *port_name) {
+    DNS_ENTRY **ptr, *entry;
+    SOCKADDR_LIST list;
+    unsigned num;
+
+    CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_DNS]);
+    for(;;) {
+        time_t now=time(NULL);
+        ptr=dns_find(host_name, port_name, now);
+        entry=*ptr;
+        if(!entry) { /* create a placeholder for concurrent lookups */
+            if(dns_entries>=DNS_CACHE_MAX) {
+                dns_evict();
+                ptr=dns_find(host_name, port_name, now);
+            }
+            entry=str_alloc_detached(sizeof(DNS_ENTRY));
+            entry->host=str_dup_detached(host_name);
+            entry->port=str_dup_detached(port_name);
+            *ptr=entry;
+            dns_lru_push(entry);
+            ++dns_entries;
+            break;
+        }
+        if(now<entry->expires) { /* valid (possibly being refreshed) */
+            ++dns_hits;
+            entry->used=now;
+            dns_lru_unlink(entry);
+            dns_lru_push(entry);
+            num=dns_copy(addr_list, entry);
+            CRYPTO_THREAD_unlock(stunnel_locks[LOCK_DNS]);
+            if(num)
+                s_log(LOG_DEBUG, "DNS cache hit for \"%s\"", host_name);
+            else
+                s_log(LOG_ERR, "Error resolving \"%s\": Cached failure",
+                    host_name);
+            return num;
+        }
+        /* dns_find() only returns an expired entry while it is resolved
+         * by another thread: wait for its result */
+        CRYPTO_THREAD_unlock(stunnel_locks[LOCK_DNS]);
+        s_poll_sleep(0, 10);
+        CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_DNS]);
+    }
+    /* resolving entries are never removed, so the pointer remains valid */
+    entry->resolving=1;
+    ++dns_misses;
+    CRYPTO_THREAD_unlock(stunnel_locks[LOCK_DNS]);
+
+    addrlist_clear(&list, 0);
+    hostport2addrlist_uncached(&list, host_name, port_name);
+
+    CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_DNS]);
+    dns_update(entry, &list);
+    num=dns_copy(addr_list, entry);
+    CRYPTO_THREAD_unlock(stunnel_locks[LOCK_DNS]);
+    return num;
+}
+
+/* return the location of the entry pointer (or where it should be stored),
+ * removing the expired entries of the bucket on the way */
+NOEXPORT DNS_ENTRY **dns_find(const char *host_name, const char *port_name,
+        time_t now) {
+    DNS_ENTRY **ptr, *entry;
+    const unsigned char *p;
+    unsigned h=5381; /* djb2 */
+
+    for(p=(const unsigned char *)host_name; *p; ++p)
+        h=h*33^(unsigned)tolower(*p);
+    for(p=(const unsigned char *)port_name; *p; ++p)
+        h=h*33^*p;
+    ptr=&dns_hash[h%DNS_HASH_SIZE];
+    while((entry=*ptr)) {
+        if(!entry->resolving && now>=entry->expires) {
+            *ptr=entry->next;
+            dns_free(entry);
+        } else if(!strcasecmp(entry->host, host_name) &&
+                !strcmp(entry->port, port_name)) {
+            break;
+        } else {
+            ptr=&entry->next;
+        }
+    }
+    return ptr;
+}
+
+/* remove the least recently used entry that is not being resolved */
+NOEXPORT void dns_evict(void) {
+    DNS_ENTRY *entry, **ptr;
+
+    for(entry=dns_lru_tail; entry && entry->resolving; entry=entry->lru_prev)
+        ;
+    if(!entry) /* all the entries are being resolved */
+        return;
+    s_log(LOG_DEBUG, "DNS cache full: removing \"%s\"", entry->host);
+    /* the entry is valid, so dns_find() returns its location */
+    ptr=dns_find(entry->host, entry->port, 0);
+    *ptr=entry->next;
+    dns_free(entry);
+}
+
+NOEXPORT void dns_lru_unlink(DNS_ENTRY *entry) {
+    if(entry->lru_prev)
+        entry->lru_prev->lru_next=entry->lru_next;
+    else
+        dns_lru_head=entry->lru_next;
+    if(entry->lru_next)
+        entry->lru_next->lru_prev=entry->lru_prev;
+    else
+        dns_lru_tail=entry->lru_prev;
+    entry->lru_prev=entry->lru_next=NULL;
+}
+
+/* insert as the most recently used entry */
+NOEXPORT void dns_lru_push(DNS_ENTRY *entry) {
+    entry->lru_prev=NULL;
+    entry->lru_next=dns_lru_head;
+    if(dns_lru_head)
+        dns_lru_head->lru_prev=entry;
+    else
+        dns_lru_tail=entry;
+    dns_lru_head=entry;
+}
+
+/* store a lookup result, LOCK_DNS needs to be held by the caller */
+NOEXPORT void dns_update(DNS_ENTRY *entry, SOCKADDR_LIST *list) {
+    time_t now=time(NULL);
+    int lifetime;
+
+    entry->resolving=0;
+    if(!list->num && entry->num && now<entry->expires) {
+        /* failed refresh: keep serving the current addresses */
+        s_log(LOG_NOTICE, "Failed to refresh \"%s\": using cached addresses",
+            entry->host);
+        entry->refresh=now+(global_options.dns_negative_timeout>0 ?
+            global_options.dns_negative_timeout : 1);
+        return;
+    }
+    str_free(entry->addr);
+    entry->addr=list->addr;
+    entry->num=list->num;
+    lifetime=entry->num ?
+        global_options.dns_cache_timeout : global_options.dns_negative_timeout;
+    entry->updated=now;
+    entry->expires=now+lifetime;
+    entry->refresh=now+lifetime-lifetime/4; /* 75% of the lifetime */
+}
+
+/* append the cached addresses, LOCK_DNS needs to be held by the caller */
+NOEXPORT unsigned dns_copy(SOCKADDR_LIST *addr_list, const DNS_ENTRY *entry) {
+    if(!entry->num)
+        return 0;
+    addr_list->addr=str_realloc_detached(addr_list->addr,
+        (addr_list->num+entry->num)*sizeof(SOCKADDR_UNION));
+    memcpy(&addr_list->addr[addr_list->num], entry->addr,
+        entry->num*sizeof(SOCKADDR_UNION));
+    addr_list->num+=entry->num;
+    return entry->num;
+}
+
+NOEXPORT void dns_free(DNS_ENTRY *entry) {
+    dns_lru_unlink(entry);
+    str_free(entry->host);
+    str_free(entry->port);
+    str_free(entry->addr);
+    str_free(entry);
+    --dns_entries;
+}
+
+/* discard cached results, e.g., on configuration reload */
+void dns_cache_flush(void) {
+    DNS_ENTRY **ptr, *entry;
+    unsigned i;
+
+    CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_DNS]);
+    for(i=0; i<DNS_HASH_SIZE; ++i) {
+        ptr=&dns_hash[i];
+        while((entry=*ptr)) {
+            if(entry->resolving) { /* still referenced by its resolver */
+                entry->expires=0;
+                ptr=&entry->next;
+            } else {
+                *ptr=entry->next;
+                dns_free(entry);
+            }
+        }
+    }
+    CRYPTO_THREAD_unlock(stunnel_locks[LOCK_DNS]);
+}
+
+void dns_cache_info(void) {
+    CRYPTO_THREAD_read_lock(stunnel_locks[LOCK_DNS]);
+    if(dns_entries || dns_hits || dns_misses)
+        s_log(LOG_NOTICE, "DNS cache: %u entry(ies), "
+            "%llu hit(s), %llu miss(es)",
+            dns_entries, dns_hits, dns_misses);
+    CRYPTO_THREAD_unlock(stunnel_locks[LOCK_DNS]);
+}
+
+/* background refresh of frequently used entries before they expire */
+
+#if defined(USE_PTHREAD)
+
+int dns_cache_init(void) {
+#if defined(HAVE_PTHREAD_SIGMASK) && !defined(__APPLE__)
+    sigset_t new_set, old_set;
+#endif /* HAVE_PTHREAD_SIGMASK && !__APPLE__*/
+    pthread_t thread_id;
+    int err;
+
+#if defined(HAVE_PTHREAD_SIGMASK) && !defined(__APPLE__)
+    sigfillset(&new_set);
+    pthread_sigmask(SIG_SETMASK, &new_set, &old_set); /* block signals */
+#endif /* HAVE_PTHREAD_SIGMASK && !__APPLE__*/
+    err=pthread_create(&thread_id, NULL, dns_thread, NULL);
+#if defined(HAVE_PTHREAD_SIGMASK) && !defined(__APPLE__)
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL); /* unblock signals */
+#endif /* HAVE_PTHREAD_SIGMASK && !__APPLE__*/
+    if(err) {
+        errno=err;
+        ioerror("pthread_create");
+        return 1;
+    }
+    pthread_detach(thread_id);
+    return 0;
+}
+
+NOEXPORT void *dns_thread(void *arg) {
+    (void)arg; /* squash the unused parameter warning */
+    tls_alloc(NULL, NULL, "dns");
+    dns_worker();
+    return NULL; /* it should never be executed */
+}
+
+#elif defined(USE_WIN32)
+
+int dns_cache_init(void) {
+    HANDLE thread_id;
+
+    thread_id=(HANDLE)_beginthreadex(NULL, 0, dns_thread, NULL, 0, NULL);
+    if(!thread_id) {
+        ioerror("_beginthreadex");
+        return 1;
+    }
+    CloseHandle(thread_id);
+    return 0;
+}
+
+NOEXPORT unsigned __stdcall dns_thread(void *arg) {
+    (void)arg; /* squash the unused parameter warning */
+    tls_alloc(NULL, NULL, "dns");
+    dns_worker();
+    _endthreadex(0); /* it should never be executed */
+    return 0;
+}
+
+#else /* USE_OS_THREADS */
+
+int dns_cache_init(void) {
+    /* expired entries are resolved again on their next use */
+    return 0;
+}
+
+#endif /* USE_OS_THREADS */
+
+#ifdef USE_OS_THREADS
+
+NOEXPORT void dns_worker(void) {
+    DNS_ENTRY *entry;
+    SOCKADDR_LIST list;
+
+    s_log(LOG_DEBUG, "DNS cache thread initialized");
+    for(;;) {
+        s_poll_sleep(1, 0);
+        for(;;) {
+            CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_DNS]);
+            entry=dns_expire(time(NULL));
+            CRYPTO_THREAD_unlock(stunnel_locks[LOCK_DNS]);
+            if(!entry)
+                break;
+            s_log(LOG_DEBUG, "Refreshing cached addresses of \"%s\"",
+                entry->host);
+            addrlist_clear(&list, 0);
+            hostport2addrlist_uncached(&list, entry->host, entry->port);
+            CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_DNS]);
+            dns_update(entry, &list);
+            CRYPTO_THREAD_unlock(stunnel_locks[LOCK_DNS]);
+        }
+    }
+}
+
+/* remove expired entries and return an entry to be refreshed (if any) */
+NOEXPORT DNS_ENTRY *dns_expire(time_t now) {
+    DNS_ENTRY **ptr, *entry;
+    unsigned i;
+
+    for(i=0; i<DNS_HASH_SIZE; ++i) {
+        ptr=&dns_hash[i];
+        while((entry=*ptr)) {
+            if(entry->resolving) {
+                ptr=&entry->next;
+            } else if(now>=entry->expires) {
+                *ptr=entry->next;
+                dns_free(entry);
+            } else if(entry->num && now>=entry->refresh &&
+                    entry->used>=entry->updated) { /* used since resolved */
+                entry->resolving=1;
+                return entry;
+            } else {
+                ptr=&entry->next;
+            }
+        }
+    }
+    return NULL;
+}
+
+#endif /* USE_OS_THREADS */
+
+#endif /* !defined(USE_FORK) */
+
 /* initialize the structure */
 void addrlist_clear(SOCKADDR_LIST *addr_list, int passive) {
     addrlist_reset(addr_list);
@@ -0,0 +1,485 @@
+/*
+ *   stunnel       TLS offloading and load-balancing proxy
+ *   Copyright (C) 1998-2019 Michal Trojnara <Michal.Trojnara@stunnel.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by the
+ *   Free Software Foundation; either version 2 of the License, or (at your
+ *   option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *   See the GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, see <http://www.gnu.org/licenses>.
+ *
+ *   Linking stunnel statically or dynamically with other modules is making
+ *   a combined work based on stunnel. Thus, the terms and conditions of
+ *   the GNU General Public License cover the whole combination.
+ *
+ *   In addition, as a special exception, the copyright holder of stunnel
+ *   gives you permission to combine stunnel with free software programs or
+ *   libraries that are released under the GNU LGPL and with code included
+ *   in the standard release of OpenSSL under the OpenSSL License (or
+ *   modified versions of such code, with unchanged license). You may copy
+ *   and distribute such a system following the terms of the GNU GPL for
+ *   stunnel and the licenses of the other code concerned.
+ *
+ *   Note that people who make modified versions of stunnel are not obligated
+ *   to grant this special exception for their modified versions; it is their
+ *   choice whether to do so. The GNU General Public License gives permission
+ *   to release a modified version without this exception; this exception
+ *   also makes it possible to release a modified version which carries
+ *   forward this exception.
+ */
+
+#include "common.h"
+#include "prototypes.h"
+
+#ifdef USE_SESSIOND_SERVER
+
+/* the packet header preceding the encoded session */
+#define CACHE_HEADER_LEN (sizeof(CACHE_PACKET)-MAX_VAL_LEN)
+
+/* the timeout used when the client did not specify one */
+#define CACHE_DEFAULT_TIMEOUT 300
+
+typedef struct sessiond_entry_struct {
+    struct sessiond_entry_struct *hash_next;              /* bucket chain */
+    struct sessiond_entry_struct *lru_prev, *lru_next;   /* LRU list */
+    struct sessiond_entry_struct *wheel_prev, *wheel_next; /* expiry slot */
+    time_t expire;                                     /* expiration time */
+    size_t val_len;                             /* encoded session length */
+    u_char key[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    u_char val[1];                  /* the encoded session (val_len bytes) */
+} SESSIOND_ENTRY;
+
+typedef struct {
+    CRYPTO_RWLOCK *lock;
+    SESSIOND_ENTRY *bucket[SESSIOND_BUCKETS];
+    SESSIOND_ENTRY *lru_head, *lru_tail;     /* the most recently used first */
+    SESSIOND_ENTRY *wheel[SESSIOND_WHEEL];      /* entries by expiration time */
+    time_t swept;                         /* the last expiry wheel slot swept */
+    size_t memory, entries;
+    unsigned long long gets, hits, evictions, expirations;
+} SESSIOND_SHARD;
+
+static SOCKET server_fd=INVALID_SOCKET;
+static SESSIOND_SHARD *shards=NULL;
+static size_t shard_memory; /* the memory limit of each shard */
+
+NOEXPORT void *sessiond_server_thread(void *);
+NOEXPORT size_t sessiond_process(CACHE_PACKET *, size_t, int,
+    CACHE_PACKET *, time_t);
+NOEXPORT unsigned sessiond_hash(const u_char *);
+NOEXPORT SESSIOND_ENTRY *sessiond_find(SESSIOND_SHARD *, unsigned,
+    const u_char *);
+NOEXPORT void sessiond_insert(SESSIOND_SHARD *, unsigned, const u_char *,
+    const u_char *, size_t, time_t);
+NOEXPORT void sessiond_delete(SESSIOND_SHARD *, unsigned, SESSIOND_ENTRY *);
+NOEXPORT void sessiond_expire(time_t);
+
+/**************************************** initialization */
+
+/* the socket is bound before the privileges are dropped */
+int sessiond_server_bind(void) {
+    SOCKADDR_UNION *addr=&global_options.sessiond_server_addr;
+    struct timeval t;
+    char *addr_str;
+    int on=1;
+
+    if(!global_options.option.sessiond_server)
+        return 0;
+    server_fd=s_socket(addr->sa.sa_family, SOCK_DGRAM, 0, 0,
+        "sessiond server: socket");
+    if(server_fd==INVALID_SOCKET)
+        return 1;
+    if(setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, (void *)&on, sizeof on))
+        sockerror("sessiond server: setsockopt SO_REUSEADDR");
+    /* wake up periodically to expire cached sessions */
+    t.tv_sec=1;
+    t.tv_usec=0;
+    if(setsockopt(server_fd, SOL_SOCKET, SO_RCVTIMEO, (void *)&t, sizeof t))
+        sockerror("sessiond server: setsockopt SO_RCVTIMEO");
+    addr_str=s_ntop(addr, addr_len(addr));
+    if(bind(server_fd, &addr->sa, addr_len(addr))) {
+        s_log(LOG_ERR, "Error binding sessiond server to %s", addr_str);
+        sockerror("bind");
+        str_free(addr_str);
+        closesocket(server_fd);
+        server_fd=INVALID_SOCKET;
+        return 1;
+    }
+    s_log(LOG_INFO, "Sessiond server (FD=%ld) bound to %s",
+        (long)server_fd, addr_str);
+    str_free(addr_str);
+    return 0;
+}
+
+/* the server threads are started after daemonize() */
+int sessiond_server_init(void) {
+    pthread_t thread_id;
+    time_t now;
+    int i;
+    long threads;
+#if defined(HAVE_PTHREAD_SIGMASK) && !defined(__APPLE__)
+    sigset_t new_set, old_set;
+#endif /* HAVE_PTHREAD_SIGMASK && !__APPLE__*/
+
+    if(server_fd==INVALID_SOCKET || shards) /* disabled or already running */
+        return 0;
+    shards=str_alloc_detached(SESSIOND_SHARDS*sizeof(SESSIOND_SHARD));
+    now=time(NULL);
+    for(i=0; i<SESSIOND_SHARDS; ++i) {
+        shards[i].lock=CRYPTO_THREAD_lock_new();
+        shards[i].swept=now;
+    }
+    shard_memory=global_options.sessiond_memory/SESSIOND_SHARDS;
+    threads=global_options.sessiond_threads;
+    if(!threads) /* auto: one thread per online CPU */
+        threads=sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads<1)
+        threads=1;
+    if(threads>SESSIOND_THREADS)
+        threads=SESSIOND_THREADS;
+
+#if defined(HAVE_PTHREAD_SIGMASK) && !defined(__APPLE__)
+    sigfillset(&new_set);
+    pthread_sigmask(SIG_SETMASK, &new_set, &old_set); /* block signals */
+#endif /* HAVE_PTHREAD_SIGMASK && !__APPLE__*/
+    for(i=0; i<threads; ++i)
+        if(pthread_create(&thread_id, NULL, sessiond_server_thread, NULL))
+            ioerror("pthread_create");
+#if defined(HAVE_PTHREAD_SIGMASK) && !defined(__APPLE__)
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL); /* unblock signals */
+#endif /* HAVE_PTHREAD_SIGMASK && !__APPLE__*/
+    s_log(LOG_NOTICE, "Sessiond server started with %ld thread(s), "
+        "%lu byte(s) of memory", threads,
+        (unsigned long)global_options.sessiond_memory);
+    return 0;
+}
+
+#ifdef __GNUC__
+#if __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 6)
+#pragma GCC diagnostic push
+#endif /* __GNUC__>=4.6 */
+#pragma GCC diagnostic ignored "-Wformat"
+#pragma GCC diagnostic ignored "-Wformat-extra-args"
+#endif /* __GNUC__ */
+void sessiond_server_info(void) {
+    size_t memory=0, entries=0;
+    unsigned long long gets=0, hits=0, evictions=0, expirations=0;
+    int i;
+
+    if(!shards)
+        return;
+    for(i=0; i<SESSIOND_SHARDS; ++i) {
+        CRYPTO_THREAD_read_lock(shards[i].lock);
+        memory+=shards[i].memory;
+        entries+=shards[i].entries;
+        gets+=shards[i].gets;
+        hits+=shards[i].hits;
+        evictions+=shards[i].evictions;
+        expirations+=shards[i].expirations;
+        CRYPTO_THREAD_unlock(shards[i].lock);
+    }
+    s_log(LOG_NOTICE, "Sessiond server: %lu session(s), %lu byte(s), "
+        "%llu lookup(s), %llu hit(s), %llu eviction(s), %llu expiration(s)",
+        (unsigned long)entries, (unsigned long)memory,
+        gets, hits, evictions, expirations);
+}
+#ifdef __GNUC__
+#if __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 6)
+#pragma GCC diagnostic pop
+#endif /* __GNUC__>=4.6 */
+#endif /* __GNUC__ */
+
+/**************************************** request processing */
+
+NOEXPORT void *sessiond_server_thread(void *arg) {
+    struct mmsghdr in[SESSIOND_BATCH], out[SESSIOND_BATCH];
+    struct iovec in_iov[SESSIOND_BATCH], out_iov[SESSIOND_BATCH];
+    SOCKADDR_UNION addr[SESSIOND_BATCH];
+    CACHE_PACKET *request, *response;
+    time_t now, swept=0;
+    size_t len;
+    int i, num, replies, sent;
+
+    (void)arg; /* squash the unused parameter warning */
+    tls_alloc(NULL, NULL, "sessiond");
+    request=str_alloc_detached(SESSIOND_BATCH*sizeof(CACHE_PACKET));
+    response=str_alloc_detached(SESSIOND_BATCH*sizeof(CACHE_PACKET));
+    for(;;) {
+        /* receive a batch of requests */
+        memset(in, 0, sizeof in);
+        for(i=0; i<SESSIOND_BATCH; ++i) {
+            in_iov[i].iov_base=request+i;
+            in_iov[i].iov_len=sizeof(CACHE_PACKET);
+            in[i].msg_hdr.msg_iov=in_iov+i;
+            in[i].msg_hdr.msg_iovlen=1;
+            in[i].msg_hdr.msg_name=addr+i;
+            in[i].msg_hdr.msg_namelen=sizeof(SOCKADDR_UNION);
+        }
+        num=recvmmsg(server_fd, in, SESSIOND_BATCH, MSG_WAITFORONE, NULL);
+        now=time(NULL);
+        if(num<0) {
+            switch(get_last_socket_error()) {
+            case S_EINTR:
+            case S_EWOULDBLOCK:
+#if S_EAGAIN!=S_EWOULDBLOCK
+            case S_EAGAIN:
+#endif
+                break; /* the periodic timeout */
+            default:
+                sockerror("sessiond server: recvmmsg");
+                s_poll_sleep(1, 0); /* avoid log trashing */
+            }
+            num=0;
+        }
+
+        /* process the requests and collect the responses */
+        memset(out, 0, sizeof out);
+        replies=0;
+        for(i=0; i<num; ++i) {
+            len=sessiond_process(request+i, in[i].msg_len,
+                in[i].msg_hdr.msg_flags, response+replies, now);
+            if(!len) /* no response is required */
+                continue;
+            out_iov[replies].iov_base=response+replies;
+            out_iov[replies].iov_len=len;
+            out[replies].msg_hdr.msg_iov=out_iov+replies;
+            out[replies].msg_hdr.msg_iovlen=1;
+            out[replies].msg_hdr.msg_name=addr+i;
+            out[replies].msg_hdr.msg_namelen=in[i].msg_hdr.msg_namelen;
+            ++replies;
+        }
+
+        /* send the responses */
+        for(sent=0; sent<replies; sent+=num) {
+            num=sendmmsg(server_fd, out+sent, (unsigned)(replies-sent), 0);
+            if(num<0) {
+                sockerror("sessiond server: sendmmsg");
+                break;
+            }
+        }
+
+        /* each thread advances the expiry wheels at most once a second */
+        if(now!=swept) {
+            sessiond_expire(now);
+            swept=now;
+        }
+    }
+    return NULL; /* it should never be executed */
+}
+
+/* returns the length of the response or 0 if no response is needed */
+NOEXPORT size_t sessiond_process(CACHE_PACKET *request, size_t len, int flags,
+        CACHE_PACKET *response, time_t now) {
+    SESSIOND_SHARD *shard;
+    SESSIOND_ENTRY *entry;
+    unsigned hash;
+    long timeout;
+
+    if(flags&MSG_TRUNC || len<CACHE_HEADER_LEN || request->version!=1) {
+        s_log(LOG_DEBUG, "Sessiond server: malformed packet received");
+        return 0;
+    }
+    hash=sessiond_hash(request->key);
+    shard=shards+(hash%SESSIOND_SHARDS);
+    switch(request->type) {
+    case CACHE_CMD_NEW:
+        timeout=ntohs(request->timeout);
+        if(!timeout)
+            timeout=CACHE_DEFAULT_TIMEOUT;
+        CRYPTO_THREAD_write_lock(shard->lock);
+        entry=sessiond_find(shard, hash, request->key);
+        if(entry)
+            sessiond_delete(shard, hash, entry);
+        sessiond_insert(shard, hash, request->key,
+            request->val, len-CACHE_HEADER_LEN, now+timeout);
+        CRYPTO_THREAD_unlock(shard->lock);
+        return 0; /* the client does not expect a response */
+    case CACHE_CMD_GET:
+        memcpy(response, request, CACHE_HEADER_LEN);
+        response->type=CACHE_RESP_ERR;
+        len=CACHE_HEADER_LEN;
+        CRYPTO_THREAD_write_lock(shard->lock); /* the LRU list is updated */
+        ++shard->gets;
+        entry=sessiond_find(shard, hash, request->key);
+        if(entry && entry->expire<=now) { /* not swept yet */
+            sessiond_delete(shard, hash, entry);
+            ++shard->expirations;
+            entry=NULL;
+        }
+        if(entry) {
+            ++shard->hits;
+            response->type=CACHE_RESP_OK;
+            memcpy(response->val, entry->val, entry->val_len);
+            len+=entry->val_len;
+            if(entry!=shard->lru_head) { /* move to the front */
+                entry->lru_prev->lru_next=entry->lru_next;
+                if(entry->lru_next)
+                    entry->lru_next->lru_prev=entry->lru_prev;
+                else
+                    shard->lru_tail=entry->lru_prev;
+                entry->lru_prev=NULL;
+                entry->lru_next=shard->lru_head;
+                shard->lru_head->lru_prev=entry;
+                shard->lru_head=entry;
+            }
+        }
+        CRYPTO_THREAD_unlock(shard->lock);
+        return len;
+    case CACHE_CMD_REMOVE:
+        CRYPTO_THREAD_write_lock(shard->lock);
+        entry=sessiond_find(shard, hash, request->key);
+        if(entry)
+            sessiond_delete(shard, hash, entry);
+        CRYPTO_THREAD_unlock(shard->lock);
+        return 0; /* the client does not expect a response */
+    default:
+        s_log(LOG_DEBUG, "Sessiond server: unknown request type %d",
+            request->type);
+        return 0;
+    }
+}
+
+/**************************************** sharded hash table */
+
+NOEXPORT unsigned sessiond_hash(const u_char *key) { /* FNV-1a */
+    unsigned hash=2166136261u;
+    size_t i;
+
+    for(i=0; i<SSL_MAX_SSL_SESSION_ID_LENGTH; ++i) {
+        hash^=key[i];
+        hash*=16777619u;
+    }
+    return hash;
+}
+
+/* the caller holds the shard lock in all the functions below */
+
+NOEXPORT SESSIOND_ENTRY *sessiond_find(SESSIOND_SHARD *shard, unsigned hash,
+        const u_char *key) {
+    SESSIOND_ENTRY *entry;
+
+    for(entry=shard->bucket[hash/SESSIOND_SHARDS%SESSIOND_BUCKETS];
+            entry; entry=entry->hash_next)
+        if(!memcmp(entry->key, key, SSL_MAX_SSL_SESSION_ID_LENGTH))
+            return entry;
+    return NULL;
+}
+
+NOEXPORT void sessiond_insert(SESSIOND_SHARD *shard, unsigned hash,
+        const u_char *key, const u_char *val, size_t val_len, time_t expire) {
+    SESSIOND_ENTRY *entry, **head;
+    size_t size=sizeof(SESSIOND_ENTRY)+val_len;
+
+    if(size>shard_memory) /* would never fit */
+        return;
+    while(shard->memory+size>shard_memory) { /* evict the least recently used */
+        entry=shard->lru_tail;
+        sessiond_delete(shard, sessiond_hash(entry->key), entry);
+        ++shard->evictions;
+    }
+
+    entry=str_alloc_detached(size);
+    memcpy(entry->key, key, SSL_MAX_SSL_SESSION_ID_LENGTH);
+    memcpy(entry->val, val, val_len);
+    entry->val_len=val_len;
+    entry->expire=expire;
+
+    /* hash bucket */
+    head=shard->bucket+hash/SESSIOND_SHARDS%SESSIOND_BUCKETS;
+    entry->hash_next=*head;
+    *head=entry;
+
+    /* LRU list */
+    entry->lru_prev=NULL;
+    entry->lru_next=shard->lru_head;
+    if(shard->lru_head)
+        shard->lru_head->lru_prev=entry;
+    else
+        shard->lru_tail=entry;
+    shard->lru_head=entry;
+
+    /* expiry wheel */
+    head=shard->wheel+(unsigned long)expire%SESSIOND_WHEEL;
+    entry->wheel_prev=NULL;
+    entry->wheel_next=*head;
+    if(*head)
+        (*head)->wheel_prev=entry;
+    *head=entry;
+
+    shard->memory+=size;
+    ++shard->entries;
+}
+
+NOEXPORT void sessiond_delete(SESSIOND_SHARD *shard, unsigned hash,
+        SESSIOND_ENTRY *entry) {
+    SESSIOND_ENTRY **ptr;
+
+    /* hash bucket */
+    for(ptr=shard->bucket+hash/SESSIOND_SHARDS%SESSIOND_BUCKETS;
+            *ptr!=entry; ptr=&(*ptr)->hash_next)
+        ;
+    *ptr=entry->hash_next;
+
+    /* LRU list */
+    if(entry->lru_prev)
+        entry->lru_prev->lru_next=entry->lru_next;
+    else
+        shard->lru_head=entry->lru_next;
+    if(entry->lru_next)
+        entry->lru_next->lru_prev=entry->lru_prev;
+    else
+        shard->lru_tail=entry->lru_prev;
+
+    /* expiry wheel */
+    if(entry->wheel_prev)
+        entry->wheel_prev->wheel_next=entry->wheel_next;
+    else
+        shard->wheel[(unsigned long)entry->expire%SESSIOND_WHEEL]=
+            entry->wheel_next;
+    if(entry->wheel_next)
+        entry->wheel_next->wheel_prev=entry->wheel_prev;
+
+    shard->memory-=sizeof(SESSIOND_ENTRY)+entry->val_len;
+    --shard->entries;
+    str_free(entry);
+}
+
+/* advance the expiry wheels of all the shards up to now */
+NOEXPORT void sessiond_expire(time_t now) {
+    SESSIOND_SHARD *shard;
+    SESSIOND_ENTRY *entry, *next;
+    time_t t;
+    int i;
+
+    for(i=0; i<SESSIOND_SHARDS; ++i) {
+        shard=shards+i;
+        CRYPTO_THREAD_write_lock(shard->lock);
+        if(now-shard->swept>SESSIOND_WHEEL) /* a full turn is enough */
+            shard->swept=now-SESSIOND_WHEEL;
+        for(t=shard->swept+1; t<=now; ++t) { /* no-op if already swept */
+            /* entries further in the future stay in the slot */
+            for(entry=shard->wheel[(unsigned long)t%SESSIOND_WHEEL];
+                    entry; entry=next) {
+                next=entry->wheel_next;
+                if(entry->expire<=now) {
+                    sessiond_delete(shard, sessiond_hash(entry->key), entry);
+                    ++shard->expirations;
+                }
+            }
+        }
+        if(shard->swept<now) /* another thread may have swept further */
+            shard->swept=now;
+        CRYPTO_THREAD_unlock(shard->lock);
+    }
+}
+
+#endif /* USE_SESSIOND_SERVER */
+
+/* end of sessiond.c */
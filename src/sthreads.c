@@ -57,7 +57,9 @@ unsigned long stunnel_process_id(void) {
 }
 
 unsigned long stunnel_thread_id(void) {
-    return ready_head ? ready_head->id : 0;
+    CONTEXT *context=scheduler_get()->current;
+
+    return context ? context->id : 0;
 }
 
 #endif /* USE_UCONTEXT */
@@ -387,40 +389,68 @@ void locking_init(void) {
 #define ARGC 1
 #endif
 
-/* first context on the ready list is the active context */
-CONTEXT *ready_head=NULL, *ready_tail=NULL;         /* ready to execute */
-CONTEXT *waiting_head=NULL, *waiting_tail=NULL;     /* waiting on poll() */
+NOEXPORT SCHEDULER scheduler_main; /* the scheduler of the main thread */
+#ifdef USE_SCHEDULERS
+SCHEDULER **schedulers=NULL;
+unsigned schedulers_num=1;
+NOEXPORT pthread_key_t scheduler_key;
+NOEXPORT void *scheduler_thread(void *);
+#endif /* USE_SCHEDULERS */
+
+SCHEDULER *scheduler_get(void) {
+#ifdef USE_SCHEDULERS
+    if(schedulers_num>1)
+        return pthread_getspecific(scheduler_key);
+#endif /* USE_SCHEDULERS */
+    return &scheduler_main;
+}
 
 NOEXPORT CONTEXT *new_context(void) {
-    static unsigned long next_id=1;
+    static unsigned long next_id=0;
     CONTEXT *context;
 
     /* allocate and fill the CONTEXT structure */
     context=str_alloc_detached(sizeof(CONTEXT));
-    context->id=next_id++;
+#ifdef USE_SCHEDULERS
+    context->id=__atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
+#else /* USE_SCHEDULERS */
+    context->id=++next_id;
+#endif /* USE_SCHEDULERS */
     context->fds=NULL;
     context->ready=0;
-
-    /* append to the tail of the ready queue */
     context->next=NULL;
-    if(ready_tail)
-        ready_tail->next=context;
-    ready_tail=context;
-    if(!ready_head)
-        ready_head=context;
-
     return context;
 }
 
+/* the entry point of a new context */
+NOEXPORT void context_start(CLI *arg) {
+    scheduler_switched(); /* complete the switch to this context */
+    client_thread(arg);
+}
+
 int sthreads_init(void) {
+    CONTEXT *context;
+
     thread_id_init();
     locking_init();
-    /* create the first (listening) context and put it in the running queue */
-    if(!new_context()) {
+#ifdef USE_EPOLL
+    scheduler_main.epoll_fd=-1;
+#endif /* USE_EPOLL */
+#ifdef USE_SCHEDULERS
+    scheduler_main.wakeup_fd=-1;
+    pthread_mutex_init(&scheduler_main.mutex, NULL);
+#endif /* USE_SCHEDULERS */
+    /* create the first (listening) context and make it the active context */
+    context=new_context();
+    if(!context) {
         s_log(LOG_ERR, "Cannot create the listening context");
         return 1;
     }
-    /* update tls for newly allocated ready_head */
+#ifdef USE_SCHEDULERS
+    context->pinned=1; /* it runs on the stack of the main thread */
+#endif /* USE_SCHEDULERS */
+    scheduler_main.current=context;
+    /* update tls for the newly created context */
     ui_tls=tls_alloc(NULL, ui_tls, "ui");
     /* no need to initialize ucontext_t structure here
        it will be initialied with swapcontext() call */
@@ -462,12 +492,85 @@ int create_client(SOCKET ls, SOCKET s, CLI *arg) {
     context->context.uc_stack.ss_size=arg->opt->stack_size;
     context->context.uc_stack.ss_flags=0;
 
-    makecontext(&context->context, (void(*)(void))client_thread, ARGC, arg);
+    makecontext(&context->context, (void(*)(void))context_start, ARGC, arg);
+    CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_THREAD_LIST]);
     thread_list_add(arg);
+    CRYPTO_THREAD_unlock(stunnel_locks[LOCK_THREAD_LIST]);
+    /* the context may be stolen by another scheduler from now on */
+    ready_queue_append(scheduler_get(), context);
     s_log(LOG_DEBUG, "New context created");
     return 0;
 }
 
+#ifdef USE_SCHEDULERS
+
+/* start the additional scheduler threads (once, at startup) */
+int scheduler_start(void) {
+    unsigned i, num=global_options.scheduler_threads;
+    SCHEDULER *sched;
+    int error;
+
+    if(schedulers || num<=1) /* already started or a single scheduler */
+        return 0;
+
+    error=pthread_key_create(&scheduler_key, NULL);
+    if(error) {
+        errno=error;
+        ioerror("pthread_key_create");
+        return 1;
+    }
+    schedulers=str_alloc_detached(num*sizeof(SCHEDULER *));
+    schedulers[0]=&scheduler_main;
+    for(i=1; i<num; ++i) {
+        sched=str_alloc_detached(sizeof(SCHEDULER));
+        sched->id=i;
+        sched->epoll_fd=-1;
+        sched->wakeup_fd=-1;
+        pthread_mutex_init(&sched->mutex, NULL);
+        schedulers[i]=sched;
+    }
+    pthread_setspecific(scheduler_key, &scheduler_main);
+    schedulers_num=num; /* scheduler_get() uses scheduler_key from now on */
+
+    /* signals are not blocked: the handler only writes to signal_pipe */
+    for(i=1; i<num; ++i) {
+        error=pthread_create(&schedulers[i]->thread_id, NULL,
+            scheduler_thread, schedulers[i]);
+        if(error) {
+            errno=error;
+            ioerror("pthread_create");
+            return 1;
+        }
+    }
+    s_log(LOG_INFO, "Started %u scheduler threads", num);
+    return 0;
+}
+
+NOEXPORT void *scheduler_thread(void *arg) {
+    SCHEDULER *sched=arg;
+    char name[16];
+
+    pthread_setspecific(scheduler_key, sched);
+    snprintf(name, sizeof name, "sched%u", sched->id);
+    tls_alloc(NULL, NULL, name);
+    s_log(LOG_DEBUG, "Scheduler thread started");
+    scheduler_run(); /* only returns on errors */
+    tls_cleanup();
+    return NULL;
+}
+
+void scheduler_info(void) {
+    unsigned i;
+
+    for(i=0; i<schedulers_num && schedulers; ++i)
+        s_log(LOG_NOTICE,
+            "Scheduler %u: %llu context switch(es), %llu stolen context(s)",
+            i, __atomic_load_n(&schedulers[i]->switches, __ATOMIC_RELAXED),
+            __atomic_load_n(&schedulers[i]->stolen, __ATOMIC_RELAXED));
+}
+
+#endif /* USE_SCHEDULERS */
+
 #endif /* USE_UCONTEXT */
 
 #ifdef USE_FORK
@@ -526,7 +629,9 @@ int sthreads_init(void) {
     return 0;
 }
 
-int create_client(SOCKET ls, SOCKET s, CLI *arg) {
+/* start a thread with all the signals blocked */
+NOEXPORT int thread_start(pthread_t *thread_id, size_t stack_size,
+        void *(*start_routine)(void *), void *arg) {
     pthread_attr_t pth_attr;
     int error;
 #if defined(HAVE_PTHREAD_SIGMASK) && !defined(__APPLE__)
@@ -536,8 +641,6 @@ int create_client(SOCKET ls, SOCKET s, CLI *arg) {
     sigset_t new_set, old_set;
 #endif /* HAVE_PTHREAD_SIGMASK && !__APPLE__*/
 
-    (void)ls; /* this parameter is only used with USE_FORK */
-
 #if defined(HAVE_PTHREAD_SIGMASK) && !defined(__APPLE__)
     /* the idea is that only the main thread handles all the signals with
      * posix threads;  signals are blocked for any other thread */
@@ -545,14 +648,235 @@ int create_client(SOCKET ls, SOCKET s, CLI *arg) {
     pthread_sigmask(SIG_SETMASK, &new_set, &old_set); /* block signals */
 #endif /* HAVE_PTHREAD_SIGMASK && !__APPLE__*/
     pthread_attr_init(&pth_attr);
-    pthread_attr_setstacksize(&pth_attr, arg->opt->stack_size);
-
-    CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_THREAD_LIST]);
-    error=pthread_create(&arg->thread_id, &pth_attr, client_thread, arg);
+    pthread_attr_setstacksize(&pth_attr, stack_size);
+    error=pthread_create(thread_id, &pth_attr, start_routine, arg);
     pthread_attr_destroy(&pth_attr);
 #if defined(HAVE_PTHREAD_SIGMASK) && !defined(__APPLE__)
     pthread_sigmask(SIG_SETMASK, &old_set, NULL); /* unblock signals */
 #endif /* HAVE_PTHREAD_SIGMASK && !__APPLE__*/
+    return error;
+}
+
+/**************************************** client thread pool */
+
+/* pool workers serve one client after another instead of exiting
+ * after the first one, so short connections do not pay for
+ * pthread_create() and a fresh stack each time */
+
+typedef struct worker_struct {
+    struct worker_struct *next, *prev;        /* all the workers of the pool */
+    struct worker_struct *idle_next;            /* LIFO list of idle workers */
+    pthread_t thread_id;
+    pthread_cond_t cond;                    /* signaled on a new job or stop */
+    size_t stack_size;
+    CLI *job;                                         /* the client to serve */
+} WORKER;
+
+NOEXPORT pthread_mutex_t pool_mutex=PTHREAD_MUTEX_INITIALIZER;
+NOEXPORT WORKER *pool_head=NULL, *pool_idle_head=NULL;
+NOEXPORT unsigned pool_min=0, pool_max=0, pool_threads=0, pool_idle=0;
+NOEXPORT int pool_timeout=60, pool_shutdown=0;
+NOEXPORT unsigned long long threads_created=0, pool_reused=0;
+
+NOEXPORT int worker_create(CLI *);
+NOEXPORT void *worker_thread(void *);
+NOEXPORT void worker_idle_del(WORKER *);
+
+int thread_pool_init(void) {
+    int error=0;
+
+    pthread_mutex_lock(&pool_mutex);
+    pool_max=global_options.thread_pool_max;
+    pool_min=global_options.thread_pool_min;
+    pool_timeout=global_options.thread_pool_idle;
+    while(!error && pool_threads<pool_min)
+        error=worker_create(NULL);
+    pthread_mutex_unlock(&pool_mutex);
+    if(error) {
+        errno=error;
+        ioerror("pthread_create");
+        return 1;
+    }
+    if(pool_max)
+        s_log(LOG_INFO, "Thread pool: %u-%u worker(s), %d second(s) idle",
+            pool_min, pool_max, pool_timeout);
+    return 0;
+}
+
+/* busy workers need to be terminated with terminate_pipe first */
+void thread_pool_stop(void) {
+    WORKER *list, *worker;
+
+    pthread_mutex_lock(&pool_mutex);
+    pool_shutdown=1;
+    list=pool_head;
+    pool_head=NULL;
+    for(worker=list; worker; worker=worker->next)
+        pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&pool_mutex);
+
+    while(list) {
+        worker=list;
+        list=worker->next;
+        if(pthread_join(worker->thread_id, NULL))
+            s_log(LOG_ERR, "pthread_join() failed");
+        pthread_cond_destroy(&worker->cond);
+        str_free(worker);
+    }
+}
+
+void thread_pool_info(void) {
+    unsigned threads, idle;
+    unsigned long long created, reused;
+
+    pthread_mutex_lock(&pool_mutex);
+    threads=pool_threads;
+    idle=pool_idle;
+    created=threads_created;
+    reused=pool_reused;
+    pthread_mutex_unlock(&pool_mutex);
+    s_log(LOG_NOTICE, "Client threads: %llu created, %llu reused",
+        created, reused);
+    if(pool_max)
+        s_log(LOG_NOTICE, "Thread pool: %u worker(s), %u idle",
+            threads, idle);
+}
+
+/* called with pool_mutex locked */
+NOEXPORT int worker_create(CLI *job) {
+    WORKER *worker;
+    size_t stack_size=DEFAULT_STACK_SIZE;
+    int error;
+
+    if(job && job->opt->stack_size>stack_size)
+        stack_size=job->opt->stack_size;
+    worker=str_alloc_detached(sizeof(WORKER));
+    pthread_cond_init(&worker->cond, NULL);
+    worker->stack_size=stack_size;
+    worker->job=job;
+    error=thread_start(&worker->thread_id, stack_size, worker_thread, worker);
+    if(error) {
+        pthread_cond_destroy(&worker->cond);
+        str_free(worker);
+        return error;
+    }
+    if(job) {
+        job->thread_id=worker->thread_id;
+        job->flag.pooled=1;
+    } else {
+        worker->idle_next=pool_idle_head;
+        pool_idle_head=worker;
+        ++pool_idle;
+    }
+    worker->next=pool_head;
+    if(pool_head)
+        pool_head->prev=worker;
+    pool_head=worker;
+    ++pool_threads;
+    ++threads_created;
+    return 0;
+}
+
+/* no thread-local storage outside of client_thread_run(), so no s_log() */
+NOEXPORT void *worker_thread(void *arg) {
+    WORKER *worker=arg;
+    CLI *c;
+    struct timespec deadline;
+    int idle;
+
+    pthread_mutex_lock(&pool_mutex);
+    idle=!worker->job; /* pre-started by thread_pool_init() */
+    for(;;) {
+        while(!worker->job && !pool_shutdown) {
+            deadline.tv_sec=time(NULL)+pool_timeout;
+            deadline.tv_nsec=0;
+            if(pthread_cond_timedwait(&worker->cond, &pool_mutex,
+                    &deadline)==ETIMEDOUT && !worker->job &&
+                    pool_threads>pool_min)
+                break; /* retire an idle worker above the minimum */
+        }
+        c=worker->job;
+        if(!c) /* idle timeout or thread_pool_stop() */
+            break;
+        worker->job=NULL;
+        idle=0; /* create_client() removed us from the idle list */
+        pthread_mutex_unlock(&pool_mutex);
+
+        client_thread_run(c);
+
+        pthread_mutex_lock(&pool_mutex);
+        if(pool_shutdown || pool_threads>pool_max)
+            break; /* threadPoolMax was reduced on reload */
+        worker->idle_next=pool_idle_head;
+        pool_idle_head=worker;
+        ++pool_idle;
+        idle=1;
+    }
+
+    if(idle)
+        worker_idle_del(worker);
+    --pool_threads;
+    if(pool_shutdown) { /* joined and released in thread_pool_stop() */
+        pthread_mutex_unlock(&pool_mutex);
+        return NULL;
+    }
+    if(pool_head==worker)
+        pool_head=worker->next;
+    if(worker->prev)
+        worker->prev->next=worker->next;
+    if(worker->next)
+        worker->next->prev=worker->prev;
+    pthread_detach(worker->thread_id);
+    pthread_mutex_unlock(&pool_mutex);
+    pthread_cond_destroy(&worker->cond);
+    str_free(worker);
+    return NULL;
+}
+
+/* called with pool_mutex locked */
+NOEXPORT void worker_idle_del(WORKER *worker) {
+    WORKER **ptr;
+
+    for(ptr=&pool_idle_head; *ptr; ptr=&(*ptr)->idle_next)
+        if(*ptr==worker) {
+            *ptr=worker->idle_next;
+            worker->idle_next=NULL;
+            --pool_idle;
+            return;
+        }
+}
+
+int create_client(SOCKET ls, SOCKET s, CLI *arg) {
+    WORKER **ptr, *worker;
+    int error=0;
+
+    (void)ls; /* this parameter is only used with USE_FORK */
+
+    CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_THREAD_LIST]);
+    pthread_mutex_lock(&pool_mutex);
+    /* the most recently used worker is the most likely to be cached */
+    for(ptr=&pool_idle_head; *ptr; ptr=&(*ptr)->idle_next)
+        if((*ptr)->stack_size>=arg->opt->stack_size)
+            break;
+    worker=*ptr;
+    if(worker) { /* hand the client over to an idle worker */
+        *ptr=worker->idle_next;
+        worker->idle_next=NULL;
+        --pool_idle;
+        ++pool_reused;
+        worker->job=arg;
+        arg->thread_id=worker->thread_id;
+        arg->flag.pooled=1;
+        pthread_cond_signal(&worker->cond);
+    } else if(pool_threads<pool_max) { /* grow the pool */
+        error=worker_create(arg);
+    } else { /* a dedicated thread above the pool limit */
+        error=thread_start(&arg->thread_id, arg->opt->stack_size,
+            client_thread, arg);
+        if(!error)
+            ++threads_created;
+    }
+    pthread_mutex_unlock(&pool_mutex);
     if(error) {
         errno=error;
         ioerror("pthread_create");
@@ -41,6 +41,9 @@
 /* Uncomment to see allocation sources in core dumps */
 /* #define DEBUG_PADDING 64 */
 
+/* Uncomment to always use the instrumented allocator without arenas */
+/* #define DEBUG_ALLOC */
+
 /* reportedly, malloc does not always return 16-byte aligned addresses
  * for 64-bit targets as specified by
  * https://msdn.microsoft.com/en-us/library/6ewkz86d.aspx */
@@ -66,7 +69,9 @@ __declspec(align(16))
 struct alloc_list_struct {
     ALLOC_LIST *prev, *next;
     TLS_DATA *tls;
-    size_t size;
+    size_t size, capacity; /* capacity is 0 for unpooled allocations */
+    ARENA_CHUNK *arena; /* NULL if not allocated from an arena */
+    int instrumented; /* canary and leak detection enabled */
     const char *alloc_file, *free_file;
     int alloc_line, free_line;
 #ifdef DEBUG_PADDING
@@ -82,6 +87,26 @@ struct alloc_list_struct {
 };
 #endif
 
+/* the instrumented allocator is only used when leaks are detected */
+#ifdef DEBUG_ALLOC
+#define str_instrumented() 1
+#else
+#define str_instrumented() (service_options.log_level>=LOG_DEBUG)
+#endif
+
+/* size classes of the pooled allocator: 32, 64, ..., STR_POOL_MAX */
+#define STR_POOL_MIN 32
+#define STR_POOL_MAX (STR_POOL_MIN<<(STR_POOL_CLASSES-1))
+
+/* a chunk of a per-client bump-pointer arena */
+struct arena_chunk_struct {
+    ARENA_CHUNK *next;
+    size_t used; /* including the chunk header */
+    unsigned live; /* allocations not released yet */
+};
+#define STR_ARENA_ALIGN(n) (((n)+15)&~(size_t)15)
+#define STR_ARENA_HEADER STR_ARENA_ALIGN(sizeof(ARENA_CHUNK))
+
 #define LEAK_TABLE_SIZE 997
 typedef struct {
     const char *alloc_file;
@@ -96,7 +121,17 @@ NOEXPORT volatile int leak_result_num=0;
 NOEXPORT LPTSTR str_vtprintf(LPCTSTR, va_list);
 #endif /* USE_WIN32 */
 
+NOEXPORT void *str_alloc_internal(size_t, const char *, int);
 NOEXPORT void *str_realloc_internal_debug(void *, size_t, const char *, int);
+NOEXPORT void *str_realloc_pooled(ALLOC_LIST *, size_t, const char *, int);
+NOEXPORT int str_pool_class(size_t);
+NOEXPORT void str_pool_flush(TLS_DATA *);
+#ifndef DEBUG_ALLOC
+NOEXPORT void *str_arena_alloc(TLS_DATA *, size_t, const char *, int);
+#endif /* DEBUG_ALLOC */
+NOEXPORT void *str_arena_realloc(ALLOC_LIST *, size_t, const char *, int);
+NOEXPORT void str_arena_free(ALLOC_LIST *);
+NOEXPORT void str_arena_release(TLS_DATA *);
 
 NOEXPORT ALLOC_LIST *get_alloc_list_ptr(void *, const char *, int);
 NOEXPORT void str_leak_debug(const ALLOC_LIST *, int);
@@ -214,14 +249,22 @@ NOEXPORT LPTSTR str_vtprintf(LPCTSTR format, va_list start_ap) {
 /**************************************** memory allocation wrappers */
 
 void str_init(TLS_DATA *tls_data) {
+    int i;
+
     tls_data->alloc_head=NULL;
     tls_data->alloc_bytes=tls_data->alloc_blocks=0;
+    for(i=0; i<STR_POOL_CLASSES; ++i)
+        tls_data->alloc_pool[i]=NULL;
+    tls_data->alloc_pool_bytes=0;
+    tls_data->arena=NULL;
 }
 
 void str_cleanup(TLS_DATA *tls_data) {
     /* free all attached allocations */
     while(tls_data->alloc_head) /* str_free macro requires an lvalue */
         str_free_expression(tls_data->alloc_head+1);
+    str_arena_release(tls_data);
+    str_pool_flush(tls_data);
 }
 
 void str_canary_init() {
@@ -271,6 +314,10 @@ void *str_alloc_debug(size_t size, const char *file, int line) {
         s_log(LOG_CRIT, "INTERNAL ERROR: Uninitialized TLS at %s, line %d",
             file, line);
     }
+#ifndef DEBUG_ALLOC
+    if(tls_data->c && size<=STR_ARENA_MAX) /* a client thread */
+        return str_arena_alloc(tls_data, size, file, line);
+#endif /* DEBUG_ALLOC */
 
     alloc_list=(ALLOC_LIST *)str_alloc_detached_debug(size, file, line)-1;
     alloc_list->prev=NULL;
@@ -291,6 +338,8 @@ void *str_alloc_detached_debug(size_t size, const char *file, int line) {
 #if 0
     printf("allocating %lu bytes at %s:%d\n", (unsigned long)size, file, line);
 #endif
+    if(!str_instrumented())
+        return str_alloc_internal(size, file, line);
     alloc_list=system_malloc(sizeof(ALLOC_LIST)+size+sizeof canary);
     if(!alloc_list)
         fatal_debug("Out of memory", file, line);
@@ -299,6 +348,9 @@ void *str_alloc_detached_debug(size_t size, const char *file, int line) {
     alloc_list->next=NULL; /* for debugging */
     alloc_list->tls=NULL;
     alloc_list->size=size;
+    alloc_list->capacity=0;
+    alloc_list->arena=NULL;
+    alloc_list->instrumented=1;
     alloc_list->alloc_file=file;
     alloc_list->alloc_line=line;
     alloc_list->free_file="none";
@@ -315,6 +367,48 @@ void *str_alloc_detached_debug(size_t size, const char *file, int line) {
     return alloc_list+1;
 }
 
+/* a thin allocator without canaries and leak detection */
+/* small blocks are recycled with a lock-free per-thread pool */
+NOEXPORT void *str_alloc_internal(size_t size, const char *file, int line) {
+    TLS_DATA *tls_data;
+    ALLOC_LIST *alloc_list=NULL;
+    size_t capacity=0;
+    int i;
+
+    i=str_pool_class(size);
+    if(i>=0) {
+        capacity=(size_t)STR_POOL_MIN<<i;
+        tls_data=tls_initialized ? tls_get() : NULL;
+        if(tls_data && tls_data->alloc_pool[i]) {
+            alloc_list=tls_data->alloc_pool[i];
+            tls_data->alloc_pool[i]=alloc_list->next;
+            tls_data->alloc_pool_bytes-=capacity;
+        }
+    }
+    if(!alloc_list) {
+        alloc_list=system_malloc(sizeof(ALLOC_LIST)+
+            (capacity ? capacity : size)+sizeof canary);
+        if(!alloc_list)
+            fatal_debug("Out of memory", file, line);
+    }
+    alloc_list->prev=NULL;
+    alloc_list->next=NULL;
+    alloc_list->tls=NULL;
+    alloc_list->size=size;
+    alloc_list->capacity=capacity;
+    alloc_list->arena=NULL;
+    alloc_list->instrumented=0;
+    alloc_list->alloc_file=file;
+    alloc_list->alloc_line=line;
+    alloc_list->free_file="none";
+    alloc_list->free_line=0;
+    alloc_list->valid_canary=CANARY_UNINTIALIZED; /* no canary to check */
+    alloc_list->magic=MAGIC_ALLOCATED;
+    memset(alloc_list+1, 0, size);
+
+    return alloc_list+1;
+}
+
 void *str_realloc_debug(void *ptr, size_t size, const char *file, int line) {
     if(ptr)
         return str_realloc_internal_debug(ptr, size, file, line);
@@ -333,7 +427,13 @@ NOEXPORT void *str_realloc_internal_debug(void *ptr, size_t size, const char *fi
     ALLOC_LIST *prev_alloc_list, *alloc_list;
 
     prev_alloc_list=get_alloc_list_ptr(ptr, file, line);
-    str_leak_debug(prev_alloc_list, -1);
+    if(prev_alloc_list->arena)
+        return str_arena_realloc(prev_alloc_list, size, file, line);
+    if(!str_instrumented() &&
+            (prev_alloc_list->capacity || str_pool_class(size)>=0))
+        return str_realloc_pooled(prev_alloc_list, size, file, line);
+    if(prev_alloc_list->instrumented)
+        str_leak_debug(prev_alloc_list, -1);
     if(prev_alloc_list->size>size) /* shrinking the allocation */
         memset((uint8_t *)ptr+size, 0, prev_alloc_list->size-size); /* paranoia */
     alloc_list=system_realloc(prev_alloc_list, sizeof(ALLOC_LIST)+size+sizeof canary);
@@ -354,6 +454,8 @@ NOEXPORT void *str_realloc_internal_debug(void *ptr, size_t size, const char *fi
         alloc_list->tls->alloc_bytes+=size-alloc_list->size;
     }
     alloc_list->size=size;
+    alloc_list->capacity=0;
+    alloc_list->instrumented=str_instrumented();
     alloc_list->alloc_file=file;
     alloc_list->alloc_line=line;
     alloc_list->free_file="none";
@@ -362,20 +464,58 @@ NOEXPORT void *str_realloc_internal_debug(void *ptr, size_t size, const char *fi
     snprintf(alloc_list->debug+1, DEBUG_PADDING-1, "ALLOC_%lu@%s:%d",
         (unsigned long)size, file, line);
 #endif
-    alloc_list->valid_canary=canary_initialized; /* before memcpy */
-    memcpy((uint8_t *)ptr+size, canary, sizeof canary);
-    str_leak_debug(alloc_list, 1);
+    if(alloc_list->instrumented) {
+        alloc_list->valid_canary=canary_initialized; /* before memcpy */
+        memcpy((uint8_t *)ptr+size, canary, sizeof canary);
+        str_leak_debug(alloc_list, 1);
+    } else {
+        alloc_list->valid_canary=CANARY_UNINTIALIZED; /* no canary to check */
+    }
+    return ptr;
+}
+
+NOEXPORT void *str_realloc_pooled(ALLOC_LIST *alloc_list, size_t size,
+        const char *file, int line) {
+    void *ptr=alloc_list+1, *new_ptr;
+
+    if(size>alloc_list->capacity) { /* move to a larger block */
+        if(alloc_list->tls) /* not detached */
+            new_ptr=str_alloc_debug(size, file, line);
+        else
+            new_ptr=str_alloc_detached_debug(size, file, line);
+        memcpy(new_ptr, ptr, alloc_list->size);
+        str_free_debug(ptr, file, line);
+        return new_ptr;
+    }
+    /* resize in place */
+    if(alloc_list->size>size) /* shrinking the allocation */
+        memset((uint8_t *)ptr+size, 0, alloc_list->size-size); /* paranoia */
+    else /* growing the allocation */
+        memset((uint8_t *)ptr+alloc_list->size, 0, size-alloc_list->size);
+    if(alloc_list->tls) /* not detached */
+        alloc_list->tls->alloc_bytes+=size-alloc_list->size;
+    alloc_list->size=size;
+    alloc_list->alloc_file=file;
+    alloc_list->alloc_line=line;
     return ptr;
 }
 
 /* detach from thread automatic deallocation list */
 /* it has no effect if the allocation is already detached */
-void str_detach_debug(void *ptr, const char *file, int line) {
+/* allocations are moved out of the arena, so a new pointer is returned */
+void *str_detach_debug(void *ptr, const char *file, int line) {
     ALLOC_LIST *alloc_list;
+    void *new_ptr;
 
     if(!ptr) /* do not attempt to free null pointers */
-        return;
+        return NULL;
     alloc_list=get_alloc_list_ptr(ptr, file, line);
+    if(alloc_list->arena) { /* copy to a detached allocation */
+        new_ptr=str_alloc_detached_debug(alloc_list->size, file, line);
+        memcpy(new_ptr, ptr, alloc_list->size);
+        str_free_debug(ptr, file, line);
+        return new_ptr;
+    }
     if(alloc_list->tls) { /* not detached */
         /* remove from linked list */
         if(alloc_list->tls->alloc_head==alloc_list)
@@ -392,10 +532,13 @@ void str_detach_debug(void *ptr, const char *file, int line) {
         alloc_list->prev=NULL;
         alloc_list->tls=NULL;
     }
+    return ptr;
 }
 
 void str_free_debug(void *ptr, const char *file, int line) {
     ALLOC_LIST *alloc_list;
+    TLS_DATA *tls_data;
+    int i;
 
     if(!ptr) /* do not attempt to free null pointers */
         return;
@@ -410,15 +553,64 @@ void str_free_debug(void *ptr, const char *file, int line) {
             file, line);
         return;
     }
+    if(alloc_list->arena) { /* released with its arena chunk */
+        get_alloc_list_ptr(ptr, file, line);
+        alloc_list->free_file=file;
+        alloc_list->free_line=line;
+        alloc_list->magic=MAGIC_DEALLOCATED; /* detect double free attempts */
+        memset(ptr, 0, alloc_list->size); /* paranoia */
+        str_arena_free(alloc_list);
+        return;
+    }
     str_detach_debug(ptr, file, line);
-    str_leak_debug(alloc_list, -1);
+    if(alloc_list->instrumented)
+        str_leak_debug(alloc_list, -1);
     alloc_list->free_file=file;
     alloc_list->free_line=line;
     alloc_list->magic=MAGIC_DEALLOCATED; /* detect double free attempts */
     memset(ptr, 0, alloc_list->size+sizeof canary); /* paranoia */
+    if(alloc_list->capacity) { /* return to the pool of the current thread */
+        tls_data=tls_get();
+        if(tls_data && tls_data->alloc_pool_bytes+alloc_list->capacity<=
+                STR_POOL_SIZE) {
+            i=str_pool_class(alloc_list->capacity);
+            alloc_list->next=tls_data->alloc_pool[i];
+            tls_data->alloc_pool[i]=alloc_list;
+            tls_data->alloc_pool_bytes+=alloc_list->capacity;
+            return;
+        }
+    }
     system_free(alloc_list);
 }
 
+/* the size class index or -1 for allocations too large to be pooled */
+NOEXPORT int str_pool_class(size_t size) {
+    size_t capacity=STR_POOL_MIN;
+    int i=0;
+
+    if(size>STR_POOL_MAX)
+        return -1;
+    while(capacity<size) {
+        capacity<<=1;
+        ++i;
+    }
+    return i;
+}
+
+NOEXPORT void str_pool_flush(TLS_DATA *tls_data) {
+    ALLOC_LIST *alloc_list;
+    int i;
+
+    for(i=0; i<STR_POOL_CLASSES; ++i) {
+        while(tls_data->alloc_pool[i]) {
+            alloc_list=tls_data->alloc_pool[i];
+            tls_data->alloc_pool[i]=alloc_list->next;
+            system_free(alloc_list);
+        }
+    }
+    tls_data->alloc_pool_bytes=0;
+}
+
 NOEXPORT ALLOC_LIST *get_alloc_list_ptr(void *ptr, const char *file, int line) {
     ALLOC_LIST *alloc_list;
 
@@ -435,6 +627,113 @@ NOEXPORT ALLOC_LIST *get_alloc_list_ptr(void *ptr, const char *file, int line) {
     return alloc_list;
 }
 
+/**************************************** per-client arena */
+
+/* client threads allocate from a bump-pointer arena released in bulk */
+/* the arena chunks themselves are subject to leak detection */
+
+#ifndef DEBUG_ALLOC
+NOEXPORT void *str_arena_alloc(TLS_DATA *tls_data, size_t size,
+        const char *file, int line) {
+    ARENA_CHUNK *chunk=tls_data->arena;
+    ALLOC_LIST *alloc_list;
+    size_t capacity=STR_ARENA_ALIGN(size);
+
+    if(!chunk || chunk->used+sizeof(ALLOC_LIST)+capacity>STR_ARENA_CHUNK) {
+        chunk=str_alloc_detached(STR_ARENA_CHUNK);
+        chunk->next=tls_data->arena;
+        chunk->used=STR_ARENA_HEADER;
+        chunk->live=0;
+        tls_data->arena=chunk;
+    }
+    alloc_list=(ALLOC_LIST *)((uint8_t *)chunk+chunk->used);
+    chunk->used+=sizeof(ALLOC_LIST)+capacity;
+    chunk->live++;
+    alloc_list->prev=NULL;
+    alloc_list->next=NULL;
+    alloc_list->tls=tls_data;
+    alloc_list->size=size;
+    alloc_list->capacity=capacity;
+    alloc_list->arena=chunk;
+    alloc_list->instrumented=0;
+    alloc_list->alloc_file=file;
+    alloc_list->alloc_line=line;
+    alloc_list->free_file="none";
+    alloc_list->free_line=0;
+    alloc_list->valid_canary=CANARY_UNINTIALIZED; /* no canary to check */
+    alloc_list->magic=MAGIC_ALLOCATED;
+    memset(alloc_list+1, 0, size);
+    tls_data->alloc_bytes+=size;
+    tls_data->alloc_blocks++;
+    return alloc_list+1;
+}
+#endif /* DEBUG_ALLOC */
+
+NOEXPORT void *str_arena_realloc(ALLOC_LIST *alloc_list, size_t size,
+        const char *file, int line) {
+    ARENA_CHUNK *chunk=alloc_list->arena;
+    void *ptr=alloc_list+1, *new_ptr;
+    size_t capacity=STR_ARENA_ALIGN(size);
+
+    if(size>alloc_list->capacity && /* try to grow the last allocation */
+            (uint8_t *)ptr+alloc_list->capacity==
+                (uint8_t *)chunk+chunk->used &&
+            chunk->used-alloc_list->capacity+capacity<=STR_ARENA_CHUNK) {
+        chunk->used+=capacity-alloc_list->capacity;
+        alloc_list->capacity=capacity;
+    }
+    if(size>alloc_list->capacity) { /* move to a new allocation */
+        new_ptr=str_alloc_debug(size, file, line);
+        memcpy(new_ptr, ptr, alloc_list->size);
+        str_free_debug(ptr, file, line);
+        return new_ptr;
+    }
+    /* resize in place */
+    if(alloc_list->size>size) /* shrinking the allocation */
+        memset((uint8_t *)ptr+size, 0, alloc_list->size-size); /* paranoia */
+    else /* growing the allocation */
+        memset((uint8_t *)ptr+alloc_list->size, 0, size-alloc_list->size);
+    alloc_list->tls->alloc_bytes+=size-alloc_list->size;
+    alloc_list->size=size;
+    alloc_list->alloc_file=file;
+    alloc_list->alloc_line=line;
+    return ptr;
+}
+
+NOEXPORT void str_arena_free(ALLOC_LIST *alloc_list) {
+    ARENA_CHUNK *chunk=alloc_list->arena, **ptr;
+    TLS_DATA *tls_data=alloc_list->tls;
+
+    tls_data->alloc_bytes-=alloc_list->size;
+    tls_data->alloc_blocks--;
+    if((uint8_t *)(alloc_list+1)+alloc_list->capacity==
+            (uint8_t *)chunk+chunk->used) /* the last allocation */
+        chunk->used=(size_t)((uint8_t *)alloc_list-(uint8_t *)chunk);
+    if(--chunk->live) /* the chunk is still in use */
+        return;
+    if(chunk==tls_data->arena) { /* reuse the current chunk */
+        chunk->used=STR_ARENA_HEADER;
+        return;
+    }
+    for(ptr=&tls_data->arena; *ptr!=chunk; ptr=&(*ptr)->next)
+        ;
+    *ptr=chunk->next;
+    str_free(chunk);
+}
+
+/* release all arena allocations at once */
+NOEXPORT void str_arena_release(TLS_DATA *tls_data) {
+    ARENA_CHUNK *chunk;
+
+    while(tls_data->arena) {
+        chunk=tls_data->arena;
+        tls_data->arena=chunk->next;
+        tls_data->alloc_blocks-=chunk->live;
+        str_free(chunk);
+    }
+    tls_data->alloc_bytes=0;
+}
+
 /**************************************** memory leak detection */
 
 NOEXPORT void str_leak_debug(const ALLOC_LIST *alloc_list, int change) {
@@ -445,10 +744,10 @@ NOEXPORT void str_leak_debug(const ALLOC_LIST *alloc_list, int change) {
 
     if(service_options.log_level<LOG_DEBUG) /* performance optimization */
         return;
-#ifdef USE_OS_THREADS
+#if defined(USE_OS_THREADS) || defined(USE_SCHEDULERS)
     if(!stunnel_locks[STUNNEL_LOCKS-1]) /* threads not initialized */
         return;
-#endif /* USE_OS_THREADS */
+#endif /* USE_OS_THREADS || USE_SCHEDULERS */
     if(!number_of_sections) /* configuration file not initialized */
         return;
 
@@ -473,7 +772,7 @@ NOEXPORT void str_leak_debug(const ALLOC_LIST *alloc_list, int change) {
     }
 
     /* for performance we try to avoid calling CRYPTO_atomic_add() here */
-#ifdef USE_OS_THREADS
+#if defined(USE_OS_THREADS) || defined(USE_SCHEDULERS)
 #if defined(__GNUC__) && defined(__ATOMIC_ACQ_REL)
     if(__atomic_is_lock_free(sizeof entry->num, &entry->num))
         allocations=__atomic_add_fetch(&entry->num, change, __ATOMIC_ACQ_REL);
@@ -486,9 +785,9 @@ NOEXPORT void str_leak_debug(const ALLOC_LIST *alloc_list, int change) {
     CRYPTO_atomic_add(&entry->num, change, &allocations,
         stunnel_locks[LOCK_LEAK_HASH]);
 #endif
-#else /* USE_OS_THREADS */
+#else /* USE_OS_THREADS || USE_SCHEDULERS */
     allocations=(entry->num+=change);
-#endif /* USE_OS_THREADS */
+#endif /* USE_OS_THREADS || USE_SCHEDULERS */
 
     if(allocations<=leak_threshold()) /* leak not detected */
         return;
@@ -68,14 +68,35 @@ struct sockaddr_un {
 };
 #endif
 
+typedef struct {
+    SOCKET fd;                              /* INVALID_SOCKET for a free slot */
+    SERVICE_OPTIONS *opt;
+} LISTENER;
+
 #if !defined(USE_WIN32) && !defined(USE_OS2)
 NOEXPORT void pid_status_nohang(const char *);
 NOEXPORT void status_info(int, int, const char *);
 #endif
-NOEXPORT int accept_connection(SERVICE_OPTIONS *, unsigned);
+NOEXPORT int accept_connection(SERVICE_OPTIONS *, SOCKET);
+NOEXPORT int accept_one(SERVICE_OPTIONS *, SOCKET);
+#ifndef USE_FORK
+NOEXPORT int clients_add(int);
+#endif
+NOEXPORT unsigned listener_hash(SOCKET);
+NOEXPORT void listener_add(SOCKET, SERVICE_OPTIONS *);
+NOEXPORT LISTENER *listener_find(SOCKET);
+NOEXPORT void listener_clear(void);
+#ifdef USE_ACCEPT_THREADS
+NOEXPORT int accept_threads_start(void);
+NOEXPORT void accept_threads_stop(void);
+NOEXPORT void *accept_thread(void *);
+#endif /* USE_ACCEPT_THREADS */
 NOEXPORT int exec_connect_start(void);
+NOEXPORT int connect_pool_start(void);
+NOEXPORT SERVICE_OPTIONS *sections_unbind(void);
+NOEXPORT void sections_free(SERVICE_OPTIONS *);
 NOEXPORT void unbind_port(SERVICE_OPTIONS *, unsigned);
-NOEXPORT SOCKET bind_port(SERVICE_OPTIONS *, int, unsigned);
+NOEXPORT SOCKET bind_port(SERVICE_OPTIONS *, int, unsigned, unsigned);
 #ifdef HAVE_CHROOT
 NOEXPORT int change_root(void);
 #endif
@@ -99,6 +120,23 @@ s_poll_set *fds; /* file descriptors of listening sockets */
 int systemd_fds; /* number of file descriptors passed by systemd */
 int listen_fds_start; /* base for systemd-provided file descriptors */
 
+/* open addressing hash table of listening sockets */
+NOEXPORT LISTENER *listener_table=NULL;
+NOEXPORT unsigned listener_size=0, listener_num=0;
+
+#ifdef USE_ACCEPT_THREADS
+typedef struct {
+    pthread_t thread_id;
+    unsigned shard;                /* index of the listening sockets served */
+    s_poll_set *fds;
+    unsigned num;                  /* number of listening sockets, 0 if idle */
+} ACCEPT_THREAD;
+
+NOEXPORT ACCEPT_THREAD *accept_threads=NULL;
+NOEXPORT unsigned accept_threads_num=0;
+NOEXPORT SOCKET accept_stop_pipe[2]={INVALID_SOCKET, INVALID_SOCKET};
+#endif /* USE_ACCEPT_THREADS */
+
 /**************************************** startup */
 
 void main_init() { /* one-time initialization */
@@ -160,6 +198,10 @@ int main_configure(char *arg1, char *arg2) {
     log_open(SINK_SYSLOG);
     if(bind_ports())
         return 1;
+#ifdef USE_SESSIOND_SERVER
+    if(sessiond_server_bind())
+        return 1;
+#endif /* USE_SESSIOND_SERVER */
 
 #ifdef HAVE_CHROOT
     /* change_root() must be called before drop_privileges()
@@ -223,9 +265,12 @@ int drop_privileges(int critical) {
 #endif /* __GNUC__>=4.6 */
 #endif /* __GNUC__ */
 void main_cleanup() {
+#ifdef USE_SCHEDULERS
+    scheduler_stop(); /* no contexts may run on other threads from now on */
+#endif /* USE_SCHEDULERS */
 #ifdef USE_OS_THREADS
     CLI *c;
-    unsigned i, threads;
+    unsigned i, threads, pooled=0;
     THREAD_ID *thread_list;
 
     CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_THREAD_LIST]);
@@ -235,17 +280,25 @@ void main_cleanup() {
     thread_list=str_alloc((threads+1)*sizeof(THREAD_ID));
     i=0;
     for(c=thread_head; c; c=c->thread_next) { /* copy client threads */
-        thread_list[i++]=c->thread_id;
         s_log(LOG_DEBUG, "Terminating a thread for [%s]", c->opt->servname);
+#ifdef USE_PTHREAD
+        if(c->flag.pooled) { /* joined in thread_pool_stop() */
+            pooled++;
+            continue;
+        }
+#endif /* USE_PTHREAD */
+        thread_list[i++]=c->thread_id;
     }
+    threads=i;
     if(cron_thread_id) { /* append cron_thread_id if used */
         thread_list[threads++]=cron_thread_id;
         s_log(LOG_DEBUG, "Terminating the cron thread");
     }
     CRYPTO_THREAD_unlock(stunnel_locks[LOCK_THREAD_LIST]);
 
-    if(threads) {
-        s_log(LOG_NOTICE, "Terminating %u service thread(s)", threads);
+    if(threads || pooled) {
+        s_log(LOG_NOTICE, "Terminating %u service thread(s)",
+            threads+pooled);
         writesocket(terminate_pipe[1], "", 1);
         for(i=0; i<threads; ++i) { /* join client threads */
 #ifdef USE_PTHREAD
@@ -261,6 +314,9 @@ void main_cleanup() {
         }
         s_log(LOG_NOTICE, "Service threads terminated");
     }
+#ifdef USE_PTHREAD
+    thread_pool_stop(); /* busy workers were terminated above */
+#endif /* USE_PTHREAD */
 
     str_free(thread_list);
 #endif /* USE_OS_THREADS */
@@ -328,34 +384,70 @@ NOEXPORT void status_info(int pid, int status, const char *info) {
 /**************************************** main loop accepting connections */
 
 void daemon_loop(void) {
+#ifdef USE_LOG_ASYNC
+    log_async_init(); /* start the log writer thread if configured */
+#endif /* USE_LOG_ASYNC */
+#ifdef USE_SESSIOND_SERVER
+    if(sessiond_server_init()) {
+        s_log(LOG_CRIT, "Sessiond server initialization failed");
+        exit(1);
+    }
+#endif /* USE_SESSIOND_SERVER */
     if(cron_init()) { /* initialize periodic events */
         s_log(LOG_CRIT, "Cron initialization failed");
         exit(1);
     }
+#ifndef USE_FORK
+    if(dns_cache_init()) { /* start refreshing cached DNS lookups */
+        s_log(LOG_CRIT, "DNS cache initialization failed");
+        exit(1);
+    }
+#endif /* !defined(USE_FORK) */
+#ifdef USE_PTHREAD
+    if(thread_pool_init()) { /* pre-start client worker threads */
+        s_log(LOG_CRIT, "Thread pool initialization failed");
+        exit(1);
+    }
+#endif /* USE_PTHREAD */
+#ifdef USE_SCHEDULERS
+    if(scheduler_start()) { /* spread contexts over several threads */
+        s_log(LOG_CRIT, "Scheduler initialization failed");
+        exit(1);
+    }
+#endif /* USE_SCHEDULERS */
     if(exec_connect_start()) {
         s_log(LOG_CRIT, "Failed to start exec+connect services");
         exit(1);
     }
+    if(connect_pool_start()) {
+        s_log(LOG_CRIT, "Failed to start connection pools");
+        exit(1);
+    }
+#ifdef USE_ACCEPT_THREADS
+    if(accept_threads_start()) {
+        s_log(LOG_CRIT, "Failed to start accept threads");
+        exit(1);
+    }
+#endif /* USE_ACCEPT_THREADS */
     while(1) {
         int temporary_lack_of_resources=0;
         int num=s_poll_wait(fds, -1, -1);
         if(num>=0) {
-            SERVICE_OPTIONS *opt;
+            LISTENER *listener;
+            SOCKET fd;
+            unsigned pos=0;
             s_log(LOG_DEBUG, "Found %d ready file descriptor(s)", num);
             if(service_options.log_level>=LOG_DEBUG) /* performance optimization */
                 s_poll_dump(fds, LOG_DEBUG);
-            if(s_poll_canread(fds, signal_pipe[0]))
+            if(s_poll_canread(fds, signal_pipe[0])) {
                 if(signal_pipe_dispatch()) /* SIGNAL_TERMINATE or error */
                     break; /* terminate daemon_loop */
-            for(opt=service_options.next; opt; opt=opt->next) {
-                unsigned i;
-                for(i=0; i<opt->local_addr.num; ++i) {
-                    SOCKET fd=opt->local_fd[i];
-                    if(fd!=INVALID_SOCKET &&
-                            s_poll_canread(fds, fd) &&
-                            accept_connection(opt, i))
-                        temporary_lack_of_resources=1;
-                }
+                continue; /* listening sockets may have been rebound */
+            }
+            while((fd=s_poll_next_read(fds, &pos))!=INVALID_SOCKET) {
+                listener=listener_find(fd);
+                if(listener && accept_connection(listener->opt, fd))
+                    temporary_lack_of_resources=1;
             }
         } else {
             log_error(LOG_NOTICE, get_last_socket_error(),
@@ -372,11 +464,27 @@ void daemon_loop(void) {
 }
 
     /* return 1 when a short delay is needed before another try */
-NOEXPORT int accept_connection(SERVICE_OPTIONS *opt, unsigned i) {
+NOEXPORT int accept_connection(SERVICE_OPTIONS *opt, SOCKET fd) {
+    unsigned i;
+    int retval;
+
+    /* drain the backlog, but give other listening sockets a chance */
+    for(i=0; i<global_options.accept_batch; ++i) {
+        retval=accept_one(opt, fd);
+        if(retval)
+            return retval>0;
+    }
+    return 0;
+}
+
+    /* return 0 to continue accepting, -1 to stop,
+     * or 1 when a short delay is needed before another try */
+NOEXPORT int accept_one(SERVICE_OPTIONS *opt, SOCKET fd) {
     SOCKADDR_UNION addr;
     char *from_address;
-    SOCKET s, fd=opt->local_fd[i];
+    SOCKET s;
     socklen_t addrlen;
+    CLI *c;
 
     addrlen=sizeof addr;
     for(;;) {
@@ -398,7 +506,7 @@ NOEXPORT int accept_connection(SERVICE_OPTIONS *opt, unsigned i) {
 #endif
                 return 1; /* temporary lack of resources */
             default:
-                return 0; /* any other error */
+                return -1; /* no pending connections or any other error */
         }
     }
     from_address=s_ntop(&addr, addrlen);
@@ -407,21 +515,25 @@ NOEXPORT int accept_connection(SERVICE_OPTIONS *opt, unsigned i) {
     str_free(from_address);
 #ifdef USE_FORK
     RAND_add("", 1, 0.0); /* each child needs a unique entropy pool */
+    c=alloc_client_session(opt, s, s);
 #else
-    if(max_clients && num_clients>=max_clients) {
+    /* reserve the slot here, as accept threads run concurrently */
+    if(clients_add(1)>max_clients && max_clients) {
+        clients_add(-1);
         s_log(LOG_WARNING, "Connection rejected: too many clients (>=%d)",
             max_clients);
         closesocket(s);
         return 0;
     }
-#endif
-#ifndef USE_FORK
     service_up_ref(opt);
+    c=alloc_client_session(opt, s, s);
+    c->flag.admitted=1;
 #endif
-    if(create_client(fd, s, alloc_client_session(opt, s, s))) {
+    if(create_client(fd, s, c)) {
         s_log(LOG_ERR, "Connection rejected: create_client failed");
         closesocket(s);
 #ifndef USE_FORK
+        clients_add(-1);
         service_free(opt);
 #endif
         return 0;
@@ -429,6 +541,199 @@ NOEXPORT int accept_connection(SERVICE_OPTIONS *opt, unsigned i) {
     return 0;
 }
 
+#ifndef USE_FORK
+NOEXPORT int clients_add(int num) {
+#if defined(USE_OS_THREADS) || defined(USE_SCHEDULERS)
+    int ret;
+
+    CRYPTO_atomic_add(&num_clients, num, &ret, stunnel_locks[LOCK_CLIENTS]);
+    return ret;
+#else
+    return num_clients+=num;
+#endif
+}
+#endif
+
+/**************************************** listening socket lookup */
+
+NOEXPORT unsigned listener_hash(SOCKET fd) {
+    return (unsigned)((size_t)fd^((size_t)fd>>2))&(listener_size-1);
+}
+
+/* the table is only modified by the main thread in bind_ports() and
+ * unbind_ports(), while accept threads are stopped */
+NOEXPORT void listener_add(SOCKET fd, SERVICE_OPTIONS *opt) {
+    unsigned h;
+
+    if(2*(listener_num+1)>listener_size) { /* grow and rehash */
+        LISTENER *old_table=listener_table;
+        unsigned old_size=listener_size;
+
+        listener_size=old_size ? 2*old_size : 16;
+        listener_table=str_alloc_detached(listener_size*sizeof(LISTENER));
+        for(h=0; h<listener_size; ++h)
+            listener_table[h].fd=INVALID_SOCKET;
+        listener_num=0;
+        for(h=0; h<old_size; ++h)
+            if(old_table[h].fd!=INVALID_SOCKET)
+                listener_add(old_table[h].fd, old_table[h].opt);
+        str_free(old_table);
+    }
+    for(h=listener_hash(fd); listener_table[h].fd!=INVALID_SOCKET;
+            h=(h+1)&(listener_size-1))
+        ;
+    listener_table[h].fd=fd;
+    listener_table[h].opt=opt;
+    ++listener_num;
+}
+
+NOEXPORT LISTENER *listener_find(SOCKET fd) {
+    unsigned h;
+
+    if(!listener_size)
+        return NULL;
+    for(h=listener_hash(fd); listener_table[h].fd!=INVALID_SOCKET;
+            h=(h+1)&(listener_size-1))
+        if(listener_table[h].fd==fd)
+            return listener_table+h;
+    return NULL; /* not a listening socket */
+}
+
+NOEXPORT void listener_clear(void) {
+    str_free(listener_table);
+    listener_table=NULL;
+    listener_size=listener_num=0;
+}
+
+#ifdef USE_ACCEPT_THREADS
+
+/* each accept thread polls its own SO_REUSEPORT listening sockets */
+NOEXPORT int accept_threads_start(void) {
+#if defined(HAVE_PTHREAD_SIGMASK) && !defined(__APPLE__)
+    sigset_t new_set, old_set;
+#endif /* HAVE_PTHREAD_SIGMASK && !__APPLE__*/
+    SERVICE_OPTIONS *opt;
+    ACCEPT_THREAD *thread;
+    unsigned t, i;
+    int err=0;
+
+    if(global_options.accept_threads<2 || accept_threads)
+        return 0; /* disabled or already running */
+    if(pipe_init(accept_stop_pipe, "accept_stop_pipe"))
+        return 1;
+    accept_threads_num=global_options.accept_threads-1;
+    accept_threads=str_alloc_detached(accept_threads_num*sizeof(ACCEPT_THREAD));
+
+#if defined(HAVE_PTHREAD_SIGMASK) && !defined(__APPLE__)
+    sigfillset(&new_set);
+    pthread_sigmask(SIG_SETMASK, &new_set, &old_set); /* block signals */
+#endif /* HAVE_PTHREAD_SIGMASK && !__APPLE__*/
+    for(t=0; !err && t<accept_threads_num; ++t) {
+        thread=accept_threads+t;
+        thread->shard=t+1; /* the main thread serves local_fd[] */
+        thread->fds=s_poll_alloc();
+        s_poll_init(thread->fds, 0);
+        s_poll_add(thread->fds, accept_stop_pipe[0], 1, 0);
+        for(opt=service_options.next; opt; opt=opt->next)
+            for(i=0; opt->shard_fd && i<opt->local_addr.num; ++i) {
+                SOCKET fd=opt->shard_fd[t*opt->local_addr.num+i];
+                if(fd==INVALID_SOCKET)
+                    continue;
+                ++thread->num;
+                s_poll_add(thread->fds, fd, 1, 0);
+            }
+        if(thread->num && pthread_create(&thread->thread_id, NULL,
+                accept_thread, thread)) {
+            ioerror("pthread_create");
+            thread->num=0; /* not to be joined */
+            err=1;
+        }
+    }
+#if defined(HAVE_PTHREAD_SIGMASK) && !defined(__APPLE__)
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL); /* unblock signals */
+#endif /* HAVE_PTHREAD_SIGMASK && !__APPLE__*/
+    if(err) { /* the listening sockets of this shard would never be accepted */
+        accept_threads_stop();
+        return 1;
+    }
+    s_log(LOG_INFO, "Started %u accept thread(s)", accept_threads_num);
+    return 0;
+}
+
+NOEXPORT void accept_threads_stop(void) {
+    unsigned t;
+
+    if(!accept_threads)
+        return;
+    if(writesocket(accept_stop_pipe[1], "", 1)!=1)
+        sockerror("writesocket (accept_stop_pipe)");
+    for(t=0; t<accept_threads_num; ++t) {
+        ACCEPT_THREAD *thread=accept_threads+t;
+        if(thread->num && pthread_join(thread->thread_id, NULL))
+            s_log(LOG_ERR, "pthread_join() failed");
+        s_poll_free(thread->fds);
+    }
+    str_free(accept_threads);
+    accept_threads=NULL;
+    accept_threads_num=0;
+    closesocket(accept_stop_pipe[0]);
+    closesocket(accept_stop_pipe[1]);
+    accept_stop_pipe[0]=accept_stop_pipe[1]=INVALID_SOCKET;
+    s_log(LOG_DEBUG, "Accept threads stopped");
+}
+
+NOEXPORT void *accept_thread(void *arg) {
+    ACCEPT_THREAD *thread=arg;
+    char name[20];
+
+    snprintf(name, sizeof name, "accept%u", thread->shard);
+    tls_alloc(NULL, NULL, name);
+#ifdef SO_INCOMING_CPU
+    if(global_options.option.accept_cpu) {
+        /* new client threads inherit the CPU affinity */
+        cpu_set_t cpus;
+        long ncpu=sysconf(_SC_NPROCESSORS_ONLN);
+
+        CPU_ZERO(&cpus);
+        CPU_SET(thread->shard%(size_t)(ncpu>0 ? ncpu : 1), &cpus);
+        if(pthread_setaffinity_np(pthread_self(), sizeof cpus, &cpus))
+            s_log(LOG_WARNING, "Failed to bind the accept thread to a CPU");
+    }
+#endif /* SO_INCOMING_CPU */
+    s_log(LOG_DEBUG, "Accept thread started with %u listening socket(s)",
+        thread->num);
+    for(;;) {
+        int temporary_lack_of_resources=0;
+        int num=s_poll_wait(thread->fds, -1, -1);
+        if(num>=0) {
+            LISTENER *listener;
+            SOCKET fd;
+            unsigned pos=0;
+            if(s_poll_canread(thread->fds, accept_stop_pipe[0]))
+                break;
+            /* the listener table is not modified while accept threads run */
+            while((fd=s_poll_next_read(thread->fds, &pos))!=INVALID_SOCKET) {
+                listener=listener_find(fd);
+                if(listener && accept_connection(listener->opt, fd))
+                    temporary_lack_of_resources=1;
+            }
+        } else {
+            log_error(LOG_NOTICE, get_last_socket_error(),
+                "accept_thread: s_poll_wait");
+            temporary_lack_of_resources=1;
+        }
+        if(temporary_lack_of_resources) {
+            s_log(LOG_NOTICE,
+                "Accepting new connections suspended for 1 second");
+            s_poll_sleep(1, 0); /* to avoid log trashing */
+        }
+    }
+    tls_cleanup();
+    return NULL;
+}
+
+#endif /* USE_ACCEPT_THREADS */
+
 /**************************************** initialization helpers */
 
 NOEXPORT int exec_connect_start(void) {
@@ -455,19 +760,55 @@ NOEXPORT int exec_connect_start(void) {
     return 0; /* OK */
 }
 
+NOEXPORT int connect_pool_start(void) {
+#ifndef USE_FORK
+    SERVICE_OPTIONS *opt;
+    CLI *c;
+
+    for(opt=service_options.next; opt; opt=opt->next) {
+        if(!opt->connect_pool_size || opt->connect_pool)
+            continue; /* not configured or kept on configuration reload */
+        s_log(LOG_DEBUG, "Starting connection pool of service [%s]",
+            opt->servname);
+        if(connect_pool_init(opt))
+            return 1; /* fatal error */
+        service_up_ref(opt);
+        c=alloc_client_session(opt, INVALID_SOCKET, INVALID_SOCKET);
+        c->flag.pool=1;
+        if(create_client(INVALID_SOCKET, INVALID_SOCKET, c)) {
+            s_log(LOG_ERR, "Failed to start connection pool of service [%s]",
+                opt->servname);
+            connect_pool_free(opt);
+            service_free(opt);
+            return 1; /* fatal error */
+        }
+    }
+#endif /* !defined(USE_FORK) */
+    return 0; /* OK */
+}
+
 /* clear fds, close old ports */
 void unbind_ports(void) {
-    SERVICE_OPTIONS *opt;
+    sections_free(sections_unbind());
+}
+
+/* close the listening sockets and detach the current sections */
+NOEXPORT SERVICE_OPTIONS *sections_unbind(void) {
+    SERVICE_OPTIONS *list, *opt;
 
+#ifdef USE_ACCEPT_THREADS
+    accept_threads_stop(); /* they use the listening sockets */
+#endif /* USE_ACCEPT_THREADS */
     s_poll_init(fds, 1);
+    listener_clear();
 
     CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_SECTIONS]);
 
-    opt=service_options.next;
+    list=service_options.next;
     service_options.next=NULL;
     service_free(&service_options);
 
-    while(opt) {
+    for(opt=list; opt; opt=opt->next) {
         unsigned i;
         s_log(LOG_DEBUG, "Unbinding service [%s]", opt->servname);
         for(i=0; i<opt->local_addr.num; ++i)
@@ -480,6 +821,22 @@ void unbind_ports(void) {
             /* FIXME: this won't work with FORK threads */
             opt->option.retry=0;
         }
+#ifndef USE_FORK
+        /* the pool keeper releases its reference when it stops */
+        connect_pool_stop(opt);
+        /* mux tunnels finish their streams before they stop */
+        mux_stop(opt);
+#endif /* !defined(USE_FORK) */
+    }
+
+    CRYPTO_THREAD_unlock(stunnel_locks[LOCK_SECTIONS]);
+    return list;
+}
+
+/* release the sections detached with sections_unbind() */
+NOEXPORT void sections_free(SERVICE_OPTIONS *opt) {
+    CRYPTO_THREAD_write_lock(stunnel_locks[LOCK_SECTIONS]);
+    while(opt) {
         /* purge session cache of the old SSL_CTX object */
         /* this workaround won't be needed anymore after */
         /* delayed deallocation calls SSL_CTX_free()     */
@@ -495,7 +852,6 @@ void unbind_ports(void) {
             service_free(garbage);
         }
     }
-
     CRYPTO_THREAD_unlock(stunnel_locks[LOCK_SECTIONS]);
 }
 
@@ -506,6 +862,18 @@ NOEXPORT void unbind_port(SERVICE_OPTIONS *opt, unsigned i) {
     struct stat sb; /* buffer for lstat() */
 #endif
 
+#ifdef USE_ACCEPT_THREADS
+    if(opt->shard_fd) {
+        unsigned shard;
+        for(shard=1; shard<global_options.accept_threads; ++shard) {
+            SOCKET *ptr=opt->shard_fd+(shard-1)*opt->local_addr.num+i;
+            if(*ptr!=INVALID_SOCKET) {
+                closesocket(*ptr);
+                *ptr=INVALID_SOCKET;
+            }
+        }
+    }
+#endif /* USE_ACCEPT_THREADS */
     if(fd==INVALID_SOCKET)
         return;
     opt->local_fd[i]=INVALID_SOCKET;
@@ -546,14 +914,12 @@ int bind_ports(void) {
 #endif /* USE_LIBWRAP */
 
     s_poll_init(fds, 1);
+    listener_clear();
 
-    /* allow clean unbind_ports() even though
-       bind_ports() was not fully performed */
-    for(opt=service_options.next; opt; opt=opt->next) {
-        unsigned i;
-        for(i=0; i<opt->local_addr.num; ++i)
-            opt->local_fd[i]=INVALID_SOCKET;
-    }
+    /* local_fd[] is initialized with INVALID_SOCKET when a section is
+       created, so unbind_ports() is clean even though bind_ports() was
+       not fully performed, and sections kept unchanged on configuration
+       reload retain their listening sockets */
 
     listening_section=0;
     for(opt=service_options.next; opt; opt=opt->next) {
@@ -562,13 +928,31 @@ int bind_ports(void) {
             unsigned i;
             s_log(LOG_DEBUG, "Binding service [%s]", opt->servname);
             for(i=0; i<opt->local_addr.num; ++i) {
-                SOCKET fd;
-                fd=bind_port(opt, listening_section, i);
+                SOCKET fd=opt->local_fd[i];
+                if(fd!=INVALID_SOCKET) /* kept on configuration reload */
+                    s_log(LOG_INFO, "Service [%s] (FD=%ld) still listening",
+                        opt->servname, (long)fd);
+                else
+                    fd=bind_port(opt, listening_section, i, 0);
                 opt->local_fd[i]=fd;
                 if(fd!=INVALID_SOCKET) {
                     s_poll_add(fds, fd, 1, 0);
+                    listener_add(fd, opt);
                     ++opt->bound_ports;
                 }
+#ifdef USE_ACCEPT_THREADS
+                if(fd!=INVALID_SOCKET && opt->shard_fd) {
+                    unsigned shard;
+                    for(shard=1; shard<global_options.accept_threads; ++shard) {
+                        SOCKET *ptr=opt->shard_fd+
+                            (shard-1)*opt->local_addr.num+i;
+                        if(*ptr==INVALID_SOCKET) /* not kept on reload */
+                            *ptr=bind_port(opt, listening_section, i, shard);
+                        if(*ptr!=INVALID_SOCKET)
+                            listener_add(*ptr, opt);
+                    }
+                }
+#endif /* USE_ACCEPT_THREADS */
             }
             if(!opt->bound_ports) {
                 s_log(LOG_ERR, "Binding service [%s] failed", opt->servname);
@@ -595,13 +979,26 @@ int bind_ports(void) {
     return 0; /* OK */
 }
 
-NOEXPORT SOCKET bind_port(SERVICE_OPTIONS *opt, int listening_section, unsigned i) {
+NOEXPORT SOCKET bind_port(SERVICE_OPTIONS *opt, int listening_section,
+        unsigned i, unsigned shard) {
     SOCKET fd;
     SOCKADDR_UNION *addr=opt->local_addr.addr+i;
 #ifdef HAVE_STRUCT_SOCKADDR_UN
     struct stat sb; /* buffer for lstat() */
 #endif
 
+#ifdef USE_ACCEPT_THREADS
+    if(shard && addr->sa.sa_family!=AF_INET
+#ifdef USE_IPv6
+            && addr->sa.sa_family!=AF_INET6
+#endif /* USE_IPv6 */
+            )
+        return INVALID_SOCKET; /* SO_REUSEPORT requires an Internet socket */
+    if(shard) /* additional listening sockets are never received from systemd */
+        listening_section=systemd_fds;
+#else /* USE_ACCEPT_THREADS */
+    (void)shard; /* squash the unused parameter warning */
+#endif /* USE_ACCEPT_THREADS */
     if(listening_section<systemd_fds) {
         fd=(SOCKET)(listen_fds_start+listening_section);
         s_log(LOG_DEBUG,
@@ -622,6 +1019,26 @@ NOEXPORT SOCKET bind_port(SERVICE_OPTIONS *opt, int listening_section, unsigned
 
     /* we don't bind or listen on a socket inherited from systemd */
     if(listening_section>=systemd_fds) {
+#ifdef USE_ACCEPT_THREADS
+        if(global_options.accept_threads>1 &&
+                addr->sa.sa_family!=AF_UNIX) {
+            int on=1;
+            if(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void *)&on, sizeof on))
+                sockerror("setsockopt SO_REUSEPORT");
+        }
+#ifdef SO_INCOMING_CPU
+        if(global_options.option.accept_cpu &&
+                global_options.accept_threads>1 &&
+                addr->sa.sa_family!=AF_UNIX) {
+            /* the accept thread serving this shard is bound to the CPU */
+            long ncpu=sysconf(_SC_NPROCESSORS_ONLN);
+            int cpu=(int)(shard%(unsigned)(ncpu>0 ? ncpu : 1));
+            if(setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU,
+                    (void *)&cpu, sizeof cpu))
+                sockerror("setsockopt SO_INCOMING_CPU");
+        }
+#endif /* SO_INCOMING_CPU */
+#endif /* USE_ACCEPT_THREADS */
         if(bind(fd, &addr->sa, addr_len(addr))) {
             int err=get_last_socket_error();
             char *requested_bind_address;
@@ -831,15 +1248,20 @@ NOEXPORT int signal_pipe_dispatch(void) {
 
 NOEXPORT void reload_config() {
     static int delay=10; /* 10ms */
+    SERVICE_OPTIONS *old_sections;
 #ifdef HAVE_CHROOT
     struct stat sb;
 #endif /* HAVE_CHROOT */
 
+#ifndef USE_FORK
+    dns_cache_flush(); /* resolve the names again */
+#endif /* !defined(USE_FORK) */
     if(options_parse(CONF_RELOAD)) {
         s_log(LOG_ERR, "Failed to reload the configuration file");
         return;
     }
-    unbind_ports();
+    /* the old sections are kept until their sessions can be migrated */
+    old_sections=sections_unbind();
     log_flush(LOG_MODE_BUFFER);
 #ifdef HAVE_CHROOT
     /* we don't close SINK_SYSLOG if chroot is enabled and
@@ -860,7 +1282,14 @@ NOEXPORT void reload_config() {
     log_flush(LOG_MODE_CONFIGURED);
     ui_config_reloaded();
     /* we use "|" instead of "||" to attempt initialization of both subsystems */
-    if(bind_ports() | exec_connect_start()) {
+    if(bind_ports() | exec_connect_start() | connect_pool_start()
+#ifdef USE_ACCEPT_THREADS
+            | accept_threads_start()
+#endif /* USE_ACCEPT_THREADS */
+#ifdef USE_PTHREAD
+            | thread_pool_init()
+#endif /* USE_PTHREAD */
+            ) {
         s_poll_sleep(delay/1000, delay%1000); /* sleep to avoid log trashing */
         signal_post(SIGNAL_RELOAD_CONFIG); /* retry */
         delay*=2;
@@ -868,7 +1297,10 @@ NOEXPORT void reload_config() {
             delay=10000;
     } else {
         delay=10; /* 10ms */
+        /* keep TLS sessions of services with an unchanged identity */
+        context_migrate(service_options.next, old_sections);
     }
+    sections_free(old_sections);
 }
 
 #ifdef __GNUC__
@@ -893,6 +1325,33 @@ NOEXPORT int process_connections() {
             (unsigned long long)c->sock_bytes);
     }
     CRYPTO_THREAD_unlock(stunnel_locks[LOCK_THREAD_LIST]);
+    buffer_pool_info();
+    session_cache_info();
+    sessiond_info();
+#ifndef USE_FORK
+    connect_pool_info();
+    connect_target_info();
+    mux_info();
+    dns_cache_info();
+#endif /* !defined(USE_FORK) */
+#ifdef USE_KTLS
+    ktls_info();
+#endif /* USE_KTLS */
+#ifdef USE_PTHREAD
+    thread_pool_info();
+#endif /* USE_PTHREAD */
+#ifdef USE_SCHEDULERS
+    scheduler_info();
+#endif /* USE_SCHEDULERS */
+#ifdef USE_SHM_CACHE
+    shm_cache_info();
+#endif /* USE_SHM_CACHE */
+#ifdef USE_SESSIOND_SERVER
+    sessiond_server_info();
+#endif /* USE_SESSIOND_SERVER */
+#ifdef USE_LOG_ASYNC
+    log_async_info();
+#endif /* USE_LOG_ASYNC */
 #endif /* USE_FORK */
     return 0; /* continue execution */
 }
@@ -1055,6 +1514,9 @@ void stunnel_info(int level) {
 #else /* defined(USE_POLL) */
         "SELECT"
 #endif /* defined(USE_POLL) */
+#ifdef USE_EPOLL
+        ",EPOLL"
+#endif /* defined(USE_EPOLL) */
         ",IPv%c"
 #ifdef USE_SYSTEMD
         ",SYSTEMD"
@@ -1097,6 +1559,14 @@ void stunnel_info(int level) {
 #endif
         "SNI"
 #endif /* !defined(OPENSSL_NO_TLSEXT) */
+#if defined(USE_KTLS) && !defined(OPENSSL_NO_KTLS)
+#ifdef TLS_FEATURE_FOUND
+        ","
+#else
+#define TLS_FEATURE_FOUND
+#endif
+        "KTLS"
+#endif /* defined(USE_KTLS) && !defined(OPENSSL_NO_KTLS) */
 #ifndef TLS_FEATURE_FOUND
         "NONE"
 #endif /* !defined(TLS_FEATURE_FOUND) */
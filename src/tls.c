@@ -100,31 +100,34 @@ void tls_cleanup() {
     tls_data=tls_get();
     if(!tls_data)
         return;
+    buffer_cache_flush(tls_data);
     str_cleanup(tls_data);
+    tls_set(NULL); /* do not return tls_data->id to the released pool */
     str_free(tls_data->id); /* detached allocation */
-    tls_set(NULL);
     free(tls_data);
 }
 
 #ifdef USE_UCONTEXT
 
-static TLS_DATA *global_tls=NULL;
-
 NOEXPORT void tls_platform_init() {
 }
 
 void tls_set(TLS_DATA *tls_data) {
-    if(ready_head)
-        ready_head->tls=tls_data;
-    else /* ucontext threads not initialized */
-        global_tls=tls_data;
+    SCHEDULER *sched=scheduler_get();
+
+    if(sched->current)
+        sched->current->tls=tls_data;
+    else /* ucontext threads not initialized or scheduling */
+        sched->tls=tls_data;
 }
 
 TLS_DATA *tls_get() {
-    if(ready_head)
-        return ready_head->tls;
-    else /* ucontext threads not initialized */
-        return global_tls;
+    SCHEDULER *sched=scheduler_get();
+
+    if(sched->current)
+        return sched->current->tls;
+    else /* ucontext threads not initialized or scheduling */
+        return sched->tls;
 }
 
 #endif /* USE_UCONTEXT */